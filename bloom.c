@@ -0,0 +1,131 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include <stdlib.h>
+
+#include "bloom.h"
+
+/* About 1% of false positives.  */
+#define BITS_PER_ITEM 10
+#define N_HASHES 7
+
+struct bloom
+{
+  uint64_t n_bits;
+  uint64_t bits[];
+};
+
+struct bloom *
+bloom_new (size_t n_items)
+{
+  uint64_t n_bits = (uint64_t) (n_items ? n_items : 1) * BITS_PER_ITEM;
+  size_t n_words = (n_bits + 63) / 64;
+  struct bloom *b;
+
+  b = calloc (1, sizeof (*b) + n_words * sizeof (uint64_t));
+  if (b == NULL)
+    return NULL;
+
+  b->n_bits = n_words * 64;
+  return b;
+}
+
+void
+bloom_free (struct bloom *b)
+{
+  free (b);
+}
+
+static uint64_t
+hash_bytes (uint64_t h, const char *s)
+{
+  for (; *s; s++)
+    {
+      h ^= (unsigned char) *s;
+      h *= 0x100000001b3ULL;
+    }
+  return h;
+}
+
+/* The paths used by the lookups can start with "./" or "/", and the
+   root directory is "." or "".  */
+static const char *
+skip_prefix (const char *path)
+{
+  for (;;)
+    {
+      if (path[0] == '/')
+        path++;
+      else if (path[0] == '.' && path[1] == '/')
+        path += 2;
+      else if (path[0] == '.' && path[1] == '\0')
+        path++;
+      else
+        return path;
+    }
+}
+
+uint64_t
+bloom_hash (const char *dir, const char *name)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  h = hash_bytes (h, skip_prefix (dir));
+  h = hash_bytes (h, "/");
+  h = hash_bytes (h, name);
+
+  /* FNV-1a mixes the low bits poorly, spread them before the double
+     hashing.  */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+void
+bloom_add_hash (struct bloom *b, uint64_t hash)
+{
+  uint64_t h1 = hash, h2 = (hash >> 33) | 1;
+  int i;
+
+  for (i = 0; i < N_HASHES; i++)
+    {
+      uint64_t bit = (h1 + i * h2) % b->n_bits;
+      b->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+bool
+bloom_may_contain (const struct bloom *b, const char *dir, const char *name)
+{
+  uint64_t hash = bloom_hash (dir, name);
+  uint64_t h1 = hash, h2 = (hash >> 33) | 1;
+  int i;
+
+  for (i = 0; i < N_HASHES; i++)
+    {
+      uint64_t bit = (h1 + i * h2) % b->n_bits;
+      if (! (b->bits[bit / 64] & (1ULL << (bit % 64))))
+        return false;
+    }
+  return true;
+}
@@ -0,0 +1,37 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOOM_H
+# define BLOOM_H
+
+# include <stdbool.h>
+# include <stddef.h>
+# include <stdint.h>
+
+/* Bloom filter of paths, made of a directory and a name.  */
+struct bloom;
+
+struct bloom *bloom_new (size_t n_items);
+void bloom_free (struct bloom *b);
+
+uint64_t bloom_hash (const char *dir, const char *name);
+void bloom_add_hash (struct bloom *b, uint64_t hash);
+/* False if NAME in DIR was never added to B.  */
+bool bloom_may_contain (const struct bloom *b, const char *dir, const char *name);
+
+#endif
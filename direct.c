@@ -29,35 +29,350 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <sys/xattr.h>
 
+#include <hash.h>
+
 #include "utils.h"
+#include "stats.h"
+
+/* Cache of O_PATH descriptors for the directories recently used in a
+   lower layer.  An operation on DIR/NAME is issued relative to the
+   descriptor of DIR, so the kernel does not walk the whole path from
+   the root of the layer again for every probe of every layer.  The
+   lower layers do not change while they are mounted, so a cached
+   descriptor, or the error to open it, stays valid until it is
+   evicted.  The upper layer is not cached as its directories are
+   renamed and deleted.  */
+
+struct dirfd_entry
+{
+  struct dirfd_entry *prev;
+  struct dirfd_entry *next;
+  char *path;
+  int fd;
+  /* The errno to open the directory when FD is -1.  */
+  int err;
+  int refs;
+  bool evicted;
+};
+
+struct dirfd_cache
+{
+  pthread_mutex_t lock;
+  Hash_table *entries;
+  /* The least recently used entry is the last one.  */
+  struct dirfd_entry *head;
+  struct dirfd_entry *tail;
+  size_t n;
+  size_t max;
+};
+
+static size_t
+dirfd_hasher (const void *p, size_t s)
+{
+  const struct dirfd_entry *e = p;
+
+  return hash_string (e->path, s);
+}
+
+static bool
+dirfd_compare (const void *n1, const void *n2)
+{
+  const struct dirfd_entry *e1 = n1;
+  const struct dirfd_entry *e2 = n2;
+
+  return strcmp (e1->path, e2->path) == 0;
+}
+
+static void
+dirfd_entry_free (struct dirfd_entry *e)
+{
+  if (e->fd >= 0)
+    close (e->fd);
+  free (e->path);
+  free (e);
+}
+
+static void
+dirfd_unlink (struct dirfd_cache *c, struct dirfd_entry *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void
+dirfd_push (struct dirfd_cache *c, struct dirfd_entry *e)
+{
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head)
+    c->head->prev = e;
+  else
+    c->tail = e;
+  c->head = e;
+}
+
+/* Drop the least recently used entries until the cache fits.  An entry
+   still in use is freed by its last dirfd_release.  */
+static void
+dirfd_evict (struct dirfd_cache *c)
+{
+  while (c->n > c->max && c->tail)
+    {
+      struct dirfd_entry *e = c->tail;
+
+      dirfd_unlink (c, e);
+      hash_delete (c->entries, e);
+      c->n--;
+      if (e->refs > 0)
+        e->evicted = true;
+      else
+        dirfd_entry_free (e);
+    }
+}
+
+static struct dirfd_cache *
+dirfd_cache_new (size_t max)
+{
+  struct dirfd_cache *c;
+
+  c = calloc (1, sizeof (*c));
+  if (c == NULL)
+    return NULL;
+
+  c->entries = hash_initialize (max, NULL, dirfd_hasher, dirfd_compare, NULL);
+  if (c->entries == NULL)
+    {
+      free (c);
+      return NULL;
+    }
+  pthread_mutex_init (&c->lock, NULL);
+  c->max = max;
+  return c;
+}
+
+static void
+dirfd_cache_free (struct dirfd_cache *c)
+{
+  struct dirfd_entry *e, *next;
+
+  if (c == NULL)
+    return;
+
+  for (e = c->head; e; e = next)
+    {
+      next = e->next;
+      dirfd_entry_free (e);
+    }
+  hash_free (c->entries);
+  pthread_mutex_destroy (&c->lock);
+  free (c);
+}
+
+static void
+dirfd_release (struct ovl_layer *l, struct dirfd_entry *e)
+{
+  struct dirfd_cache *c = l->dirfds;
+  int saved_errno = errno;
+  bool free_it;
+
+  if (e == NULL)
+    return;
+
+  pthread_mutex_lock (&c->lock);
+  free_it = --e->refs == 0 && e->evicted;
+  pthread_mutex_unlock (&c->lock);
+
+  if (free_it)
+    dirfd_entry_free (e);
+  errno = saved_errno;
+}
+
+/* Return the descriptor to resolve PATH from, with *NAME set to the
+   rest of PATH to resolve from it.  *ENTRY is set to the cache entry
+   that must be released with dirfd_release, or to NULL.  It is the
+   root of the layer when PATH has no parent or it cannot be cached.
+   On an error the parent directory does not exist in the layer.  */
+static int
+dirfd_acquire (struct ovl_layer *l, const char *path, const char **name, struct dirfd_entry **entry)
+{
+  struct dirfd_cache *c = l->dirfds;
+  struct dirfd_entry key, *e, *found;
+  char dir[PATH_MAX];
+  const char *slash;
+  size_t len;
+  int fd, err = 0;
+
+  *name = path;
+  *entry = NULL;
+
+  if (c == NULL || ! l->low)
+    return l->fd;
+
+  slash = strrchr (path, '/');
+  if (slash == NULL || slash == path || slash[1] == '\0')
+    return l->fd;
+
+  len = slash - path;
+  if (len >= sizeof (dir))
+    return l->fd;
+  memcpy (dir, path, len);
+  dir[len] = '\0';
+  key.path = dir;
+
+  pthread_mutex_lock (&c->lock);
+  e = hash_lookup (c->entries, &key);
+  if (e)
+    {
+      dirfd_unlink (c, e);
+      dirfd_push (c, e);
+      e->refs++;
+    }
+  pthread_mutex_unlock (&c->lock);
+
+  if (e)
+    {
+      ovl_stats_add (OVL_STAT_dirfd_hits, 1);
+      goto done;
+    }
+  ovl_stats_add (OVL_STAT_dirfd_misses, 1);
+
+  fd = TEMP_FAILURE_RETRY (safe_openat (l->fd, dir, O_PATH|O_DIRECTORY|O_CLOEXEC, 0));
+  if (fd < 0)
+    {
+      /* Only the absence of the directory is permanent.  */
+      if (errno != ENOENT && errno != ENOTDIR)
+        return l->fd;
+      err = errno;
+    }
+
+  e = calloc (1, sizeof (*e));
+  if (e == NULL || (e->path = strdup (dir)) == NULL)
+    {
+      free (e);
+      if (fd >= 0)
+        close (fd);
+      return l->fd;
+    }
+  e->fd = fd;
+  e->err = err;
+  e->refs = 1;
+
+  pthread_mutex_lock (&c->lock);
+  found = hash_insert (c->entries, e);
+  if (found == e)
+    {
+      dirfd_push (c, e);
+      c->n++;
+      dirfd_evict (c);
+    }
+  else if (found)
+    found->refs++;
+  pthread_mutex_unlock (&c->lock);
+
+  if (found == NULL)
+    {
+      dirfd_entry_free (e);
+      return l->fd;
+    }
+  if (found != e)
+    {
+      /* Another thread opened it first.  */
+      dirfd_entry_free (e);
+      e = found;
+    }
+
+ done:
+  if (e->fd < 0)
+    {
+      err = e->err;
+      dirfd_release (l, e);
+      errno = err;
+      return -1;
+    }
+
+  *name = slash + 1;
+  *entry = e;
+  return e->fd;
+}
+
+/* Like dirfd_acquire, but when PATH is resolved from a cached
+   descriptor set FULL_PATH to a path of it that does not walk the tree
+   again, for the calls that take no descriptor.  */
+static int
+dirfd_full_path (struct ovl_layer *l, const char *path, char *full_path, struct dirfd_entry **entry)
+{
+  const char *name;
+  int dirfd;
+
+  dirfd = dirfd_acquire (l, path, &name, entry);
+  if (dirfd < 0)
+    return dirfd;
+
+  if (*entry)
+    snprintf (full_path, PATH_MAX, "/proc/self/fd/%d/%s", dirfd, name);
+  else
+    strconcat3 (full_path, PATH_MAX, l->path, "/", path);
+  return 0;
+}
 
 static int
 direct_file_exists (struct ovl_layer *l, const char *pathname)
 {
-  return file_exists_at (l->fd, pathname);
+  struct dirfd_entry *e;
+  const char *name;
+  int dirfd, ret;
+
+  dirfd = dirfd_acquire (l, pathname, &name, &e);
+  if (dirfd < 0)
+    return dirfd;
+
+  ret = file_exists_at (dirfd, name);
+  dirfd_release (l, e);
+  return ret;
 }
 
 static int
 direct_listxattr (struct ovl_layer *l, const char *path, char *buf, size_t size)
 {
   char full_path[PATH_MAX];
+  struct dirfd_entry *e;
+  int ret;
 
-  strconcat3 (full_path, PATH_MAX, l->path, "/", path);
+  if (dirfd_full_path (l, path, full_path, &e) < 0)
+    return -1;
 
-  return llistxattr (full_path, buf, size);
+  ret = llistxattr (full_path, buf, size);
+  dirfd_release (l, e);
+  return ret;
 }
 
 static int
 direct_getxattr (struct ovl_layer *l, const char *path, const char *name, char *buf, size_t size)
 {
   char full_path[PATH_MAX];
+  struct dirfd_entry *e;
+  int ret;
 
-  strconcat3 (full_path, PATH_MAX, l->path, "/", path);
+  if (dirfd_full_path (l, path, full_path, &e) < 0)
+    return -1;
 
-  return lgetxattr (full_path, name, buf, size);
+  ret = lgetxattr (full_path, name, buf, size);
+  dirfd_release (l, e);
+  return ret;
 }
 
 static int
@@ -90,13 +405,28 @@ direct_fstat (struct ovl_layer *l, int fd, const char *path, unsigned int mask,
 static int
 direct_statat (struct ovl_layer *l, const char *path, struct stat *st, int flags, unsigned int mask)
 {
+  struct dirfd_entry *e = NULL;
+  const char *name = path;
+  int dirfd = l->fd;
   int ret;
 #ifdef HAVE_STATX
   struct statx stx;
+#endif
 
-  ret = statx (l->fd, path, AT_STATX_DONT_SYNC|flags, mask, &stx);
+  /* A symlink followed from a cached descriptor would be resolved from
+     the wrong root.  */
+  if (flags & AT_SYMLINK_NOFOLLOW)
+    {
+      dirfd = dirfd_acquire (l, path, &name, &e);
+      if (dirfd < 0)
+        return dirfd;
+    }
+
+#ifdef HAVE_STATX
+  ret = statx (dirfd, name, AT_STATX_DONT_SYNC|flags, mask, &stx);
   if (ret < 0 && (errno == ENOSYS || errno == EINVAL))
     goto fallback;
+  dirfd_release (l, e);
   if (ret == 0)
     {
       statx_to_stat (&stx, st);
@@ -106,7 +436,8 @@ direct_statat (struct ovl_layer *l, const char *path, struct stat *st, int flags
   return ret;
 #endif
  fallback:
-  ret = fstatat (l->fd, path, st, flags);
+  ret = fstatat (dirfd, name, st, flags);
+  dirfd_release (l, e);
   if (ret != 0)
     return ret;
 
@@ -147,13 +478,37 @@ direct_closedir (void *dirp)
 static int
 direct_openat (struct ovl_layer *l, const char *path, int flags, mode_t mode)
 {
-  return TEMP_FAILURE_RETRY (safe_openat (l->fd, path, flags, mode));
+  struct dirfd_entry *e;
+  const char *name;
+  int dirfd, ret;
+
+  if (! (flags & O_NOFOLLOW) || (flags & O_CREAT))
+    return TEMP_FAILURE_RETRY (safe_openat (l->fd, path, flags, mode));
+
+  dirfd = dirfd_acquire (l, path, &name, &e);
+  if (dirfd < 0)
+    return dirfd;
+
+  ret = TEMP_FAILURE_RETRY (safe_openat (dirfd, name, flags, mode));
+  dirfd_release (l, e);
+  return ret;
 }
 
 static ssize_t
 direct_readlinkat (struct ovl_layer *l, const char *path, char *buf, size_t bufsiz)
 {
-  return TEMP_FAILURE_RETRY (readlinkat (l->fd, path, buf, bufsiz));
+  struct dirfd_entry *e;
+  const char *name;
+  ssize_t ret;
+  int dirfd;
+
+  dirfd = dirfd_acquire (l, path, &name, &e);
+  if (dirfd < 0)
+    return dirfd;
+
+  ret = TEMP_FAILURE_RETRY (readlinkat (dirfd, name, buf, bufsiz));
+  dirfd_release (l, e);
+  return ret;
 }
 
 static int
@@ -182,12 +537,17 @@ direct_load_data_source (struct ovl_layer *l, const char *opaque, const char *pa
   else if (fgetxattr (l->fd, XATTR_OVERRIDE_CONTAINERS_STAT, tmp, sizeof (tmp)) >= 0)
     l->stat_override_mode = STAT_OVERRIDE_CONTAINERS;
 
+  if (l->ovl_data->dirfd_cache > 0)
+    l->dirfds = dirfd_cache_new (l->ovl_data->dirfd_cache);
+
   return 0;
 }
 
 static int
 direct_cleanup (struct ovl_layer *l)
 {
+  dirfd_cache_free (l->dirfds);
+  l->dirfds = NULL;
   return 0;
 }
 
@@ -26,6 +26,14 @@
 
 typedef struct hash_table Hash_table;
 
+struct ovl_lazy_copyup;
+struct thread_pool;
+struct bloom;
+struct dirfd_cache;
+struct otable;
+struct ovl_dir_snapshot;
+struct ovl_lower_cache;
+
 struct ovl_ino
 {
   struct ovl_node *node;
@@ -33,24 +41,56 @@ struct ovl_ino
   dev_t dev;
   int lookups;
   mode_t mode;
+
+  /* FUSE passthrough backing file shared by the open files of the inode.  */
+  int backing_id;
+  unsigned int backing_refs;
+  struct ovl_layer *backing_layer;
+
+  /* Set while the data of the upper file is copied up lazily.  */
+  struct ovl_lazy_copyup *lazy;
+  bool lazy_checked;
+
+  /* Lower file with the data of a metadata only upper file.  */
+  struct ovl_layer *metacopy_layer;
+  char *metacopy_path;
+  bool metacopy_checked;
+
+  /* Queued to be freed by the forget thread.  */
+  struct ovl_ino *forget_prev, *forget_next;
+  bool forget_queued;
 };
 
 struct ovl_node
 {
   struct ovl_node *parent;
-  Hash_table *children;
+  struct otable *children;
   struct ovl_layer *layer, *last_layer;
   ino_t tmp_ino;
   dev_t tmp_dev;
+  /* Only set for hidden nodes and nodes detached from their parent,
+     use node_path to get the path of a node.  */
   char *path;
   char *name;
   int hidden_dirfd;
   int node_lookups;
   size_t name_hash;
-  Hash_table *inodes;
+  struct otable *inodes;
   struct ovl_ino *ino;
   struct ovl_node *next_link;
   unsigned int in_readdir;
+  /* Names known to be missing from a directory that is not loaded.  */
+  Hash_table *negative;
+  /* LRU of the directories with children.  */
+  struct ovl_node *lru_prev, *lru_next;
+  /* Readdir snapshot kept for the next readers, and the counter of the
+     changes to the children it is checked against.  */
+  struct ovl_dir_snapshot *snapshot;
+  unsigned long generation;
+  /* Stat and xattrs of a node on a lower layer.  */
+  struct ovl_lower_cache *lower_cache;
+  /* Path in the lower layers of a redirected directory.  */
+  char *redirect;
 
   unsigned int do_unlink : 1;
   unsigned int do_rmdir : 1;
@@ -67,25 +107,58 @@ struct ovl_mapping
   unsigned int len;
 };
 
+/* The IDs from FIRST to LAST are translated to (ID & MASK) + DELTA.
+   A mask of 0 maps the whole range to DELTA.  */
+struct ovl_id_range
+{
+  unsigned int first;
+  unsigned int last;
+  unsigned int mask;
+  unsigned int delta;
+};
+
+/* Disjoint ranges sorted by ID, IDs outside of them are translated
+   to OVERFLOW.  */
+struct ovl_id_map
+{
+  size_t n_ranges;
+  struct ovl_id_range *ranges;
+  unsigned int overflow;
+};
+
+struct ovl_path_prefix
+{
+  char *prefix;
+  size_t len;
+};
+
 struct ovl_data
 {
   struct fuse_session *se;
   char *uid_str;
   char *gid_str;
-  struct ovl_mapping *uid_mappings;
-  struct ovl_mapping *gid_mappings;
+  /* From the IDs on the file system to the IDs reported, and back.  */
+  struct ovl_id_map uid_map;
+  struct ovl_id_map gid_map;
+  struct ovl_id_map uid_map_back;
+  struct ovl_id_map gid_map_back;
   char *mountpoint;
   char *lowerdir;
   char *context;
   char *upperdir;
   char *workdir;
   char *redirect_dir;
+  bool redirect_create;
+  bool redirect_follow;
   char *plugins;
+  char *denied_paths_str;
+  struct ovl_path_prefix *denied_paths;
+  size_t n_denied_paths;
   int workdir_fd;
   int debug;
   struct ovl_layer *layers;
 
-  Hash_table *inodes;
+  struct otable *inodes;
 
   struct ovl_node *root;
   char *timeout_str;
@@ -100,6 +173,34 @@ struct ovl_data
   int squash_to_uid;
   int squash_to_gid;
   int static_nlink;
+  int passthrough;
+  int lazy_copyup;
+  int metacopy;
+  int whiteout_filters;
+  unsigned long max_cached_nodes;
+  int parallel_lookup;
+  char *lower_view;
+  char *stats_socket;
+  int group_commit;
+  int dirfd_cache;
+  unsigned int max_idle_threads;
+  char *cpus;
+  int numa_node;
+  int fast_startup;
+  int lazy_copyup_fd;
+  /* Sorted inode numbers of the markers found in the lazy-copyup
+     directory at mount time that were not resumed yet, protected by the
+     lock of the lazy copy-ups.  LAZY_COPYUP_PENDING is cleared when the
+     last one is.  */
+  ino_t *lazy_copyup_leftovers;
+  size_t n_lazy_copyup_leftovers;
+  bool lazy_copyup_pending;
+  /* Workers for the data copy of copyup.  */
+  struct thread_pool *copyup_pool;
+  /* Workers for the readdirplus attribute prefetch.  */
+  struct thread_pool *attr_pool;
+  /* Workers for parallel_lookup.  */
+  struct thread_pool *lookup_pool;
 
   /* current uid/gid*/
   uid_t uid;
@@ -130,6 +231,15 @@ struct ovl_layer
 
   void *data_source_private_data;
   int stat_override_mode;
+
+  /* Filters of the whiteouts and the opaque directories of a lower
+     layer, NULL until they are built.  */
+  struct bloom *whiteouts;
+  struct bloom *opaques;
+
+  /* Cached descriptors of the directories of a lower layer, see
+     direct.c.  */
+  struct dirfd_cache *dirfds;
 };
 
 /* a data_source defines the methods for accessing a lower layer.  */
@@ -148,6 +258,13 @@ struct data_source
   int (*listxattr)(struct ovl_layer *l, const char *path, char *buf, size_t size);
   int (*getxattr)(struct ovl_layer *l, const char *path, const char *name, char *buf, size_t size);
   ssize_t (*readlinkat)(struct ovl_layer *l, const char *path, char *buf, size_t bufsiz);
+
+  /* Optional, only used with plugins of version 2.  Stat the N PATHS,
+     storing in ERRS[I] 0 or the errno of PATHS[I].  It is only used to
+     prefetch the attributes for readdirplus: a lookup stats one name
+     in each layer, so there is nothing to batch in a single layer, and
+     load_dir stats only the entries without a d_type.  */
+  int (*statat_batch)(struct ovl_layer *l, size_t n, const char **paths, struct stat *st, int *errs, int flags, unsigned int mask);
 };
 
 /* passthrough to the file system.  */
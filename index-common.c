@@ -0,0 +1,223 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <config.h>
+
+#include "index-common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/xattr.h>
+
+#include "utils.h"
+
+const char *
+index_normalize_path (const char *path)
+{
+  for (;;)
+    {
+      if (path[0] == '/')
+        path++;
+      else if (path[0] == '.' && path[1] == '/')
+        path += 2;
+      else if (path[0] == '.' && path[1] == '\0')
+        path++;
+      else
+        return path;
+    }
+}
+
+/* Compare the string S with the first LEN bytes of KEY.  */
+static int
+compare_len (const char *s, const char *key, size_t len)
+{
+  int r = strncmp (s, key, len);
+  if (r)
+    return r;
+  return s[len] == '\0' ? 0 : 1;
+}
+
+const void *
+index_find (const void *base, size_t n, size_t stride,
+            const char *strings, size_t strings_len,
+            const char *key, size_t len)
+{
+  size_t lo = 0, hi = n;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const char *it = (const char *) base + mid * stride;
+      uint64_t off = *(const uint64_t *) it;
+      int r;
+
+      if (off >= strings_len)
+        {
+          errno = EIO;
+          return NULL;
+        }
+
+      r = compare_len (strings + off, key, len);
+
+      if (r == 0)
+        return it;
+      if (r < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  errno = ENOENT;
+  return NULL;
+}
+
+bool
+index_fd_is_opaque (int fd)
+{
+  char c;
+
+  if (fgetxattr (fd, PRIVILEGED_OPAQUE_XATTR, &c, 1) == 1 && c == 'y')
+    return true;
+  return fgetxattr (fd, OPAQUE_XATTR, &c, 1) == 1 && c == 'y';
+}
+
+static int
+add_dir (struct index_walk *w, char *path)
+{
+  if (w->n_dirs == w->allocated)
+    {
+      size_t allocated = w->allocated ? w->allocated * 2 : 64;
+      char **new = realloc (w->dirs, allocated * sizeof (*new));
+      if (new == NULL)
+        {
+          free (path);
+          return -1;
+        }
+      w->dirs = new;
+      w->allocated = allocated;
+    }
+  w->dirs[w->n_dirs++] = path;
+  return 0;
+}
+
+/* Read the directory W->dirs[I] and queue its subdirectories.  */
+static int
+scan_dir (struct index_walk *w, int layer_fd, size_t i, const struct index_walk_ops *ops, void *data)
+{
+  cleanup_dir DIR *dp = NULL;
+  const char *path = w->dirs[i];
+  struct dirent *dent;
+  int fd;
+
+  fd = TEMP_FAILURE_RETRY (safe_openat (layer_fd, path[0] ? path : ".", O_DIRECTORY|O_RDONLY|O_NOFOLLOW|O_CLOEXEC, 0));
+  if (fd < 0)
+    return -1;
+
+  if (ops->dir (data, i, index_fd_is_opaque (fd)) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  dp = fdopendir (fd);
+  if (dp == NULL)
+    {
+      close (fd);
+      return -1;
+    }
+
+  for (;;)
+    {
+      struct stat st;
+
+      errno = 0;
+      dent = readdir (dp);
+      if (dent == NULL)
+        {
+          if (errno)
+            return -1;
+          break;
+        }
+
+      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+        continue;
+
+      if (fstatat (dirfd (dp), dent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -1;
+
+      if (ops->entry (data, i, dent->d_name, &st) < 0)
+        return -1;
+
+      if (S_ISDIR (st.st_mode))
+        {
+          char *child;
+
+          if (path[0])
+            {
+              if (asprintf (&child, "%s/%s", path, dent->d_name) < 0)
+                return -1;
+            }
+          else
+            {
+              child = strdup (dent->d_name);
+              if (child == NULL)
+                return -1;
+            }
+
+          if (add_dir (w, child) < 0)
+            return -1;
+        }
+    }
+
+  return 0;
+}
+
+int
+index_walk_layer (struct index_walk *w, int layer_fd, const struct index_walk_ops *ops, void *data)
+{
+  size_t i = w->n_dirs;
+  char *root;
+
+  root = strdup ("");
+  if (root == NULL || add_dir (w, root) < 0)
+    return -1;
+
+  for (; i < w->n_dirs; i++)
+    if (scan_dir (w, layer_fd, i, ops, data) < 0)
+      return -1;
+  return 0;
+}
+
+void
+index_walk_free (struct index_walk *w)
+{
+  size_t i;
+
+  for (i = 0; i < w->n_dirs; i++)
+    free (w->dirs[i]);
+  free (w->dirs);
+  w->dirs = NULL;
+  w->n_dirs = w->allocated = 0;
+}
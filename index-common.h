@@ -0,0 +1,74 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef INDEX_COMMON_H
+# define INDEX_COMMON_H
+
+# include <stdbool.h>
+# include <stddef.h>
+# include <stdint.h>
+# include <sys/stat.h>
+
+/* Code shared by the layer index and the lower view, which both store
+   the directories of the lower layers in a mmap'ed file: the lookups in
+   their sorted tables and the walk of a layer that builds them.  */
+
+# define OPAQUE_XATTR "user.fuseoverlayfs.opaque"
+# define PRIVILEGED_OPAQUE_XATTR "trusted.overlay.opaque"
+
+/* Paths are relative to the root of the layer, skip any "/" or "./"
+   prefix.  */
+const char *index_normalize_path (const char *path);
+
+/* Find, in the N records of STRIDE bytes at BASE sorted by their key, the
+   one whose key is the first LEN bytes of KEY.  The key of a record is
+   a string of STRINGS, at the offset stored in its first uint64_t, and
+   must be within the STRINGS_LEN bytes of STRINGS, the last one being
+   '\0'.  Return NULL and set errno to ENOENT if there is no such
+   record, or to EIO if an offset is out of bounds.  */
+const void *index_find (const void *base, size_t n, size_t stride,
+                        const char *strings, size_t strings_len,
+                        const char *key, size_t len);
+
+bool index_fd_is_opaque (int fd);
+
+/* The directories found by the walk of the layers, relative to their
+   root.  The paths are owned here and stay at the same address until
+   index_walk_free, so the caller can keep pointers to them.  */
+struct index_walk
+{
+  char **dirs;
+  size_t n_dirs;
+  size_t allocated;
+};
+
+struct index_walk_ops
+{
+  /* Called when DIRS[I] is opened, before its entries.  */
+  int (*dir) (void *data, size_t i, bool opaque);
+  /* Called for every entry of DIRS[I].  */
+  int (*entry) (void *data, size_t i, const char *name, const struct stat *st);
+};
+
+/* Append every directory of the layer LAYER_FD to W, from its root, and
+   call OPS on them.  */
+int index_walk_layer (struct index_walk *w, int layer_fd, const struct index_walk_ops *ops, void *data);
+void index_walk_free (struct index_walk *w);
+
+#endif
@@ -0,0 +1,789 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <config.h>
+
+#include "fuse-overlayfs.h"
+#include "layer-index.h"
+#include "index-common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "utils.h"
+
+#define INDEX_SUFFIX ".ovl-index"
+#define INDEX_MAGIC "OVLINDEX"
+#define INDEX_VERSION 1
+
+/* On-disk format of the index, in host byte order.  The directories are
+   sorted by path, "" for the root of the layer, and the entries of each
+   directory by name.  Paths and names are offsets in the string table
+   at the end of the file.  The index is considered stale when the root
+   of the layer changed, so the layer must not be modified while it has
+   an index.  */
+
+struct index_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t root_mode;
+  uint64_t root_ino;
+  int64_t root_mtime_sec;
+  int64_t root_mtime_nsec;
+  int64_t root_ctime_sec;
+  int64_t root_ctime_nsec;
+  uint64_t n_dirs;
+  uint64_t n_entries;
+  uint64_t dirs_off;
+  uint64_t entries_off;
+  uint64_t strings_off;
+  uint64_t size;
+};
+
+#define INDEX_DIR_OPAQUE 1
+
+struct index_dir
+{
+  uint64_t path;
+  uint64_t first_entry;
+  uint64_t n_entries;
+  uint64_t flags;
+};
+
+struct index_entry
+{
+  uint64_t name;
+  uint64_t ino;
+  uint64_t rdev;
+  uint64_t mode;
+};
+
+struct layer_index
+{
+  void *map;
+  size_t size;
+  const struct index_header *h;
+  const struct index_dir *dirs;
+  const struct index_entry *entries;
+  const char *strings;
+  size_t strings_len;
+  dev_t dev;
+};
+
+struct layer_index_dirp
+{
+  /* Set when the directory is read from the file system.  */
+  DIR *dir;
+  struct layer_index *idx;
+  const struct index_entry *next;
+  const struct index_entry *end;
+  struct dirent dent;
+};
+
+static struct layer_index *
+get_index (struct ovl_layer *l)
+{
+  return l->data_source_private_data;
+}
+
+static const struct index_dir *
+find_dir (struct layer_index *idx, const char *path, size_t len)
+{
+  return index_find (idx->dirs, idx->h->n_dirs, sizeof (*idx->dirs), idx->strings, idx->strings_len, path, len);
+}
+
+static const struct index_entry *
+find_entry (struct layer_index *idx, const struct index_dir *d, const char *name)
+{
+  return index_find (&idx->entries[d->first_entry], d->n_entries, sizeof (*idx->entries),
+                     idx->strings, idx->strings_len, name, strlen (name));
+}
+
+/* Look up PATH in the index.  Return false if it does not exist in the
+   layer, otherwise store its mode, inode and rdev in ST.  */
+static bool
+index_lookup (struct layer_index *idx, const char *path, struct stat *st)
+{
+  const struct index_entry *e;
+  const struct index_dir *d;
+  const char *slash, *name;
+
+  path = index_normalize_path (path);
+
+  memset (st, 0, sizeof (*st));
+  st->st_dev = idx->dev;
+
+  if (path[0] == '\0')
+    {
+      st->st_mode = idx->h->root_mode;
+      st->st_ino = idx->h->root_ino;
+      return true;
+    }
+
+  slash = strrchr (path, '/');
+  if (slash)
+    {
+      d = find_dir (idx, path, slash - path);
+      name = slash + 1;
+    }
+  else
+    {
+      d = find_dir (idx, "", 0);
+      name = path;
+    }
+  if (d == NULL)
+    return false;
+
+  e = find_entry (idx, d, name);
+  if (e == NULL)
+    return false;
+
+  st->st_mode = e->mode;
+  st->st_ino = e->ino;
+  st->st_rdev = e->rdev;
+  return true;
+}
+
+static const struct index_dir *
+index_find_dir (struct layer_index *idx, const char *path)
+{
+  path = index_normalize_path (path);
+  return find_dir (idx, path, strlen (path));
+}
+
+static int
+index_file_exists (struct ovl_layer *l, const char *pathname)
+{
+  struct layer_index *idx = get_index (l);
+  struct stat st;
+
+  if (idx == NULL)
+    return direct_access_ds.file_exists (l, pathname);
+
+  if (index_lookup (idx, pathname, &st))
+    return 0;
+
+  errno = ENOENT;
+  return -1;
+}
+
+static int
+index_statat (struct ovl_layer *l, const char *path, struct stat *st, int flags, unsigned int mask)
+{
+  struct layer_index *idx = get_index (l);
+  struct stat tmp;
+
+  if (idx == NULL)
+    return direct_access_ds.statat (l, path, st, flags, mask);
+
+  if (! index_lookup (idx, path, &tmp))
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  /* Only the type, mode and inode are stored in the index.  */
+  if ((mask & ~(STATX_TYPE|STATX_MODE|STATX_INO))
+      || ! (flags & AT_SYMLINK_NOFOLLOW)
+      || l->stat_override_mode != STAT_OVERRIDE_NONE)
+    return direct_access_ds.statat (l, path, st, flags, mask);
+
+  *st = tmp;
+  return 0;
+}
+
+static int
+index_fstat (struct ovl_layer *l, int fd, const char *path, unsigned int mask, struct stat *st)
+{
+  return direct_access_ds.fstat (l, fd, path, mask, st);
+}
+
+static void *
+index_opendir (struct ovl_layer *l, const char *path)
+{
+  struct layer_index *idx = get_index (l);
+  struct layer_index_dirp *dirp;
+  const struct index_dir *d = NULL;
+
+  if (idx)
+    {
+      struct stat st;
+
+      d = index_find_dir (idx, path);
+      if (d == NULL)
+        {
+          errno = index_lookup (idx, path, &st) ? ENOTDIR : ENOENT;
+          return NULL;
+        }
+    }
+
+  dirp = calloc (1, sizeof (*dirp));
+  if (dirp == NULL)
+    return NULL;
+
+  if (d == NULL)
+    {
+      dirp->dir = direct_access_ds.opendir (l, path);
+      if (dirp->dir == NULL)
+        {
+          free (dirp);
+          return NULL;
+        }
+      return dirp;
+    }
+
+  dirp->idx = idx;
+  dirp->next = &idx->entries[d->first_entry];
+  dirp->end = dirp->next + d->n_entries;
+  return dirp;
+}
+
+static struct dirent *
+index_readdir (void *p)
+{
+  struct layer_index_dirp *dirp = p;
+  const struct index_entry *e;
+
+  if (dirp->dir)
+    return direct_access_ds.readdir (dirp->dir);
+
+  if (dirp->next == dirp->end)
+    return NULL;
+
+  e = dirp->next++;
+  dirp->dent.d_ino = e->ino;
+  dirp->dent.d_reclen = sizeof (dirp->dent);
+  dirp->dent.d_type = IFTODT (e->mode);
+  strncpy (dirp->dent.d_name, dirp->idx->strings + e->name, sizeof (dirp->dent.d_name) - 1);
+  dirp->dent.d_name[sizeof (dirp->dent.d_name) - 1] = '\0';
+  return &dirp->dent;
+}
+
+static int
+index_closedir (void *p)
+{
+  struct layer_index_dirp *dirp = p;
+  int ret = 0;
+
+  if (dirp->dir)
+    ret = direct_access_ds.closedir (dirp->dir);
+  free (dirp);
+  return ret;
+}
+
+static int
+index_openat (struct ovl_layer *l, const char *path, int flags, mode_t mode)
+{
+  struct layer_index *idx = get_index (l);
+  struct stat st;
+
+  if (idx && ! (flags & O_CREAT) && ! index_lookup (idx, path, &st))
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  return direct_access_ds.openat (l, path, flags, mode);
+}
+
+static int
+index_listxattr (struct ovl_layer *l, const char *path, char *buf, size_t size)
+{
+  return direct_access_ds.listxattr (l, path, buf, size);
+}
+
+static int
+index_getxattr (struct ovl_layer *l, const char *path, const char *name, char *buf, size_t size)
+{
+  struct layer_index *idx = get_index (l);
+  const struct index_dir *d;
+  struct stat st;
+
+  if (idx == NULL)
+    return direct_access_ds.getxattr (l, path, name, buf, size);
+
+  if (! index_lookup (idx, path, &st))
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  /* The index knows whether a directory is opaque.  */
+  if (strcmp (name, OPAQUE_XATTR) == 0 || strcmp (name, PRIVILEGED_OPAQUE_XATTR) == 0)
+    {
+      d = index_find_dir (idx, path);
+      if (d)
+        {
+          if (! (d->flags & INDEX_DIR_OPAQUE))
+            {
+              errno = ENODATA;
+              return -1;
+            }
+          if (size == 0)
+            return 1;
+          buf[0] = 'y';
+          return 1;
+        }
+    }
+
+  return direct_access_ds.getxattr (l, path, name, buf, size);
+}
+
+static ssize_t
+index_readlinkat (struct ovl_layer *l, const char *path, char *buf, size_t bufsiz)
+{
+  return direct_access_ds.readlinkat (l, path, buf, bufsiz);
+}
+
+/* Creation of the index.  */
+
+struct build_entry
+{
+  char *name;
+  uint64_t ino;
+  uint64_t rdev;
+  uint64_t mode;
+};
+
+struct build_dir
+{
+  /* Owned by WALK.  */
+  const char *path;
+  struct build_entry *entries;
+  size_t n_entries;
+  size_t allocated;
+  bool opaque;
+};
+
+struct build
+{
+  struct index_walk walk;
+  struct build_dir *dirs;
+  size_t n_dirs;
+  size_t allocated;
+};
+
+static void
+free_build (struct build *b)
+{
+  size_t i, j;
+
+  for (i = 0; i < b->n_dirs; i++)
+    {
+      for (j = 0; j < b->dirs[i].n_entries; j++)
+        free (b->dirs[i].entries[j].name);
+      free (b->dirs[i].entries);
+    }
+  free (b->dirs);
+  index_walk_free (&b->walk);
+}
+
+static int
+walk_dir (void *data, size_t i, bool opaque)
+{
+  struct build *b = data;
+
+  if (i == b->allocated)
+    {
+      size_t allocated = b->allocated ? b->allocated * 2 : 64;
+      struct build_dir *new = realloc (b->dirs, allocated * sizeof (*new));
+      if (new == NULL)
+        return -1;
+      b->dirs = new;
+      b->allocated = allocated;
+    }
+  memset (&b->dirs[i], 0, sizeof (b->dirs[0]));
+  b->dirs[i].path = b->walk.dirs[i];
+  b->dirs[i].opaque = opaque;
+  b->n_dirs = i + 1;
+  return 0;
+}
+
+static int
+walk_entry (void *data, size_t i, const char *name, const struct stat *st)
+{
+  struct build *b = data;
+  struct build_dir *d = &b->dirs[i];
+  struct build_entry *e;
+
+  if (d->n_entries == d->allocated)
+    {
+      size_t allocated = d->allocated ? d->allocated * 2 : 16;
+      struct build_entry *new = realloc (d->entries, allocated * sizeof (*new));
+      if (new == NULL)
+        return -1;
+      d->entries = new;
+      d->allocated = allocated;
+    }
+
+  e = &d->entries[d->n_entries];
+  e->name = strdup (name);
+  if (e->name == NULL)
+    return -1;
+  e->ino = st->st_ino;
+  e->rdev = st->st_rdev;
+  e->mode = st->st_mode;
+  d->n_entries++;
+  return 0;
+}
+
+static const struct index_walk_ops build_ops = {
+  .dir = walk_dir,
+  .entry = walk_entry,
+};
+
+static int
+compare_build_dirs (const void *a, const void *b)
+{
+  return strcmp (((const struct build_dir *) a)->path, ((const struct build_dir *) b)->path);
+}
+
+static int
+compare_build_entries (const void *a, const void *b)
+{
+  return strcmp (((const struct build_entry *) a)->name, ((const struct build_entry *) b)->name);
+}
+
+static int
+write_index (FILE *f, struct build *b, const struct stat *root)
+{
+  struct index_header h;
+  uint64_t paths_len = 0, off, entry = 0;
+  size_t i, j;
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, INDEX_MAGIC, sizeof (h.magic));
+  h.version = INDEX_VERSION;
+  h.root_mode = root->st_mode;
+  h.root_ino = root->st_ino;
+  h.root_mtime_sec = root->st_mtim.tv_sec;
+  h.root_mtime_nsec = root->st_mtim.tv_nsec;
+  h.root_ctime_sec = root->st_ctim.tv_sec;
+  h.root_ctime_nsec = root->st_ctim.tv_nsec;
+  h.n_dirs = b->n_dirs;
+
+  off = 0;
+  for (i = 0; i < b->n_dirs; i++)
+    {
+      paths_len += strlen (b->dirs[i].path) + 1;
+      h.n_entries += b->dirs[i].n_entries;
+      for (j = 0; j < b->dirs[i].n_entries; j++)
+        off += strlen (b->dirs[i].entries[j].name) + 1;
+    }
+
+  h.dirs_off = sizeof (h);
+  h.entries_off = h.dirs_off + h.n_dirs * sizeof (struct index_dir);
+  h.strings_off = h.entries_off + h.n_entries * sizeof (struct index_entry);
+  h.size = h.strings_off + paths_len + off;
+
+  if (fwrite (&h, sizeof (h), 1, f) != 1)
+    return -1;
+
+  off = 0;
+  for (i = 0; i < b->n_dirs; i++)
+    {
+      struct index_dir d = {
+        .path = off,
+        .first_entry = entry,
+        .n_entries = b->dirs[i].n_entries,
+        .flags = b->dirs[i].opaque ? INDEX_DIR_OPAQUE : 0,
+      };
+
+      if (fwrite (&d, sizeof (d), 1, f) != 1)
+        return -1;
+      off += strlen (b->dirs[i].path) + 1;
+      entry += b->dirs[i].n_entries;
+    }
+
+  for (i = 0; i < b->n_dirs; i++)
+    for (j = 0; j < b->dirs[i].n_entries; j++)
+      {
+        struct build_entry *be = &b->dirs[i].entries[j];
+        struct index_entry e = {
+          .name = off,
+          .ino = be->ino,
+          .rdev = be->rdev,
+          .mode = be->mode,
+        };
+
+        if (fwrite (&e, sizeof (e), 1, f) != 1)
+          return -1;
+        off += strlen (be->name) + 1;
+      }
+
+  for (i = 0; i < b->n_dirs; i++)
+    if (fwrite (b->dirs[i].path, strlen (b->dirs[i].path) + 1, 1, f) != 1)
+      return -1;
+
+  for (i = 0; i < b->n_dirs; i++)
+    for (j = 0; j < b->dirs[i].n_entries; j++)
+      if (fwrite (b->dirs[i].entries[j].name, strlen (b->dirs[i].entries[j].name) + 1, 1, f) != 1)
+        return -1;
+
+  return 0;
+}
+
+/* Walk the layer LAYER_FD and store its index in INDEX_PATH.  */
+static int
+build_index (int layer_fd, const char *index_path)
+{
+  struct build b;
+  cleanup_free char *tmp_path = NULL;
+  cleanup_file FILE *f = NULL;
+  struct stat root;
+  size_t i;
+  int ret = -1;
+  int fd;
+
+  if (fstat (layer_fd, &root) < 0)
+    return -1;
+
+  memset (&b, 0, sizeof (b));
+  if (index_walk_layer (&b.walk, layer_fd, &build_ops, &b) < 0)
+    goto exit;
+
+  qsort (b.dirs, b.n_dirs, sizeof (b.dirs[0]), compare_build_dirs);
+  for (i = 0; i < b.n_dirs; i++)
+    qsort (b.dirs[i].entries, b.dirs[i].n_entries, sizeof (b.dirs[i].entries[0]), compare_build_entries);
+
+  if (asprintf (&tmp_path, "%s.XXXXXX", index_path) < 0)
+    {
+      tmp_path = NULL;
+      goto exit;
+    }
+
+  fd = mkostemp (tmp_path, O_CLOEXEC);
+  if (fd < 0)
+    goto exit;
+
+  f = fdopen (fd, "w");
+  if (f == NULL)
+    {
+      close (fd);
+      unlink (tmp_path);
+      goto exit;
+    }
+
+  if (write_index (f, &b, &root) < 0 || fflush (f) != 0 || fsync (fileno (f)) < 0
+      || rename (tmp_path, index_path) < 0)
+    {
+      unlink (tmp_path);
+      goto exit;
+    }
+
+  ret = 0;
+
+ exit:
+  free_build (&b);
+  return ret;
+}
+
+/* Map INDEX_PATH and check that it is an index of the current contents
+   of the layer LAYER_FD.  */
+static struct layer_index *
+open_index (int layer_fd, const char *index_path)
+{
+  cleanup_close int fd = -1;
+  struct layer_index *idx;
+  const struct index_header *h;
+  struct stat st, root;
+  uint64_t i;
+  void *map;
+
+  if (fstat (layer_fd, &root) < 0)
+    return NULL;
+
+  fd = open (index_path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0)
+    return NULL;
+
+  if ((size_t) st.st_size < sizeof (*h))
+    goto invalid;
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  h = map;
+  if (memcmp (h->magic, INDEX_MAGIC, sizeof (h->magic)) || h->version != INDEX_VERSION
+      || h->size != (uint64_t) st.st_size
+      || h->dirs_off != sizeof (*h)
+      || h->n_dirs == 0
+      || h->n_dirs > (h->size - h->dirs_off) / sizeof (struct index_dir)
+      || h->entries_off != h->dirs_off + h->n_dirs * sizeof (struct index_dir)
+      || h->n_entries > (h->size - h->entries_off) / sizeof (struct index_entry)
+      || h->strings_off != h->entries_off + h->n_entries * sizeof (struct index_entry)
+      || h->strings_off >= h->size
+      || ((const char *) map)[h->size - 1] != '\0')
+    goto invalid_map;
+
+  if (h->root_ino != root.st_ino
+      || h->root_mtime_sec != root.st_mtim.tv_sec || h->root_mtime_nsec != root.st_mtim.tv_nsec
+      || h->root_ctime_sec != root.st_ctim.tv_sec || h->root_ctime_nsec != root.st_ctim.tv_nsec)
+    goto invalid_map;
+
+  idx = calloc (1, sizeof (*idx));
+  if (idx == NULL)
+    {
+      munmap (map, st.st_size);
+      return NULL;
+    }
+
+  idx->map = map;
+  idx->size = st.st_size;
+  idx->h = h;
+  idx->dirs = (const struct index_dir *) ((const char *) map + h->dirs_off);
+  idx->entries = (const struct index_entry *) ((const char *) map + h->entries_off);
+  idx->strings = (const char *) map + h->strings_off;
+  idx->strings_len = h->size - h->strings_off;
+  idx->dev = root.st_dev;
+
+  /* Validate the offsets once, so that the lookups can trust them.  */
+  for (i = 0; i < h->n_dirs; i++)
+    if (idx->dirs[i].path >= idx->strings_len
+        || idx->dirs[i].first_entry > h->n_entries
+        || idx->dirs[i].n_entries > h->n_entries - idx->dirs[i].first_entry)
+      goto invalid_idx;
+  for (i = 0; i < h->n_entries; i++)
+    if (idx->entries[i].name >= idx->strings_len)
+      goto invalid_idx;
+
+  return idx;
+
+ invalid_idx:
+  free (idx);
+ invalid_map:
+  munmap (map, st.st_size);
+ invalid:
+  errno = EINVAL;
+  return NULL;
+}
+
+static int
+index_load_data_source (struct ovl_layer *l, const char *opaque, const char *path, int n_layer)
+{
+  cleanup_free char *index_path = NULL;
+  struct layer_index *idx;
+  bool create;
+
+  if (strcmp (opaque, "auto") == 0)
+    create = true;
+  else if (strcmp (opaque, "ro") == 0)
+    create = false;
+  else
+    {
+      fprintf (stderr, "invalid index mode %s\n", opaque);
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (direct_access_ds.load_data_source (l, opaque, path, n_layer) < 0)
+    return -1;
+
+  if (asprintf (&index_path, "%s" INDEX_SUFFIX, l->path) < 0)
+    {
+      index_path = NULL;
+      return -1;
+    }
+
+  idx = open_index (l->fd, index_path);
+  if (idx == NULL && create)
+    {
+      if (build_index (l->fd, index_path) < 0)
+        fprintf (stderr, "cannot create the index %s: %s\n", index_path, strerror (errno));
+      else
+        idx = open_index (l->fd, index_path);
+    }
+  if (idx == NULL)
+    fprintf (stderr, "cannot use the index %s, accessing %s directly\n", index_path, l->path);
+
+  l->data_source_private_data = idx;
+  return 0;
+}
+
+static int
+index_cleanup (struct ovl_layer *l)
+{
+  struct layer_index *idx = get_index (l);
+
+  if (idx)
+    {
+      munmap (idx->map, idx->size);
+      free (idx);
+      l->data_source_private_data = NULL;
+    }
+  return direct_access_ds.cleanup (l);
+}
+
+static int
+index_num_of_layers (const char *opaque, const char *path)
+{
+  return 1;
+}
+
+static struct data_source layer_index_ds =
+  {
+   .num_of_layers = index_num_of_layers,
+   .load_data_source = index_load_data_source,
+   .cleanup = index_cleanup,
+   .file_exists = index_file_exists,
+   .statat = index_statat,
+   .fstat = index_fstat,
+   .opendir = index_opendir,
+   .readdir = index_readdir,
+   .closedir = index_closedir,
+   .openat = index_openat,
+   .getxattr = index_getxattr,
+   .listxattr = index_listxattr,
+   .readlinkat = index_readlinkat,
+  };
+
+struct data_source *
+layer_index_plugin_load (const char *opaque, const char *path)
+{
+  return &layer_index_ds;
+}
+
+int
+layer_index_plugin_release ()
+{
+  return 0;
+}
+
+const char *
+layer_index_plugin_name ()
+{
+  return "index";
+}
@@ -0,0 +1,33 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LAYER_INDEX_H
+# define LAYER_INDEX_H
+
+# include <plugin.h>
+
+/* Built-in "index" data source: a lower layer specified as
+   //index/MODE/PATH is accessed like a directory, but the lookups are
+   answered from the mmap'ed index file PATH.ovl-index.  MODE is "auto"
+   to create the index when it is missing or stale, or "ro" to only use
+   an existing one.  */
+struct data_source *layer_index_plugin_load (const char *opaque, const char *path);
+int layer_index_plugin_release ();
+const char *layer_index_plugin_name ();
+
+#endif
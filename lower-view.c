@@ -0,0 +1,974 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <config.h>
+
+#include "fuse-overlayfs.h"
+#include "lower-view.h"
+#include "index-common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "utils.h"
+
+#define VIEW_SUFFIX ".ovl-view"
+#define VIEW_MAGIC "OVLMERGE"
+#define VIEW_VERSION 1
+
+/* On-disk format of the view, in host byte order.  The directories of
+   all the layers are sorted by path, "" for the root, the entries of
+   each directory by name, and the records of each entry, one for every
+   layer that has it, by layer.  Whiteout files are entries like the
+   others, so a layer answers the whiteout checks without a syscall.
+   Paths and names are offsets in the string table at the end of the
+   file.  The view is stale when the root of any layer changed, so the
+   layers must not be modified while they have a view.  */
+
+struct view_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t n_layers;
+  uint64_t n_dirs;
+  uint64_t n_entries;
+  uint64_t n_records;
+  uint64_t layers_off;
+  uint64_t dirs_off;
+  uint64_t entries_off;
+  uint64_t records_off;
+  uint64_t strings_off;
+  uint64_t size;
+};
+
+struct view_layer_id
+{
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ctime_sec;
+  int64_t ctime_nsec;
+};
+
+struct view_dir
+{
+  uint64_t path;
+  uint64_t first_entry;
+  uint64_t n_entries;
+};
+
+struct view_entry
+{
+  uint64_t name;
+  uint64_t first_record;
+  uint64_t n_records;
+};
+
+#define VIEW_RECORD_OPAQUE 1
+
+struct view_record
+{
+  uint32_t layer;
+  uint32_t flags;
+  uint64_t mode;
+  uint64_t ino;
+  uint64_t rdev;
+};
+
+struct lower_view
+{
+  void *map;
+  size_t size;
+  unsigned int refs;
+  const struct view_header *h;
+  const struct view_dir *dirs;
+  const struct view_entry *entries;
+  const struct view_record *records;
+  const char *strings;
+  size_t strings_len;
+};
+
+/* Private data of a layer using the view.  */
+struct lower_view_layer
+{
+  struct lower_view *v;
+  uint32_t layer;
+  dev_t dev;
+};
+
+struct lower_view_dirp
+{
+  /* Set when the directory is read from the file system.  */
+  DIR *dir;
+  struct lower_view *v;
+  uint32_t layer;
+  const struct view_entry *next;
+  const struct view_entry *end;
+  struct dirent dent;
+};
+
+static struct lower_view_layer *
+get_view_layer (struct ovl_layer *l)
+{
+  return l->data_source_private_data;
+}
+
+/* The view is shared by every mount of the same layers, so only its
+   header is checked when it is opened.  The offsets are checked when
+   they are used, and a lookup that finds one out of bounds fails with
+   EIO; otherwise the lookups fail with ENOENT.  */
+
+static const struct view_dir *
+find_dir (struct lower_view *v, const char *path, size_t len)
+{
+  return index_find (v->dirs, v->h->n_dirs, sizeof (*v->dirs), v->strings, v->strings_len, path, len);
+}
+
+static bool
+dir_is_valid (struct lower_view *v, const struct view_dir *d)
+{
+  if (d->first_entry > v->h->n_entries || d->n_entries > v->h->n_entries - d->first_entry)
+    {
+      errno = EIO;
+      return false;
+    }
+  return true;
+}
+
+static const struct view_entry *
+find_entry (struct lower_view *v, const struct view_dir *d, const char *name)
+{
+  if (! dir_is_valid (v, d))
+    return NULL;
+  return index_find (&v->entries[d->first_entry], d->n_entries, sizeof (*v->entries),
+                     v->strings, v->strings_len, name, strlen (name));
+}
+
+static const struct view_record *
+find_record (struct lower_view *v, const struct view_entry *e, uint32_t layer)
+{
+  size_t lo = 0, hi = e->n_records;
+
+  if (e->first_record > v->h->n_records || e->n_records > v->h->n_records - e->first_record)
+    {
+      errno = EIO;
+      return NULL;
+    }
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct view_record *r = &v->records[e->first_record + mid];
+
+      if (r->layer == layer)
+        return r;
+      if (r->layer < layer)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  errno = ENOENT;
+  return NULL;
+}
+
+/* Look up PATH in the layer VL.  Return NULL and set errno if it does
+   not exist there, or if it is the root, which every layer has; ROOT
+   tells them apart.  */
+static const struct view_record *
+view_lookup (struct lower_view_layer *vl, const char *path, bool *root)
+{
+  const struct view_entry *e;
+  const struct view_dir *d;
+  const char *slash, *name;
+
+  path = index_normalize_path (path);
+
+  *root = path[0] == '\0';
+  if (*root)
+    return NULL;
+
+  slash = strrchr (path, '/');
+  if (slash)
+    {
+      d = find_dir (vl->v, path, slash - path);
+      name = slash + 1;
+    }
+  else
+    {
+      d = find_dir (vl->v, "", 0);
+      name = path;
+    }
+  if (d == NULL)
+    return NULL;
+
+  e = find_entry (vl->v, d, name);
+  if (e == NULL)
+    return NULL;
+
+  return find_record (vl->v, e, vl->layer);
+}
+
+static int
+view_file_exists (struct ovl_layer *l, const char *pathname)
+{
+  bool root;
+
+  if (view_lookup (get_view_layer (l), pathname, &root) || root)
+    return 0;
+  return -1;
+}
+
+static int
+view_statat (struct ovl_layer *l, const char *path, struct stat *st, int flags, unsigned int mask)
+{
+  struct lower_view_layer *vl = get_view_layer (l);
+  const struct view_record *r;
+  bool root;
+
+  r = view_lookup (vl, path, &root);
+  if (root)
+    return direct_access_ds.statat (l, path, st, flags, mask);
+  if (r == NULL)
+    return -1;
+
+  /* Only the type, mode and inode are stored in the view.  */
+  if ((mask & ~(STATX_TYPE|STATX_MODE|STATX_INO))
+      || ! (flags & AT_SYMLINK_NOFOLLOW)
+      || l->stat_override_mode != STAT_OVERRIDE_NONE)
+    return direct_access_ds.statat (l, path, st, flags, mask);
+
+  memset (st, 0, sizeof (*st));
+  st->st_dev = vl->dev;
+  st->st_mode = r->mode;
+  st->st_ino = r->ino;
+  st->st_rdev = r->rdev;
+  return 0;
+}
+
+static void *
+view_opendir (struct ovl_layer *l, const char *path)
+{
+  struct lower_view_layer *vl = get_view_layer (l);
+  struct lower_view_dirp *dirp;
+  const struct view_record *r;
+  const struct view_dir *d;
+  bool root;
+
+  r = view_lookup (vl, path, &root);
+  if (! root)
+    {
+      if (r == NULL)
+        return NULL;
+      if (! S_ISDIR (r->mode))
+        {
+          errno = ENOTDIR;
+          return NULL;
+        }
+    }
+
+  path = index_normalize_path (path);
+  d = find_dir (vl->v, path, strlen (path));
+  if (d == NULL ? errno != ENOENT : ! dir_is_valid (vl->v, d))
+    return NULL;
+
+  dirp = calloc (1, sizeof (*dirp));
+  if (dirp == NULL)
+    return NULL;
+
+  if (d == NULL)
+    {
+      dirp->dir = direct_access_ds.opendir (l, path[0] ? path : ".");
+      if (dirp->dir == NULL)
+        {
+          free (dirp);
+          return NULL;
+        }
+      return dirp;
+    }
+
+  dirp->v = vl->v;
+  dirp->layer = vl->layer;
+  dirp->next = &vl->v->entries[d->first_entry];
+  dirp->end = dirp->next + d->n_entries;
+  return dirp;
+}
+
+static struct dirent *
+view_readdir (void *p)
+{
+  struct lower_view_dirp *dirp = p;
+
+  if (dirp->dir)
+    return direct_access_ds.readdir (dirp->dir);
+
+  while (dirp->next < dirp->end)
+    {
+      const struct view_entry *e = dirp->next++;
+      const struct view_record *r = find_record (dirp->v, e, dirp->layer);
+
+      if (r == NULL)
+        {
+          if (errno != ENOENT)
+            return NULL;
+          continue;
+        }
+      if (e->name >= dirp->v->strings_len)
+        {
+          errno = EIO;
+          return NULL;
+        }
+
+      dirp->dent.d_ino = r->ino;
+      dirp->dent.d_reclen = sizeof (dirp->dent);
+      dirp->dent.d_type = IFTODT (r->mode);
+      strncpy (dirp->dent.d_name, dirp->v->strings + e->name, sizeof (dirp->dent.d_name) - 1);
+      dirp->dent.d_name[sizeof (dirp->dent.d_name) - 1] = '\0';
+      return &dirp->dent;
+    }
+  return NULL;
+}
+
+static int
+view_closedir (void *p)
+{
+  struct lower_view_dirp *dirp = p;
+  int ret = 0;
+
+  if (dirp->dir)
+    ret = direct_access_ds.closedir (dirp->dir);
+  free (dirp);
+  return ret;
+}
+
+static int
+view_openat (struct ovl_layer *l, const char *path, int flags, mode_t mode)
+{
+  bool root;
+
+  if (! (flags & O_CREAT) && view_lookup (get_view_layer (l), path, &root) == NULL && ! root)
+    return -1;
+
+  return direct_access_ds.openat (l, path, flags, mode);
+}
+
+static int
+view_getxattr (struct ovl_layer *l, const char *path, const char *name, char *buf, size_t size)
+{
+  const struct view_record *r;
+  bool root;
+
+  r = view_lookup (get_view_layer (l), path, &root);
+  if (root)
+    return direct_access_ds.getxattr (l, path, name, buf, size);
+  if (r == NULL)
+    return -1;
+
+  /* The view knows whether a directory is opaque.  */
+  if (S_ISDIR (r->mode) && (strcmp (name, OPAQUE_XATTR) == 0 || strcmp (name, PRIVILEGED_OPAQUE_XATTR) == 0))
+    {
+      if (! (r->flags & VIEW_RECORD_OPAQUE))
+        {
+          errno = ENODATA;
+          return -1;
+        }
+      if (size == 0)
+        return 1;
+      buf[0] = 'y';
+      return 1;
+    }
+
+  return direct_access_ds.getxattr (l, path, name, buf, size);
+}
+
+static void
+view_unref (struct lower_view *v)
+{
+  if (--v->refs > 0)
+    return;
+
+  munmap (v->map, v->size);
+  free (v);
+}
+
+static int
+view_cleanup (struct ovl_layer *l)
+{
+  struct lower_view_layer *vl = get_view_layer (l);
+
+  if (vl)
+    {
+      view_unref (vl->v);
+      free (vl);
+      l->data_source_private_data = NULL;
+    }
+  return direct_access_ds.cleanup (l);
+}
+
+static struct data_source lower_view_ds;
+
+/* Creation of the view.  */
+
+/* One entry of a directory in a layer.  A mark only carries the opaque
+   flag of a directory, found when the directory itself is read, and is
+   merged into the entry read from its parent.  */
+struct build_tuple
+{
+  char *dir;
+  char *name;
+  uint32_t layer;
+  uint32_t flags;
+  bool mark;
+  /* DIR is owned by the tuple, instead of pointing to B->walk.  */
+  bool own_dir;
+  uint64_t mode;
+  uint64_t ino;
+  uint64_t rdev;
+};
+
+struct build
+{
+  struct build_tuple *tuples;
+  size_t n_tuples;
+  size_t allocated_tuples;
+
+  /* Every directory of every layer.  */
+  struct index_walk walk;
+};
+
+static void
+free_build (struct build *b)
+{
+  size_t i;
+
+  for (i = 0; i < b->n_tuples; i++)
+    {
+      free (b->tuples[i].name);
+      if (b->tuples[i].own_dir)
+        free (b->tuples[i].dir);
+    }
+  free (b->tuples);
+  index_walk_free (&b->walk);
+}
+
+static struct build_tuple *
+add_tuple (struct build *b, char *dir, const char *name, uint32_t layer)
+{
+  struct build_tuple *t;
+
+  if (b->n_tuples == b->allocated_tuples)
+    {
+      size_t allocated = b->allocated_tuples ? b->allocated_tuples * 2 : 1024;
+      struct build_tuple *new = realloc (b->tuples, allocated * sizeof (*new));
+      if (new == NULL)
+        return NULL;
+      b->tuples = new;
+      b->allocated_tuples = allocated;
+    }
+
+  t = &b->tuples[b->n_tuples];
+  memset (t, 0, sizeof (*t));
+  t->name = strdup (name);
+  if (t->name == NULL)
+    return NULL;
+  t->dir = dir;
+  t->layer = layer;
+  b->n_tuples++;
+  return t;
+}
+
+struct walk_data
+{
+  struct build *b;
+  uint32_t layer;
+};
+
+/* An opaque directory adds a mark to its entry in the parent.  */
+static int
+walk_dir (void *data, size_t i, bool opaque)
+{
+  struct walk_data *wd = data;
+  const char *path = wd->b->walk.dirs[i];
+  const char *slash;
+  struct build_tuple *t;
+  char *parent;
+
+  if (path[0] == '\0' || ! opaque)
+    return 0;
+
+  slash = strrchr (path, '/');
+  parent = strndup (path, slash ? (size_t) (slash - path) : 0);
+  t = parent ? add_tuple (wd->b, parent, slash ? slash + 1 : path, wd->layer) : NULL;
+  if (t == NULL)
+    {
+      free (parent);
+      return -1;
+    }
+  t->own_dir = true;
+  t->mark = true;
+  t->flags = VIEW_RECORD_OPAQUE;
+  return 0;
+}
+
+static int
+walk_entry (void *data, size_t i, const char *name, const struct stat *st)
+{
+  struct walk_data *wd = data;
+  struct build_tuple *t;
+
+  t = add_tuple (wd->b, wd->b->walk.dirs[i], name, wd->layer);
+  if (t == NULL)
+    return -1;
+  t->mode = st->st_mode;
+  t->ino = st->st_ino;
+  t->rdev = st->st_rdev;
+  return 0;
+}
+
+static const struct index_walk_ops walk_ops = {
+  .dir = walk_dir,
+  .entry = walk_entry,
+};
+
+static int
+compare_tuples (const void *a, const void *b)
+{
+  const struct build_tuple *ta = a, *tb = b;
+  int r;
+
+  r = strcmp (ta->dir, tb->dir);
+  if (r)
+    return r;
+  r = strcmp (ta->name, tb->name);
+  if (r)
+    return r;
+  if (ta->layer != tb->layer)
+    return ta->layer < tb->layer ? -1 : 1;
+  return (int) ta->mark - (int) tb->mark;
+}
+
+static int
+compare_strings (const void *a, const void *b)
+{
+  return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+static int
+write_view (FILE *f, struct build *b, const struct view_layer_id *ids, uint32_t n_layers)
+{
+  struct view_header h;
+  uint64_t strings_len = 0, name_off, path_off, entry, n_entries = 0;
+  size_t i, t;
+
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, VIEW_MAGIC, sizeof (h.magic));
+  h.version = VIEW_VERSION;
+  h.n_layers = n_layers;
+  h.n_dirs = b->walk.n_dirs;
+
+  for (i = 0; i < b->walk.n_dirs; i++)
+    strings_len += strlen (b->walk.dirs[i]) + 1;
+  for (t = 0; t < b->n_tuples; t++)
+    {
+      if (t == 0 || b->tuples[t].dir != b->tuples[t - 1].dir || strcmp (b->tuples[t].name, b->tuples[t - 1].name))
+        {
+          n_entries++;
+          strings_len += strlen (b->tuples[t].name) + 1;
+        }
+    }
+  h.n_entries = n_entries;
+  h.n_records = b->n_tuples;
+
+  h.layers_off = sizeof (h);
+  h.dirs_off = h.layers_off + n_layers * sizeof (struct view_layer_id);
+  h.entries_off = h.dirs_off + h.n_dirs * sizeof (struct view_dir);
+  h.records_off = h.entries_off + h.n_entries * sizeof (struct view_entry);
+  h.strings_off = h.records_off + h.n_records * sizeof (struct view_record);
+  h.size = h.strings_off + strings_len;
+
+  if (fwrite (&h, sizeof (h), 1, f) != 1)
+    return -1;
+  if (fwrite (ids, sizeof (*ids), n_layers, f) != n_layers)
+    return -1;
+
+  /* The tuples are sorted by directory, like the directories, and the
+     directories have their names first in the string table.  */
+  name_off = 0;
+  for (i = 0; i < b->walk.n_dirs; i++)
+    name_off += strlen (b->walk.dirs[i]) + 1;
+
+  path_off = entry = 0;
+  for (i = t = 0; i < b->walk.n_dirs; i++)
+    {
+      struct view_dir d = {
+        .path = path_off,
+        .first_entry = entry,
+      };
+
+      for (; t < b->n_tuples && b->tuples[t].dir == b->walk.dirs[i]; t++)
+        if (t == 0 || b->tuples[t].dir != b->tuples[t - 1].dir || strcmp (b->tuples[t].name, b->tuples[t - 1].name))
+          d.n_entries++;
+
+      if (fwrite (&d, sizeof (d), 1, f) != 1)
+        return -1;
+      path_off += strlen (b->walk.dirs[i]) + 1;
+      entry += d.n_entries;
+    }
+
+  for (t = 0; t < b->n_tuples;)
+    {
+      struct view_entry e = {
+        .name = name_off,
+        .first_record = t,
+      };
+      size_t end;
+
+      for (end = t + 1; end < b->n_tuples && b->tuples[end].dir == b->tuples[t].dir && strcmp (b->tuples[end].name, b->tuples[t].name) == 0; end++)
+        ;
+      e.n_records = end - t;
+
+      if (fwrite (&e, sizeof (e), 1, f) != 1)
+        return -1;
+      name_off += strlen (b->tuples[t].name) + 1;
+      t = end;
+    }
+
+  for (t = 0; t < b->n_tuples; t++)
+    {
+      struct view_record r = {
+        .layer = b->tuples[t].layer,
+        .flags = b->tuples[t].flags,
+        .mode = b->tuples[t].mode,
+        .ino = b->tuples[t].ino,
+        .rdev = b->tuples[t].rdev,
+      };
+
+      if (fwrite (&r, sizeof (r), 1, f) != 1)
+        return -1;
+    }
+
+  for (i = 0; i < b->walk.n_dirs; i++)
+    if (fwrite (b->walk.dirs[i], strlen (b->walk.dirs[i]) + 1, 1, f) != 1)
+      return -1;
+
+  for (t = 0; t < b->n_tuples; t++)
+    if (t == 0 || b->tuples[t].dir != b->tuples[t - 1].dir || strcmp (b->tuples[t].name, b->tuples[t - 1].name))
+      if (fwrite (b->tuples[t].name, strlen (b->tuples[t].name) + 1, 1, f) != 1)
+        return -1;
+
+  return 0;
+}
+
+/* Sort the tuples and the directories, make the tuples of a directory
+   share its path in B->walk, drop the paths found in several layers
+   and merge the marks in the entries they belong to.  */
+static void
+merge_tuples (struct build *b)
+{
+  size_t i, j, d;
+
+  qsort (b->walk.dirs, b->walk.n_dirs, sizeof (b->walk.dirs[0]), compare_strings);
+  qsort (b->tuples, b->n_tuples, sizeof (b->tuples[0]), compare_tuples);
+
+  /* Both are sorted by path, the first copy of each path is kept.  */
+  for (i = d = 0; i < b->n_tuples; i++)
+    {
+      struct build_tuple *t = &b->tuples[i];
+
+      while (strcmp (b->walk.dirs[d], t->dir) != 0)
+        d++;
+      if (t->own_dir)
+        free (t->dir);
+      t->dir = b->walk.dirs[d];
+      t->own_dir = false;
+    }
+
+  for (i = j = 0; i < b->walk.n_dirs; i++)
+    {
+      if (j > 0 && strcmp (b->walk.dirs[i], b->walk.dirs[j - 1]) == 0)
+        free (b->walk.dirs[i]);
+      else
+        b->walk.dirs[j++] = b->walk.dirs[i];
+    }
+  b->walk.n_dirs = j;
+
+  for (i = j = 0; i < b->n_tuples; i++)
+    {
+      struct build_tuple *t = &b->tuples[i];
+
+      if (t->mark)
+        {
+          if (j > 0 && b->tuples[j - 1].dir == t->dir && b->tuples[j - 1].layer == t->layer
+              && strcmp (b->tuples[j - 1].name, t->name) == 0)
+            b->tuples[j - 1].flags |= t->flags;
+          free (t->name);
+          continue;
+        }
+      b->tuples[j++] = *t;
+    }
+  b->n_tuples = j;
+}
+
+static int
+build_view (struct ovl_layer *lower, const struct view_layer_id *ids, uint32_t n_layers, const char *view_path)
+{
+  struct build b;
+  cleanup_free char *tmp_path = NULL;
+  cleanup_file FILE *f = NULL;
+  struct walk_data wd = { &b, 0 };
+  struct ovl_layer *it;
+  int ret = -1;
+  int fd;
+
+  memset (&b, 0, sizeof (b));
+
+  /* Every layer is walked from its root; the directories found in
+     several layers are queued once per layer and deduplicated after.  */
+  for (it = lower; it; it = it->next, wd.layer++)
+    if (index_walk_layer (&b.walk, it->fd, &walk_ops, &wd) < 0)
+      goto exit;
+
+  merge_tuples (&b);
+
+  if (asprintf (&tmp_path, "%s.XXXXXX", view_path) < 0)
+    {
+      tmp_path = NULL;
+      goto exit;
+    }
+
+  fd = mkostemp (tmp_path, O_CLOEXEC);
+  if (fd < 0)
+    goto exit;
+
+  f = fdopen (fd, "w");
+  if (f == NULL)
+    {
+      close (fd);
+      unlink (tmp_path);
+      goto exit;
+    }
+
+  if (write_view (f, &b, ids, n_layers) < 0 || fflush (f) != 0 || fsync (fileno (f)) < 0
+      || fchmod (fileno (f), 0644) < 0 || rename (tmp_path, view_path) < 0)
+    {
+      unlink (tmp_path);
+      goto exit;
+    }
+
+  ret = 0;
+
+ exit:
+  free_build (&b);
+  return ret;
+}
+
+/* Map VIEW_PATH and check that it is a view of the N_LAYERS layers
+   identified by IDS.  */
+static struct lower_view *
+open_view (const char *view_path, const struct view_layer_id *ids, uint32_t n_layers)
+{
+  cleanup_close int fd = -1;
+  const struct view_header *h;
+  struct lower_view *v;
+  struct stat st;
+  void *map;
+
+  fd = open (view_path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) < 0)
+    return NULL;
+
+  if ((size_t) st.st_size < sizeof (*h))
+    goto invalid;
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  h = map;
+  if (memcmp (h->magic, VIEW_MAGIC, sizeof (h->magic)) || h->version != VIEW_VERSION
+      || h->size != (uint64_t) st.st_size
+      || h->n_layers != n_layers
+      || h->layers_off != sizeof (*h)
+      || h->dirs_off != h->layers_off + n_layers * sizeof (struct view_layer_id)
+      || h->n_dirs == 0
+      || h->n_dirs > (h->size - h->dirs_off) / sizeof (struct view_dir)
+      || h->entries_off != h->dirs_off + h->n_dirs * sizeof (struct view_dir)
+      || h->n_entries > (h->size - h->entries_off) / sizeof (struct view_entry)
+      || h->records_off != h->entries_off + h->n_entries * sizeof (struct view_entry)
+      || h->n_records > (h->size - h->records_off) / sizeof (struct view_record)
+      || h->strings_off != h->records_off + h->n_records * sizeof (struct view_record)
+      || h->strings_off >= h->size
+      || ((const char *) map)[h->size - 1] != '\0')
+    goto invalid_map;
+
+  if (memcmp ((const char *) map + h->layers_off, ids, n_layers * sizeof (*ids)) != 0)
+    goto invalid_map;
+
+  v = calloc (1, sizeof (*v));
+  if (v == NULL)
+    {
+      munmap (map, st.st_size);
+      return NULL;
+    }
+
+  v->map = map;
+  v->size = st.st_size;
+  v->h = h;
+  v->dirs = (const struct view_dir *) ((const char *) map + h->dirs_off);
+  v->entries = (const struct view_entry *) ((const char *) map + h->entries_off);
+  v->records = (const struct view_record *) ((const char *) map + h->records_off);
+  v->strings = (const char *) map + h->strings_off;
+  v->strings_len = h->size - h->strings_off;
+  return v;
+
+ invalid_map:
+  munmap (map, st.st_size);
+ invalid:
+  errno = EINVAL;
+  return NULL;
+}
+
+/* FNV-1a of the identities of the layers, to name the view.  */
+static uint64_t
+view_key (const struct view_layer_id *ids, uint32_t n_layers)
+{
+  const unsigned char *p = (const unsigned char *) ids;
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < n_layers * sizeof (*ids); i++)
+    {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+int
+lower_view_attach (struct ovl_layer *lower, const char *dir)
+{
+  cleanup_free struct view_layer_id *ids = NULL;
+  cleanup_free char *view_path = NULL;
+  struct lower_view *v;
+  struct ovl_layer *it;
+  uint32_t n_layers = 0, i;
+
+  for (it = lower; it; it = it->next)
+    {
+      /* Only plain directories can be merged.  */
+      if (it->ds != &direct_access_ds)
+        {
+          errno = EINVAL;
+          return -1;
+        }
+      n_layers++;
+    }
+  if (n_layers == 0)
+    return 0;
+
+  ids = calloc (n_layers, sizeof (*ids));
+  if (ids == NULL)
+    return -1;
+
+  for (it = lower, i = 0; it; it = it->next, i++)
+    {
+      struct stat st;
+
+      if (fstat (it->fd, &st) < 0)
+        return -1;
+
+      ids[i].dev = st.st_dev;
+      ids[i].ino = st.st_ino;
+      ids[i].mtime_sec = st.st_mtim.tv_sec;
+      ids[i].mtime_nsec = st.st_mtim.tv_nsec;
+      ids[i].ctime_sec = st.st_ctim.tv_sec;
+      ids[i].ctime_nsec = st.st_ctim.tv_nsec;
+    }
+
+  if (asprintf (&view_path, "%s/%016" PRIx64 VIEW_SUFFIX, dir, view_key (ids, n_layers)) < 0)
+    {
+      view_path = NULL;
+      return -1;
+    }
+
+  v = open_view (view_path, ids, n_layers);
+  if (v == NULL)
+    {
+      if (build_view (lower, ids, n_layers, view_path) < 0)
+        return -1;
+      v = open_view (view_path, ids, n_layers);
+      if (v == NULL)
+        return -1;
+    }
+
+  if (lower_view_ds.statat == NULL)
+    {
+      lower_view_ds = direct_access_ds;
+      lower_view_ds.cleanup = view_cleanup;
+      lower_view_ds.file_exists = view_file_exists;
+      lower_view_ds.statat = view_statat;
+      lower_view_ds.opendir = view_opendir;
+      lower_view_ds.readdir = view_readdir;
+      lower_view_ds.closedir = view_closedir;
+      lower_view_ds.openat = view_openat;
+      lower_view_ds.getxattr = view_getxattr;
+    }
+
+  for (it = lower, i = 0; it; it = it->next, i++)
+    {
+      struct lower_view_layer *vl = calloc (1, sizeof (*vl));
+
+      if (vl == NULL)
+        {
+          /* The layers set up so far keep their reference.  */
+          if (v->refs == 0)
+            {
+              munmap (v->map, v->size);
+              free (v);
+            }
+          return -1;
+        }
+
+      vl->v = v;
+      vl->layer = i;
+      vl->dev = ids[i].dev;
+      v->refs++;
+
+      it->data_source_private_data = vl;
+      it->ds = &lower_view_ds;
+    }
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOWER_VIEW_H
+# define LOWER_VIEW_H
+
+# include <fuse-overlayfs.h>
+
+/* Merged view of a stack of lower layers: with lower_view=DIR, the
+   directories and entries of all the lower layers are stored once in
+   DIR/KEY.ovl-view, where KEY identifies the ordered list of layers, so
+   that the mounts of the same stack share it.  The lookups and the
+   directory reads of the lower layers are then answered from the
+   mmap'ed view.  Attach the view to the lower layers starting at LOWER,
+   creating it if needed.  The layers keep being accessed directly on
+   errors.  */
+int lower_view_attach (struct ovl_layer *lower, const char *dir);
+
+#endif
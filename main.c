@@ -35,13 +35,11 @@
 #include <string.h>
 #include <limits.h>
 #include <dirent.h>
+#include <libgen.h>
 #include <assert.h>
 #include <errno.h>
 #include <err.h>
 #include <sys/ioctl.h>
-#ifdef HAVE_SYS_SENDFILE_H
-# include <sys/sendfile.h>
-#endif
 
 #include <fuse_overlayfs_error.h>
 
@@ -60,9 +58,16 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include <utils.h>
 #include <plugin.h>
+#include <lower-view.h>
+#include <stats.h>
+#include <thread-pool.h>
+#include <bloom.h>
+#include <slab.h>
+#include <open-table.h>
 
 #ifndef TEMP_FAILURE_RETRY
 #define TEMP_FAILURE_RETRY(expression) \
@@ -95,28 +100,71 @@ struct fuse_req {
 	struct fuse_req *prev;
 };
 
+/* The node tree is protected by a reader/writer lock.  Operations that
+   only read the tree (getattr, getxattr, readlink, readdir of an already
+   loaded table, lookup of a cached entry...) take it shared so they can
+   run in parallel on all the worker threads, everything that modifies
+   the tree takes it exclusive.  */
 static bool disable_locking;
-static pthread_mutex_t lock;
-char hostpid[64];
+static pthread_rwlock_t lock;
 bool isBoxRunning=false;
 
 static int
 enter_big_lock ()
 {
+  uint64_t start;
+
+  if (disable_locking)
+    return 0;
+
+  /* Only the contended case is timed.  */
+  if (pthread_rwlock_trywrlock (&lock) == 0)
+    return 1;
+
+  start = ovl_stats_now ();
+  pthread_rwlock_wrlock (&lock);
+  ovl_stats_add (OVL_STAT_lock_waits, 1);
+  ovl_stats_add (OVL_STAT_lock_wait_ns, ovl_stats_now () - start);
+  return 1;
+}
+
+static int
+enter_big_lock_shared ()
+{
+  uint64_t start;
+
   if (disable_locking)
     return 0;
 
-  pthread_mutex_lock (&lock);
+  if (pthread_rwlock_tryrdlock (&lock) == 0)
+    return 1;
+
+  start = ovl_stats_now ();
+  pthread_rwlock_rdlock (&lock);
+  ovl_stats_add (OVL_STAT_lock_waits, 1);
+  ovl_stats_add (OVL_STAT_lock_wait_ns, ovl_stats_now () - start);
   return 1;
 }
 
+static void
+init_big_lock ()
+{
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init (&attr);
+  /* Do not let a stream of readers starve the writers.  */
+  pthread_rwlockattr_setkind_np (&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init (&lock, &attr);
+  pthread_rwlockattr_destroy (&attr);
+}
+
 static int
 release_big_lock ()
 {
   if (disable_locking)
     return 0;
 
-  pthread_mutex_unlock (&lock);
+  pthread_rwlock_unlock (&lock);
   return 0;
 }
 
@@ -126,7 +174,7 @@ cleanup_lockp (int *l)
   if (*l == 0)
     return;
 
-  pthread_mutex_unlock (&lock);
+  pthread_rwlock_unlock (&lock);
   *l = 0;
 }
 
@@ -160,10 +208,13 @@ open_by_handle_at (int mount_fd, struct file_handle *handle, int flags)
 #define XATTR_PREFIX "user.fuseoverlayfs."
 #define ORIGIN_XATTR "user.fuseoverlayfs.origin"
 #define OPAQUE_XATTR "user.fuseoverlayfs.opaque"
+#define METACOPY_XATTR "user.fuseoverlayfs.metacopy"
+#define REDIRECT_XATTR "user.fuseoverlayfs.redirect"
 #define XATTR_CONTAINERS_PREFIX "user.containers."
 #define PRIVILEGED_XATTR_PREFIX "trusted.overlay."
 #define PRIVILEGED_OPAQUE_XATTR "trusted.overlay.opaque"
 #define PRIVILEGED_ORIGIN_XATTR "trusted.overlay.origin"
+#define PRIVILEGED_REDIRECT_XATTR "trusted.overlay.redirect"
 #define OPAQUE_WHITEOUT ".wh..wh..opq"
 #define WHITEOUT_MAX_LEN (sizeof (".wh.")-1)
 
@@ -195,12 +246,41 @@ struct stats_s
 
 static volatile struct stats_s stats;
 
+/* Nodes, inodes and node names are allocated from slabs.  */
+static struct slab node_slab = SLAB_INITIALIZER (sizeof (struct ovl_node));
+static struct slab ino_slab = SLAB_INITIALIZER (sizeof (struct ovl_ino));
+
+/* Directories start with a small children table, it grows with the
+   entries.  */
+#define CHILDREN_TABLE_SIZE 4
+
+/* Bumped by the SIGUSR1/SIGUSR2 handlers to drop every verdict cached
+   by caller_in_host_pidns.  */
+static volatile sig_atomic_t pidns_cache_generation;
+
 void SIGUSR1_handle(int sig)
 {
   fprintf (stderr, "Reveice SIGUSR1 signal %d \n", sig);
   isBoxRunning = false;
-  char fmt[128];
-  int l = snprintf (fmt, sizeof (fmt) - 1, "# INODES: %zu\n# NODES: %zu\n", stats.inodes, stats.nodes);
+  pidns_cache_generation++;
+  char fmt[512];
+  struct rusage ru;
+  int l;
+
+  if (getrusage (RUSAGE_SELF, &ru) < 0)
+    ru.ru_maxrss = 0;
+  l = snprintf (fmt, sizeof (fmt) - 1,
+                "# INODES: %zu\n# NODES: %zu\n"
+                "# NODE SLAB: %zu used %zu allocated %zu allocations\n"
+                "# INODE SLAB: %zu used %zu allocated %zu allocations\n"
+                "# NAMES: %zu bytes\n"
+                "# PEAK RSS: %ld kB\n",
+                stats.inodes, stats.nodes,
+                node_slab.in_use, node_slab.capacity, node_slab.allocs,
+                ino_slab.in_use, ino_slab.capacity, ino_slab.allocs,
+                slab_strings_size (), ru.ru_maxrss);
+  if (l >= (int) sizeof (fmt) - 1)
+    l = sizeof (fmt) - 2;
   fmt[l] = '\0';
   write (STDERR_FILENO, fmt, l + 1);
 }
@@ -209,6 +289,7 @@ void SIGUSR2_handle(int sig)
 {
     fprintf (stderr, "Reveice SIGUSR2 signal %d \n", sig);
     isBoxRunning = true;
+    pidns_cache_generation++;
 }
 
 static double
@@ -256,6 +337,38 @@ static const struct fuse_opt ovl_opts[] = {
    offsetof (struct ovl_data, squash_to_gid), 1},
   {"static_nlink",
    offsetof (struct ovl_data, static_nlink), 1},
+  {"passthrough=%d",
+   offsetof (struct ovl_data, passthrough), 0},
+  {"lazy_copyup=%d",
+   offsetof (struct ovl_data, lazy_copyup), 0},
+  {"metacopy=on",
+   offsetof (struct ovl_data, metacopy), 1},
+  {"metacopy=off",
+   offsetof (struct ovl_data, metacopy), 0},
+  {"whiteout_filters=%d",
+   offsetof (struct ovl_data, whiteout_filters), 0},
+  {"max_cached_nodes=%lu",
+   offsetof (struct ovl_data, max_cached_nodes), 0},
+  {"parallel_lookup=%d",
+   offsetof (struct ovl_data, parallel_lookup), 0},
+  {"lower_view=%s",
+   offsetof (struct ovl_data, lower_view), 0},
+  {"stats_socket=%s",
+   offsetof (struct ovl_data, stats_socket), 0},
+  {"group_commit=%d",
+   offsetof (struct ovl_data, group_commit), 0},
+  {"dirfd_cache=%d",
+   offsetof (struct ovl_data, dirfd_cache), 0},
+  {"max_idle_threads=%u",
+   offsetof (struct ovl_data, max_idle_threads), 0},
+  {"cpus=%s",
+   offsetof (struct ovl_data, cpus), 0},
+  {"numa_node=%d",
+   offsetof (struct ovl_data, numa_node), 0},
+  {"fast_startup",
+   offsetof (struct ovl_data, fast_startup), 1},
+  {"denied_paths=%s",
+   offsetof (struct ovl_data, denied_paths_str), 0},
   {"volatile",  /* native overlay supports "volatile" to mean fsync=0.  */
    offsetof (struct ovl_data, fsync), 0},
   FUSE_OPT_END
@@ -400,16 +513,142 @@ free_mapping (struct ovl_mapping *it)
     }
 }
 
+static void *
+id_map_alloc (size_t size)
+{
+  void *ret = malloc (size);
+
+  if (ret == NULL)
+    error (EXIT_FAILURE, errno, "cannot allocate memory");
+  return ret;
+}
+
+static int
+cmp_boundaries (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Compile the MAPPINGS, in the direction from host to container if
+   DIRECT, to a table of disjoint sorted ranges.  When the mappings
+   overlap, the first one in the list wins, as it did when the list was
+   walked for each ID.  */
+static void
+compile_id_map (struct ovl_id_map *map, const struct ovl_mapping *mappings, bool direct,
+                unsigned int overflow)
+{
+  const struct ovl_mapping *it;
+  uint64_t *bounds;
+  size_t n = 0, n_bounds = 0, i;
+
+  map->overflow = overflow;
+  map->n_ranges = 0;
+  map->ranges = NULL;
+
+  if (mappings == NULL)
+    {
+      map->ranges = id_map_alloc (sizeof (*map->ranges));
+      map->ranges[0] = (struct ovl_id_range) { 0, UINT_MAX, UINT_MAX, 0 };
+      map->n_ranges = 1;
+      return;
+    }
+
+  for (it = mappings; it; it = it->next)
+    n++;
+
+  /* Split the ID space at every start and end of a mapping, then find
+     the mapping that wins for each piece.  */
+  bounds = id_map_alloc (2 * n * sizeof (*bounds));
+  for (it = mappings; it; it = it->next)
+    {
+      uint64_t first = direct ? it->host : it->to;
+
+      if (it->len == 0)
+        continue;
+      bounds[n_bounds++] = first;
+      bounds[n_bounds++] = first + it->len;
+    }
+  qsort (bounds, n_bounds, sizeof (*bounds), cmp_boundaries);
+
+  map->ranges = id_map_alloc ((n_bounds ? n_bounds : 1) * sizeof (*map->ranges));
+  for (i = 0; i + 1 < n_bounds; i++)
+    {
+      uint64_t first = bounds[i], end = bounds[i + 1];
+      struct ovl_id_range *r;
+      unsigned int delta;
+
+      if (first == end || first > UINT_MAX)
+        continue;
+      if (end > (uint64_t) UINT_MAX + 1)
+        end = (uint64_t) UINT_MAX + 1;
+
+      for (it = mappings; it; it = it->next)
+        {
+          uint64_t from = direct ? it->host : it->to;
+
+          if (first >= from && first < from + it->len)
+            break;
+        }
+      if (it == NULL)
+        continue;
+
+      delta = direct ? it->to - it->host : it->host - it->to;
+      r = map->n_ranges ? &map->ranges[map->n_ranges - 1] : NULL;
+      if (r && r->delta == delta && (uint64_t) r->last + 1 == first)
+        r->last = end - 1;
+      else
+        map->ranges[map->n_ranges++] = (struct ovl_id_range) { first, end - 1, UINT_MAX, delta };
+    }
+  free (bounds);
+}
+
+/* Every ID is translated to ID.  */
+static void
+compile_id_squash (struct ovl_id_map *map, unsigned int id)
+{
+  map->ranges = id_map_alloc (sizeof (*map->ranges));
+  map->ranges[0] = (struct ovl_id_range) { 0, UINT_MAX, 0, id };
+  map->n_ranges = 1;
+  map->overflow = id;
+}
+
+static inline unsigned int
+id_map_lookup (const struct ovl_id_map *map, unsigned int id)
+{
+  const struct ovl_id_range *r = map->ranges;
+  size_t lo = 0, hi = map->n_ranges;
+
+  /* The usual single range is a compare and an add.  */
+  if (hi == 1)
+    return id - r->first <= r->last - r->first ? (id & r->mask) + r->delta : map->overflow;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (id < r[mid].first)
+        hi = mid;
+      else if (id > r[mid].last)
+        lo = mid + 1;
+      else
+        return (id & r[mid].mask) + r[mid].delta;
+    }
+  return map->overflow;
+}
+
 /* Useful in a gdb session.  */
 void
 dump_directory (struct ovl_node *node)
 {
   struct ovl_node *it;
+  size_t pos;
 
   if (node->children == NULL)
     return;
 
-  for (it = hash_get_first (node->children); it; it = hash_get_next (node->children, it))
+  for (pos = 0; (it = otable_next (node->children, &pos));)
     printf ("ENTRY: %s (%s)\n", it->name, it->path);
 }
 
@@ -462,6 +701,21 @@ ovl_init (void *userdata, struct fuse_conn_info *conn)
     conn->want |= FUSE_CAP_POSIX_ACL;
 
   conn->want |= FUSE_CAP_DONT_MASK | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
+#if HAVE_FUSE_PASSTHROUGH
+  if (lo->passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH))
+    {
+      conn->want |= FUSE_CAP_PASSTHROUGH;
+      /* The kernel does not support passthrough together with the
+         writeback cache.  */
+      lo->writeback = 0;
+    }
+  else
+    lo->passthrough = 0;
+#else
+  lo->passthrough = 0;
+#endif
+
   if (lo->writeback)
     conn->want |= FUSE_CAP_WRITEBACK_CACHE;
 }
@@ -734,2512 +988,5634 @@ is_directory_opaque (struct ovl_layer *l, const char *path)
   return b[0] == 'y' ? 1 : 0;
 }
 
-static int
-create_whiteout (struct ovl_data *lo, struct ovl_node *parent, const char *name, bool skip_mknod, bool force_create)
-{
-  char whiteout_wh_path[PATH_MAX];
-  cleanup_close int fd = -1;
-  int ret;
+/* Nodes only store their name, the path of a node relative to its
+   layer is built from the names of its parents.  Hidden nodes and the
+   nodes that are still referenced after they were dropped from their
+   parent store the path they had in node->path.
 
-  if (! force_create)
-    {
-      char path[PATH_MAX];
-      struct ovl_layer *l;
-      bool found = false;
+   Write the path of NODE in BUF, that must be PATH_MAX bytes, and
+   return it, or NULL with errno set to ENAMETOOLONG.  */
+static const char *
+node_path (struct ovl_node *node, char *buf)
+{
+  struct ovl_node *it;
+  size_t len = 0;
+  char *p;
 
-      strconcat3 (path, PATH_MAX, parent->path, "/", name);
+  if (node->path)
+    return node->path;
+  if (node->parent == NULL)
+    return ".";
 
-      for (l = get_lower_layers (lo); l; l = l->next)
-        {
-          ret = l->ds->file_exists (l, path);
-          if (ret < 0 && errno == ENOENT)
-            continue;
+  for (it = node; it->parent && it->path == NULL; it = it->parent)
+    len += strlen (it->name) + 1;
+  /* The children of the root have no "./" prefix.  */
+  if (it->path)
+    len += strlen (it->path);
+  else
+    len--;
 
-          found = true;
-          break;
-        }
-      /* Not present in the lower layers, do not do anything.  */
-      if (!found)
-        return 0;
+  if (len >= PATH_MAX)
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
     }
 
-  if (!skip_mknod && can_mknod)
+  p = buf + len;
+  *p = '\0';
+  for (it = node; it->parent && it->path == NULL; it = it->parent)
     {
-      char whiteout_path[PATH_MAX];
+      size_t l = strlen (it->name);
 
-      strconcat3 (whiteout_path, PATH_MAX, parent->path, "/", name);
+      p -= l;
+      memcpy (p, it->name, l);
+      if (p > buf)
+        *--p = '/';
+    }
+  if (it->path)
+    memcpy (buf, it->path, p - buf);
 
-      ret = mknodat (get_upper_layer (lo)->fd, whiteout_path, S_IFCHR|0700, makedev (0, 0));
-      if (ret == 0)
-        return 0;
+  return buf;
+}
 
-      if (errno == EEXIST)
-        {
-          int saved_errno = errno;
-          struct stat st;
+/* Store the current path of NODE before it is detached from its parent.  */
+static void
+node_keep_path (struct ovl_node *node)
+{
+  char buf[PATH_MAX];
+  const char *path;
 
-          /* Check whether it is already a whiteout.  */
-          if (TEMP_FAILURE_RETRY (fstatat (get_upper_layer (lo)->fd, whiteout_path, &st, AT_SYMLINK_NOFOLLOW)) == 0
-              && (st.st_mode & S_IFMT) == S_IFCHR
-              && major (st.st_rdev) == 0
-              && minor (st.st_rdev) == 0)
-            return 0;
+  if (node->path || node->parent == NULL)
+    return;
 
-          errno = saved_errno;
-        }
+  /* A node too deep for a path cannot be reached anyway.  */
+  path = node_path (node, buf);
+  if (path)
+    node->path = strdup (path);
+}
 
-      if (errno != EPERM && errno != ENOTSUP)
-        return -1;
+/* Redirected directories.  With redirect_dir=on a directory that has
+   lower layers is renamed by moving only its upper directory, that
+   gets a redirect xattr with its path in the lower layers, as the
+   kernel overlay does.  node->redirect is set on such a directory and
+   the lower layers of its descendants are found under it.  */
 
-      /* if it fails with EPERM then do not attempt mknod again.  */
-      can_mknod = false;
+static unsigned long n_redirects;
+
+/* Write the path of NODE in the lower layers in BUF, that must be
+   PATH_MAX bytes, and return it, or NULL like node_path.  */
+static const char *
+node_lower_path (struct ovl_node *node, char *buf)
+{
+  char full[PATH_MAX], prefix[PATH_MAX];
+  const char *p, *pp;
+  struct ovl_node *it;
+
+  if (n_redirects == 0)
+    return node_path (node, buf);
+
+  for (it = node; it->parent && it->redirect == NULL; it = it->parent)
+    ;
+  if (it->redirect == NULL)
+    return node_path (node, buf);
+  if (it == node)
+    return node->redirect;
+
+  p = node_path (node, full);
+  pp = node_path (it, prefix);
+  if (p == NULL || pp == NULL)
+    return NULL;
+  p += strlen (pp);
+  if (strlen (it->redirect) + strlen (p) >= PATH_MAX)
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
     }
+  strconcat3 (buf, PATH_MAX, it->redirect, p, NULL);
+  return buf;
+}
 
-  strconcat3 (whiteout_wh_path, PATH_MAX, parent->path, "/.wh.", name);
+/* The path of NODE in the layer L.  */
+static const char *
+node_path_in (struct ovl_node *node, struct ovl_layer *l, char *buf)
+{
+  return l->low ? node_lower_path (node, buf) : node_path (node, buf);
+}
 
-  fd = get_upper_layer (lo)->ds->openat (get_upper_layer (lo), whiteout_wh_path, O_CREAT|O_WRONLY|O_NONBLOCK, 0700);
-  if (fd < 0 && errno != EEXIST)
-    return -1;
+/* The path of NODE in its own layer.  */
+static const char *
+node_layer_path (struct ovl_node *node, char *buf)
+{
+  return node_path_in (node, node->layer, buf);
+}
 
-  return 0;
+static void
+node_set_redirect (struct ovl_node *node, char *redirect)
+{
+  if (node->redirect)
+    n_redirects--;
+  free (node->redirect);
+  node->redirect = redirect;
+  if (redirect)
+    n_redirects++;
 }
 
-static int
-delete_whiteout (struct ovl_data *lo, int dirfd, struct ovl_node *parent, const char *name)
+/* Read the redirect of the directory PATH in the upper layer L, child
+   of PARENT.  A relative redirect is a name in the lower directory of
+   PARENT.  Return NULL if there is none.  */
+static char *
+read_redirect (struct ovl_layer *l, const char *path, struct ovl_node *parent)
 {
-  struct stat st;
+  char value[PATH_MAX];
+  char parent_buf[PATH_MAX];
+  const char *v = value, *ppath;
+  char *ret;
+  ssize_t s;
 
-  if (can_mknod)
+  s = l->ds->getxattr (l, path, PRIVILEGED_REDIRECT_XATTR, value, sizeof (value) - 1);
+  if (s < 0 && errno == ENODATA)
+    s = l->ds->getxattr (l, path, REDIRECT_XATTR, value, sizeof (value) - 1);
+  if (s <= 0)
+    return NULL;
+  value[s] = '\0';
+
+  if (value[0] == '/')
     {
-      if (dirfd >= 0)
-        {
-          if (TEMP_FAILURE_RETRY (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) == 0
-              && (st.st_mode & S_IFMT) == S_IFCHR
-              && major (st.st_rdev) == 0
-              && minor (st.st_rdev) == 0)
-            {
-              if (unlinkat (dirfd, name, 0) < 0)
-                return -1;
-            }
-        }
-      else
-        {
-          char whiteout_path[PATH_MAX];
+      while (*v == '/')
+        v++;
+      return strdup (*v ? v : ".");
+    }
 
-          strconcat3 (whiteout_path, PATH_MAX, parent->path, "/", name);
+  if (parent == NULL || parent->parent == NULL)
+    return strdup (value);
+  ppath = node_lower_path (parent, parent_buf);
+  if (ppath == NULL)
+    return NULL;
+  if (asprintf (&ret, "%s/%s", ppath, value) < 0)
+    return NULL;
+  return ret;
+}
 
-          if (get_upper_layer (lo)->ds->statat (get_upper_layer (lo), whiteout_path, &st, AT_SYMLINK_NOFOLLOW, STATX_MODE|STATX_TYPE) == 0
-              && (st.st_mode & S_IFMT) == S_IFCHR
-              && major (st.st_rdev) == 0
-              && minor (st.st_rdev) == 0)
-            {
-              if (unlinkat (get_upper_layer (lo)->fd, whiteout_path, 0) < 0)
-                return -1;
-            }
-        }
-    }
+/* Store REDIRECT, a path in the lower layers, as the redirect of the
+   upper directory PATH, in the same format as the kernel overlay.  */
+static int
+write_redirect (int dirfd, const char *path, const char *redirect)
+{
+  cleanup_close int fd = -1;
+  cleanup_free char *value = NULL;
 
-  /* Look for the .wh. alternative as well.  */
+  fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, path, O_DIRECTORY|O_RDONLY, 0));
+  if (fd < 0)
+    return -1;
 
-  if (dirfd >= 0)
-    {
-      char whiteout_path[PATH_MAX];
+  if (asprintf (&value, "/%s", redirect) < 0)
+    return -1;
 
-      strconcat3 (whiteout_path, PATH_MAX, ".wh.", name, NULL);
+  if (fsetxattr (fd, PRIVILEGED_REDIRECT_XATTR, value, strlen (value), 0) == 0)
+    return 0;
+  if (errno != EPERM)
+    return -1;
+  return fsetxattr (fd, REDIRECT_XATTR, value, strlen (value), 0);
+}
 
-      if (unlinkat (dirfd, whiteout_path, 0) < 0 && errno != ENOENT)
-        return -1;
-    }
-  else
-    {
-      char whiteout_path[PATH_MAX];
+/* Negative lookup cache.  When a name was probed in every layer of a
+   directory that is not loaded, it is remembered in the directory node
+   so that the next lookups fail without probing the layers again.  A
+   name is dropped from the cache when a node with that name is
+   inserted in the directory.  */
 
-      strconcat3 (whiteout_path, PATH_MAX, parent->path, "/.wh.", name);
+#define NEGATIVE_CACHE_MAX 1024
 
-      if (unlinkat (get_upper_layer (lo)->fd, whiteout_path, 0) < 0 && errno != ENOENT)
-        return -1;
-    }
+static size_t
+negative_hasher (const void *p, size_t s)
+{
+  return hash_string (p, s);
+}
 
-  return 0;
+static bool
+negative_compare (const void *n1, const void *n2)
+{
+  return strcmp (n1, n2) == 0;
 }
 
-int getParentPid(int pid, int *decision)
+static bool
+negative_cache_lookup (struct ovl_node *pnode, const char *name)
 {
-    char dir[1024]={0};
-    char statPath[1024] = {0};
-    char buf[1024] = {0};
-    int rpid=0;
-    int fpid=0;
-    char fpath[1024]={0};
-    struct stat st;
-    ssize_t ret =0;
+  return pnode->negative && hash_lookup (pnode->negative, name) != NULL;
+}
 
-    sprintf(dir,"/proc/%d/",pid);
+static void
+negative_cache_add (struct ovl_data *lo, struct ovl_node *pnode, const char *name)
+{
+  char *n;
 
-    sprintf(statPath,"%sstat",dir);
+  if (get_timeout (lo) <= 0)
+    return;
 
-    if(stat(statPath,&st)!=0)
+  if (pnode->negative == NULL)
     {
-        return -2; 
+      pnode->negative = hash_initialize (16, NULL, negative_hasher, negative_compare, free);
+      if (pnode->negative == NULL)
+        return;
     }
+  else if (hash_get_n_entries (pnode->negative) >= NEGATIVE_CACHE_MAX)
+    hash_clear (pnode->negative);
 
-    memset(buf,0,strlen(buf));
-
-    FILE * fp = fopen(statPath,"r");
+  n = strdup (name);
+  if (n == NULL)
+    return;
 
-    ret += fread(buf + ret,1,300-ret,fp);
+  if (hash_insert (pnode->negative, n) != n)
+    free (n);
+}
 
-    fclose(fp);
+static void
+negative_cache_forget (struct ovl_node *pnode, const char *name)
+{
+  if (pnode->negative)
+    free (hash_delete (pnode->negative, name));
+}
 
-    sscanf(buf,"%*d %*c%s %*c %d %*s",fpath,&fpid);
+static void
+negative_cache_free (struct ovl_node *pnode)
+{
+  if (pnode->negative)
+    hash_free (pnode->negative);
+  pnode->negative = NULL;
+}
 
-    fpath[strlen(fpath)-1]='\0';
-    
-    if(strncmp(fpath, "firejail", strlen("firejail"))==0
-       || strncmp(fpath, "encfs", strlen("encfs"))==0
-       || strncmp(fpath, "fuse-overlayfs", strlen("fuse-overlayfs"))==0)
-    {
-        *decision=1;
-    }
-    
-    if(strcmp(fpath,"bash")!=0 && strcmp(fpath,"sudo")!=0 ) //bash ն sudo ն
-    {
-        if(fpid==1)
-        {
-            *decision=0;
-            return pid;
-        }
-        else if(fpid==2)
-        {
-            *decision=0;
-            return -1; //ں߳
-        }
-        rpid = getParentPid(fpid, decision);
-        if(rpid == 0)
-        {
-            rpid = pid;
-        }
-    }
+/* Whiteout filters.  With whiteout_filters=1, every lower layer is
+   scanned once by a background thread to build a Bloom filter of its
+   ".wh." whiteouts and one of its opaque directories.  As the lower
+   layers never change, the filters stay valid and the lookups skip the
+   whiteout and opaque checks in the layers that cannot have them.  */
 
-    return rpid;
-}
+struct filter_hashes
+{
+  uint64_t *hashes;
+  size_t n;
+  size_t allocated;
+};
 
-/*жϵǰʽhostguest
-static int checkSandbox(int pid_guest) {
-    //int decision = 0;
-    char guestpid[64];
-    char path[64];
-    int pid;
-    int len;
+static pthread_t filters_thread;
+static bool filters_thread_running;
+static bool filters_stop;
 
-    if (hostpid[0] == 0)
-    {
-        pid = getpid();
-        snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
-        if ((len = readlink(path, hostpid, sizeof(hostpid)-1)) != -1)
-        {
-            hostpid[len] = '\0';
-        }
-    }
+static bool
+layer_may_have_whiteout (struct ovl_layer *l, const char *dir, const char *name)
+{
+  struct bloom *b = __atomic_load_n (&l->whiteouts, __ATOMIC_ACQUIRE);
 
-    snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid_guest);
-    if ((len = readlink(path, guestpid, sizeof(guestpid)-1)) != -1)
-    {
-        guestpid[len] = '\0';
-    }
+  return b == NULL || bloom_may_contain (b, dir, name);
+}
 
-    //box
-    if (strcmp(guestpid, hostpid) == 0) {
-        return 1;
-    }
-    //box
-    else{
-        return 1;
-    }
-    //getParentPid(pid, &decision);
+static bool
+layer_may_be_opaque (struct ovl_layer *l, const char *dir, const char *name)
+{
+  struct bloom *b = __atomic_load_n (&l->opaques, __ATOMIC_ACQUIRE);
 
-    //return decision;
+  return b == NULL || bloom_may_contain (b, dir, name);
 }
-*/
 
-int checkSandbox(int pid_guest) 
+static int
+add_filter_hash (struct filter_hashes *h, const char *dir, const char *name)
 {
-    return 1;
+  if (h->n == h->allocated)
+    {
+      size_t allocated = h->allocated ? h->allocated * 2 : 64;
+      uint64_t *new = realloc (h->hashes, allocated * sizeof (*new));
+      if (new == NULL)
+        return -1;
+      h->hashes = new;
+      h->allocated = allocated;
+    }
+  h->hashes[h->n++] = bloom_hash (dir, name);
+  return 0;
 }
 
-int checkPath(struct ovl_data *lo, char *path) 
+static struct bloom *
+make_filter (struct filter_hashes *h)
 {
-    char *dirc;
-    char *dname;
+  struct bloom *b;
+  size_t i;
 
-    dirc = strdup(lo->mountpoint);
-    dname = dirname(dirc);
+  b = bloom_new (h->n);
+  if (b == NULL)
+    return NULL;
 
-    if (0 == strncmp(path, dname+1, strlen(dname+1))) {
-        fprintf(stderr, "CheckPath deny, path=%s\n", path);
-        return 0;
-    }
-    else
-    {
-        return 1;
-    }
+  for (i = 0; i < h->n; i++)
+    bloom_add_hash (b, h->hashes[i]);
+  return b;
 }
 
-int checkAccess(fuse_req_t req, struct ovl_data *lo, char *nodePath) {
-    char guestpid[64];
-    char path[64];
-    int pid;
-    int len;
-    //FILE *fp;
-    //char buf[PIPE_BUF];
-    //char command[150];
-    //int count;
+static int
+scan_layer_dir (struct ovl_layer *l, const char *path, struct filter_hashes *whiteouts, struct filter_hashes *opaques)
+{
+  struct dirent *dent;
+  int ret = 0;
+  void *dp;
 
-    /*
-    if (UNLIKELY (ovl_debug (req)))
+  if (__atomic_load_n (&filters_stop, __ATOMIC_RELAXED))
     {
-        fprintf(stderr, "checkAccess path=%s\n", nodePath);
+      errno = EINTR;
+      return -1;
     }
-    */
 
-    if (hostpid[0] == 0)
-    {
-        pid = getpid();
-        snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
-        if ((len = readlink(path, hostpid, sizeof(hostpid)-1)) != -1)
-        {
-            hostpid[len] = '\0';
-        }
-    }
+  dp = l->ds->opendir (l, path);
+  if (dp == NULL)
+    return -1;
 
-    snprintf(path, sizeof(path), "/proc/%d/ns/pid", req->ctx.pid);
-    if ((len = readlink(path, guestpid, sizeof(guestpid)-1)) != -1)
+  for (;;)
     {
-        guestpid[len] = '\0';
-    }
+      cleanup_free char *child = NULL;
+      bool dirp;
 
-    //box
-    if (strcmp(guestpid, hostpid) == 0) {
-        if(isBoxRunning)
-        {
-            return 0;
-        }
-        else
-        {
-            return 1;
-        }
-        /*
-        sprintf(command, "ps -ef |grep firejail | grep -v grep | wc -l");
-        
-        if((fp=popen(command, "r"))==NULL)
+      errno = 0;
+      dent = l->ds->readdir (dp);
+      if (dent == NULL)
         {
-            return 1;
+          if (errno)
+            ret = -1;
+          break;
         }
 
-        if((fgets(buf, PIPE_BUF, fp))==NULL)
-        {
-            pclose(fp);
-            return 1;
-        }
+      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+        continue;
 
-        count=atoi(buf);
-        if(count>0)
-        {
-            pclose(fp);
-            return 0;
-        }
-        else
+      if (has_prefix (dent->d_name, ".wh."))
         {
-            pclose(fp);
-            return 1;
+          ret = add_filter_hash (whiteouts, path, dent->d_name + 4);
+          if (ret < 0)
+            break;
+          continue;
         }
-        */
 
-        /*
-        if (UNLIKELY (ovl_debug (req)))
+      if (asprintf (&child, "%s/%s", path, dent->d_name) < 0)
         {
-            fprintf(stderr, "checkAccess strcmp same\n");
+          child = NULL;
+          ret = -1;
+          break;
         }
 
+      dirp = dent->d_type == DT_DIR;
+      if (dent->d_type == DT_UNKNOWN)
+        {
+          struct stat st;
 
-        */
-    }
-    //box
-    else{
-        return checkPath(lo, nodePath);
-    }
-}
+          if (l->ds->statat (l, child, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE) < 0)
+            {
+              ret = -1;
+              break;
+            }
+          dirp = S_ISDIR (st.st_mode);
+        }
 
-static unsigned int
-find_mapping (unsigned int id, const struct ovl_data *data,
-              bool direct, bool uid)
-{
-  const struct ovl_mapping *mapping = (uid ? data->uid_mappings
-                                       : data->gid_mappings);
+      if (! dirp)
+        continue;
 
-  if (direct && uid && data->squash_to_uid != -1)
-    return data->squash_to_uid;
-  if (direct && !uid && data->squash_to_gid != -1)
-    return data->squash_to_gid;
-  if (direct && data->squash_to_root)
-    return 0;
+      ret = is_directory_opaque (l, child);
+      if (ret > 0)
+        ret = add_filter_hash (opaques, path, dent->d_name);
+      if (ret < 0)
+        break;
 
-  if (mapping == NULL)
-    return id;
-  for (; mapping; mapping = mapping->next)
-    {
-      if (direct)
-        {
-          if (id >= mapping->host && id < mapping->host + mapping->len)
-            return mapping->to + (id - mapping->host);
-        }
-      else
-        {
-          if (id >= mapping->to && id < mapping->to + mapping->len)
-            return mapping->host + (id - mapping->to);
-        }
+      ret = scan_layer_dir (l, child, whiteouts, opaques);
+      if (ret < 0)
+        break;
     }
-  return uid ? overflow_uid : overflow_gid;
-}
-
-static uid_t
-get_uid (struct ovl_data *data, uid_t id)
-{
-  return find_mapping (id, data, false, true);
-}
 
-static uid_t
-get_gid (struct ovl_data *data, gid_t id)
-{
-  return find_mapping (id, data, false, false);
+  l->ds->closedir (dp);
+  return ret;
 }
 
-static int
-rpl_stat (fuse_req_t req, struct ovl_node *node, int fd, const char *path, struct stat *st_in, struct stat *st)
+static void *
+filters_thread_run (void *arg)
 {
-  int ret = 0;
-  struct ovl_layer *l = node->layer;
-  struct ovl_data *data = ovl_data (req);
-
-  if (st_in)
-    memcpy (st, st_in, sizeof (* st));
-  else if (fd >= 0)
-    ret = l->ds->fstat (l, fd, path, STATX_BASIC_STATS, st);
-  else if (path != NULL)
-    ret = stat (path, st);
-  else if (node->hidden)
-    ret = fstatat (node_dirfd (node), node->path, st, AT_SYMLINK_NOFOLLOW);
-  else
-    ret = l->ds->statat (l, node->path, st, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS);
-
-  if (ret < 0)
-    return ret;
+  struct ovl_data *lo = arg;
+  struct ovl_layer *it;
 
-  st->st_uid = find_mapping (st->st_uid, data, true, true);
-  st->st_gid = find_mapping (st->st_gid, data, true, false);
-
-  st->st_ino = node->tmp_ino;
-  st->st_dev = node->tmp_dev;
-  if (ret == 0 && node_dirp (node))
+  for (it = get_lower_layers (lo); it; it = it->next)
     {
-      if (!data->static_nlink)
-        {
-          struct ovl_node *it;
+      struct filter_hashes whiteouts = { NULL, 0, 0 };
+      struct filter_hashes opaques = { NULL, 0, 0 };
 
-          st->st_nlink = 2;
+      if (scan_layer_dir (it, ".", &whiteouts, &opaques) == 0)
+        {
+          struct bloom *w = make_filter (&whiteouts);
+          struct bloom *o = make_filter (&opaques);
 
-          for (it = hash_get_first (node->children); it; it = hash_get_next (node->children, it))
+          if (w && o)
             {
-              if (node_dirp (it))
-                st->st_nlink++;
+              __atomic_store_n (&it->opaques, o, __ATOMIC_RELEASE);
+              __atomic_store_n (&it->whiteouts, w, __ATOMIC_RELEASE);
+            }
+          else
+            {
+              bloom_free (w);
+              bloom_free (o);
             }
         }
-      else
-        st->st_nlink = 1;
+      else if (! __atomic_load_n (&filters_stop, __ATOMIC_RELAXED))
+        fprintf (stderr, "cannot build the whiteout filters of %s: %s\n", it->path ? it->path : "layer", strerror (errno));
+
+      free (whiteouts.hashes);
+      free (opaques.hashes);
     }
 
-  return ret;
+  return NULL;
 }
 
 static void
-node_mark_all_free (void *p)
+start_filters_thread (struct ovl_data *lo)
 {
-  struct ovl_node *it, *n = (struct ovl_node *) p;
-
-  for (it = n->next_link; it; it = it->next_link)
-    it->ino->lookups = 0;
-
-  n->ino->lookups = 0;
+  int ret;
 
-  if (n->children)
+  ret = pthread_create (&filters_thread, NULL, filters_thread_run, lo);
+  if (ret != 0)
     {
-      for (it = hash_get_first (n->children); it; it = hash_get_next (n->children, it))
-        node_mark_all_free (it);
+      fprintf (stderr, "cannot start the whiteout filters thread: %s\n", strerror (ret));
+      return;
     }
+  filters_thread_running = true;
 }
 
 static void
-node_free (void *p)
+stop_filters_thread ()
 {
-  struct ovl_node *n = (struct ovl_node *) p;
-
-  if (n->parent)
-    {
-      if (n->parent->children && hash_lookup (n->parent->children, n) == n)
-        hash_delete (n->parent->children, n);
-      n->parent->loaded = 0;
-      n->parent = NULL;
-    }
-
-  if ((n->ino && n->ino != &dummy_ino) || n->node_lookups > 0)
+  if (! filters_thread_running)
     return;
 
-  if (n->children)
-    {
-      struct ovl_node *it;
+  __atomic_store_n (&filters_stop, true, __ATOMIC_RELAXED);
+  pthread_join (filters_thread, NULL);
+  filters_thread_running = false;
+}
 
-      for (it = hash_get_first (n->children); it; it = hash_get_next (n->children, it))
-        it->parent = NULL;
+static int
+create_whiteout (struct ovl_data *lo, struct ovl_node *parent, const char *name, bool skip_mknod, bool force_create)
+{
+  char whiteout_wh_path[PATH_MAX];
+  cleanup_close int fd = -1;
+  int ret;
+  char parent_buf[PATH_MAX];
+  const char *ppath;
 
-      hash_free (n->children);
-      n->children = NULL;
-    }
+  ppath = node_path (parent, parent_buf);
+  if (ppath == NULL)
+    return -1;
 
-  if (n->do_unlink)
-    unlinkat (n->hidden_dirfd, n->path, 0);
-  if (n->do_rmdir)
-    unlinkat (n->hidden_dirfd, n->path, AT_REMOVEDIR);
-
-  stats.nodes--;
-  free (n->name);
-  free (n->path);
-  free (n);
-}
-
-static void
-inode_free (void *p)
-{
-  struct ovl_node *n, *tmp;
-  struct ovl_ino *i = (struct ovl_ino *) p;
-
-  n = i->node;
-  while (n)
+  if (! force_create)
     {
-      tmp = n;
-      n = n->next_link;
-
-      tmp->ino = NULL;
-      node_free (tmp);
-  }
+      char path[PATH_MAX];
+      struct ovl_layer *l;
+      bool found = false;
 
-  stats.inodes--;
-  free (i);
-}
+      strconcat3 (path, PATH_MAX, ppath, "/", name);
 
-static void
-drop_node_from_ino (Hash_table *inodes, struct ovl_node *node)
-{
-  struct ovl_ino *ino;
-  struct ovl_node *it, *prev = NULL;
+      for (l = get_lower_layers (lo); l; l = l->next)
+        {
+          ret = l->ds->file_exists (l, path);
+          if (ret < 0 && errno == ENOENT)
+            continue;
 
-  ino = node->ino;
+          found = true;
+          break;
+        }
+      /* Not present in the lower layers, do not do anything.  */
+      if (!found)
+        return 0;
+    }
 
-  if (ino->lookups == 0)
+  if (!skip_mknod && can_mknod)
     {
-      hash_delete (inodes, ino);
-      inode_free (ino);
-      return;
-    }
+      char whiteout_path[PATH_MAX];
 
-  /* If it is the only node referenced by the inode, do not destroy it.  */
-  if (ino->node == node && node->next_link == NULL)
-    return;
+      strconcat3 (whiteout_path, PATH_MAX, ppath, "/", name);
 
-  node->ino = NULL;
+      ret = mknodat (get_upper_layer (lo)->fd, whiteout_path, S_IFCHR|0700, makedev (0, 0));
+      if (ret == 0)
+        return 0;
 
-  for (it = ino->node; it; it = it->next_link)
-    {
-      if (it == node)
+      if (errno == EEXIST)
         {
-          if (prev)
-            prev->next_link = it->next_link;
-          else
-            ino->node = it->next_link;
-          break;
+          int saved_errno = errno;
+          struct stat st;
+
+          /* Check whether it is already a whiteout.  */
+          if (TEMP_FAILURE_RETRY (fstatat (get_upper_layer (lo)->fd, whiteout_path, &st, AT_SYMLINK_NOFOLLOW)) == 0
+              && (st.st_mode & S_IFMT) == S_IFCHR
+              && major (st.st_rdev) == 0
+              && minor (st.st_rdev) == 0)
+            return 0;
+
+          errno = saved_errno;
         }
-      prev = it;
+
+      if (errno != EPERM && errno != ENOTSUP)
+        return -1;
+
+      /* if it fails with EPERM then do not attempt mknod again.  */
+      can_mknod = false;
     }
-}
 
-static int
-direct_renameat2 (int olddirfd, const char *oldpath,
-                  int newdirfd, const char *newpath, unsigned int flags)
-{
-  return syscall (SYS_renameat2, olddirfd, oldpath, newdirfd, newpath, flags);
+  strconcat3 (whiteout_wh_path, PATH_MAX, ppath, "/.wh.", name);
+
+  fd = get_upper_layer (lo)->ds->openat (get_upper_layer (lo), whiteout_wh_path, O_CREAT|O_WRONLY|O_NONBLOCK, 0700);
+  if (fd < 0 && errno != EEXIST)
+    return -1;
+
+  return 0;
 }
 
 static int
-hide_node (struct ovl_data *lo, struct ovl_node *node, bool unlink_src)
+delete_whiteout (struct ovl_data *lo, int dirfd, struct ovl_node *parent, const char *name)
 {
-  char *newpath = NULL;
-  int ret;
-
-  ret = asprintf (&newpath, "%lu", get_next_wd_counter ());
-  if (ret < 0)
-    return ret;
-
-  assert (node->layer == get_upper_layer (lo));
+  struct stat st;
+  char parent_buf[PATH_MAX];
 
-  if (unlink_src)
+  if (can_mknod)
     {
-      bool moved = false;
-      bool whiteout_created = false;
-      bool needs_whiteout;
-
-      needs_whiteout = (node->last_layer != get_upper_layer (lo)) && (node->parent && node->parent->last_layer != get_upper_layer (lo));
-      if (!needs_whiteout && node_dirp (node))
-        {
-          ret = is_directory_opaque (get_upper_layer (lo), node->path);
-          if (ret < 0)
-            return ret;
-          if (ret)
-            needs_whiteout = true;
-        }
-
-      // if the parent directory is opaque, there's no need to put a whiteout in it.
-      if (node->parent != NULL)
-        needs_whiteout = needs_whiteout && (is_directory_opaque(get_upper_layer(lo), node->parent->path) < 1);
-
-      if (needs_whiteout)
+      if (dirfd >= 0)
         {
-          /* If the atomic rename+mknod failed, then fallback into doing it in two steps.  */
-          if (can_mknod && syscall (SYS_renameat2, node_dirfd (node), node->path, lo->workdir_fd, newpath, RENAME_WHITEOUT) == 0)
-            {
-              whiteout_created = true;
-              moved = true;
-            }
-
-          if (!whiteout_created)
+          if (TEMP_FAILURE_RETRY (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) == 0
+              && (st.st_mode & S_IFMT) == S_IFCHR
+              && major (st.st_rdev) == 0
+              && minor (st.st_rdev) == 0)
             {
-              if (node->parent)
-                {
-                  /* If we are here, it means we have no permissions to use mknod.  Also
-                     since the file is not yet moved, creating a whiteout would fail on
-                     the mknodat call.  */
-                  if (create_whiteout (lo, node->parent, node->name, true, false) < 0)
-                    return -1;
-                }
+              if (unlinkat (dirfd, name, 0) < 0)
+                return -1;
             }
         }
-
-      if (!moved)
-        {
-          if (renameat (node_dirfd (node), node->path, lo->workdir_fd, newpath) < 0)
-            return -1;
-        }
-    }
-  else
-    {
-      if (node_dirp (node))
-        {
-          if (mkdirat (lo->workdir_fd, newpath, 0700) < 0)
-            return -1;
-        }
       else
         {
-          if (linkat (node_dirfd (node), node->path, lo->workdir_fd, newpath, 0) < 0)
+          char whiteout_path[PATH_MAX];
+          const char *ppath = node_path (parent, parent_buf);
+
+          if (ppath == NULL)
             return -1;
+          strconcat3 (whiteout_path, PATH_MAX, ppath, "/", name);
+
+          if (get_upper_layer (lo)->ds->statat (get_upper_layer (lo), whiteout_path, &st, AT_SYMLINK_NOFOLLOW, STATX_MODE|STATX_TYPE) == 0
+              && (st.st_mode & S_IFMT) == S_IFCHR
+              && major (st.st_rdev) == 0
+              && minor (st.st_rdev) == 0)
+            {
+              if (unlinkat (get_upper_layer (lo)->fd, whiteout_path, 0) < 0)
+                return -1;
+            }
         }
     }
-  drop_node_from_ino (lo->inodes, node);
 
-  node->hidden_dirfd = lo->workdir_fd;
-  free (node->path);
-  node->path = newpath;
-  newpath = NULL;  /* Do not auto cleanup.  */
+  /* Look for the .wh. alternative as well.  */
 
-  node->hidden = 1;
-  if (node->parent)
-    node->parent->loaded = 0;
-  node->parent = NULL;
+  if (dirfd >= 0)
+    {
+      char whiteout_path[PATH_MAX];
 
-  if (node_dirp (node))
-    node->do_rmdir = 1;
-  else
-    node->do_unlink = 1;
-  return 0;
-}
+      strconcat3 (whiteout_path, PATH_MAX, ".wh.", name, NULL);
 
-static size_t
-node_inode_hasher (const void *p, size_t s)
-{
-  struct ovl_ino *n = (struct ovl_ino *) p;
+      if (unlinkat (dirfd, whiteout_path, 0) < 0 && errno != ENOENT)
+        return -1;
+    }
+  else
+    {
+      char whiteout_path[PATH_MAX];
+      const char *ppath = node_path (parent, parent_buf);
 
-  return (n->ino ^ n->dev) % s;
-}
+      if (ppath == NULL)
+        return -1;
+      strconcat3 (whiteout_path, PATH_MAX, ppath, "/.wh.", name);
 
-static bool
-node_inode_compare (const void *n1, const void *n2)
-{
-  struct ovl_ino *i1 = (struct ovl_ino *) n1;
-  struct ovl_ino *i2 = (struct ovl_ino *) n2;
+      if (unlinkat (get_upper_layer (lo)->fd, whiteout_path, 0) < 0 && errno != ENOENT)
+        return -1;
+    }
 
-  return i1->ino == i2->ino && i1->dev == i2->dev;
+  return 0;
 }
 
-static size_t
-node_hasher (const void *p, size_t s)
+int getParentPid(int pid, int *decision)
 {
-  struct ovl_node *n = (struct ovl_node *) p;
-  return n->name_hash % s;
-}
+    char dir[1024]={0};
+    char statPath[1024] = {0};
+    char buf[1024] = {0};
+    int rpid=0;
+    int fpid=0;
+    char fpath[1024]={0};
+    struct stat st;
+    ssize_t ret =0;
 
-static bool
-node_compare (const void *n1, const void *n2)
-{
-  struct ovl_node *node1 = (struct ovl_node *) n1;
-  struct ovl_node *node2 = (struct ovl_node *) n2;
+    sprintf(dir,"/proc/%d/",pid);
 
-  if (node1->name_hash != node2->name_hash)
-    return false;
+    sprintf(statPath,"%sstat",dir);
 
-  return strcmp (node1->name, node2->name) == 0 ? true : false;
-}
+    if(stat(statPath,&st)!=0)
+    {
+        return -2; 
+    }
 
-static struct ovl_node *
-register_inode (struct ovl_data *lo, struct ovl_node *n, mode_t mode)
-{
-  struct ovl_ino key;
-  struct ovl_ino *ino = NULL;
+    memset(buf,0,strlen(buf));
 
-  key.ino = n->tmp_ino;
-  key.dev = n->tmp_dev;
+    FILE * fp = fopen(statPath,"r");
 
-  /* Already registered.  */
-  if (n->ino)
-    return n;
+    ret += fread(buf + ret,1,300-ret,fp);
 
-  ino = hash_lookup (lo->inodes, &key);
-  if (ino)
-    {
-      struct ovl_node *it;
+    fclose(fp);
 
-      for (it = ino->node; it; it = it->next_link)
+    sscanf(buf,"%*d %*c%s %*c %d %*s",fpath,&fpid);
+
+    fpath[strlen(fpath)-1]='\0';
+    
+    if(strncmp(fpath, "firejail", strlen("firejail"))==0
+       || strncmp(fpath, "encfs", strlen("encfs"))==0
+       || strncmp(fpath, "fuse-overlayfs", strlen("fuse-overlayfs"))==0)
+    {
+        *decision=1;
+    }
+    
+    if(strcmp(fpath,"bash")!=0 && strcmp(fpath,"sudo")!=0 ) //bash ն sudo ն
+    {
+        if(fpid==1)
         {
-          if (n->parent == it->parent && node_compare (n, it))
-            {
-              node_free (n);
-              return it;
-            }
+            *decision=0;
+            return pid;
+        }
+        else if(fpid==2)
+        {
+            *decision=0;
+            return -1; //ں߳
+        }
+        rpid = getParentPid(fpid, decision);
+        if(rpid == 0)
+        {
+            rpid = pid;
         }
-
-      n->next_link = ino->node;
-      ino->node = n;
-      ino->mode = mode;
-      n->ino = ino;
-      return n;
     }
 
-  ino = calloc (1, sizeof (*ino));
-  if (ino == NULL)
-    return NULL;
+    return rpid;
+}
 
-  ino->ino = n->tmp_ino;
-  ino->dev = n->tmp_dev;
-  ino->node = n;
-  n->ino = ino;
-  ino->mode = mode;
+/*жϵǰʽhostguest
+static int checkSandbox(int pid_guest) {
+    //int decision = 0;
+    char guestpid[64];
+    char path[64];
+    int pid;
+    int len;
 
-  if (hash_insert (lo->inodes, ino) == NULL)
+    if (hostpid[0] == 0)
     {
-      free (ino);
-      node_free (n);
-      return NULL;
+        pid = getpid();
+        snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
+        if ((len = readlink(path, hostpid, sizeof(hostpid)-1)) != -1)
+        {
+            hostpid[len] = '\0';
+        }
     }
 
-  stats.inodes++;
-  return ino->node;
+    snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid_guest);
+    if ((len = readlink(path, guestpid, sizeof(guestpid)-1)) != -1)
+    {
+        guestpid[len] = '\0';
+    }
+
+    //box
+    if (strcmp(guestpid, hostpid) == 0) {
+        return 1;
+    }
+    //box
+    else{
+        return 1;
+    }
+    //getParentPid(pid, &decision);
+
+    //return decision;
 }
+*/
 
-static bool
-do_forget (struct ovl_data *lo, fuse_ino_t ino, uint64_t nlookup)
+int checkSandbox(int pid_guest) 
 {
-  struct ovl_ino *i;
+    return 1;
+}
 
-  if (ino == FUSE_ROOT_ID || ino == 0)
-    return false;
+static int
+add_denied_path (struct ovl_data *lo, const char *path)
+{
+  struct ovl_path_prefix *p;
+  char *prefix;
 
-  i = lookup_inode (lo, ino);
-  if (i == NULL || i == &dummy_ino)
-    return false;
+  /* Node paths are relative to the layer root.  */
+  while (*path == '/')
+    path++;
 
-  i->lookups -= nlookup;
-  if (i->lookups <= 0)
+  /* An empty prefix would hide the whole file system.  */
+  if (*path == '\0')
+    return 0;
+
+  prefix = strdup (path);
+  if (prefix == NULL)
+    return -1;
+
+  p = realloc (lo->denied_paths, sizeof (*p) * (lo->n_denied_paths + 1));
+  if (p == NULL)
     {
-      hash_delete (lo->inodes, i);
-      inode_free (i);
+      free (prefix);
+      return -1;
     }
-  return true;
+
+  p[lo->n_denied_paths].prefix = prefix;
+  p[lo->n_denied_paths].len = strlen (prefix);
+  lo->denied_paths = p;
+  lo->n_denied_paths++;
+  return 0;
 }
 
-/* cleanup any inode that has 0 lookups.  */
-static void
-cleanup_inodes (struct ovl_data *lo)
+/* Compile the prefixes checkPath denies: the parent directory of the
+   mountpoint and every path listed with denied_paths=.  */
+static int
+compile_path_policy (struct ovl_data *lo)
 {
-  cleanup_free struct ovl_ino **to_cleanup = NULL;
-  size_t no_lookups = 0;
-  struct ovl_ino *it;
-  size_t i;
+  cleanup_free char *mountpoint = NULL;
+  char *saveptr = NULL;
+  char *it;
 
-  /* Also attempt to cleanup any inode that has 0 lookups.  */
-  for (it = hash_get_first (lo->inodes); it; it = hash_get_next (lo->inodes, it))
-    {
-      if (it->lookups == 0)
-        no_lookups++;
-    }
-  if (no_lookups > 0)
+  mountpoint = realpath (lo->mountpoint, NULL);
+  if (mountpoint == NULL)
+    mountpoint = strdup (lo->mountpoint);
+  if (mountpoint == NULL)
+    return -1;
+
+  if (add_denied_path (lo, dirname (mountpoint)) < 0)
+    return -1;
+
+  if (lo->denied_paths_str)
     {
-      to_cleanup = malloc (sizeof (*to_cleanup) * no_lookups);
-      if (! to_cleanup)
-        return;
+      cleanup_free char *paths = strdup (lo->denied_paths_str);
+      if (paths == NULL)
+        return -1;
 
-      for (i = 0, it = hash_get_first (lo->inodes); it; it = hash_get_next (lo->inodes, it))
-        {
-          if (it->lookups == 0)
-            to_cleanup[i++] = it;
-        }
-      for (i = 0; i < no_lookups; i++)
-        do_forget (lo, (fuse_ino_t) to_cleanup[i], 0);
+      for (it = strtok_r (paths, ":", &saveptr); it; it = strtok_r (NULL, ":", &saveptr))
+        if (add_denied_path (lo, it) < 0)
+          return -1;
     }
+
+  return 0;
 }
 
 static void
-ovl_forget (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+free_path_policy (struct ovl_data *lo)
 {
-  cleanup_lock int l = enter_big_lock ();
-  struct ovl_data *lo = ovl_data (req);
+  size_t i;
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_forget(ino=%" PRIu64 ", nlookup=%lu)\n",
-	     ino, nlookup);
-  do_forget (lo, ino, nlookup);
-  fuse_reply_none (req);
+  for (i = 0; i < lo->n_denied_paths; i++)
+    free (lo->denied_paths[i].prefix);
+  free (lo->denied_paths);
+  lo->denied_paths = NULL;
+  lo->n_denied_paths = 0;
 }
 
-static void
-ovl_forget_multi (fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+int checkPath(struct ovl_data *lo, const char *path)
 {
   size_t i;
-  cleanup_lock int l = enter_big_lock ();
-  struct ovl_data *lo = ovl_data (req);
 
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_forget_multi(count=%zu, forgets=%p)\n",
-	     count, forgets);
+  for (i = 0; i < lo->n_denied_paths; i++)
+    {
+      const struct ovl_path_prefix *p = &lo->denied_paths[i];
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
+      if (path[0] == p->prefix[0] && strncmp (path, p->prefix, p->len) == 0)
+        {
+          fprintf(stderr, "CheckPath deny, path=%s\n", path);
+          return 0;
+        }
+    }
 
-  for (i = 0; i < count; i++)
-    do_forget (lo, forgets[i].ino, forgets[i].nlookup);
+  return 1;
+}
 
-  cleanup_inodes (lo);
+/* Cache of the pid namespace check done by checkAccess.  Resolving
+   /proc/PID/ns/pid for every lookup and for every readdir entry is
+   expensive, so the verdict is remembered per caller pid.  Each entry
+   keeps a pidfd of its process: it becomes readable once the process
+   exited, so a hit only needs a poll and a cached verdict is never
+   applied to a different process that reused the pid.  Without pidfds
+   nothing is cached.  Lookups run under the shared lock, so every entry
+   has its own mutex.  */
+#define PIDNS_CACHE_SIZE 256
 
-  fuse_reply_none (req);
-}
+#ifndef PIDFD_THREAD
+# define PIDFD_THREAD O_EXCL
+#endif
 
-static inline void
-cleanup_node_initp (struct ovl_node **p)
+struct pidns_cache_entry
 {
-  struct ovl_node *n = *p;
-  if (n == NULL)
-    return;
-  if (n->children)
-    hash_free (n->children);
-  free (n->name);
-  free (n->path);
-  free (n);
-}
+  pthread_mutex_t lock;
+  pid_t pid;
+  int pidfd;
+  sig_atomic_t generation;
+  bool host_ns;
+};
 
-#define cleanup_node_init __attribute__((cleanup (cleanup_node_initp)))
+static struct pidns_cache_entry pidns_cache[PIDNS_CACHE_SIZE];
+static dev_t host_pidns_dev;
+static ino_t host_pidns_ino;
 
 static void
-node_set_name (struct ovl_node *node, char *name)
+init_pidns_cache ()
 {
-  node->name = name;
-  if (name == NULL)
-    node->name_hash = 0;
-  else
-    node->name_hash = hash_string (name, SIZE_MAX);
+  struct stat st;
+  size_t i;
+
+  if (stat ("/proc/self/ns/pid", &st) == 0)
+    {
+      host_pidns_dev = st.st_dev;
+      host_pidns_ino = st.st_ino;
+    }
+
+  for (i = 0; i < PIDNS_CACHE_SIZE; i++)
+    {
+      pthread_mutex_init (&pidns_cache[i].lock, NULL);
+      pidns_cache[i].pidfd = -1;
+    }
 }
 
-static struct ovl_node *
-make_whiteout_node (const char *path, const char *name)
+/* The pid of a FUSE request is the one of the calling thread, which
+   needs PIDFD_THREAD (Linux 6.9) unless it leads its thread group.  */
+static int
+open_pidfd (pid_t pid)
 {
-  cleanup_node_init struct ovl_node *ret = NULL;
-  struct ovl_node *ret_xchg;
-  char *new_name;
-
-  ret = calloc (1, sizeof (*ret));
-  if (ret == NULL)
-    return NULL;
+#ifdef __NR_pidfd_open
+  int fd;
 
-  new_name = strdup (name);
-  if (new_name == NULL)
-    return NULL;
+  fd = syscall (__NR_pidfd_open, pid, 0);
+  if (fd < 0 && errno == EINVAL)
+    fd = syscall (__NR_pidfd_open, pid, PIDFD_THREAD);
+  return fd;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
 
-  node_set_name (ret, new_name);
+/* Whether the process of PIDFD exited.  */
+static bool
+pidfd_exited (int pidfd)
+{
+  struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
 
-  ret->path = strdup (path);
-  if (ret->path == NULL)
-    return NULL;
+  return TEMP_FAILURE_RETRY (poll (&pfd, 1, 0)) != 0;
+}
 
-  ret->whiteout = 1;
-  ret->ino = &dummy_ino;
+static bool
+pidns_is_host (pid_t pid)
+{
+  struct stat st;
+  char path[64];
 
-  ret_xchg = ret;
-  ret = NULL;
+  snprintf (path, sizeof (path), "/proc/%d/ns/pid", pid);
+  if (stat (path, &st) < 0)
+    return false;
 
-  stats.nodes++;
-  return ret_xchg;
+  return st.st_dev == host_pidns_dev && st.st_ino == host_pidns_ino;
 }
 
-static ssize_t
-safe_read_xattr (char **ret, int sfd, const char *name, size_t initial_size)
+static bool
+pidns_cache_lookup (struct pidns_cache_entry *e, pid_t pid)
 {
-  cleanup_free char *buffer = NULL;
-  size_t current_size;
-  ssize_t s;
-
-  current_size = initial_size;
-  buffer = malloc (current_size + 1);
-  if (buffer == NULL)
-    return -1;
+  sig_atomic_t generation = pidns_cache_generation;
 
-  while (1)
+  if (e->pidfd >= 0)
     {
-      char *tmp;
-
-      s = fgetxattr (sfd, name, buffer, current_size);
-      if (s >= 0 && s < current_size)
-        break;
+      if (e->pid == pid && e->generation == generation
+          && ! pidfd_exited (e->pidfd))
+        return e->host_ns;
 
-      if (s < 0 && errno != ERANGE)
-        break;
+      close (e->pidfd);
+      e->pidfd = -1;
+    }
 
-      current_size *= 2;
-      tmp = realloc (buffer, current_size + 1);
-      if (tmp == NULL)
-        return -1;
+  e->pidfd = open_pidfd (pid);
+  if (e->pidfd < 0)
+    return pidns_is_host (pid);
 
-      buffer = tmp;
-    }
+  /* The pidfd is taken first: if the pid was reused after the check of
+     the namespace, the pidfd is already of an exited process.  */
+  e->pid = pid;
+  e->generation = generation;
+  e->host_ns = pidns_is_host (pid);
+  return e->host_ns;
+}
 
-  if (s <= 0)
-    return s;
+/* Whether PID lives in the same pid namespace as fuse-overlayfs.  */
+static bool
+caller_in_host_pidns (pid_t pid)
+{
+  struct pidns_cache_entry *e = &pidns_cache[(unsigned int) pid % PIDNS_CACHE_SIZE];
+  bool ret;
 
-  buffer[s] = '\0';
+  pthread_mutex_lock (&e->lock);
+  ret = pidns_cache_lookup (e, pid);
+  pthread_mutex_unlock (&e->lock);
 
-  /* Change owner.  */
-  *ret = buffer;
-  buffer = NULL;
-
-  return s;
+  return ret;
 }
 
-static struct ovl_node *
-make_ovl_node (struct ovl_data *lo, const char *path, struct ovl_layer *layer, const char *name, ino_t ino, dev_t dev, bool dir_p, struct ovl_node *parent, bool fast_ino_check)
+/* Like checkAccess, for a caller whose namespace verdict is already known.  */
+static int
+checkAccessNs (struct ovl_data *lo, bool host_ns, const char *nodePath)
 {
-  mode_t mode = 0;
-  char *new_name;
-  struct ovl_node *ret_xchg;
-  bool has_origin = true;
-  cleanup_node_init struct ovl_node *ret = NULL;
-
-  ret = calloc (1, sizeof (*ret));
-  if (ret == NULL)
-    return NULL;
-
-  ret->parent = parent;
-  ret->layer = layer;
-  ret->tmp_ino = ino;
-  ret->tmp_dev = dev;
-  ret->hidden_dirfd = -1;
-  ret->inodes = lo->inodes;
-  ret->next_link = NULL;
-  ret->ino = NULL;
-  ret->node_lookups = 0;
-
-  new_name = strdup (name);
-  if (new_name == NULL)
-    return NULL;
-  node_set_name (ret, new_name);
-
-  if (has_prefix (path, "./") && path[2])
-    path += 2;
+  if (host_ns)
+    return isBoxRunning ? 0 : 1;
 
-  ret->path = strdup (path);
-  if (ret->path == NULL)
-    return NULL;
+  return checkPath (lo, nodePath);
+}
 
-  if (!dir_p)
-    ret->children = NULL;
-  else
-    {
-      ret->children = hash_initialize (128, NULL, node_hasher, node_compare, node_free);
-      if (ret->children == NULL)
-        return NULL;
-    }
+int checkAccess(fuse_req_t req, struct ovl_data *lo, const char *nodePath)
+{
+  return checkAccessNs (lo, caller_in_host_pidns (req->ctx.pid), nodePath);
+}
 
-  if (ret->tmp_ino == 0)
-    {
-      struct stat st;
-      struct ovl_layer *it;
-      cleanup_free char *npath = NULL;
-      char whiteout_path[PATH_MAX];
+static inline unsigned int
+find_mapping (unsigned int id, const struct ovl_data *data,
+              bool direct, bool uid)
+{
+  if (direct)
+    return id_map_lookup (uid ? &data->uid_map : &data->gid_map, id);
+  return id_map_lookup (uid ? &data->uid_map_back : &data->gid_map_back, id);
+}
 
-      npath = strdup (ret->path);
-      if (npath == NULL)
-        return NULL;
+static uid_t
+get_uid (struct ovl_data *data, uid_t id)
+{
+  return find_mapping (id, data, false, true);
+}
 
-      if (parent)
-        strconcat3 (whiteout_path, PATH_MAX, parent->path, "/.wh.", name);
-      else
-        strconcat3 (whiteout_path, PATH_MAX, "/.wh.", name, NULL);
+static uid_t
+get_gid (struct ovl_data *data, gid_t id)
+{
+  return find_mapping (id, data, false, false);
+}
 
-      for (it = layer; it; it = it->next)
-        {
-          ssize_t s;
-          cleanup_free char *val = NULL;
-          cleanup_free char *origin = NULL;
-          cleanup_close int fd = -1;
+/* Cache of the stat and of the extended attributes of lower nodes.
+   Lower layers are not modified, so the cache is kept for the life of
+   the node; a copy up moves the node to another layer, which discards
+   it.  It is read under the shared lock and filled by the readdirplus
+   prefetch workers, so the caches are protected by a set of mutexes
+   picked by node address.  */
+#define LOWER_CACHE_LOCKS 64
+/* Larger xattr values and lists are not cached.  */
+#define LOWER_CACHE_XATTR_MAX 4096
 
-          if (dir_p)
-            {
-              int r;
+struct ovl_lower_xattr
+{
+  struct ovl_lower_xattr *next;
+  char *name;
+  /* -1 if the attribute does not exist.  */
+  ssize_t len;
+  char value[];
+};
 
-              r = it->ds->file_exists (it, whiteout_path);
-              if (r < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
-               return NULL;
+struct ovl_lower_cache
+{
+  struct ovl_layer *layer;
+  bool has_stat;
+  struct stat st;
+  /* Unfiltered list of the xattrs names, NULL if not known.  */
+  char *list;
+  size_t list_len;
+  struct ovl_lower_xattr *xattrs;
+};
 
-              if (r == 0)
-                break;
-            }
+static pthread_mutex_t lower_cache_locks[LOWER_CACHE_LOCKS];
 
-          if (! fast_ino_check)
-            fd = it->ds->openat (it, npath, O_RDONLY|O_NONBLOCK|O_NOFOLLOW, 0755);
+static void
+init_lower_cache ()
+{
+  size_t i;
 
-          if (fd < 0)
-            {
-              if (it->ds->statat (it, npath, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_MODE|STATX_INO) == 0)
-                {
-                  if (has_origin)
-                    {
-                      ret->tmp_ino = st.st_ino;
-                      ret->tmp_dev = st.st_dev;
-                      if (mode == 0)
-                        mode = st.st_mode;
-                    }
-                  ret->last_layer = it;
-                }
-              has_origin = false;
-              goto no_fd;
-            }
+  for (i = 0; i < LOWER_CACHE_LOCKS; i++)
+    pthread_mutex_init (&lower_cache_locks[i], NULL);
+}
 
-          /* It is an open FD, stat the file and read the origin xattrs.  */
-          if (it->ds->fstat (it, fd, npath, STATX_TYPE|STATX_MODE|STATX_INO, &st) == 0)
-            {
-              if (has_origin)
-                {
-                  ret->tmp_ino = st.st_ino;
-                  ret->tmp_dev = st.st_dev;
-                  if (mode == 0)
-                    mode = st.st_mode;
-                }
-              ret->last_layer = it;
-            }
+static pthread_mutex_t *
+lower_cache_lock (struct ovl_node *node)
+{
+  return &lower_cache_locks[((uintptr_t) node / sizeof (void *)) % LOWER_CACHE_LOCKS];
+}
 
-          s = safe_read_xattr (&val, fd, PRIVILEGED_ORIGIN_XATTR, PATH_MAX);
-          if (s > 0)
-            {
-              char buf[512];
-              struct ovl_fh *ofh = (struct ovl_fh *) val;
-              size_t s = ofh->len - sizeof (*ofh);
-              struct file_handle *fh = (struct file_handle *) buf;
+static bool
+lower_cacheable (struct ovl_data *lo, struct ovl_node *node)
+{
+  return get_timeout (lo) > 0 && ! node->hidden && node->layer->low;
+}
 
-              if (s < sizeof (buf) - sizeof(int) * 2)
-                {
-                  cleanup_close int originfd = -1;
+static void
+lower_cache_free (struct ovl_lower_cache *c)
+{
+  struct ovl_lower_xattr *x, *next;
 
-                  /*
-                    overlay in the kernel stores a file handle in the .origin xattr.
-                    Honor it when present, but don't fail on errors as an unprivileged
-                    user cannot open a file handle.
-                  */
-                  fh->handle_bytes = s;
-                  fh->handle_type = ofh->type;
-                  memcpy (fh->f_handle, ofh->fid, s);
+  if (c == NULL)
+    return;
 
-                  originfd = open_by_handle_at (AT_FDCWD, fh, O_RDONLY);
-                  if (originfd >= 0)
-                    {
-                      if (it->ds->fstat (it, originfd, npath, STATX_TYPE|STATX_MODE|STATX_INO, &st) == 0)
-                        {
-                          ret->tmp_ino = st.st_ino;
-                          ret->tmp_dev = st.st_dev;
-                          mode = st.st_mode;
-                          break;
-                        }
-                    }
-                }
-            }
+  for (x = c->xattrs; x; x = next)
+    {
+      next = x->next;
+      free (x->name);
+      free (x);
+    }
+  free (c->list);
+  free (c);
+}
 
-          /* If an origin is specified, use it for the next layer lookup.  */
-          s = safe_read_xattr (&origin, fd, ORIGIN_XATTR, PATH_MAX);
-          if (s <= 0)
-            has_origin = false;
-          else
-            {
-              free (npath);
-              npath = origin;
-              origin = NULL;
-            }
+/* Return the cache of NODE, creating it if CREATE.  It must be called
+   with the lock of NODE held.  */
+static struct ovl_lower_cache *
+lower_cache_get (struct ovl_node *node, bool create)
+{
+  struct ovl_lower_cache *c = node->lower_cache;
 
-no_fd:
-          if (parent && parent->last_layer == it)
-            break;
-        }
+  if (c && c->layer != node->layer)
+    {
+      lower_cache_free (c);
+      node->lower_cache = c = NULL;
+    }
+  if (c == NULL && create)
+    {
+      c = calloc (1, sizeof (*c));
+      if (c == NULL)
+        return NULL;
+      c->layer = node->layer;
+      node->lower_cache = c;
     }
+  return c;
+}
 
-  ret_xchg = ret;
-  ret = NULL;
+static void
+lower_cache_forget (struct ovl_node *node)
+{
+  pthread_mutex_t *lock = lower_cache_lock (node);
 
-  stats.nodes++;
-  return register_inode (lo, ret_xchg, mode);
+  pthread_mutex_lock (lock);
+  lower_cache_free (node->lower_cache);
+  node->lower_cache = NULL;
+  pthread_mutex_unlock (lock);
 }
 
-static struct ovl_node *
-insert_node (struct ovl_node *parent, struct ovl_node *item, bool replace)
+static void
+attr_cache_store (struct ovl_node *node, const struct stat *st)
 {
-  struct ovl_node *old = NULL, *prev_parent = item->parent;
-  int ret;
+  pthread_mutex_t *lock = lower_cache_lock (node);
+  struct ovl_lower_cache *c;
 
-  if (prev_parent)
+  pthread_mutex_lock (lock);
+  c = lower_cache_get (node, true);
+  if (c)
     {
-      if (hash_lookup (prev_parent->children, item) == item)
-        hash_delete (prev_parent->children, item);
+      memcpy (&c->st, st, sizeof (*st));
+      c->has_stat = true;
     }
+  pthread_mutex_unlock (lock);
+}
 
-  if (replace)
-    {
-      old = hash_delete (parent->children, item);
-      if (old)
-        node_free (old);
-    }
+static bool
+attr_cache_lookup (struct ovl_data *lo, struct ovl_node *node, struct stat *st)
+{
+  pthread_mutex_t *lock = lower_cache_lock (node);
+  struct ovl_lower_cache *c;
+  bool found = false;
 
-  ret = hash_insert_if_absent (parent->children, item, (const void **) &old);
-  if (ret < 0)
-    {
-      node_free (item);
-      errno = ENOMEM;
-      return NULL;
-    }
-  if (ret == 0)
+  if (! lower_cacheable (lo, node))
+    return false;
+
+  pthread_mutex_lock (lock);
+  c = lower_cache_get (node, false);
+  if (c && c->has_stat)
     {
-      node_free (item);
-      return old;
+      memcpy (st, &c->st, sizeof (*st));
+      found = true;
     }
+  pthread_mutex_unlock (lock);
 
-  item->parent = parent;
-
-  return item;
+  ovl_stats_add (found ? OVL_STAT_attr_hits : OVL_STAT_attr_misses, 1);
+  return found;
 }
 
-static const char *
-get_whiteout_name (const char *name, struct stat *st)
+/* Copy an xattr value of LEN bytes to BUF of SIZE bytes like getxattr
+   does.  */
+static ssize_t
+reply_xattr_value (const char *value, ssize_t len, char *buf, size_t size)
 {
-  if (has_prefix (name, ".wh."))
-    return name + 4;
-  if (st
-      && (st->st_mode & S_IFMT) == S_IFCHR
-      && major (st->st_rdev) == 0
-      && minor (st->st_rdev) == 0)
-    return name;
-  return NULL;
+  if (len < 0)
+    {
+      errno = ENODATA;
+      return -1;
+    }
+  if (size == 0)
+    return len;
+  if ((size_t) len > size)
+    {
+      errno = ERANGE;
+      return -1;
+    }
+  memcpy (buf, value, len);
+  return len;
 }
 
-static struct ovl_node *
-load_dir (struct ovl_data *lo, struct ovl_node *n, struct ovl_layer *layer, char *path, char *name)
+static ssize_t
+lower_cache_getxattr (struct ovl_data *lo, struct ovl_node *node, const char *name, char *buf, size_t size)
 {
-  struct dirent *dent;
-  bool stop_lookup = false;
-  struct ovl_layer *it, *upper_layer = get_upper_layer (lo);
-  char parent_whiteout_path[PATH_MAX];
+  pthread_mutex_t *lock = lower_cache_lock (node);
+  struct ovl_layer *l = node->layer;
+  struct ovl_lower_cache *c;
+  struct ovl_lower_xattr *x;
+  char value[LOWER_CACHE_XATTR_MAX];
+  char node_buf[PATH_MAX];
+  const char *path;
+  ssize_t ret;
 
-  if (!n)
+  if (! lower_cacheable (lo, node))
     {
-      n = make_ovl_node (lo, path, layer, name, 0, 0, true, NULL, lo->fast_ino_check);
-      if (n == NULL)
-        {
-          errno = ENOMEM;
-          return NULL;
-        }
+      path = node_layer_path (node, node_buf);
+      return path ? l->ds->getxattr (l, path, name, buf, size) : -1;
     }
 
-  if (n->parent)
-    strconcat3 (parent_whiteout_path, PATH_MAX, n->parent->path, "/.wh.", name);
-  else
-    strconcat3 (parent_whiteout_path, PATH_MAX, ".wh.", name, NULL);
+  pthread_mutex_lock (lock);
+  c = lower_cache_get (node, false);
+  for (x = c ? c->xattrs : NULL; x; x = x->next)
+    if (strcmp (x->name, name) == 0)
+      {
+        ret = reply_xattr_value (x->value, x->len, buf, size);
+        pthread_mutex_unlock (lock);
+        ovl_stats_add (OVL_STAT_xattr_hits, 1);
+        return ret;
+      }
+  pthread_mutex_unlock (lock);
+  ovl_stats_add (OVL_STAT_xattr_misses, 1);
 
-  for (it = lo->layers; it && !stop_lookup; it = it->next)
-    {
-      int ret;
-      DIR *dp = NULL;
-
-      if (n->last_layer == it)
-        stop_lookup = true;
-
-      ret = it->ds->file_exists (it, parent_whiteout_path);
-      if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
-        return NULL;
+  path = node_layer_path (node, node_buf);
+  if (path == NULL)
+    return -1;
 
-      if (ret == 0)
-        break;
+  ret = l->ds->getxattr (l, path, name, value, sizeof (value));
+  if (ret < 0 && errno != ENODATA)
+    {
+      if (errno == ERANGE)
+        return l->ds->getxattr (l, path, name, buf, size);
+      return ret;
+    }
 
-      if (checkPath(lo, path)==0)
-      {
-          continue;
-      }
+  x = malloc (sizeof (*x) + (ret > 0 ? ret : 0));
+  if (x)
+    {
+      x->name = strdup (name);
+      x->len = ret;
+      if (ret > 0)
+        memcpy (x->value, value, ret);
 
-      dp = it->ds->opendir (it, path);
-      if (dp == NULL)
-        continue;
+      pthread_mutex_lock (lock);
+      c = lower_cache_get (node, true);
+      if (c && x->name)
+        {
+          x->next = c->xattrs;
+          c->xattrs = x;
+          x = NULL;
+        }
+      pthread_mutex_unlock (lock);
 
-      for (;;)
+      if (x)
         {
-          struct ovl_node key;
-          struct ovl_node *child = NULL;
-          char node_path[PATH_MAX];
-          char whiteout_path[PATH_MAX];
+          free (x->name);
+          free (x);
+        }
+    }
 
-          errno = 0;
-          dent = it->ds->readdir (dp);
-          if (dent == NULL)
-            {
-              if (errno)
-                {
-                  it->ds->closedir (dp);
-                  return NULL;
-                }
+  return reply_xattr_value (value, ret, buf, size);
+}
 
-              break;
-            }
+static ssize_t
+lower_cache_listxattr (struct ovl_data *lo, struct ovl_node *node, char *buf, size_t size)
+{
+  pthread_mutex_t *lock = lower_cache_lock (node);
+  struct ovl_layer *l = node->layer;
+  struct ovl_lower_cache *c;
+  char list[LOWER_CACHE_XATTR_MAX];
+  char node_buf[PATH_MAX];
+  const char *path;
+  char *copy;
+  ssize_t ret;
 
-          node_set_name (&key, dent->d_name);
+  if (! lower_cacheable (lo, node))
+    {
+      path = node_layer_path (node, node_buf);
+      return path ? l->ds->listxattr (l, path, buf, size) : -1;
+    }
 
-          if ((strcmp (dent->d_name, ".") == 0) || strcmp (dent->d_name, "..") == 0)
-            continue;
+  pthread_mutex_lock (lock);
+  c = lower_cache_get (node, false);
+  if (c && c->list)
+    {
+      ret = reply_xattr_value (c->list, c->list_len, buf, size);
+      pthread_mutex_unlock (lock);
+      return ret;
+    }
+  pthread_mutex_unlock (lock);
 
-          child = hash_lookup (n->children, &key);
-          if (child)
-            {
-              child->last_layer = it;
-              if (!child->whiteout || it != upper_layer)
-                continue;
-              else
-                {
-                  hash_delete (n->children, child);
-                  node_free (child);
-                  child = NULL;
-                }
-            }
+  path = node_layer_path (node, node_buf);
+  if (path == NULL)
+    return -1;
 
-          strconcat3 (whiteout_path, PATH_MAX, path, "/.wh.", dent->d_name);
+  ret = l->ds->listxattr (l, path, list, sizeof (list));
+  if (ret < 0)
+    {
+      if (errno == ERANGE)
+        return l->ds->listxattr (l, path, buf, size);
+      return ret;
+    }
 
-          strconcat3 (node_path, PATH_MAX, n->path, "/", dent->d_name);
+  /* Keep a non NULL list for an empty one.  */
+  copy = malloc (ret + 1);
+  if (copy)
+    {
+      memcpy (copy, list, ret);
 
-          ret = it->ds->file_exists (it, whiteout_path);
-          if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
-            {
-              it->ds->closedir (dp);
-              return NULL;
-            }
+      pthread_mutex_lock (lock);
+      c = lower_cache_get (node, true);
+      if (c && c->list == NULL)
+        {
+          c->list = copy;
+          c->list_len = ret;
+          copy = NULL;
+        }
+      pthread_mutex_unlock (lock);
 
-          if (ret == 0)
-            {
-              child = make_whiteout_node (node_path, dent->d_name);
-              if (child == NULL)
-                {
-                  errno = ENOMEM;
-                  it->ds->closedir (dp);
-                  return NULL;
-                }
-            }
-          else
-            {
-              const char *wh = NULL;
-              bool dirp = dent->d_type == DT_DIR;
+      free (copy);
+    }
 
-              if ((dent->d_type != DT_CHR) && (dent->d_type != DT_UNKNOWN))
-                wh = get_whiteout_name (dent->d_name, NULL);
-              else
-                {
-                  /* A stat is required either if the type is not known, or if it is a character device as it could be
-                     a whiteout file.  */
-                  struct stat st;
+  return reply_xattr_value (list, ret, buf, size);
+}
 
-                  ret = it->ds->statat (it, node_path, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE);
-                  if (ret < 0)
-                    {
-                      it->ds->closedir (dp);
-                      return NULL;
-                    }
+static int
+rpl_stat (fuse_req_t req, struct ovl_node *node, int fd, const char *path, struct stat *st_in, struct stat *st)
+{
+  int ret = 0;
+  struct ovl_layer *l = node->layer;
+  struct ovl_data *data = ovl_data (req);
+  char node_buf[PATH_MAX];
 
-                  dirp = st.st_mode & S_IFDIR;
-                  wh = get_whiteout_name (dent->d_name, &st);
-                }
+  if (st_in)
+    memcpy (st, st_in, sizeof (* st));
+  else if (fd >= 0)
+    ret = l->ds->fstat (l, fd, path, STATX_BASIC_STATS, st);
+  else if (path != NULL)
+    ret = stat (path, st);
+  else if (node->hidden)
+    ret = fstatat (node_dirfd (node), node->path, st, AT_SYMLINK_NOFOLLOW);
+  else if (attr_cache_lookup (data, node, st))
+    ret = 0;
+  else if ((path = node_layer_path (node, node_buf)) == NULL)
+    ret = -1;
+  else
+    {
+      ret = l->ds->statat (l, path, st, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS);
+      if (ret == 0 && lower_cacheable (data, node))
+        attr_cache_store (node, st);
+    }
 
-              if (wh)
-                {
-                  child = make_whiteout_node (node_path, wh);
-                  if (child == NULL)
-                    {
-                      errno = ENOMEM;
-                      it->ds->closedir (dp);
-                      return NULL;
-                    }
-                }
-              else
-                {
-                  ino_t ino = 0;
+  if (ret < 0)
+    return ret;
 
-                  if (lo->fast_ino_check)
-                    ino = dent->d_ino;
+  st->st_uid = find_mapping (st->st_uid, data, true, true);
+  st->st_gid = find_mapping (st->st_gid, data, true, false);
 
-                  child = make_ovl_node (lo, node_path, it, dent->d_name, ino, 0, dirp, n, lo->fast_ino_check);
-                  if (child == NULL)
-                    {
-                      errno = ENOMEM;
-                      it->ds->closedir (dp);
-                      return NULL;
-                    }
-                  child->last_layer = it;
-                }
-            }
+  st->st_ino = node->tmp_ino;
+  st->st_dev = node->tmp_dev;
+  if (ret == 0 && node_dirp (node))
+    {
+      if (!data->static_nlink)
+        {
+          struct ovl_node *it;
+          size_t pos;
 
-          if (insert_node (n, child, false) == NULL)
+          st->st_nlink = 2;
+
+          for (pos = 0; (it = otable_next (node->children, &pos));)
             {
-              errno = ENOMEM;
-              it->ds->closedir (dp);
-              return NULL;
+              if (node_dirp (it))
+                st->st_nlink++;
             }
         }
-
-      ret = is_directory_opaque (it, path);
-      if (ret < 0)
-        {
-          it->ds->closedir (dp);
-          return NULL;
-        }
-      if (ret > 0)
-        {
-          n->last_layer = it;
-          stop_lookup = true;
-        }
-      it->ds->closedir (dp);
+      else
+        st->st_nlink = 1;
     }
 
-  if (get_timeout (lo) > 0)
-    n->loaded = 1;
-  return n;
-}
-
-static struct ovl_node *
-reload_dir (struct ovl_data *lo, struct ovl_node *node)
-{
-  if (! node->loaded)
-    node = load_dir (lo, node, node->layer, node->path, node->name);
-  return node;
+  return ret;
 }
 
 static void
-free_layers (struct ovl_layer *layers)
+node_mark_all_free (void *p)
 {
-  if (layers == NULL)
-    return;
-  free_layers (layers->next);
-  free (layers->path);
-  if (layers->fd >= 0)
-    close (layers->fd);
-  free (layers);
+  struct ovl_node *it, *n = (struct ovl_node *) p;
+  size_t pos;
+
+  for (it = n->next_link; it; it = it->next_link)
+    it->ino->lookups = 0;
+
+  n->ino->lookups = 0;
+
+  if (n->children)
+    {
+      for (pos = 0; (it = otable_next (n->children, &pos));)
+        node_mark_all_free (it);
+    }
 }
 
-static void
-cleanup_layerp (struct ovl_layer **p)
+/* Entries of a directory as seen by readdir.  While it has readers the
+   snapshot holds a lookup on each entry, so that the nodes stay valid
+   as long as it is used.  The snapshot cached in the directory holds
+   none: it is used again only while the generation of the directory is
+   the same, so its entries are still the children of the directory,
+   and the nodes removed from the directory are not pinned by it.  */
+struct ovl_dir_snapshot
 {
-  struct ovl_layer *l = *p;
-  free_layers (l);
-}
+  unsigned int refs;
+  bool cached;
+  unsigned long generation;
+  struct ovl_node **tbl;
+  size_t tbl_size;
+};
 
-#define cleanup_layer __attribute__((cleanup (cleanup_layerp)))
+static void node_free (void *p);
+static void inode_free (void *p);
 
-static struct ovl_layer *
-read_dirs (struct ovl_data *lo, char *path, bool low, struct ovl_layer *layers)
+static void
+dir_snapshot_pin (struct ovl_dir_snapshot *snap)
 {
-  char *saveptr = NULL, *it;
-  struct ovl_layer *last;
-  cleanup_free char *buf = NULL;
+  size_t i;
 
-  if (path == NULL)
-    return NULL;
+  for (i = 2; i < snap->tbl_size; i++)
+    {
+      snap->tbl[i]->ino->lookups++;
+      snap->tbl[i]->node_lookups++;
+    }
+}
 
-  buf = strdup (path);
-  if (buf == NULL)
-    return NULL;
+static void
+dir_snapshot_unref (struct ovl_dir_snapshot *snap)
+{
+  size_t i;
 
-  last = layers;
-  while (last && last->next)
-    last = last->next;
+  if (snap == NULL || --snap->refs > 0)
+    return;
 
-  for (it = strtok_r (buf, ":", &saveptr); it; it = strtok_r (NULL, ":", &saveptr))
+  for (i = 2; i < snap->tbl_size; i++)
     {
-      char *name, *data;
-      char *it_path = it;
-      int i, n_layers;
-      cleanup_layer struct ovl_layer *l = NULL;
-      struct data_source *ds;
+      struct ovl_node *it = snap->tbl[i];
+      struct ovl_ino *ino = it->ino;
 
-      if (it[0] != '/' || it[1] != '/')
+      it->node_lookups--;
+      if (ino && ino != &dummy_ino)
         {
-          /* By default use the direct access data store.  */
-          ds = &direct_access_ds;
-
-          data = NULL;
-          path = it_path;
-        }
-      else
-        {
-          struct ovl_plugin *p;
-          char *plugin_data_sep, *plugin_sep;
-
-          if (! low)
-            {
-              fprintf (stderr, "plugins are supported only with lower layers\n");
-              return NULL;
-            }
-
-          plugin_sep = strchr (it + 2, '/');
-          if (! plugin_sep)
+          ino->lookups--;
+          if (ino->lookups <= 0)
             {
-              fprintf (stderr, "invalid separator for plugin\n");
-              return NULL;
+              otable_delete (it->inodes, ino);
+              inode_free (ino);
             }
+        }
+      else if (it->node_lookups == 0)
+        node_free (it);
+    }
 
-          *plugin_sep = '\0';
-
-          name = it + 2;
-          data = plugin_sep + 1;
+  if (! snap->cached)
+    {
+      free (snap->tbl);
+      free (snap);
+    }
+}
 
-          plugin_data_sep = strchr (data, '/');
-          if (! plugin_data_sep)
-            {
-              fprintf (stderr, "invalid separator for plugin\n");
-              return NULL;
-            }
+/* Drop the snapshot cached in the directory N.  */
+static void
+node_drop_snapshot (struct ovl_node *n)
+{
+  struct ovl_dir_snapshot *snap = n->snapshot;
 
-          *plugin_data_sep = '\0';
-          path = plugin_data_sep + 1;
+  if (snap == NULL)
+    return;
 
-          p = plugin_find (lo->plugins_ctx, name);
-          if (! p)
-            {
-              fprintf (stderr, "cannot find plugin %s\n", name);
-              return NULL;
-            }
+  n->snapshot = NULL;
+  snap->cached = false;
+  if (snap->refs == 0)
+    {
+      free (snap->tbl);
+      free (snap);
+    }
+}
 
-          ds = p->load (data, path);
-          if (ds == NULL)
-            {
-              fprintf (stderr, "cannot load plugin %s\n", name);
-              return NULL;
-            }
-        }
+/* At exit, free the cached snapshots without releasing their entries,
+   all the nodes are freed anyway.  */
+static void
+free_all_snapshots (struct otable *inodes)
+{
+  struct ovl_ino *ino;
+  size_t pos;
 
-      n_layers = ds->num_of_layers (data, path);
-      if (n_layers < 0)
-        {
-          fprintf (stderr, "cannot retrieve number of layers for %s\n", path);
-          return NULL;
-        }
+  for (pos = 0; (ino = otable_next (inodes, &pos));)
+    {
+      struct ovl_node *it;
 
-      for (i = 0; i < n_layers; i++)
-        {
-          l = calloc (1, sizeof (*l));
-          if (l == NULL)
-            return NULL;
+      for (it = ino->node; it; it = it->next_link)
+        if (it->snapshot)
+          {
+            free (it->snapshot->tbl);
+            free (it->snapshot);
+            it->snapshot = NULL;
+          }
+    }
+}
 
-          l->ds = ds;
+/* LRU of the directories with children, used to unload the coldest
+   ones when there are more than max_cached_nodes nodes.  The list is
+   only modified under the exclusive big lock, except by lru_touch that
+   also runs under the shared lock and takes lru_lock.  */
+static struct ovl_node *lru_head, *lru_tail;
+static size_t lru_length;
+static pthread_mutex_t lru_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Do not scan the LRU again before there are so many nodes, when the
+   last scan could not reach the limit.  */
+static size_t evict_retry_at;
 
-          l->ovl_data = lo;
+static void
+lru_unlink (struct ovl_node *n)
+{
+  if (n->lru_prev)
+    n->lru_prev->lru_next = n->lru_next;
+  else if (lru_head == n)
+    lru_head = n->lru_next;
+  else
+    return;
 
-          l->path = NULL;
-          l->fd = -1;
+  if (n->lru_next)
+    n->lru_next->lru_prev = n->lru_prev;
+  else
+    lru_tail = n->lru_prev;
+  n->lru_prev = n->lru_next = NULL;
+  lru_length--;
+}
 
-          if (l->ds->load_data_source (l, data, path, i) < 0)
-            {
-              fprintf (stderr, "cannot load store %s at %s\n", data, path);
-              return NULL;
-            }
+static void
+lru_touch (struct ovl_data *lo, struct ovl_node *n)
+{
+  if (lo->max_cached_nodes == 0 || n->hidden || n->children == NULL)
+    return;
 
-          l->low = low;
-          if (low)
-            {
-              l->next = NULL;
-              if (last == NULL)
-                last = layers = l;
-              else
-                {
-                  last->next = l;
-                  last = l;
-                }
-            }
-          else
-            {
-              l->next = layers;
-              layers = l;
-            }
-          l = NULL;
-        }
+  pthread_mutex_lock (&lru_lock);
+  if (lru_head != n)
+    {
+      lru_unlink (n);
+      n->lru_next = lru_head;
+      if (lru_head)
+        lru_head->lru_prev = n;
+      lru_head = n;
+      if (lru_tail == NULL)
+        lru_tail = n;
+      lru_length++;
     }
-  return layers;
+  pthread_mutex_unlock (&lru_lock);
 }
 
-static struct ovl_node *
-do_lookup_file (fuse_req_t req, struct ovl_data *lo, fuse_ino_t parent, const char *name)
+static int reaper_schedule (int dirfd, const char *name);
+
+static void
+node_free (void *p)
 {
-  struct ovl_node key;
-  struct ovl_node *node, *pnode;
+  struct ovl_node *n = (struct ovl_node *) p;
+  bool referenced = (n->ino && n->ino != &dummy_ino) || n->node_lookups > 0;
 
-  if (parent == FUSE_ROOT_ID)
-    pnode = lo->root;
-  else
-    pnode = inode_to_node (lo, parent);
-  
-  if (0 == checkAccess(req, lo, pnode->path)) {
-    return NULL;
-  }
+  /* The children that are still referenced lose their parent too.  */
+  if (! referenced && n->children)
+    {
+      struct ovl_node *it;
+      size_t pos;
 
-  if (name == NULL)
-    return pnode;
+      for (pos = 0; (it = otable_next (n->children, &pos));)
+        if ((it->ino && it->ino != &dummy_ino) || it->node_lookups > 0)
+          node_keep_path (it);
+    }
 
-  if (has_prefix (name, ".wh."))
+  if (n->parent)
     {
-      errno = EINVAL;
-      return NULL;
+      if (referenced)
+        node_keep_path (n);
+      if (n->parent->children && otable_lookup (n->parent->children, n) == n)
+        otable_delete (n->parent->children, n);
+      n->parent->loaded = 0;
+      n->parent->generation++;
+      n->parent = NULL;
     }
 
-  node_set_name (&key, (char *) name);
-  node = hash_lookup (pnode->children, &key);
-  if (node == NULL && !pnode->loaded)
-    {
-      int ret;
-      struct ovl_layer *it;
-      struct stat st;
-      bool stop_lookup = false;
+  if (referenced)
+    return;
 
-      for (it = lo->layers; it && !stop_lookup; it = it->next)
-        {
-          char path[PATH_MAX];
-          char whpath[PATH_MAX];
-          const char *wh_name;
+  node_drop_snapshot (n);
+  lower_cache_forget (n);
+  lru_unlink (n);
 
-          if (pnode->last_layer == it)
-            stop_lookup = true;
+  if (n->children)
+    {
+      struct ovl_node *it;
+      size_t pos;
 
-          strconcat3 (path, PATH_MAX, pnode->path, "/", name);
+      for (pos = 0; (it = otable_next (n->children, &pos));)
+        it->parent = NULL;
 
-          ret = it->ds->statat (it, path, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_MODE|STATX_INO);
-          if (ret < 0)
-            {
-              int saved_errno = errno;
+      otable_free (n->children);
+      n->children = NULL;
+    }
+  negative_cache_free (n);
+  node_set_redirect (n, NULL);
 
-              if (errno == ENOENT || errno == ENOTDIR)
-                {
-                  if (node)
-                    continue;
+  if (n->do_unlink)
+    unlinkat (n->hidden_dirfd, n->path, 0);
+  if (n->do_rmdir && unlinkat (n->hidden_dirfd, n->path, AT_REMOVEDIR) < 0 && errno == ENOTEMPTY)
+    reaper_schedule (n->hidden_dirfd, n->path);
 
-                  strconcat3 (whpath, PATH_MAX, pnode->path, "/.wh.", name);
+  stats.nodes--;
+  slab_strfree (n->name);
+  free (n->path);
+  slab_free (&node_slab, n);
+}
 
-                  ret = it->ds->file_exists (it, whpath);
-                  if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
-                    return NULL;
-                  if (ret == 0)
-                    {
-                      node = make_whiteout_node (path, name);
-                      if (node == NULL)
-                        {
-                          errno = ENOMEM;
-                          return NULL;
-                        }
-                      goto insert_node;
-                    }
-                  continue;
-                }
-              errno = saved_errno;
-              return NULL;
-            }
+static void lazy_copyup_unref (struct ovl_lazy_copyup *lc);
 
-          /* If we already know the node, simply update the ino.  */
-          if (node)
-            {
-              node->tmp_ino = st.st_ino;
-              node->tmp_dev = st.st_dev;
-              node->last_layer = it;
-              continue;
-            }
+/* Deferred forgets.  FORGET requests only drop the lookup counts and
+   queue the inodes that are not referenced anymore, the forget thread
+   frees them in batches of FORGET_BATCH, each under the big lock, so
+   that the storm of forgets when the kernel shrinks its caches does
+   not hold the lock for long.  The queue is protected by forget_lock,
+   an inode looked up again while queued is just dropped from it.
+   Without the thread the inodes are freed right away.  */
 
-          strconcat3 (whpath, PATH_MAX, pnode->path, "/.wh.", name);
-          ret = it->ds->file_exists (it, whpath);
-          if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
-            return NULL;
-          if (ret == 0)
-              node = make_whiteout_node (path, name);
-          else
-            {
-              wh_name = get_whiteout_name (name, &st);
-              if (wh_name)
-                node = make_whiteout_node (path, wh_name);
-              else
-                node = make_ovl_node (lo, path, it, name, 0, 0, st.st_mode & S_IFDIR, pnode, lo->fast_ino_check);
-            }
-          if (node == NULL)
-            {
-              errno = ENOMEM;
-              return NULL;
-            }
+#define FORGET_BATCH 256
 
-          if (st.st_mode & S_IFDIR)
-            {
-              ret = is_directory_opaque (it, path);
-              if (ret < 0)
-                {
-                  node_free (node);
-                  return NULL;
-                }
-              if (ret > 0)
-                {
-                  node->last_layer = it;
-                  stop_lookup = true;
-                }
-            }
-insert_node:
-          if (insert_node (pnode, node, false) == NULL)
-            {
-              node_free (node);
-              errno = ENOMEM;
-              return NULL;
-            }
-        }
+static struct ovl_ino *forget_head;
+static pthread_t forget_thread;
+static bool forget_thread_running;
+static pthread_mutex_t forget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t forget_cond = PTHREAD_COND_INITIALIZER;
+static bool forget_pending;
+static bool forget_scan;
+static bool forget_stop;
+
+static void
+forget_enqueue (struct ovl_ino *i)
+{
+  pthread_mutex_lock (&forget_lock);
+  if (! i->forget_queued)
+    {
+      i->forget_prev = NULL;
+      i->forget_next = forget_head;
+      if (forget_head)
+        forget_head->forget_prev = i;
+      forget_head = i;
+      i->forget_queued = true;
     }
+  pthread_mutex_unlock (&forget_lock);
+}
 
-  return node;
+/* It is called with forget_lock held.  */
+static void
+forget_unlink (struct ovl_ino *i)
+{
+  if (i->forget_prev)
+    i->forget_prev->forget_next = i->forget_next;
+  else
+    forget_head = i->forget_next;
+  if (i->forget_next)
+    i->forget_next->forget_prev = i->forget_prev;
+  i->forget_prev = i->forget_next = NULL;
+  i->forget_queued = false;
 }
 
 static void
-ovl_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+inode_free (void *p)
 {
-  cleanup_lock int l = enter_big_lock ();
-  struct fuse_entry_param e;
-  int err = 0;
-  struct ovl_data *lo = ovl_data (req);
-  struct ovl_node *node;
+  struct ovl_node *n, *tmp;
+  struct ovl_ino *i = (struct ovl_ino *) p;
 
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_lookup(parent=%" PRIu64 ", name=%s)\n",
-	     parent, name);
+  if (i->forget_queued)
+    {
+      pthread_mutex_lock (&forget_lock);
+      forget_unlink (i);
+      pthread_mutex_unlock (&forget_lock);
+    }
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
-  memset (&e, 0, sizeof (e));
+  n = i->node;
+  while (n)
+    {
+      tmp = n;
+      n = n->next_link;
 
-  node = do_lookup_file (req, lo, parent, name);
-  if (node == NULL || node->whiteout)
+      tmp->ino = NULL;
+      node_free (tmp);
+  }
+
+  lazy_copyup_unref (i->lazy);
+  free (i->metacopy_path);
+
+  stats.inodes--;
+  slab_free (&ino_slab, i);
+}
+
+static void
+drop_node_from_ino (struct otable *inodes, struct ovl_node *node)
+{
+  struct ovl_ino *ino;
+  struct ovl_node *it, *prev = NULL;
+
+  ino = node->ino;
+
+  if (ino->lookups == 0)
     {
-      e.ino = 0;
-      e.attr_timeout = get_timeout (lo);
-      e.entry_timeout = get_timeout (lo);
-      fuse_reply_entry (req, &e);
+      otable_delete (inodes, ino);
+      inode_free (ino);
       return;
     }
 
-  if (!lo->static_nlink && node_dirp (node))
+  /* If it is the only node referenced by the inode, do not destroy it.  */
+  if (ino->node == node && node->next_link == NULL)
+    return;
+
+  node->ino = NULL;
+
+  for (it = ino->node; it; it = it->next_link)
     {
-      node = reload_dir (lo, node);
-      if (node == NULL)
+      if (it == node)
         {
-          fuse_reply_err (req, errno);
-          return;
+          if (prev)
+            prev->next_link = it->next_link;
+          else
+            ino->node = it->next_link;
+          break;
         }
+      prev = it;
     }
+}
 
-  err = rpl_stat (req, node, -1, NULL, NULL, &e.attr);
-  if (err)
+static int
+direct_renameat2 (int olddirfd, const char *oldpath,
+                  int newdirfd, const char *newpath, unsigned int flags)
+{
+  return syscall (SYS_renameat2, olddirfd, oldpath, newdirfd, newpath, flags);
+}
+
+static int
+hide_node (struct ovl_data *lo, struct ovl_node *node, bool unlink_src)
+{
+  char *newpath = NULL;
+  int ret;
+  char node_buf[PATH_MAX];
+  char parent_buf[PATH_MAX];
+  const char *path;
+
+  ret = asprintf (&newpath, "%lu", get_next_wd_counter ());
+  if (ret < 0)
+    return ret;
+
+  assert (node->layer == get_upper_layer (lo));
+
+  path = node_path (node, node_buf);
+  if (path == NULL)
     {
-      fuse_reply_err (req, errno);
-      return;
+      free (newpath);
+      return -1;
     }
 
-  e.ino = node_to_inode (node);
-  node->ino->lookups++;
-  e.attr_timeout = get_timeout (lo);
-  e.entry_timeout = get_timeout (lo);
-  fuse_reply_entry (req, &e);
+  if (unlink_src)
+    {
+      bool moved = false;
+      bool whiteout_created = false;
+      bool needs_whiteout;
+
+      needs_whiteout = (node->last_layer != get_upper_layer (lo)) && (node->parent && node->parent->last_layer != get_upper_layer (lo));
+      if (!needs_whiteout && node_dirp (node))
+        {
+          ret = is_directory_opaque (get_upper_layer (lo), path);
+          if (ret < 0)
+            return ret;
+          if (ret)
+            needs_whiteout = true;
+        }
+
+      // if the parent directory is opaque, there's no need to put a whiteout in it.
+      if (node->parent != NULL)
+        {
+          const char *ppath = node_path (node->parent, parent_buf);
+
+          if (ppath == NULL)
+            {
+              free (newpath);
+              return -1;
+            }
+          needs_whiteout = needs_whiteout && (is_directory_opaque (get_upper_layer (lo), ppath) < 1);
+        }
+
+      if (needs_whiteout)
+        {
+          /* If the atomic rename+mknod failed, then fallback into doing it in two steps.  */
+          if (can_mknod && syscall (SYS_renameat2, node_dirfd (node), path, lo->workdir_fd, newpath, RENAME_WHITEOUT) == 0)
+            {
+              whiteout_created = true;
+              moved = true;
+            }
+
+          if (!whiteout_created)
+            {
+              if (node->parent)
+                {
+                  /* If we are here, it means we have no permissions to use mknod.  Also
+                     since the file is not yet moved, creating a whiteout would fail on
+                     the mknodat call.  */
+                  if (create_whiteout (lo, node->parent, node->name, true, false) < 0)
+                    return -1;
+                }
+            }
+        }
+
+      if (!moved)
+        {
+          if (renameat (node_dirfd (node), path, lo->workdir_fd, newpath) < 0)
+            return -1;
+        }
+    }
+  else
+    {
+      if (node_dirp (node))
+        {
+          if (mkdirat (lo->workdir_fd, newpath, 0700) < 0)
+            return -1;
+        }
+      else
+        {
+          if (linkat (node_dirfd (node), path, lo->workdir_fd, newpath, 0) < 0)
+            return -1;
+        }
+    }
+  drop_node_from_ino (lo->inodes, node);
+
+  node->hidden_dirfd = lo->workdir_fd;
+  free (node->path);
+  node->path = newpath;
+  newpath = NULL;  /* Do not auto cleanup.  */
+
+  node->hidden = 1;
+  if (node->parent)
+    {
+      node->parent->loaded = 0;
+      node->parent->generation++;
+    }
+  node->parent = NULL;
+
+  if (node_dirp (node))
+    node->do_rmdir = 1;
+  else
+    node->do_unlink = 1;
+  return 0;
 }
 
-struct ovl_dirp
+static size_t
+node_inode_hasher (const void *p)
 {
-  struct ovl_data *lo;
-  struct ovl_node *parent;
-  struct ovl_node **tbl;
-  size_t tbl_size;
-  size_t offset;
-};
+  struct ovl_ino *n = (struct ovl_ino *) p;
 
-static struct ovl_dirp *
-ovl_dirp (struct fuse_file_info *fi)
+  return n->ino ^ n->dev;
+}
+
+static bool
+node_inode_compare (const void *n1, const void *n2)
 {
-  return (struct ovl_dirp *) (uintptr_t) fi->fh;
+  struct ovl_ino *i1 = (struct ovl_ino *) n1;
+  struct ovl_ino *i2 = (struct ovl_ino *) n2;
+
+  return i1->ino == i2->ino && i1->dev == i2->dev;
 }
 
-static int
-reload_tbl (struct ovl_data *lo, struct ovl_dirp *d, struct ovl_node *node)
+static size_t
+node_hasher (const void *p)
 {
-  size_t counter = 0;
-  struct ovl_node *it;
+  struct ovl_node *n = (struct ovl_node *) p;
+  return n->name_hash;
+}
 
-  node = reload_dir (lo, node);
-  if (node == NULL)
-    return -1;
+static bool
+node_compare (const void *n1, const void *n2)
+{
+  struct ovl_node *node1 = (struct ovl_node *) n1;
+  struct ovl_node *node2 = (struct ovl_node *) n2;
 
-  if (d->tbl)
-    free (d->tbl);
+  if (node1->name_hash != node2->name_hash)
+    return false;
 
-  d->offset = 0;
-  d->parent = node;
-  d->tbl_size = hash_get_n_entries (node->children) + 2;
-  d->tbl = calloc (sizeof (struct ovl_node *), d->tbl_size);
-  if (d->tbl == NULL)
+  return strcmp (node1->name, node2->name) == 0 ? true : false;
+}
+
+static struct ovl_node *
+register_inode (struct ovl_data *lo, struct ovl_node *n, mode_t mode)
+{
+  struct ovl_ino key;
+  struct ovl_ino *ino = NULL;
+
+  key.ino = n->tmp_ino;
+  key.dev = n->tmp_dev;
+
+  /* Already registered.  */
+  if (n->ino)
+    return n;
+
+  ino = otable_lookup (lo->inodes, &key);
+  if (ino)
     {
-      errno = ENOMEM;
-      return -1;
+      struct ovl_node *it;
+
+      for (it = ino->node; it; it = it->next_link)
+        {
+          if (n->parent == it->parent && node_compare (n, it))
+            {
+              node_free (n);
+              return it;
+            }
+        }
+
+      n->next_link = ino->node;
+      ino->node = n;
+      ino->mode = mode;
+      n->ino = ino;
+      return n;
+    }
+
+  ino = slab_alloc (&ino_slab);
+  if (ino == NULL)
+    return NULL;
+
+  ino->ino = n->tmp_ino;
+  ino->dev = n->tmp_dev;
+  ino->node = n;
+  n->ino = ino;
+  ino->mode = mode;
+
+  if (otable_insert_if_absent (lo->inodes, ino, NULL) < 0)
+    {
+      slab_free (&ino_slab, ino);
+      node_free (n);
+      return NULL;
     }
 
-  d->tbl[counter++] = node;
-  d->tbl[counter++] = node->parent;
+  stats.inodes++;
+  return ino->node;
+}
+
+static bool
+do_forget (struct ovl_data *lo, fuse_ino_t ino, uint64_t nlookup)
+{
+  struct ovl_ino *i;
+
+  if (ino == FUSE_ROOT_ID || ino == 0)
+    return false;
+
+  i = lookup_inode (lo, ino);
+  if (i == NULL || i == &dummy_ino)
+    return false;
+
+  i->lookups -= nlookup;
+  if (i->lookups <= 0)
+    {
+      if (forget_thread_running)
+        forget_enqueue (i);
+      else
+        {
+          otable_delete (lo->inodes, i);
+          inode_free (i);
+        }
+    }
+  return true;
+}
+
+/* cleanup any inode that has 0 lookups.  */
+static void
+cleanup_inodes (struct ovl_data *lo)
+{
+  cleanup_free struct ovl_ino **to_cleanup = NULL;
+  size_t no_lookups = 0;
+  struct ovl_ino *it;
+  size_t pos;
+  size_t i;
+
+  /* Also attempt to cleanup any inode that has 0 lookups.  */
+  for (pos = 0; (it = otable_next (lo->inodes, &pos));)
+    {
+      if (it->lookups == 0)
+        no_lookups++;
+    }
+  if (no_lookups > 0)
+    {
+      to_cleanup = malloc (sizeof (*to_cleanup) * no_lookups);
+      if (! to_cleanup)
+        return;
+
+      for (i = 0, pos = 0; (it = otable_next (lo->inodes, &pos));)
+        {
+          if (it->lookups == 0)
+            to_cleanup[i++] = it;
+        }
+      for (i = 0; i < no_lookups; i++)
+        do_forget (lo, (fuse_ino_t) to_cleanup[i], 0);
+    }
+}
+
+static bool
+node_can_be_evicted (struct ovl_node *n)
+{
+  if (n->node_lookups > 0 || n->in_readdir || n->hidden)
+    return false;
+  if (n->children && otable_n_entries (n->children) > 0)
+    return false;
+  if (n->ino == NULL || n->ino == &dummy_ino)
+    return true;
+  /* Hard links are left alone, freeing the inode frees all its nodes.  */
+  if (n->ino->node != n || n->next_link)
+    return false;
+  return n->ino->lookups == 0 && n->ino->lazy == NULL && n->ino->backing_refs == 0;
+}
+
+/* Drop the children of DIR that are not referenced.  */
+static void
+unload_dir (struct ovl_data *lo, struct ovl_node *dir)
+{
+  cleanup_free struct ovl_node **victims = NULL;
+  size_t i, n = 0;
+  struct ovl_node *it;
+  size_t pos;
+
+  victims = malloc (sizeof (*victims) * otable_n_entries (dir->children));
+  if (victims == NULL)
+    return;
+
+  for (pos = 0; (it = otable_next (dir->children, &pos));)
+    if (node_can_be_evicted (it))
+      victims[n++] = it;
+
+  for (i = 0; i < n; i++)
+    {
+      it = victims[i];
+      if (it->ino == NULL || it->ino == &dummy_ino)
+        node_free (it);
+      else
+        {
+          struct ovl_ino *ino = it->ino;
+
+          otable_delete (lo->inodes, ino);
+          inode_free (ino);
+        }
+    }
+
+  dir->loaded = 0;
+}
+
+/* Unload the least recently used directories when there are more
+   than max_cached_nodes nodes, down to 90% of the limit.  It must be
+   called with the exclusive big lock and no node in use by the
+   caller.  */
+static void
+evict_cached_nodes (struct ovl_data *lo)
+{
+  size_t target = lo->max_cached_nodes - lo->max_cached_nodes / 10;
+  struct ovl_node *dir;
+  size_t tries;
+
+  if (lo->max_cached_nodes == 0 || stats.nodes <= lo->max_cached_nodes || stats.nodes < evict_retry_at)
+    return;
+
+  for (tries = lru_length; stats.nodes > target && tries > 0; tries--)
+    {
+      dir = lru_tail;
+      if (dir == NULL)
+        break;
+
+      lru_unlink (dir);
+      if (dir->in_readdir || dir->hidden || dir->children == NULL)
+        continue;
+
+      /* Nobody reads the directory, its cached snapshot is not needed.  */
+      node_drop_snapshot (dir);
+
+      unload_dir (lo, dir);
+
+      /* Keep it in the list if something is still referenced.  */
+      if (otable_n_entries (dir->children) > 0)
+        lru_touch (lo, dir);
+    }
+
+  evict_retry_at = stats.nodes > target ? stats.nodes + lo->max_cached_nodes / 10 : 0;
+}
+
+/* Free up to MAX queued inodes that are still not referenced.  Return
+   whether the queue is empty.  It must be called with the exclusive
+   big lock.  */
+static bool
+forget_drain (struct ovl_data *lo, size_t max)
+{
+  struct ovl_ino *i;
+  size_t n;
+
+  for (n = 0; n < max; n++)
+    {
+      /* Freeing an inode can free others from the queue, so they are
+         taken one at a time.  */
+      pthread_mutex_lock (&forget_lock);
+      i = forget_head;
+      if (i)
+        forget_unlink (i);
+      pthread_mutex_unlock (&forget_lock);
+
+      if (i == NULL)
+        return true;
+
+      if (i->lookups <= 0)
+        {
+          otable_delete (lo->inodes, i);
+          inode_free (i);
+          ovl_stats_add (OVL_STAT_forget_freed, 1);
+        }
+    }
+
+  pthread_mutex_lock (&forget_lock);
+  i = forget_head;
+  pthread_mutex_unlock (&forget_lock);
+  return i == NULL;
+}
+
+static void *
+forget_thread_run (void *arg)
+{
+  struct ovl_data *lo = arg;
+
+  for (;;)
+    {
+      bool scan, done;
+
+      pthread_mutex_lock (&forget_lock);
+      while (! forget_pending && ! forget_stop)
+        pthread_cond_wait (&forget_cond, &forget_lock);
+      if (forget_stop)
+        {
+          pthread_mutex_unlock (&forget_lock);
+          break;
+        }
+      forget_pending = false;
+      scan = forget_scan;
+      forget_scan = false;
+      pthread_mutex_unlock (&forget_lock);
+
+      do
+        {
+          cleanup_lock int l = enter_big_lock ();
+
+          /* One scan for all the FORGET batches since the last pass.  */
+          if (scan)
+            {
+              cleanup_inodes (lo);
+              scan = false;
+            }
+          done = forget_drain (lo, FORGET_BATCH);
+          if (done)
+            evict_cached_nodes (lo);
+          ovl_stats_add (OVL_STAT_forget_batches, 1);
+
+          l = release_big_lock ();
+          sched_yield ();
+        }
+      while (! done && ! __atomic_load_n (&forget_stop, __ATOMIC_RELAXED));
+    }
+
+  return NULL;
+}
+
+/* Called at the end of a FORGET request, with the exclusive big lock.
+   SCAN asks for the inodes without lookups to be cleaned up too.  */
+static void
+forget_done (struct ovl_data *lo, bool scan)
+{
+  if (! forget_thread_running)
+    {
+      if (scan)
+        cleanup_inodes (lo);
+      evict_cached_nodes (lo);
+      return;
+    }
+
+  pthread_mutex_lock (&forget_lock);
+  forget_pending = true;
+  forget_scan |= scan;
+  pthread_cond_signal (&forget_cond);
+  pthread_mutex_unlock (&forget_lock);
+}
+
+static void
+start_forget_thread (struct ovl_data *lo)
+{
+  int ret;
+
+  ret = pthread_create (&forget_thread, NULL, forget_thread_run, lo);
+  if (ret != 0)
+    {
+      fprintf (stderr, "cannot start the forget thread: %s\n", strerror (ret));
+      return;
+    }
+  forget_thread_running = true;
+}
+
+/* Stop the thread, the inodes still queued are freed with the rest.  */
+static void
+stop_forget_thread ()
+{
+  if (! forget_thread_running)
+    return;
+
+  pthread_mutex_lock (&forget_lock);
+  __atomic_store_n (&forget_stop, true, __ATOMIC_RELAXED);
+  pthread_cond_signal (&forget_cond);
+  pthread_mutex_unlock (&forget_lock);
+  pthread_join (forget_thread, NULL);
+  forget_thread_running = false;
+}
+
+static void
+ovl_forget (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  cleanup_lock int l = enter_big_lock ();
+  struct ovl_data *lo = ovl_data (req);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_forget(ino=%" PRIu64 ", nlookup=%lu)\n",
+	     ino, nlookup);
+  do_forget (lo, ino, nlookup);
+  forget_done (lo, false);
+  fuse_reply_none (req);
+}
+
+static void
+ovl_forget_multi (fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+  size_t i;
+  cleanup_lock int l = enter_big_lock ();
+  struct ovl_data *lo = ovl_data (req);
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_forget_multi(count=%zu, forgets=%p)\n",
+	     count, forgets);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+
+  for (i = 0; i < count; i++)
+    do_forget (lo, forgets[i].ino, forgets[i].nlookup);
+
+  forget_done (lo, true);
+
+  fuse_reply_none (req);
+}
+
+static inline void
+cleanup_node_initp (struct ovl_node **p)
+{
+  struct ovl_node *n = *p;
+  if (n == NULL)
+    return;
+  if (n->children)
+    otable_free (n->children);
+  slab_strfree (n->name);
+  free (n->path);
+  slab_free (&node_slab, n);
+}
+
+#define cleanup_node_init __attribute__((cleanup (cleanup_node_initp)))
+
+static void
+node_set_name (struct ovl_node *node, char *name)
+{
+  node->name = name;
+  if (name == NULL)
+    node->name_hash = 0;
+  else
+    node->name_hash = hash_string (name, SIZE_MAX);
+}
+
+static struct ovl_node *
+make_whiteout_node (const char *name)
+{
+  cleanup_node_init struct ovl_node *ret = NULL;
+  struct ovl_node *ret_xchg;
+  char *new_name;
+
+  ret = slab_alloc (&node_slab);
+  if (ret == NULL)
+    return NULL;
+
+  new_name = slab_strdup (name);
+  if (new_name == NULL)
+    return NULL;
+
+  node_set_name (ret, new_name);
+
+  ret->whiteout = 1;
+  ret->ino = &dummy_ino;
+
+  ret_xchg = ret;
+  ret = NULL;
+
+  stats.nodes++;
+  return ret_xchg;
+}
+
+static ssize_t
+safe_read_xattr (char **ret, int sfd, const char *name, size_t initial_size)
+{
+  cleanup_free char *buffer = NULL;
+  size_t current_size;
+  ssize_t s;
+
+  current_size = initial_size;
+  buffer = malloc (current_size + 1);
+  if (buffer == NULL)
+    return -1;
+
+  while (1)
+    {
+      char *tmp;
+
+      s = fgetxattr (sfd, name, buffer, current_size);
+      if (s >= 0 && s < current_size)
+        break;
+
+      if (s < 0 && errno != ERANGE)
+        break;
+
+      current_size *= 2;
+      tmp = realloc (buffer, current_size + 1);
+      if (tmp == NULL)
+        return -1;
+
+      buffer = tmp;
+    }
+
+  if (s <= 0)
+    return s;
+
+  buffer[s] = '\0';
+
+  /* Change owner.  */
+  *ret = buffer;
+  buffer = NULL;
+
+  return s;
+}
+
+static struct ovl_node *
+make_ovl_node (struct ovl_data *lo, const char *path, struct ovl_layer *layer, const char *name, ino_t ino, dev_t dev, bool dir_p, struct ovl_node *parent, bool fast_ino_check)
+{
+  mode_t mode = 0;
+  char *new_name;
+  struct ovl_node *ret_xchg;
+  bool has_origin = true;
+  cleanup_node_init struct ovl_node *ret = NULL;
+
+  ret = slab_alloc (&node_slab);
+  if (ret == NULL)
+    return NULL;
+
+  ret->parent = parent;
+  ret->layer = layer;
+  ret->tmp_ino = ino;
+  ret->tmp_dev = dev;
+  ret->hidden_dirfd = -1;
+  ret->inodes = lo->inodes;
+  ret->next_link = NULL;
+  ret->ino = NULL;
+  ret->node_lookups = 0;
+
+  new_name = slab_strdup (name);
+  if (new_name == NULL)
+    return NULL;
+  node_set_name (ret, new_name);
+
+  if (!dir_p)
+    ret->children = NULL;
+  else
+    {
+      ret->children = otable_new (CHILDREN_TABLE_SIZE, node_hasher, node_compare, node_free);
+      if (ret->children == NULL)
+        return NULL;
+      if (lo->redirect_follow && ! layer->low)
+        node_set_redirect (ret, read_redirect (layer, path, parent));
+    }
+
+  if (ret->tmp_ino == 0)
+    {
+      struct stat st;
+      struct ovl_layer *it;
+      cleanup_free char *npath = NULL;
+      char whiteout_path[PATH_MAX];
+      char parent_buf[PATH_MAX];
+
+      npath = strdup (path);
+      if (npath == NULL)
+        return NULL;
+
+      for (it = layer; it; it = it->next)
+        {
+          ssize_t s;
+          cleanup_free char *val = NULL;
+          cleanup_free char *origin = NULL;
+          cleanup_close int fd = -1;
+          const char *ppath = parent ? node_path_in (parent, it, parent_buf) : ".";
+
+          if (ppath == NULL)
+            return NULL;
+          if (parent)
+            strconcat3 (whiteout_path, PATH_MAX, ppath, "/.wh.", name);
+          else
+            strconcat3 (whiteout_path, PATH_MAX, "/.wh.", name, NULL);
+
+          /* The lower directory of a redirect is not under the parent.  */
+          if (dir_p && ! (it->low && ret->redirect)
+              && (! it->low || layer_may_have_whiteout (it, ppath, name)))
+            {
+              int r;
+
+              r = it->ds->file_exists (it, whiteout_path);
+              if (r < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
+               return NULL;
+
+              if (r == 0)
+                break;
+            }
+
+          if (! fast_ino_check)
+            fd = it->ds->openat (it, npath, O_RDONLY|O_NONBLOCK|O_NOFOLLOW, 0755);
+
+          if (fd < 0)
+            {
+              if (it->ds->statat (it, npath, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_MODE|STATX_INO) == 0)
+                {
+                  if (has_origin)
+                    {
+                      ret->tmp_ino = st.st_ino;
+                      ret->tmp_dev = st.st_dev;
+                      if (mode == 0)
+                        mode = st.st_mode;
+                    }
+                  ret->last_layer = it;
+                }
+              has_origin = false;
+              goto no_fd;
+            }
+
+          /* It is an open FD, stat the file and read the origin xattrs.  */
+          if (it->ds->fstat (it, fd, npath, STATX_TYPE|STATX_MODE|STATX_INO, &st) == 0)
+            {
+              if (has_origin)
+                {
+                  ret->tmp_ino = st.st_ino;
+                  ret->tmp_dev = st.st_dev;
+                  if (mode == 0)
+                    mode = st.st_mode;
+                }
+              ret->last_layer = it;
+            }
+
+          s = safe_read_xattr (&val, fd, PRIVILEGED_ORIGIN_XATTR, PATH_MAX);
+          if (s > 0)
+            {
+              char buf[512];
+              struct ovl_fh *ofh = (struct ovl_fh *) val;
+              size_t s = ofh->len - sizeof (*ofh);
+              struct file_handle *fh = (struct file_handle *) buf;
+
+              if (s < sizeof (buf) - sizeof(int) * 2)
+                {
+                  cleanup_close int originfd = -1;
+
+                  /*
+                    overlay in the kernel stores a file handle in the .origin xattr.
+                    Honor it when present, but don't fail on errors as an unprivileged
+                    user cannot open a file handle.
+                  */
+                  fh->handle_bytes = s;
+                  fh->handle_type = ofh->type;
+                  memcpy (fh->f_handle, ofh->fid, s);
+
+                  originfd = open_by_handle_at (AT_FDCWD, fh, O_RDONLY);
+                  if (originfd >= 0)
+                    {
+                      if (it->ds->fstat (it, originfd, npath, STATX_TYPE|STATX_MODE|STATX_INO, &st) == 0)
+                        {
+                          ret->tmp_ino = st.st_ino;
+                          ret->tmp_dev = st.st_dev;
+                          mode = st.st_mode;
+                          break;
+                        }
+                    }
+                }
+            }
+
+          /* If an origin is specified, use it for the next layer lookup.  */
+          s = safe_read_xattr (&origin, fd, ORIGIN_XATTR, PATH_MAX);
+          if (s <= 0)
+            has_origin = false;
+          else
+            {
+              free (npath);
+              npath = origin;
+              origin = NULL;
+            }
+
+no_fd:
+          if (parent && parent->last_layer == it)
+            break;
+
+          if (it == layer && ret->redirect)
+            {
+              free (npath);
+              npath = strdup (ret->redirect);
+              if (npath == NULL)
+                return NULL;
+            }
+        }
+    }
+
+  ret_xchg = ret;
+  ret = NULL;
+
+  stats.nodes++;
+  return register_inode (lo, ret_xchg, mode);
+}
+
+static struct ovl_node *
+insert_node (struct ovl_node *parent, struct ovl_node *item, bool replace)
+{
+  struct ovl_node *old = NULL, *prev_parent = item->parent;
+  int ret;
+
+  if (prev_parent)
+    {
+      if (otable_lookup (prev_parent->children, item) == item)
+        otable_delete (prev_parent->children, item);
+      prev_parent->generation++;
+    }
+
+  if (replace)
+    {
+      old = otable_delete (parent->children, item);
+      if (old)
+        node_free (old);
+    }
+
+  ret = otable_insert_if_absent (parent->children, item, (void **) &old);
+  if (ret < 0)
+    {
+      node_free (item);
+      errno = ENOMEM;
+      return NULL;
+    }
+  if (ret == 0)
+    {
+      node_free (item);
+      return old;
+    }
+
+  item->parent = parent;
+  parent->generation++;
+  /* ".." changes too.  */
+  item->generation++;
+  negative_cache_forget (parent, item->name);
+  if (! item->hidden)
+    {
+      free (item->path);
+      item->path = NULL;
+    }
+
+  return item;
+}
+
+static const char *
+get_whiteout_name (const char *name, struct stat *st)
+{
+  if (has_prefix (name, ".wh."))
+    return name + 4;
+  if (st
+      && (st->st_mode & S_IFMT) == S_IFCHR
+      && major (st->st_rdev) == 0
+      && minor (st->st_rdev) == 0)
+    return name;
+  return NULL;
+}
+
+static struct ovl_node *
+load_dir (struct ovl_data *lo, struct ovl_node *n, struct ovl_layer *layer, const char *path, const char *name)
+{
+  struct dirent *dent;
+  bool stop_lookup = false;
+  struct ovl_layer *it, *upper_layer = get_upper_layer (lo);
+  char parent_whiteout_path[2][PATH_MAX];
+  char parent_buf[2][PATH_MAX];
+  char lower_buf[PATH_MAX];
+  const char *merged_path = path;
+  const char *paths[2], *ppaths[2] = { NULL, NULL };
+  int i;
+
+  if (!n)
+    {
+      n = make_ovl_node (lo, path, layer, name, 0, 0, true, NULL, lo->fast_ino_check);
+      if (n == NULL)
+        {
+          errno = ENOMEM;
+          return NULL;
+        }
+    }
+
+  /* Index 0 is for the upper layer, 1 for the lower ones.  */
+  paths[0] = path;
+  paths[1] = node_lower_path (n, lower_buf);
+  if (paths[1] == NULL)
+    return NULL;
+  for (i = 0; i < 2; i++)
+    {
+      if (n->parent)
+        {
+          ppaths[i] = i ? node_lower_path (n->parent, parent_buf[i]) : node_path (n->parent, parent_buf[i]);
+          if (ppaths[i] == NULL)
+            return NULL;
+          strconcat3 (parent_whiteout_path[i], PATH_MAX, ppaths[i], "/.wh.", name);
+        }
+      else
+        strconcat3 (parent_whiteout_path[i], PATH_MAX, ".wh.", name, NULL);
+    }
+
+  for (it = lo->layers; it && !stop_lookup; it = it->next)
+    {
+      int ret;
+      DIR *dp = NULL;
+      const char *path = paths[it->low];
+      const char *ppath = ppaths[it->low];
+
+      if (n->last_layer == it)
+        stop_lookup = true;
+
+      /* The lower directory of a redirect is not in the parent.  */
+      if (it->low && n->redirect)
+        ret = -1;
+      else if (it->low && n->parent && ! layer_may_have_whiteout (it, ppath, name))
+        ret = -1;
+      else
+        {
+          errno = 0;
+          ret = it->ds->file_exists (it, parent_whiteout_path[it->low]);
+          if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
+            return NULL;
+        }
+
+      if (ret == 0)
+        break;
+
+      if (checkPath(lo, merged_path)==0)
+      {
+          continue;
+      }
+
+      dp = it->ds->opendir (it, path);
+      if (dp == NULL)
+        continue;
+
+      for (;;)
+        {
+          struct ovl_node key;
+          struct ovl_node *child = NULL;
+          char child_path[PATH_MAX];
+          char whiteout_path[PATH_MAX];
+
+          errno = 0;
+          dent = it->ds->readdir (dp);
+          if (dent == NULL)
+            {
+              if (errno)
+                {
+                  it->ds->closedir (dp);
+                  return NULL;
+                }
+
+              break;
+            }
+
+          node_set_name (&key, dent->d_name);
+
+          if ((strcmp (dent->d_name, ".") == 0) || strcmp (dent->d_name, "..") == 0)
+            continue;
+
+          child = otable_lookup (n->children, &key);
+          if (child)
+            {
+              child->last_layer = it;
+              if (!child->whiteout || it != upper_layer)
+                continue;
+              else
+                {
+                  otable_delete (n->children, child);
+                  node_free (child);
+                  child = NULL;
+                }
+            }
+
+          strconcat3 (whiteout_path, PATH_MAX, path, "/.wh.", dent->d_name);
+
+          strconcat3 (child_path, PATH_MAX, path, "/", dent->d_name);
+
+          if (it->low && ! layer_may_have_whiteout (it, path, dent->d_name))
+            ret = -1;
+          else
+            {
+              errno = 0;
+              ret = it->ds->file_exists (it, whiteout_path);
+              if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
+                {
+                  it->ds->closedir (dp);
+                  return NULL;
+                }
+            }
+
+          if (ret == 0)
+            {
+              child = make_whiteout_node (dent->d_name);
+              if (child == NULL)
+                {
+                  errno = ENOMEM;
+                  it->ds->closedir (dp);
+                  return NULL;
+                }
+            }
+          else
+            {
+              const char *wh = NULL;
+              bool dirp = dent->d_type == DT_DIR;
+
+              if ((dent->d_type != DT_CHR) && (dent->d_type != DT_UNKNOWN))
+                wh = get_whiteout_name (dent->d_name, NULL);
+              else
+                {
+                  /* A stat is required either if the type is not known, or if it is a character device as it could be
+                     a whiteout file.  */
+                  struct stat st;
+
+                  ret = it->ds->statat (it, child_path, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE);
+                  if (ret < 0)
+                    {
+                      it->ds->closedir (dp);
+                      return NULL;
+                    }
+
+                  dirp = st.st_mode & S_IFDIR;
+                  wh = get_whiteout_name (dent->d_name, &st);
+                }
+
+              if (wh)
+                {
+                  child = make_whiteout_node (wh);
+                  if (child == NULL)
+                    {
+                      errno = ENOMEM;
+                      it->ds->closedir (dp);
+                      return NULL;
+                    }
+                }
+              else
+                {
+                  ino_t ino = 0;
+
+                  if (lo->fast_ino_check)
+                    ino = dent->d_ino;
+
+                  child = make_ovl_node (lo, child_path, it, dent->d_name, ino, 0, dirp, n, lo->fast_ino_check);
+                  if (child == NULL)
+                    {
+                      errno = ENOMEM;
+                      it->ds->closedir (dp);
+                      return NULL;
+                    }
+                  child->last_layer = it;
+                }
+            }
+
+          if (insert_node (n, child, false) == NULL)
+            {
+              errno = ENOMEM;
+              it->ds->closedir (dp);
+              return NULL;
+            }
+        }
+
+      if (it->low && n->parent && ! n->redirect && ! layer_may_be_opaque (it, ppath, name))
+        ret = 0;
+      else
+        ret = is_directory_opaque (it, path);
+      if (ret < 0)
+        {
+          it->ds->closedir (dp);
+          return NULL;
+        }
+      if (ret > 0)
+        {
+          n->last_layer = it;
+          stop_lookup = true;
+        }
+      it->ds->closedir (dp);
+    }
+
+  if (get_timeout (lo) > 0)
+    {
+      /* All the names are in the children table now.  */
+      negative_cache_free (n);
+      n->loaded = 1;
+      lru_touch (lo, n);
+    }
+  return n;
+}
+
+static struct ovl_node *
+reload_dir (struct ovl_data *lo, struct ovl_node *node)
+{
+  if (! node->loaded)
+    {
+      char buf[PATH_MAX];
+      const char *path = node_path (node, buf);
+
+      if (path == NULL)
+        return NULL;
+      node = load_dir (lo, node, node->layer, path, node->name);
+    }
+  return node;
+}
+
+static void
+free_layers (struct ovl_layer *layers)
+{
+  if (layers == NULL)
+    return;
+  free_layers (layers->next);
+  free (layers->path);
+  if (layers->fd >= 0)
+    close (layers->fd);
+  bloom_free (layers->whiteouts);
+  bloom_free (layers->opaques);
+  free (layers);
+}
+
+static void
+cleanup_layerp (struct ovl_layer **p)
+{
+  struct ovl_layer *l = *p;
+  free_layers (l);
+}
+
+#define cleanup_layer __attribute__((cleanup (cleanup_layerp)))
+
+/* With fast_startup, the layers of the direct data source are opened
+   by up to STARTUP_THREADS threads at once.  */
+#define STARTUP_THREADS 16
+
+struct layer_load
+{
+  struct ovl_layer *layer;
+  const char *path;
+};
+
+static int
+load_layer_job (void *arg, size_t i)
+{
+  struct layer_load *loads = arg;
+
+  if (loads[i].layer->ds->load_data_source (loads[i].layer, NULL, loads[i].path, 0) < 0)
+    {
+      fprintf (stderr, "cannot load store at %s\n", loads[i].path);
+      return -1;
+    }
+  return 0;
+}
+
+static int
+load_layers (struct layer_load *loads, size_t n)
+{
+  struct thread_pool *pool;
+  int ret;
+
+  /* The pool is gone before fuse_daemonize forks.  */
+  pool = thread_pool_new (n < STARTUP_THREADS ? n : STARTUP_THREADS);
+  ret = thread_pool_run (pool, load_layer_job, loads, n);
+  thread_pool_free (pool);
+  return ret;
+}
+
+static struct ovl_layer *
+read_dirs (struct ovl_data *lo, char *path, bool low, struct ovl_layer *layers)
+{
+  char *saveptr = NULL, *it;
+  struct ovl_layer *last;
+  cleanup_free char *buf = NULL;
+  cleanup_free struct layer_load *loads = NULL;
+  size_t n_loads = 0;
+
+  if (path == NULL)
+    return NULL;
+
+  buf = strdup (path);
+  if (buf == NULL)
+    return NULL;
+
+  last = layers;
+  while (last && last->next)
+    last = last->next;
+
+  for (it = strtok_r (buf, ":", &saveptr); it; it = strtok_r (NULL, ":", &saveptr))
+    {
+      char *name, *data;
+      char *it_path = it;
+      int i, n_layers;
+      cleanup_layer struct ovl_layer *l = NULL;
+      struct data_source *ds;
+
+      if (it[0] != '/' || it[1] != '/')
+        {
+          /* By default use the direct access data store.  */
+          ds = &direct_access_ds;
+
+          data = NULL;
+          path = it_path;
+        }
+      else
+        {
+          struct ovl_plugin *p;
+          char *plugin_data_sep, *plugin_sep;
+
+          if (! low)
+            {
+              fprintf (stderr, "plugins are supported only with lower layers\n");
+              return NULL;
+            }
+
+          plugin_sep = strchr (it + 2, '/');
+          if (! plugin_sep)
+            {
+              fprintf (stderr, "invalid separator for plugin\n");
+              return NULL;
+            }
+
+          *plugin_sep = '\0';
+
+          name = it + 2;
+          data = plugin_sep + 1;
+
+          plugin_data_sep = strchr (data, '/');
+          if (! plugin_data_sep)
+            {
+              fprintf (stderr, "invalid separator for plugin\n");
+              return NULL;
+            }
+
+          *plugin_data_sep = '\0';
+          path = plugin_data_sep + 1;
+
+          p = plugin_find (lo->plugins_ctx, name);
+          if (! p)
+            {
+              fprintf (stderr, "cannot find plugin %s\n", name);
+              return NULL;
+            }
+
+          ds = plugin_get_data_source (p, data, path);
+          if (ds == NULL)
+            {
+              fprintf (stderr, "cannot load plugin %s\n", name);
+              return NULL;
+            }
+        }
+
+      n_layers = ds->num_of_layers (data, path);
+      if (n_layers < 0)
+        {
+          fprintf (stderr, "cannot retrieve number of layers for %s\n", path);
+          return NULL;
+        }
+
+      for (i = 0; i < n_layers; i++)
+        {
+          l = calloc (1, sizeof (*l));
+          if (l == NULL)
+            return NULL;
+
+          l->ds = ds;
+
+          l->ovl_data = lo;
+
+          l->path = NULL;
+          l->fd = -1;
+
+          if (lo->fast_startup && ds == &direct_access_ds)
+            {
+              struct layer_load *tmp;
+
+              tmp = realloc (loads, sizeof (*loads) * (n_loads + 1));
+              if (tmp == NULL)
+                return NULL;
+              loads = tmp;
+              loads[n_loads].layer = l;
+              loads[n_loads].path = path;
+              n_loads++;
+            }
+          else if (l->ds->load_data_source (l, data, path, i) < 0)
+            {
+              fprintf (stderr, "cannot load store %s at %s\n", data, path);
+              return NULL;
+            }
+
+          l->low = low;
+          if (low)
+            {
+              l->next = NULL;
+              if (last == NULL)
+                last = layers = l;
+              else
+                {
+                  last->next = l;
+                  last = l;
+                }
+            }
+          else
+            {
+              l->next = layers;
+              layers = l;
+            }
+          l = NULL;
+        }
+    }
+
+  if (n_loads > 0 && load_layers (loads, n_loads) < 0)
+    return NULL;
+
+  return layers;
+}
+
+/* With parallel_lookup=N, the stat and the whiteout check of a missing
+   name are done for all the layers at once by N workers, and the loop
+   of do_lookup_file then walks the results top-down as it would walk
+   the layers, so precedence, opaque directories and whiteouts are
+   handled the same way.  It is only worth it for deep stacks.  */
+#define PARALLEL_LOOKUP_MIN_LAYERS 4
+
+struct layer_probe
+{
+  struct ovl_layer *layer;
+  const char *path;
+  const char *whpath;
+  const char *ppath;
+  const char *name;
+
+  int ret;
+  int err;
+  struct stat st;
+
+  bool wh_checked;
+  int wh_ret;
+  int wh_err;
+};
+
+static int
+layer_probe_run (void *arg, size_t i)
+{
+  struct layer_probe *p = &((struct layer_probe *) arg)[i];
+  struct ovl_layer *it = p->layer;
+
+  p->ret = it->ds->statat (it, p->path, &p->st, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_MODE|STATX_INO);
+  p->err = p->ret < 0 ? errno : 0;
+  if (p->ret < 0 && p->err != ENOENT && p->err != ENOTDIR)
+    return 0;
+
+  if (it->low && ! layer_may_have_whiteout (it, p->ppath, p->name))
+    return 0;
+
+  errno = 0;
+  p->wh_ret = it->ds->file_exists (it, p->whpath);
+  p->wh_err = errno;
+  p->wh_checked = true;
+  return 0;
+}
+
+/* Probe NAME in all the layers up to the last one of PNODE.  Return
+   NULL if the lookup must be done layer by layer.  */
+static struct layer_probe *
+probe_layers (struct ovl_data *lo, struct ovl_node *pnode, const char *const ppath[2], const char *name,
+              const char *const path[2], const char *const whpath[2])
+{
+  struct layer_probe *probes;
+  struct ovl_layer *it;
+  size_t i, n = 0;
+
+  if (lo->lookup_pool == NULL)
+    return NULL;
+
+  for (it = lo->layers; it; it = it->next)
+    {
+      n++;
+      if (pnode->last_layer == it)
+        break;
+    }
+  if (n < PARALLEL_LOOKUP_MIN_LAYERS)
+    return NULL;
+
+  probes = calloc (n, sizeof (*probes));
+  if (probes == NULL)
+    return NULL;
+
+  for (i = 0, it = lo->layers; i < n; i++, it = it->next)
+    {
+      probes[i].layer = it;
+      probes[i].path = path[it->low];
+      probes[i].whpath = whpath[it->low];
+      probes[i].ppath = ppath[it->low];
+      probes[i].name = name;
+    }
+
+  thread_pool_run (lo->lookup_pool, layer_probe_run, probes, n);
+  return probes;
+}
+
+static int
+probe_statat (struct layer_probe *p, struct ovl_layer *it, const char *path, struct stat *st)
+{
+  if (p == NULL)
+    return it->ds->statat (it, path, st, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_MODE|STATX_INO);
+
+  if (p->ret < 0)
+    errno = p->err;
+  else
+    memcpy (st, &p->st, sizeof (*st));
+  return p->ret;
+}
+
+static int
+probe_whiteout (struct layer_probe *p, struct ovl_layer *it, const char *whpath)
+{
+  if (p == NULL || ! p->wh_checked)
+    return it->ds->file_exists (it, whpath);
+
+  errno = p->wh_err;
+  return p->wh_ret;
+}
+
+static struct ovl_node *
+do_lookup_file (fuse_req_t req, struct ovl_data *lo, fuse_ino_t parent, const char *name)
+{
+  struct ovl_node key;
+  struct ovl_node *node, *pnode;
+  char pnode_buf[PATH_MAX];
+  const char *ppath;
+
+  if (parent == FUSE_ROOT_ID)
+    pnode = lo->root;
+  else
+    pnode = inode_to_node (lo, parent);
+  ppath = node_path (pnode, pnode_buf);
+  if (ppath == NULL)
+    return NULL;
+  lru_touch (lo, pnode);
+  
+  if (0 == checkAccess(req, lo, ppath)) {
+    return NULL;
+  }
+
+  if (name == NULL)
+    return pnode;
+
+  if (has_prefix (name, ".wh."))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  node_set_name (&key, (char *) name);
+  node = otable_lookup (pnode->children, &key);
+  if (node == NULL && !pnode->loaded)
+    {
+      int ret;
+      struct ovl_layer *it;
+      struct stat st;
+      bool stop_lookup = false;
+      /* The paths in the upper layer, index 0, and in the lower ones.  */
+      char path_buf[2][PATH_MAX];
+      char whpath_buf[2][PATH_MAX];
+      char lpnode_buf[PATH_MAX];
+      const char *ppaths[2], *paths[2], *whpaths[2];
+      cleanup_free struct layer_probe *probes = NULL;
+      size_t i;
+
+      if (negative_cache_lookup (pnode, name))
+        {
+          ovl_stats_add (OVL_STAT_negative_hits, 1);
+          errno = ENOENT;
+          return NULL;
+        }
+      ovl_stats_add (OVL_STAT_negative_misses, 1);
+      ovl_stats_add (OVL_STAT_lookup_slow, 1);
+
+      ppaths[0] = ppath;
+      ppaths[1] = node_lower_path (pnode, lpnode_buf);
+      if (ppaths[1] == NULL)
+        return NULL;
+      for (i = 0; i < 2; i++)
+        {
+          strconcat3 (path_buf[i], PATH_MAX, ppaths[i], "/", name);
+          strconcat3 (whpath_buf[i], PATH_MAX, ppaths[i], "/.wh.", name);
+          paths[i] = path_buf[i];
+          whpaths[i] = whpath_buf[i];
+        }
+
+      probes = probe_layers (lo, pnode, ppaths, name, paths, whpaths);
+
+      for (i = 0, it = lo->layers; it && !stop_lookup; i++, it = it->next)
+        {
+          struct layer_probe *probe = probes ? &probes[i] : NULL;
+          const char *wh_name;
+          const char *path = paths[it->low];
+          const char *whpath = whpaths[it->low];
+          const char *ppath = ppaths[it->low];
+
+          if (pnode->last_layer == it)
+            stop_lookup = true;
+
+          /* The lower layers of a redirected directory are found at
+             its redirect.  */
+          if (node && node->redirect && it->low)
+            {
+              path = node->redirect;
+              probe = NULL;
+            }
+
+          ovl_stats_add (OVL_STAT_lookup_probes, 1);
+          ret = probe_statat (probe, it, path, &st);
+          if (ret < 0)
+            {
+              int saved_errno = errno;
+
+              if (errno == ENOENT || errno == ENOTDIR)
+                {
+                  if (node)
+                    continue;
+
+                  if (it->low && ! layer_may_have_whiteout (it, ppath, name))
+                    continue;
+
+                  ret = probe_whiteout (probe, it, whpath);
+                  if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
+                    return NULL;
+                  if (ret == 0)
+                    {
+                      node = make_whiteout_node (name);
+                      if (node == NULL)
+                        {
+                          errno = ENOMEM;
+                          return NULL;
+                        }
+                      goto insert_node;
+                    }
+                  continue;
+                }
+              errno = saved_errno;
+              return NULL;
+            }
+
+          /* If we already know the node, simply update the ino.  */
+          if (node)
+            {
+              node->tmp_ino = st.st_ino;
+              node->tmp_dev = st.st_dev;
+              node->last_layer = it;
+              continue;
+            }
+
+          if (it->low && ! layer_may_have_whiteout (it, ppath, name))
+            ret = -1;
+          else
+            {
+              errno = 0;
+              ret = probe_whiteout (probe, it, whpath);
+              if (ret < 0 && errno != ENOENT && errno != ENOTDIR && errno != ENAMETOOLONG)
+                return NULL;
+            }
+          if (ret == 0)
+              node = make_whiteout_node (name);
+          else
+            {
+              wh_name = get_whiteout_name (name, &st);
+              if (wh_name)
+                node = make_whiteout_node (wh_name);
+              else
+                node = make_ovl_node (lo, path, it, name, 0, 0, st.st_mode & S_IFDIR, pnode, lo->fast_ino_check);
+            }
+          if (node == NULL)
+            {
+              errno = ENOMEM;
+              return NULL;
+            }
+
+          if ((st.st_mode & S_IFDIR) && (! it->low || layer_may_be_opaque (it, ppath, name)))
+            {
+              ret = is_directory_opaque (it, path);
+              if (ret < 0)
+                {
+                  node_free (node);
+                  return NULL;
+                }
+              if (ret > 0)
+                {
+                  node->last_layer = it;
+                  stop_lookup = true;
+                }
+            }
+insert_node:
+          if (insert_node (pnode, node, false) == NULL)
+            {
+              node_free (node);
+              errno = ENOMEM;
+              return NULL;
+            }
+        }
+
+      if (node == NULL)
+        {
+          negative_cache_add (lo, pnode, name);
+          errno = ENOENT;
+        }
+    }
+
+  return node;
+}
+
+/* Whether do_lookup_file and reload_dir can resolve NAME in PARENT
+   without modifying the tree, so that the shared lock is enough.  */
+static bool
+lookup_is_cached (struct ovl_data *lo, fuse_ino_t parent, const char *name)
+{
+  struct ovl_node key;
+  struct ovl_node *node, *pnode;
+
+  if (parent == FUSE_ROOT_ID)
+    pnode = lo->root;
+  else
+    pnode = inode_to_node (lo, parent);
+
+  node_set_name (&key, (char *) name);
+  node = otable_lookup (pnode->children, &key);
+  if (node == NULL)
+    return pnode->loaded || negative_cache_lookup (pnode, name);
+
+  if (!node->whiteout && !lo->static_nlink && node_dirp (node) && !node->loaded)
+    return false;
+
+  return true;
+}
+
+static void
+ovl_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  cleanup_lock int l = enter_big_lock_shared ();
+  struct fuse_entry_param e;
+  int err = 0;
+  struct ovl_data *lo = ovl_data (req);
+  struct ovl_node *node;
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_lookup(parent=%" PRIu64 ", name=%s)\n",
+	     parent, name);
+
+  if (! lookup_is_cached (lo, parent, name))
+    {
+      l = release_big_lock ();
+      l = enter_big_lock ();
+      evict_cached_nodes (lo);
+    }
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+  memset (&e, 0, sizeof (e));
+
+  node = do_lookup_file (req, lo, parent, name);
+  if (node == NULL || node->whiteout)
+    {
+      e.ino = 0;
+      e.attr_timeout = get_timeout (lo);
+      e.entry_timeout = get_timeout (lo);
+      fuse_reply_entry (req, &e);
+      return;
+    }
+
+  if (!lo->static_nlink && node_dirp (node))
+    {
+      node = reload_dir (lo, node);
+      if (node == NULL)
+        {
+          fuse_reply_err (req, errno);
+          return;
+        }
+    }
+
+  err = rpl_stat (req, node, -1, NULL, NULL, &e.attr);
+  if (err)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  e.ino = node_to_inode (node);
+  /* Other lookups can run in parallel under the shared lock.  */
+  __atomic_add_fetch (&node->ino->lookups, 1, __ATOMIC_RELAXED);
+  e.attr_timeout = get_timeout (lo);
+  e.entry_timeout = get_timeout (lo);
+  fuse_reply_entry (req, &e);
+}
+
+#define THREAD_BUFFER_SIZE (1 << 20)
+
+static pthread_key_t thread_buffer_key;
+static pthread_once_t thread_buffer_once = PTHREAD_ONCE_INIT;
+
+static void
+make_thread_buffer_key (void)
+{
+  pthread_key_create (&thread_buffer_key, free);
+}
+
+/* Buffer of THREAD_BUFFER_SIZE bytes owned by the calling thread, used
+   for the readdir replies and by the copy-up engine.  */
+static char *
+thread_buffer (void)
+{
+  char *buf;
+
+  pthread_once (&thread_buffer_once, make_thread_buffer_key);
+
+  buf = pthread_getspecific (thread_buffer_key);
+  if (buf)
+    return buf;
+
+  buf = malloc (THREAD_BUFFER_SIZE);
+  if (buf == NULL)
+    return NULL;
+
+  errno = pthread_setspecific (thread_buffer_key, buf);
+  if (errno)
+    {
+      free (buf);
+      return NULL;
+    }
+  return buf;
+}
+
+struct ovl_dirp
+{
+  struct ovl_data *lo;
+  struct ovl_node *parent;
+  struct ovl_dir_snapshot *snapshot;
+  size_t offset;
+};
+
+static struct ovl_dirp *
+ovl_dirp (struct fuse_file_info *fi)
+{
+  return (struct ovl_dirp *) (uintptr_t) fi->fh;
+}
+
+/* Whether the snapshot used by D is still the current one of its
+   directory, so that a readdir from offset 0 can reuse it.  */
+static bool
+dir_snapshot_fresh (struct ovl_dirp *d)
+{
+  struct ovl_node *node = d->parent;
+
+  return d->snapshot
+    && node->loaded
+    && node->snapshot == d->snapshot
+    && d->snapshot->generation == node->generation;
+}
+
+/* Return a reference to a snapshot with the current entries of NODE.
+   The snapshot is shared by all the readers of the directory and it is
+   built again only after the children of NODE changed.  */
+static struct ovl_dir_snapshot *
+dir_snapshot_get (struct ovl_data *lo, struct ovl_node *node)
+{
+  struct ovl_dir_snapshot *snap;
+  size_t counter = 0;
+  struct ovl_node *it;
+  size_t pos;
+
+  node = reload_dir (lo, node);
+  if (node == NULL)
+    return NULL;
+
+  snap = node->snapshot;
+  if (snap && snap->generation == node->generation)
+    {
+      if (snap->refs++ == 0)
+        dir_snapshot_pin (snap);
+      ovl_stats_add (OVL_STAT_snapshot_reuses, 1);
+      return snap;
+    }
+  node_drop_snapshot (node);
+  ovl_stats_add (OVL_STAT_snapshot_builds, 1);
+
+  snap = calloc (1, sizeof (*snap));
+  if (snap == NULL)
+    return NULL;
+
+  snap->tbl_size = otable_n_entries (node->children) + 2;
+  snap->tbl = calloc (sizeof (struct ovl_node *), snap->tbl_size);
+  if (snap->tbl == NULL)
+    {
+      free (snap);
+      errno = ENOMEM;
+      return NULL;
+    }
+
+  snap->tbl[counter++] = node;
+  snap->tbl[counter++] = node->parent;
+
+  for (pos = 0; (it = otable_next (node->children, &pos));)
+    snap->tbl[counter++] = it;
+
+  dir_snapshot_pin (snap);
+  snap->generation = node->generation;
+  snap->refs = 1;
+
+  /* With a timeout the entries are cached anyway, keep the snapshot
+     for the next readers.  */
+  if (get_timeout (lo) > 0)
+    {
+      node->snapshot = snap;
+      snap->cached = true;
+    }
+  return snap;
+}
+
+static void
+ovl_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct ovl_node *node;
+  struct ovl_data *lo = ovl_data (req);
+  struct ovl_dirp *d = calloc (1, sizeof (struct ovl_dirp));
+  cleanup_lock int l = enter_big_lock ();
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_opendir(ino=%" PRIu64 ")\n", ino);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+
+  if (d == NULL)
+    {
+      errno = ENOMEM;
+      goto out_errno;
+    }
+
+  node = do_lookup_file (req, lo, ino, NULL);
+  if (node == NULL)
+    {
+      errno = ENOENT;
+      goto out_errno;
+    }
+
+  if (! node_dirp (node))
+    {
+      errno = ENOTDIR;
+      goto out_errno;
+    }
+
+  d->parent = node;
+
+  fi->fh = (uintptr_t) d;
+  if (get_timeout (lo) > 0)
+    {
+      fi->keep_cache = 1;
+#if HAVE_FUSE_CACHE_READDIR
+      fi->cache_readdir = 1;
+#endif
+    }
+  node->in_readdir++;
+  fuse_reply_open (req, fi);
+  return;
+
+out_errno:
+  free (d);
+  fuse_reply_err (req, errno);
+}
+
+static int
+create_missing_whiteouts (struct ovl_data *lo, struct ovl_node *node, const char *from)
+{
+  struct ovl_layer *l;
+
+  if (! node_dirp (node))
+    return 0;
+
+  node = reload_dir (lo, node);
+  if (node == NULL)
+    return -1;
+
+  for (l = get_lower_layers (lo); l; l = l->next)
+    {
+      void *dp;
+      int saved_errno;
+      int ret = 0;
+
+      dp = l->ds->opendir (l, from);
+      if (dp == NULL)
+        {
+          if (errno == ENOTDIR)
+            break;
+          if (errno == ENOENT)
+            continue;
+          return -1;
+        }
+      else
+        {
+          struct dirent *dent;
+
+          for (;;)
+            {
+              struct ovl_node key;
+              struct ovl_node *n;
+
+              errno = 0;
+              dent = l->ds->readdir (dp);
+              if (dent == NULL)
+                {
+                  if (errno)
+                    ret = -1;
+
+                  break;
+                }
+
+              if (strcmp (dent->d_name, ".") == 0)
+                continue;
+              if (strcmp (dent->d_name, "..") == 0)
+                continue;
+              if (has_prefix (dent->d_name, ".wh."))
+                continue;
+
+              node_set_name (&key, (char *) dent->d_name);
+
+              n = otable_lookup (node->children, &key);
+              if (n)
+                {
+                  if (node_dirp (n))
+                    {
+                      char c[PATH_MAX];
+
+                      n = reload_dir (lo, n);
+                      if (n == NULL)
+                        {
+                          ret = -1;
+                          break;
+                        }
+
+                      strconcat3 (c, PATH_MAX, from, "/", n->name);
+
+                      if (create_missing_whiteouts (lo, n, c) < 0)
+                        {
+                          ret = -1;
+                          break;
+                        }
+                    }
+                  continue;
+                }
+
+              if (create_whiteout (lo, node, dent->d_name, false, true) < 0)
+                {
+                  ret = -1;
+                  break;
+                }
+            }
+
+          saved_errno = errno;
+          l->ds->closedir (dp);
+          if (ret < 0)
+            {
+              errno = saved_errno;
+              return -1;
+            }
+        }
+    }
+  return 0;
+}
+
+/* readdirplus stats the entries of the next reply window in parallel
+   and leaves the results in the attribute cache, where the loop below
+   and the lookups that follow find them.  */
+#define ATTR_PREFETCH_THREADS 4
+#define ATTR_PREFETCH_MAX 256
+/* Rough size of a direntplus entry, to guess how many fit the reply.  */
+#define ATTR_PREFETCH_ENTRY_SIZE 160
+
+static int
+attr_prefetch_one (void *arg, size_t i)
+{
+  struct ovl_node *node = ((struct ovl_node **) arg)[i];
+  struct ovl_layer *l = node->layer;
+  struct stat st;
+  char node_buf[PATH_MAX];
+  const char *path = node_layer_path (node, node_buf);
+
+  if (path && l->ds->statat (l, path, &st, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS) == 0)
+    attr_cache_store (node, &st);
+  return 0;
+}
+
+/* Stat the N nodes of layer L with a single statat_batch call.  */
+static void
+attr_prefetch_layer (struct ovl_layer *l, struct ovl_node **nodes, size_t n)
+{
+  const char *paths[ATTR_PREFETCH_MAX];
+  struct stat st[ATTR_PREFETCH_MAX];
+  int errs[ATTR_PREFETCH_MAX];
+  char node_buf[PATH_MAX];
+  size_t i, n_paths;
+
+  for (n_paths = 0; n_paths < n; n_paths++)
+    {
+      const char *path = node_layer_path (nodes[n_paths], node_buf);
+
+      paths[n_paths] = path ? strdup (path) : NULL;
+      if (paths[n_paths] == NULL)
+        break;
+    }
+
+  if (l->ds->statat_batch (l, n_paths, paths, st, errs, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS) == 0)
+    {
+      for (i = 0; i < n_paths; i++)
+        if (errs[i] == 0)
+          attr_cache_store (nodes[i], &st[i]);
+    }
+
+  for (i = 0; i < n_paths; i++)
+    free ((char *) paths[i]);
+}
+
+static void
+attr_prefetch (struct ovl_data *lo, struct ovl_dir_snapshot *snap, struct ovl_node *parent, off_t offset, size_t size)
+{
+  struct ovl_node *nodes[ATTR_PREFETCH_MAX];
+  struct ovl_node *group[ATTR_PREFETCH_MAX];
+  size_t max = size / ATTR_PREFETCH_ENTRY_SIZE;
+  size_t i, j, n = 0, left = 0;
+  struct stat st;
+
+  if (max > ATTR_PREFETCH_MAX)
+    max = ATTR_PREFETCH_MAX;
+
+  if (offset < 2)
+    offset = 2;
+  for (; n < max && offset < snap->tbl_size; offset++)
+    {
+      struct ovl_node *node = snap->tbl[offset];
+
+      if (node == NULL || node->whiteout || node->parent != parent)
+        continue;
+      if (! lower_cacheable (lo, node) || attr_cache_lookup (lo, node, &st))
+        continue;
+
+      nodes[n++] = node;
+    }
+
+  /* The layers that can stat in batches get one call each, the others
+     are spread over the workers.  */
+  for (i = 0; i < n; i++)
+    {
+      struct ovl_layer *l;
+      size_t n_group = 0;
+
+      if (nodes[i] == NULL)
+        continue;
+
+      l = nodes[i]->layer;
+      if (l->ds->statat_batch == NULL)
+        {
+          nodes[left++] = nodes[i];
+          continue;
+        }
+
+      for (j = i; j < n; j++)
+        if (nodes[j] && nodes[j]->layer == l)
+          {
+            group[n_group++] = nodes[j];
+            nodes[j] = NULL;
+          }
+      attr_prefetch_layer (l, group, n_group);
+    }
+
+  if (left > 1)
+    thread_pool_run (lo->attr_pool, attr_prefetch_one, nodes, left);
+}
+
+static void
+ovl_do_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
+	       off_t offset, struct fuse_file_info *fi, int plus)
+{
+  struct ovl_data *lo = ovl_data (req);
+  struct ovl_dirp *d = ovl_dirp (fi);
+  size_t remaining = size;
+  bool host_ns;
+  char *p;
+  cleanup_free char *allocated = NULL;
+  struct ovl_dir_snapshot *snap;
+  char *buffer;
+  char node_buf[PATH_MAX];
+
+  if (size <= THREAD_BUFFER_SIZE)
+    buffer = thread_buffer ();
+  else
+    buffer = allocated = malloc (size);
+  if (buffer == NULL)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  if (d->snapshot == NULL || (offset == 0 && ! dir_snapshot_fresh (d)))
+    {
+      snap = dir_snapshot_get (lo, d->parent);
+      if (snap == NULL)
+        {
+          fuse_reply_err (req, errno);
+          return;
+        }
+      dir_snapshot_unref (d->snapshot);
+      d->snapshot = snap;
+    }
+  snap = d->snapshot;
+
+  /* One namespace check for the whole reply buffer.  */
+  host_ns = caller_in_host_pidns (req->ctx.pid);
+
+  if (plus && lo->attr_pool)
+    attr_prefetch (lo, snap, d->parent, offset, size);
+
+  p = buffer;
+  for (; remaining > 0 && offset < snap->tbl_size; offset++)
+      {
+        int ret;
+        size_t entsize;
+        const char *name, *path;
+        struct ovl_node *node = snap->tbl[offset];
+        struct fuse_entry_param e;
+        struct stat *st = &e.attr;
+
+        if (node == NULL || node->whiteout || node->hidden)
+          continue;
+
+        if (offset == 0)
+          name = ".";
+        else if (offset == 1)
+          name = "..";
+        else
+          {
+            if (node->parent != d->parent)
+              continue;
+            name = node->name;
+          }
+
+        path = node_path (node, node_buf);
+        if (path == NULL || 0 == checkAccessNs (lo, host_ns, path)) {
+          continue;
+        }
+  
+        if (!plus)
+          {
+            /* From the 'stbuf' argument the st_ino field and bits 12-15 of the
+             * st_mode field are used.  The other fields are ignored.
+             */
+            st->st_ino = node->tmp_ino;
+            st->st_dev = node->tmp_dev;
+            st->st_mode = node->ino->mode;
+
+            entsize = fuse_add_direntry (req, p, remaining, name, st, offset + 1);
+          }
+        else
+          {
+            if (!lo->static_nlink && node_dirp (node))
+              {
+                node = reload_dir (lo, node);
+                if (node == NULL)
+                  {
+                    fuse_reply_err (req, errno);
+                    return;
+                  }
+              }
+            memset (&e, 0, sizeof (e));
+            ret = rpl_stat (req, node, -1, NULL, NULL, st);
+            if (ret < 0)
+              {
+                fuse_reply_err (req, errno);
+                return;
+              }
+
+            e.attr_timeout = get_timeout (lo);
+            e.entry_timeout = get_timeout (lo);
+            e.ino = node_to_inode (node);
+            entsize = fuse_add_direntry_plus (req, p, remaining, name, &e, offset + 1);
+            if (entsize <= remaining)
+              {
+                /* First two entries are . and .. */
+                if (offset >= 2)
+                  node->ino->lookups++;
+              }
+          }
+
+        if (entsize > remaining)
+          break;
+
+        p += entsize;
+        remaining -= entsize;
+      }
+  fuse_reply_buf (req, buffer, size - remaining);
+}
+
+static void
+ovl_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
+	    off_t offset, struct fuse_file_info *fi)
+{
+  struct ovl_dirp *d = ovl_dirp (fi);
+  cleanup_lock int l = enter_big_lock_shared ();
+
+  /* The shared snapshot is only read, unless it must be built again.  */
+  if (d->snapshot == NULL || (offset == 0 && ! dir_snapshot_fresh (d)))
+    {
+      l = release_big_lock ();
+      l = enter_big_lock ();
+    }
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_readdir(ino=%" PRIu64 ", size=%zu, offset=%lo)\n", ino, size, offset);
+  ovl_do_readdir (req, ino, size, offset, fi, 0);
+}
+
+static void
+ovl_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+  cleanup_lock int l = enter_big_lock ();
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_readdirplus(ino=%" PRIu64 ", size=%zu, offset=%lo)\n", ino, size, offset);
+  ovl_do_readdir (req, ino, size, offset, fi, 1);
+}
+
+static void
+ovl_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  cleanup_lock int l = enter_big_lock ();
+  struct ovl_dirp *d = ovl_dirp (fi);
+  struct ovl_data *lo = ovl_data (req);
+  struct ovl_node *node = NULL;
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_releasedir(ino=%" PRIu64 ")\n", ino);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+  dir_snapshot_unref (d->snapshot);
+
+  node = do_lookup_file (req, lo, ino, NULL);
+  if (node)
+    node->in_readdir--;
+
+  free (d);
+  fuse_reply_err (req, 0);
+}
+
+/* in-place filter xattrs that cannot be accessed.  */
+static ssize_t
+filter_xattrs_list (char *buf, ssize_t len)
+{
+  ssize_t ret = 0;
+  char *it;
+
+  if (buf == NULL)
+    return len;
+
+  it = buf;
+
+  while (it < buf + len)
+    {
+      size_t it_len;
+
+      it_len = strlen (it) + 1;
+
+      if (can_access_xattr (it))
+        {
+          it += it_len;
+          ret += it_len;
+        }
+      else
+        {
+          char *next = it + it_len;
+
+          memmove (it, next, buf + len - next);
+          len -= it_len;
+        }
+    }
+
+  return ret;
+}
+
+static void
+ovl_listxattr (fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+  cleanup_lock int l = enter_big_lock_shared ();
+  ssize_t len;
+  struct ovl_node *node;
+  struct ovl_data *lo = ovl_data (req);
+  cleanup_free char *allocated = NULL;
+  char *buf = NULL;
+  int ret;
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_listxattr(ino=%" PRIu64 ", size=%zu)\n", ino, size);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+
+  if (lo->disable_xattrs)
+    {
+      fuse_reply_err (req, ENOSYS);
+      return;
+    }
+
+  node = do_lookup_file (req, lo, ino, NULL);
+  if (node == NULL)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  if (size > 0)
+    {
+      if (size <= THREAD_BUFFER_SIZE)
+        buf = thread_buffer ();
+      else
+        buf = allocated = malloc (size);
+      if (buf == NULL)
+        {
+          fuse_reply_err (req, errno);
+          return;
+        }
+    }
+
+  if (! node->hidden)
+    ret = lower_cache_listxattr (lo, node, buf, size);
+  else
+    {
+      char path[PATH_MAX];
+      strconcat3 (path, PATH_MAX, lo->workdir, "/", node->path);
+      ret = listxattr (path, buf, size);
+    }
+  if (ret < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  len = filter_xattrs_list (buf, ret);
+
+  if (size == 0)
+    fuse_reply_xattr (req, len);
+  else if (len <= size)
+    fuse_reply_buf (req, buf, len);
+}
+
+static void
+ovl_getxattr (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+  cleanup_lock int l = enter_big_lock_shared ();
+  ssize_t len;
+  struct ovl_node *node;
+  struct ovl_data *lo = ovl_data (req);
+  cleanup_free char *allocated = NULL;
+  char *buf = NULL;
+  int ret;
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_getxattr(ino=%" PRIu64 ", name=%s, size=%zu)\n", ino, name, size);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+
+  if (lo->disable_xattrs)
+    {
+      fuse_reply_err (req, ENOSYS);
+      return;
+    }
+
+  if (! can_access_xattr (name))
+    {
+      fuse_reply_err (req, ENODATA);
+      return;
+    }
+
+  node = do_lookup_file (req, lo, ino, NULL);
+  if (node == NULL || node->whiteout)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  if (size > 0)
+    {
+      if (size <= THREAD_BUFFER_SIZE)
+        buf = thread_buffer ();
+      else
+        buf = allocated = malloc (size);
+      if (buf == NULL)
+        {
+          fuse_reply_err (req, errno);
+          return;
+        }
+    }
+
+  if (! node->hidden)
+    ret = lower_cache_getxattr (lo, node, name, buf, size);
+  else
+    {
+      char path[PATH_MAX];
+      strconcat3 (path, PATH_MAX, lo->workdir, "/", node->path);
+      ret = getxattr (path, name, buf, size);
+    }
+
+  if (ret < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  len = ret;
+
+  if (size == 0)
+    fuse_reply_xattr (req, len);
+  else
+    fuse_reply_buf (req, buf, len);
+}
+
+static void
+ovl_access (fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  cleanup_lock int l = enter_big_lock_shared ();
+  struct ovl_data *lo = ovl_data (req);
+  struct ovl_node *n = do_lookup_file (req, lo, ino, NULL);
+
+  if (UNLIKELY (ovl_debug (req)))
+    fprintf (stderr, "ovl_access(ino=%" PRIu64 ", mask=%d)\n",
+	     ino, mask);
+
+  if (0 == checkSandbox(req->ctx.pid)) {
+      fuse_reply_err (req, 1);
+      return;
+  }
+  if ((mask & n->ino->mode) == mask)
+    fuse_reply_err (req, 0);
+  else
+    fuse_reply_err (req, EPERM);
+}
+
+static int
+copy_xattr (int sfd, int dfd, char *buf, size_t buf_size)
+{
+  ssize_t xattr_len;
+
+  xattr_len = flistxattr (sfd, buf, buf_size);
+  if (xattr_len > 0)
+    {
+      char *it;
+      for (it = buf; it - buf < xattr_len; it += strlen (it) + 1)
+        {
+          cleanup_free char *v = NULL;
+          ssize_t s;
+
+          if (! can_access_xattr (it))
+            continue;
+
+          s = safe_read_xattr (&v, sfd, it, 256);
+          if (s < 0)
+            return -1;
+
+          if (fsetxattr (dfd, it, v, s, 0) < 0)
+            {
+              if (errno == EINVAL || errno == EOPNOTSUPP)
+                continue;
+              return -1;
+            }
+        }
+    }
+  return 0;
+}
+
+static int
+empty_dirfd (int fd)
+{
+  cleanup_dir DIR *dp = NULL;
+  struct dirent *dent;
+
+  dp = fdopendir (fd);
+  if (dp == NULL)
+    {
+      close (fd);
+      return -1;
+    }
+
+  for (;;)
+    {
+      int ret;
+
+      errno = 0;
+      dent = readdir (dp);
+      if (dent == NULL)
+        {
+          if (errno)
+            return -1;
+
+          break;
+        }
+      if (strcmp (dent->d_name, ".") == 0)
+        continue;
+      if (strcmp (dent->d_name, "..") == 0)
+        continue;
+
+      ret = unlinkat (dirfd (dp), dent->d_name, 0);
+      if (ret < 0 && errno == EISDIR)
+        {
+          ret = unlinkat (dirfd (dp), dent->d_name, AT_REMOVEDIR);
+          if (ret < 0 && errno == ENOTEMPTY)
+            {
+              int dfd;
+
+              dfd = safe_openat (dirfd (dp), dent->d_name, O_DIRECTORY, 0);
+              if (dfd < 0)
+                return -1;
+
+              ret = empty_dirfd (dfd);
+              if (ret < 0)
+                return -1;
+
+              ret = unlinkat (dirfd (dp), dent->d_name, AT_REMOVEDIR);
+              if (ret < 0)
+                return -1;
+
+              continue;
+            }
+        }
+      if (ret < 0)
+        return ret;
+    }
+
+  return 0;
+}
+
+/* Background removal of directories.  Removing a directory that is
+   not empty, like a deleted directory that still holds whiteouts or a
+   directory replaced during a copy-up, only renames it into the trash
+   directory, next to the workdir, and the reaper thread deletes its
+   content out of the request path.  Entries left in the trash by a
+   previous mount are deleted when the reaper starts.  */
+
+#define TRASH_DIR "trash"
+/* Pause for REAPER_PAUSE_MS after every REAPER_BATCH deletions.  */
+#define REAPER_BATCH 1024
+#define REAPER_PAUSE_MS 10
+
+static int reaper_trash_fd = -1;
+static pthread_t reaper_thread;
+static bool reaper_thread_running;
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static bool reaper_pending;
+static bool reaper_stop;
+static size_t reaper_deleted;
+
+/* Move NAME in DIRFD to the trash, or delete it now if there is no
+   trash.  */
+static int
+reaper_schedule (int dirfd, const char *name)
+{
+  char trash_name[64];
+  int fd;
+
+  if (reaper_trash_fd >= 0)
+    {
+      sprintf (trash_name, "%d-%lu", getpid (), get_next_wd_counter ());
+      if (renameat (dirfd, name, reaper_trash_fd, trash_name) == 0)
+        {
+          pthread_mutex_lock (&reaper_lock);
+          reaper_pending = true;
+          pthread_cond_signal (&reaper_cond);
+          pthread_mutex_unlock (&reaper_lock);
+          return 0;
+        }
+    }
+
+  fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, name, O_DIRECTORY, 0));
+  if (fd < 0)
+    return -1;
+  if (empty_dirfd (fd) < 0)
+    return -1;
+  return unlinkat (dirfd, name, AT_REMOVEDIR);
+}
+
+static bool
+reaper_throttle ()
+{
+  if (++reaper_deleted % REAPER_BATCH == 0)
+    {
+      struct timespec ts = { 0, REAPER_PAUSE_MS * 1000000L };
+
+      nanosleep (&ts, NULL);
+    }
+  return __atomic_load_n (&reaper_stop, __ATOMIC_RELAXED);
+}
+
+/* Like empty_dirfd, but rate limited and interrupted by
+   stop_reaper_thread.  It takes ownership of FD.  */
+static int
+reaper_empty_dirfd (int fd)
+{
+  cleanup_dir DIR *dp = NULL;
+  struct dirent *dent;
+
+  dp = fdopendir (fd);
+  if (dp == NULL)
+    {
+      close (fd);
+      return -1;
+    }
+
+  for (;;)
+    {
+      int ret;
+
+      errno = 0;
+      dent = readdir (dp);
+      if (dent == NULL)
+        return errno ? -1 : 0;
+      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+        continue;
+
+      ret = unlinkat (dirfd (dp), dent->d_name, 0);
+      if (ret < 0 && errno == EISDIR)
+        {
+          ret = unlinkat (dirfd (dp), dent->d_name, AT_REMOVEDIR);
+          if (ret < 0 && errno == ENOTEMPTY)
+            {
+              int dfd;
+
+              dfd = safe_openat (dirfd (dp), dent->d_name, O_DIRECTORY, 0);
+              if (dfd < 0)
+                return -1;
+              if (reaper_empty_dirfd (dfd) < 0)
+                return -1;
+              ret = unlinkat (dirfd (dp), dent->d_name, AT_REMOVEDIR);
+            }
+        }
+      if (ret < 0 && errno != ENOENT)
+        return -1;
+
+      if (reaper_throttle ())
+        {
+          errno = EINTR;
+          return -1;
+        }
+    }
+}
+
+static void *
+reaper_thread_run (void *arg)
+{
+  for (;;)
+    {
+      int fd;
+
+      pthread_mutex_lock (&reaper_lock);
+      while (! reaper_pending && ! reaper_stop)
+        pthread_cond_wait (&reaper_cond, &reaper_lock);
+      reaper_pending = false;
+      pthread_mutex_unlock (&reaper_lock);
+
+      if (__atomic_load_n (&reaper_stop, __ATOMIC_RELAXED))
+        break;
+
+      /* A new descriptor for each pass, as readdir moves its offset.  */
+      fd = openat (reaper_trash_fd, ".", O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+      if (fd >= 0)
+        reaper_empty_dirfd (fd);
+    }
+
+  return NULL;
+}
+
+static bool directory_has_entries (int dirfd);
+
+/* Replace the workdir WORKDIR_FD, with leftovers, by an empty one and
+   move the old one to the trash at once, keeping the descriptor number.  */
+static int
+trash_whole_workdir (int workdir_fd)
+{
+  char trash_name[64];
+  int fd;
+
+  sprintf (trash_name, "%d-%lu", getpid (), get_next_wd_counter ());
+  if (renameat (workdir_fd, "../work", reaper_trash_fd, trash_name) < 0)
+    return -1;
+
+  if (mkdirat (reaper_trash_fd, "../work", 0700) < 0)
+    goto fail;
+  fd = openat (reaper_trash_fd, "../work", O_DIRECTORY);
+  if (fd < 0)
+    {
+      unlinkat (reaper_trash_fd, "../work", AT_REMOVEDIR);
+      goto fail;
+    }
+  if (dup2 (fd, workdir_fd) < 0)
+    {
+      close (fd);
+      unlinkat (reaper_trash_fd, "../work", AT_REMOVEDIR);
+      goto fail;
+    }
+  close (fd);
+  reaper_pending = true;
+  return 0;
+
+ fail:
+  renameat (reaper_trash_fd, trash_name, workdir_fd, "../work");
+  return -1;
+}
+
+/* Open the trash next to WORKDIR_FD and move the leftovers of the
+   workdir there, with FAST the whole workdir.  On failure the
+   directories are deleted in the request path.  */
+static void
+init_reaper (int workdir_fd, bool fast)
+{
+  cleanup_dir DIR *dp = NULL;
+  struct dirent *dent;
+  int fd;
+
+  if (mkdirat (workdir_fd, "../" TRASH_DIR, 0700) < 0 && errno != EEXIST)
+    return;
+  reaper_trash_fd = openat (workdir_fd, "../" TRASH_DIR, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+  if (reaper_trash_fd < 0)
+    return;
+
+  if (fast && directory_has_entries (workdir_fd) && trash_whole_workdir (workdir_fd) == 0)
+    return;
+
+  fd = openat (workdir_fd, ".", O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return;
+  dp = fdopendir (fd);
+  if (dp == NULL)
+    {
+      close (fd);
+      return;
+    }
+  while ((dent = readdir (dp)))
+    {
+      char trash_name[64];
+
+      if (strcmp (dent->d_name, ".") == 0 || strcmp (dent->d_name, "..") == 0)
+        continue;
+      sprintf (trash_name, "%d-%lu", getpid (), get_next_wd_counter ());
+      if (renameat (workdir_fd, dent->d_name, reaper_trash_fd, trash_name) < 0
+          && unlinkat (workdir_fd, dent->d_name, 0) < 0 && errno == EISDIR)
+        {
+          int dfd = safe_openat (workdir_fd, dent->d_name, O_DIRECTORY, 0);
+
+          if (dfd >= 0 && empty_dirfd (dfd) == 0)
+            unlinkat (workdir_fd, dent->d_name, AT_REMOVEDIR);
+        }
+    }
+
+  reaper_pending = true;
+}
+
+static void
+start_reaper_thread ()
+{
+  int ret;
+
+  if (reaper_trash_fd < 0)
+    return;
+
+  ret = pthread_create (&reaper_thread, NULL, reaper_thread_run, NULL);
+  if (ret != 0)
+    {
+      fprintf (stderr, "cannot start the reaper thread: %s\n", strerror (ret));
+      close (reaper_trash_fd);
+      reaper_trash_fd = -1;
+      return;
+    }
+  reaper_thread_running = true;
+}
+
+static void
+stop_reaper_thread ()
+{
+  if (! reaper_thread_running)
+    return;
+
+  pthread_mutex_lock (&reaper_lock);
+  __atomic_store_n (&reaper_stop, true, __ATOMIC_RELAXED);
+  pthread_cond_signal (&reaper_cond);
+  pthread_mutex_unlock (&reaper_lock);
+  pthread_join (reaper_thread, NULL);
+  reaper_thread_running = false;
+}
+
+static int create_node_directory (struct ovl_data *lo, struct ovl_node *src);
+
+static int
+create_directory (struct ovl_data *lo, int dirfd, const char *name, const struct timespec *times,
+                  struct ovl_node *parent, int xattr_sfd, uid_t uid, gid_t gid, mode_t mode, bool set_opaque, struct stat *st_out)
+{
+  int ret;
+  int saved_errno;
+  cleanup_close int dfd = -1;
+  char *buf;
+  char wd_tmp_file_name[32];
+  bool need_rename;
+
+  if (lo->xattr_permissions)
+    mode |= 0755;
+
+  need_rename = set_opaque || times || xattr_sfd >= 0 || uid != lo->uid || gid != lo->gid;
+  if (!need_rename)
+    {
+      /* mkdir can be used directly without a temporary directory in the working directory.  */
+      ret = mkdirat (dirfd, name, mode);
+      if (ret < 0)
+        {
+          if (errno == EEXIST)
+            {
+              unlinkat (dirfd, name, 0);
+              ret = mkdirat (dirfd, name, mode);
+            }
+          if (ret < 0)
+            return ret;
+        }
+      if (st_out)
+        return fstatat (dirfd, name, st_out, AT_SYMLINK_NOFOLLOW);
+      return 0;
+    }
+
+  sprintf (wd_tmp_file_name, "%lu", get_next_wd_counter ());
+
+  ret = mkdirat (lo->workdir_fd, wd_tmp_file_name, mode);
+  if (ret < 0)
+    goto out;
+
+  ret = dfd = TEMP_FAILURE_RETRY (safe_openat (lo->workdir_fd, wd_tmp_file_name, O_RDONLY, 0));
+  if (ret < 0)
+    goto out;
+
+  if (uid != lo->uid || gid != lo->gid || get_upper_layer (lo)->stat_override_mode != STAT_OVERRIDE_NONE)
+    {
+      ret = do_fchown (lo, dfd, uid, gid, mode);
+      if (ret < 0)
+        goto out;
+    }
+
+  if (times)
+    {
+      ret = futimens (dfd, times);
+      if (ret < 0)
+        goto out;
+    }
+
+  if (ret == 0 && xattr_sfd >= 0)
+    {
+      buf = thread_buffer ();
+      if (buf == NULL)
+        {
+          ret = -1;
+          goto out;
+        }
+
+      ret = copy_xattr (xattr_sfd, dfd, buf, THREAD_BUFFER_SIZE);
+      if (ret < 0)
+        goto out;
+    }
+
+  if (set_opaque)
+    {
+      ret = set_fd_opaque (dfd);
+      if (ret < 0)
+        goto out;
+    }
+
+  if (st_out)
+    {
+      ret = fstat (dfd, st_out);
+      if (ret < 0)
+        goto out;
+    }
+
+  ret = renameat (lo->workdir_fd, wd_tmp_file_name, dirfd, name);
+  if (ret < 0)
+    {
+      if (errno == EEXIST)
+        {
+          ret = direct_renameat2 (lo->workdir_fd, wd_tmp_file_name, dirfd, name, RENAME_EXCHANGE);
+          if (ret < 0)
+            goto out;
+
+          return reaper_schedule (lo->workdir_fd, wd_tmp_file_name);
+        }
+      if (errno == ENOTDIR)
+        unlinkat (dirfd, name, 0);
+      if (errno == ENOENT && parent)
+        {
+          ret = create_node_directory (lo, parent);
+          if (ret != 0)
+            goto out;
+        }
+
+      ret = renameat (lo->workdir_fd, wd_tmp_file_name, dirfd, name);
+    }
+out:
+  saved_errno = errno;
+  if (ret < 0)
+      unlinkat (lo->workdir_fd, wd_tmp_file_name, AT_REMOVEDIR);
+  errno = saved_errno;
+
+  return ret;
+}
+
+static int
+create_node_directory (struct ovl_data *lo, struct ovl_node *src)
+{
+  int ret;
+  struct stat st;
+  cleanup_close int sfd = -1;
+  struct timespec times[2];
+  char src_buf[PATH_MAX];
+  const char *path;
+
+  if (src == NULL)
+    return 0;
+
+  if (src->layer == get_upper_layer (lo))
+    return 0;
+
+  path = node_layer_path (src, src_buf);
+  if (path == NULL)
+    return -1;
+
+  ret = sfd = src->layer->ds->openat (src->layer, path, O_RDONLY|O_NONBLOCK, 0755);
+  if (ret < 0)
+    return ret;
+
+  ret = TEMP_FAILURE_RETRY (fstat (sfd, &st));
+  if (ret < 0)
+    return ret;
+
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+
+  path = node_path (src, src_buf);
+  if (path == NULL)
+    return -1;
+
+  ret = create_directory (lo, get_upper_layer (lo)->fd, path, times, src->parent, sfd, st.st_uid, st.st_gid, st.st_mode, false, NULL);
+  if (ret == 0)
+    {
+      src->layer = get_upper_layer (lo);
 
-  for (it = hash_get_first (node->children); it; it = hash_get_next (node->children, it))
-    {
-      it->ino->lookups++;
-      it->node_lookups++;
-      d->tbl[counter++] = it;
+      if (src->parent)
+        delete_whiteout (lo, -1, src->parent, src->name);
     }
 
-  return 0;
+  return ret;
 }
 
-static void
-ovl_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
-{
-  struct ovl_node *node;
-  struct ovl_data *lo = ovl_data (req);
-  struct ovl_dirp *d = calloc (1, sizeof (struct ovl_dirp));
-  cleanup_lock int l = enter_big_lock ();
+/* Copy-up engine.  The data is copied with copy_file_range, which lets
+   the file system copy it on its side, or through a buffer owned by the
+   thread if the file system cannot do it.  The holes of the source file
+   are preserved, and big files are split in chunks copied in parallel
+   by the copy-up thread pool.  */
 
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_opendir(ino=%" PRIu64 ")\n", ino);
+#define COPYUP_CHUNK_SIZE (8 << 20)
+#define COPYUP_THREADS 4
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
 
-  if (d == NULL)
-    {
-      errno = ENOMEM;
-      goto out_errno;
-    }
+/* Copy [OFF, OFF + LEN) of SFD to the same range of DFD.  */
+static int
+copy_range (int sfd, int dfd, off_t off, off_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  static bool support_copy_file_range = true;
+  bool use_copy_file_range = __atomic_load_n (&support_copy_file_range, __ATOMIC_RELAXED);
+#endif
+  char *buf = NULL;
 
-  node = do_lookup_file (req, lo, ino, NULL);
-  if (node == NULL)
+  while (len > 0)
     {
-      errno = ENOENT;
-      goto out_errno;
-    }
+      size_t tocopy = len > COPYUP_CHUNK_SIZE ? COPYUP_CHUNK_SIZE : (size_t) len;
+      ssize_t written = 0;
+      ssize_t r;
 
-  if (! node_dirp (node))
-    {
-      errno = ENOTDIR;
-      goto out_errno;
-    }
+#ifdef HAVE_COPY_FILE_RANGE
+      if (use_copy_file_range)
+        {
+          loff_t in = off, out = off;
 
-  d->parent = node;
+          r = TEMP_FAILURE_RETRY (copy_file_range (sfd, &in, dfd, &out, tocopy, 0));
+          if (r == 0)
+            return 0;
+          if (r > 0)
+            {
+              off += r;
+              len -= r;
+              continue;
+            }
+          if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+            return -1;
 
-  fi->fh = (uintptr_t) d;
-  if (get_timeout (lo) > 0)
-    {
-      fi->keep_cache = 1;
-#if HAVE_FUSE_CACHE_READDIR
-      fi->cache_readdir = 1;
+          /* Fallback to the buffer for this file, and don't attempt again
+             copy_file_range if the kernel doesn't know it.  */
+          if (errno == ENOSYS)
+            __atomic_store_n (&support_copy_file_range, false, __ATOMIC_RELAXED);
+          use_copy_file_range = false;
+        }
 #endif
-    }
-  node->in_readdir++;
-  fuse_reply_open (req, fi);
-  return;
 
-out_errno:
-  if (d)
-    {
-      if (d->tbl)
-        free (d->tbl);
-      free (d);
+      if (buf == NULL)
+        {
+          buf = thread_buffer ();
+          if (buf == NULL)
+            return -1;
+        }
+
+      r = TEMP_FAILURE_RETRY (pread (sfd, buf, tocopy > THREAD_BUFFER_SIZE ? THREAD_BUFFER_SIZE : tocopy, off));
+      if (r < 0)
+        return -1;
+      if (r == 0)
+        return 0;
+
+      while (written < r)
+        {
+          ssize_t w = TEMP_FAILURE_RETRY (pwrite (dfd, buf + written, r - written, off + written));
+          if (w < 0)
+            return -1;
+          written += w;
+        }
+      off += r;
+      len -= r;
     }
-  fuse_reply_err (req, errno);
+  return 0;
 }
 
+struct copy_chunk
+{
+  off_t off;
+  off_t len;
+};
+
+struct copy_job
+{
+  int sfd;
+  int dfd;
+  struct copy_chunk *chunks;
+};
+
 static int
-create_missing_whiteouts (struct ovl_data *lo, struct ovl_node *node, const char *from)
+copy_job_chunk (void *arg, size_t i)
 {
-  struct ovl_layer *l;
+  struct copy_job *job = arg;
 
-  if (! node_dirp (node))
-    return 0;
+  if (copy_range (job->sfd, job->dfd, job->chunks[i].off, job->chunks[i].len) < 0)
+    return errno ? errno : EIO;
+  return 0;
+}
 
-  node = reload_dir (lo, node);
-  if (node == NULL)
-    return -1;
+/* Copy the data in [OFF, OFF + LEN) of SFD to the same range of DFD.
+   The holes of SFD are skipped, so they must be holes in DFD too.  */
+static int
+copy_file_data (struct thread_pool *pool, int sfd, int dfd, off_t off, off_t len)
+{
+  cleanup_free struct copy_chunk *chunks = NULL;
+  struct copy_job job;
+  size_t n_chunks = 0;
+  size_t allocated = 0;
+  off_t end = off + len;
+  int ret;
 
-  for (l = get_lower_layers (lo); l; l = l->next)
+  while (off < end)
     {
-      cleanup_dir DIR *dp = NULL;
+      off_t data, hole;
 
-      dp = l->ds->opendir (l, from);
-      if (dp == NULL)
+      data = lseek (sfd, off, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+        break;
+      if (data < 0)
         {
-          if (errno == ENOTDIR)
-            break;
-          if (errno == ENOENT)
-            continue;
-          return -1;
+          if (errno != EINVAL && errno != EOPNOTSUPP)
+            return -1;
+
+          /* No SEEK_DATA support, copy everything.  */
+          data = off;
+          hole = end;
         }
       else
         {
-          struct dirent *dent;
-
-          for (;;)
-            {
-              struct ovl_node key;
-              struct ovl_node *n;
-
-              errno = 0;
-              dent = readdir (dp);
-              if (dent == NULL)
-                {
-                  if (errno)
-                    return -1;
-
-                  break;
-                }
-
-              if (strcmp (dent->d_name, ".") == 0)
-                continue;
-              if (strcmp (dent->d_name, "..") == 0)
-                continue;
-              if (has_prefix (dent->d_name, ".wh."))
-                continue;
-
-              node_set_name (&key, (char *) dent->d_name);
-
-              n = hash_lookup (node->children, &key);
-              if (n)
-                {
-                  if (node_dirp (n))
-                    {
-                      char c[PATH_MAX];
-
-                      n = reload_dir (lo, n);
-                      if (n == NULL)
-                        return -1;
+          if (data >= end)
+            break;
 
-                      strconcat3 (c, PATH_MAX, from, "/", n->name);
+          hole = lseek (sfd, data, SEEK_HOLE);
+          if (hole < 0)
+            return -1;
+          if (hole > end)
+            hole = end;
+        }
 
-                      if (create_missing_whiteouts (lo, n, c) < 0)
-                        return -1;
-                    }
-                  continue;
-                }
+      for (off = data; off < hole; off += COPYUP_CHUNK_SIZE)
+        {
+          if (n_chunks == allocated)
+            {
+              struct copy_chunk *new;
 
-              if (create_whiteout (lo, node, dent->d_name, false, true) < 0)
+              allocated = allocated ? allocated * 2 : 16;
+              new = realloc (chunks, allocated * sizeof (*chunks));
+              if (new == NULL)
                 return -1;
+              chunks = new;
             }
+          chunks[n_chunks].off = off;
+          chunks[n_chunks].len = hole - off < COPYUP_CHUNK_SIZE ? hole - off : COPYUP_CHUNK_SIZE;
+          n_chunks++;
         }
+      off = hole;
     }
-  return 0;
-}
-
-static void
-ovl_do_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
-	       off_t offset, struct fuse_file_info *fi, int plus)
-{
-  struct ovl_data *lo = ovl_data (req);
-  struct ovl_dirp *d = ovl_dirp (fi);
-  size_t remaining = size;
-  char *p;
-  cleanup_free char *buffer = NULL;
 
-  buffer = malloc (size);
-  if (buffer == NULL)
+  job.sfd = sfd;
+  job.dfd = dfd;
+  job.chunks = chunks;
+  ret = thread_pool_run (pool, copy_job_chunk, &job, n_chunks);
+  if (ret)
     {
-      fuse_reply_err (req, errno);
-      return;
+      errno = ret;
+      return -1;
     }
+  return 0;
+}
 
-  if (offset == 0 || d->tbl == NULL)
-    {
-      if (reload_tbl (lo, d, d->parent) < 0)
-        {
-          fuse_reply_err (req, errno);
-          return;
-        }
-    }
+/* Lazy copy-up.  With lazy_copyup=1, a big file that cannot be cloned
+   is copied up as a sparse file with the same size, metadata and
+   xattrs of the lower file.  Its data is copied in chunk by chunk: a
+   chunk is copied before it is read or written, and a background thread
+   copies the remaining ones.
+
+   The chunks already copied are tracked in a bitmap stored in the
+   LAZY_COPYUP_XATTR xattr of the upper file, and a marker named after
+   the inode number of the upper file is created in the lazy-copyup
+   directory next to the workdir.  The bitmap is stored only after the
+   data it describes is synced, and it is stored again before an fsync
+   returns, so after a crash the copy resumes the next time the file is
+   opened.  When the last chunk is copied, the xattr and the marker are
+   removed.  */
+
+#define LAZY_COPYUP_XATTR "user.fuseoverlayfs.lazy_copyup"
+#define LAZY_COPYUP_DIR "lazy-copyup"
+#define LAZY_COPYUP_MIN_SIZE (16 << 20)
+#define LAZY_COPYUP_MIN_CHUNK_SHIFT 20
+/* Keep the bitmap small enough to be stored in an xattr on any file system.  */
+#define LAZY_COPYUP_MAX_CHUNKS (2048 * 8)
+/* How many chunks the background copy copies before storing the bitmap.  */
+#define LAZY_COPYUP_SAVE_INTERVAL 64
+
+struct lazy_copyup_header
+{
+  uint32_t version;
+  uint32_t chunk_shift;
+  /* Size of the lower file.  */
+  uint64_t lower_size;
+  /* Size of the data to copy, smaller than lower_size after a truncate.  */
+  uint64_t size;
+};
 
-  p = buffer;
-  for (; remaining > 0 && offset < d->tbl_size; offset++)
-      {
-        int ret;
-        size_t entsize;
-        const char *name;
-        struct ovl_node *node = d->tbl[offset];
-        struct fuse_entry_param e;
-        struct stat *st = &e.attr;
+struct ovl_lazy_copyup
+{
+  /* Link in lazy_copyups.  */
+  struct ovl_lazy_copyup *next;
+  /* Link in the queue of the background thread.  */
+  struct ovl_lazy_copyup *next_queued;
+  pthread_mutex_t lock;
+  unsigned int refs;
+  bool fsync;
+  bool done;
+  int sfd;
+  int dfd;
+  int markers_fd;
+  ino_t ino;
+  off_t size;
+  unsigned int chunk_shift;
+  size_t n_chunks;
+  size_t n_copied;
+  size_t n_unsaved;
+  /* Times of the upper file, restored after a chunk is copied.  */
+  struct timespec times[2];
+  /* struct lazy_copyup_header followed by the bitmap.  */
+  uint8_t *data;
+  size_t data_len;
+};
 
-        if (node == NULL || node->whiteout || node->hidden)
-          continue;
+/* Every lazy copy-up still in progress, so that the state is found
+   again if the inode is forgotten and looked up again.  */
+static pthread_mutex_t lazy_copyups_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ovl_lazy_copyup *lazy_copyups;
 
-        if (offset == 0)
-          name = ".";
-        else if (offset == 1)
-          name = "..";
-        else
-          {
-            if (node->parent != d->parent)
-              continue;
-            name = node->name;
-          }
+static struct lazy_copyup_header *
+lazy_copyup_header (struct ovl_lazy_copyup *lc)
+{
+  return (struct lazy_copyup_header *) lc->data;
+}
 
-        if (0 == checkAccess(req, lo, node->path)) {
-          continue;
-        }
-  
-        if (!plus)
-          {
-            /* From the 'stbuf' argument the st_ino field and bits 12-15 of the
-             * st_mode field are used.  The other fields are ignored.
-             */
-            st->st_ino = node->tmp_ino;
-            st->st_dev = node->tmp_dev;
-            st->st_mode = node->ino->mode;
+static uint8_t *
+lazy_copyup_bitmap (struct ovl_lazy_copyup *lc)
+{
+  return lc->data + sizeof (struct lazy_copyup_header);
+}
 
-            entsize = fuse_add_direntry (req, p, remaining, name, st, offset + 1);
-          }
-        else
-          {
-            if (!lo->static_nlink && node_dirp (node))
-              {
-                node = reload_dir (lo, node);
-                if (node == NULL)
-                  {
-                    fuse_reply_err (req, errno);
-                    return;
-                  }
-              }
-            memset (&e, 0, sizeof (e));
-            ret = rpl_stat (req, node, -1, NULL, NULL, st);
-            if (ret < 0)
-              {
-                fuse_reply_err (req, errno);
-                return;
-              }
+static bool
+lazy_copyup_chunk_copied (struct ovl_lazy_copyup *lc, size_t chunk)
+{
+  return lazy_copyup_bitmap (lc)[chunk / 8] & (1 << (chunk % 8));
+}
 
-            e.attr_timeout = get_timeout (lo);
-            e.entry_timeout = get_timeout (lo);
-            e.ino = node_to_inode (node);
-            entsize = fuse_add_direntry_plus (req, p, remaining, name, &e, offset + 1);
-            if (entsize <= remaining)
-              {
-                /* First two entries are . and .. */
-                if (offset >= 2)
-                  node->ino->lookups++;
-              }
-          }
+static size_t
+lazy_copyup_n_chunks (off_t size, unsigned int chunk_shift)
+{
+  return size == 0 ? 0 : ((size - 1) >> chunk_shift) + 1;
+}
 
-        if (entsize > remaining)
-          break;
+static struct ovl_lazy_copyup *
+lazy_copyup_ref (struct ovl_lazy_copyup *lc)
+{
+  if (lc)
+    __atomic_add_fetch (&lc->refs, 1, __ATOMIC_RELAXED);
+  return lc;
+}
 
-        p += entsize;
-        remaining -= entsize;
-      }
-  fuse_reply_buf (req, buffer, size - remaining);
+static void
+lazy_copyup_close (struct ovl_lazy_copyup *lc)
+{
+  if (lc->sfd >= 0)
+    close (lc->sfd);
+  if (lc->dfd >= 0)
+    close (lc->dfd);
+  lc->sfd = lc->dfd = -1;
+}
+
+static void
+lazy_copyup_unref (struct ovl_lazy_copyup *lc)
+{
+  if (lc == NULL || __atomic_sub_fetch (&lc->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  lazy_copyup_close (lc);
+  pthread_mutex_destroy (&lc->lock);
+  free (lc->data);
+  free (lc);
 }
 
 static void
-ovl_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
-	    off_t offset, struct fuse_file_info *fi)
+cleanup_lazy_copyupp (struct ovl_lazy_copyup **p)
 {
-  cleanup_lock int l = enter_big_lock ();
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_readdir(ino=%" PRIu64 ", size=%zu, offset=%lo)\n", ino, size, offset);
-  ovl_do_readdir (req, ino, size, offset, fi, 0);
+  lazy_copyup_unref (*p);
 }
 
-static void
-ovl_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size,
-		off_t offset, struct fuse_file_info *fi)
+#define cleanup_lazy_copyup __attribute__((cleanup (cleanup_lazy_copyupp)))
+
+static bool
+lazy_copyup_is_done (struct ovl_lazy_copyup *lc)
 {
-  cleanup_lock int l = enter_big_lock ();
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_readdirplus(ino=%" PRIu64 ", size=%zu, offset=%lo)\n", ino, size, offset);
-  ovl_do_readdir (req, ino, size, offset, fi, 1);
+  bool done;
+
+  pthread_mutex_lock (&lc->lock);
+  done = lc->done;
+  pthread_mutex_unlock (&lc->lock);
+
+  return done;
+}
+
+static struct ovl_lazy_copyup *
+make_lazy_copyup (struct ovl_data *lo, int sfd, int dfd, ino_t ino, const struct lazy_copyup_header *h)
+{
+  struct ovl_lazy_copyup *lc;
+  struct stat st;
+
+  if (fstat (dfd, &st) < 0)
+    return NULL;
+
+  lc = calloc (1, sizeof (*lc));
+  if (lc == NULL)
+    return NULL;
+
+  lc->n_chunks = lazy_copyup_n_chunks (h->size, h->chunk_shift);
+  lc->data_len = sizeof (*h) + (lc->n_chunks + 7) / 8;
+  lc->data = calloc (1, lc->data_len);
+  if (lc->data == NULL)
+    {
+      free (lc);
+      return NULL;
+    }
+  memcpy (lc->data, h, sizeof (*h));
+
+  pthread_mutex_init (&lc->lock, NULL);
+  lc->refs = 1;
+  lc->fsync = lo->fsync;
+  lc->sfd = sfd;
+  lc->dfd = dfd;
+  lc->markers_fd = lo->lazy_copyup_fd;
+  lc->ino = ino;
+  lc->size = h->size;
+  lc->chunk_shift = h->chunk_shift;
+  lc->times[0] = st.st_atim;
+  lc->times[1] = st.st_mtim;
+  return lc;
 }
 
 static void
-ovl_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+lazy_copyup_register (struct ovl_lazy_copyup *lc)
 {
-  cleanup_lock int l = enter_big_lock ();
-  size_t s;
-  struct ovl_dirp *d = ovl_dirp (fi);
-  struct ovl_data *lo = ovl_data (req);
-  struct ovl_node *node = NULL;
+  pthread_mutex_lock (&lazy_copyups_lock);
+  lc->next = lazy_copyups;
+  lazy_copyups = lazy_copyup_ref (lc);
+  pthread_mutex_unlock (&lazy_copyups_lock);
+}
 
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_releasedir(ino=%" PRIu64 ")\n", ino);
+/* Find the lazy copy-up in progress for the upper inode INO.  The
+   completed ones are dropped from the list.  */
+static struct ovl_lazy_copyup *
+lazy_copyup_find (ino_t ino)
+{
+  struct ovl_lazy_copyup *ret = NULL;
+  struct ovl_lazy_copyup **it;
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
-  for (s = 2; s < d->tbl_size; s++)
+  pthread_mutex_lock (&lazy_copyups_lock);
+  for (it = &lazy_copyups; *it;)
     {
-      d->tbl[s]->node_lookups--;
-      if (! do_forget (lo, (fuse_ino_t) d->tbl[s]->ino, 1))
+      struct ovl_lazy_copyup *lc = *it;
+
+      if (lazy_copyup_is_done (lc))
         {
-          if (d->tbl[s]->node_lookups == 0)
-            node_free (d->tbl[s]);
+          *it = lc->next;
+          lazy_copyup_unref (lc);
+          continue;
         }
+      if (lc->ino == ino)
+        ret = lazy_copyup_ref (lc);
+      it = &lc->next;
     }
+  pthread_mutex_unlock (&lazy_copyups_lock);
 
-  node = do_lookup_file (req, lo, ino, NULL);
-  if (node)
-    node->in_readdir--;
+  return ret;
+}
 
-  free (d->tbl);
-  free (d);
-  fuse_reply_err (req, 0);
+static void
+lazy_copyup_marker_name (char *name, size_t len, ino_t ino)
+{
+  snprintf (name, len, "%llu", (unsigned long long) ino);
 }
 
-/* in-place filter xattrs that cannot be accessed.  */
-static ssize_t
-filter_xattrs_list (char *buf, ssize_t len)
+/* Store the bitmap, once the chunks it marks as copied are on disk.
+   Must be called with lc->lock held.  */
+static int
+lazy_copyup_save (struct ovl_lazy_copyup *lc)
 {
-  ssize_t ret = 0;
-  char *it;
+  if (lc->done || lc->n_unsaved == 0)
+    return 0;
 
-  if (buf == NULL)
-    return len;
+  if (lc->fsync && fdatasync (lc->dfd) < 0)
+    return -1;
 
-  it = buf;
+  if (fsetxattr (lc->dfd, LAZY_COPYUP_XATTR, lc->data, lc->data_len, 0) < 0)
+    return -1;
 
-  while (it < buf + len)
+  lc->n_unsaved = 0;
+  return 0;
+}
+
+/* Must be called with lc->lock held.  */
+static int
+lazy_copyup_done (struct ovl_lazy_copyup *lc)
+{
+  char marker[32];
+
+  if (lc->fsync && fdatasync (lc->dfd) < 0)
+    return -1;
+
+  if (fremovexattr (lc->dfd, LAZY_COPYUP_XATTR) < 0 && errno != ENODATA)
+    return -1;
+
+  lazy_copyup_marker_name (marker, sizeof (marker), lc->ino);
+  unlinkat (lc->markers_fd, marker, 0);
+
+  lazy_copyup_close (lc);
+  lc->done = true;
+  return 0;
+}
+
+/* Copy in the chunks from FIRST to LAST included.  Must be called with
+   lc->lock held.  */
+static int
+lazy_copyup_chunks (struct ovl_lazy_copyup *lc, size_t first, size_t last)
+{
+  const size_t chunk_size = ((size_t) 1) << lc->chunk_shift;
+  bool copied = false;
+  size_t i;
+
+  for (i = first; i <= last && i < lc->n_chunks; i++)
     {
-      size_t it_len;
+      off_t off = ((off_t) i) << lc->chunk_shift;
+      off_t len = chunk_size;
 
-      it_len = strlen (it) + 1;
+      if (lazy_copyup_chunk_copied (lc, i))
+        continue;
 
-      if (can_access_xattr (it))
-        {
-          it += it_len;
-          ret += it_len;
-        }
-      else
-        {
-          char *next = it + it_len;
+      if (off + len > lc->size)
+        len = lc->size - off;
 
-          memmove (it, next, buf + len - next);
-          len -= it_len;
-        }
+      if (copy_file_data (NULL, lc->sfd, lc->dfd, off, len) < 0)
+        return -1;
+      copied = true;
+
+      lazy_copyup_bitmap (lc)[i / 8] |= 1 << (i % 8);
+      lc->n_copied++;
+      lc->n_unsaved++;
     }
 
+  if (copied && futimens (lc->dfd, lc->times) < 0)
+    return -1;
+
+  if (lc->n_copied == lc->n_chunks)
+    return lazy_copyup_done (lc);
+
+  return 0;
+}
+
+/* Make sure the data in [OFF, OFF + LEN) is present in the upper file.  */
+static int
+lazy_copyup_range (struct ovl_lazy_copyup *lc, off_t off, size_t len)
+{
+  int ret = 0;
+
+  if (lc == NULL || len == 0)
+    return 0;
+
+  pthread_mutex_lock (&lc->lock);
+  if (! lc->done && off < lc->size)
+    ret = lazy_copyup_chunks (lc, off >> lc->chunk_shift, (off + len - 1) >> lc->chunk_shift);
+  pthread_mutex_unlock (&lc->lock);
+
   return ret;
 }
 
-static void
-ovl_listxattr (fuse_req_t req, fuse_ino_t ino, size_t size)
+static int
+lazy_copyup_finish (struct ovl_lazy_copyup *lc)
 {
-  cleanup_lock int l = enter_big_lock ();
-  ssize_t len;
-  struct ovl_node *node;
-  struct ovl_data *lo = ovl_data (req);
-  cleanup_free char *buf = NULL;
-  int ret;
+  int ret = 0;
 
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_listxattr(ino=%" PRIu64 ", size=%zu)\n", ino, size);
+  if (lc == NULL)
+    return 0;
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
+  pthread_mutex_lock (&lc->lock);
+  if (! lc->done)
+    ret = lazy_copyup_chunks (lc, 0, lc->n_chunks);
+  pthread_mutex_unlock (&lc->lock);
 
-  if (lo->disable_xattrs)
-    {
-      fuse_reply_err (req, ENOSYS);
-      return;
-    }
+  return ret;
+}
 
-  node = do_lookup_file (req, lo, ino, NULL);
-  if (node == NULL)
-    {
-      fuse_reply_err (req, ENOENT);
-      return;
-    }
+/* Called before the file is truncated to SIZE.  Only the chunk at the
+   new end of the file is still needed, the following ones are dropped.  */
+static int
+lazy_copyup_truncate (struct ovl_lazy_copyup *lc, off_t size)
+{
+  int ret = 0;
 
-  if (size > 0)
+  if (lc == NULL)
+    return 0;
+
+  pthread_mutex_lock (&lc->lock);
+  if (! lc->done && size < lc->size)
     {
-      buf = malloc (size);
-      if (buf == NULL)
+      size_t n = lazy_copyup_n_chunks (size, lc->chunk_shift);
+      size_t i;
+
+      if (size & ((((off_t) 1) << lc->chunk_shift) - 1))
+        ret = lazy_copyup_chunks (lc, n - 1, n - 1);
+
+      if (ret == 0 && ! lc->done)
         {
-          fuse_reply_err (req, errno);
-          return;
+          for (i = n; i < lc->n_chunks; i++)
+            if (lazy_copyup_chunk_copied (lc, i))
+              lc->n_copied--;
+
+          lc->size = size;
+          lc->n_chunks = n;
+          lc->data_len = sizeof (struct lazy_copyup_header) + (n + 7) / 8;
+          lazy_copyup_header (lc)->size = size;
+          lc->n_unsaved++;
+
+          if (lc->n_copied == lc->n_chunks)
+            ret = lazy_copyup_done (lc);
+          else
+            ret = lazy_copyup_save (lc);
         }
     }
+  pthread_mutex_unlock (&lc->lock);
 
-  if (! node->hidden)
-    ret = node->layer->ds->listxattr (node->layer, node->path, buf, size);
-  else
-    {
-      char path[PATH_MAX];
-      strconcat3 (path, PATH_MAX, lo->workdir, "/", node->path);
-      ret = listxattr (path, buf, size);
-    }
-  if (ret < 0)
-    {
-      fuse_reply_err (req, errno);
-      return;
-    }
+  return ret;
+}
 
-  len = filter_xattrs_list (buf, ret);
+/* Called before an fsync on the file.  */
+static int
+lazy_copyup_sync (struct ovl_lazy_copyup *lc)
+{
+  int ret;
 
-  if (size == 0)
-    fuse_reply_xattr (req, len);
-  else if (len <= size)
-    fuse_reply_buf (req, buf, len);
+  if (lc == NULL)
+    return 0;
+
+  pthread_mutex_lock (&lc->lock);
+  ret = lazy_copyup_save (lc);
+  pthread_mutex_unlock (&lc->lock);
+
+  return ret;
 }
 
+/* The times of the file were changed by a write or a setattr, keep them
+   when copying the next chunks.  */
 static void
-ovl_getxattr (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+lazy_copyup_update_times (struct ovl_lazy_copyup *lc)
 {
-  cleanup_lock int l = enter_big_lock ();
-  ssize_t len;
-  struct ovl_node *node;
-  struct ovl_data *lo = ovl_data (req);
-  cleanup_free char *buf = NULL;
-  int ret;
-
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_getxattr(ino=%" PRIu64 ", name=%s, size=%zu)\n", ino, name, size);
+  struct stat st;
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
+  if (lc == NULL)
+    return;
 
-  if (lo->disable_xattrs)
+  pthread_mutex_lock (&lc->lock);
+  if (! lc->done && fstat (lc->dfd, &st) == 0)
     {
-      fuse_reply_err (req, ENOSYS);
-      return;
+      lc->times[0] = st.st_atim;
+      lc->times[1] = st.st_mtim;
     }
+  pthread_mutex_unlock (&lc->lock);
+}
 
-  if (! can_access_xattr (name))
-    {
-      fuse_reply_err (req, ENODATA);
-      return;
-    }
+static pthread_mutex_t lazy_copyup_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazy_copyup_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct ovl_lazy_copyup *lazy_copyup_queue;
+static bool lazy_copyup_thread_running;
 
-  node = do_lookup_file (req, lo, ino, NULL);
-  if (node == NULL || node->whiteout)
+static void *
+lazy_copyup_thread (void *arg)
+{
+  for (;;)
     {
-      fuse_reply_err (req, ENOENT);
-      return;
-    }
+      struct ovl_lazy_copyup *lc;
+      size_t i = 0;
 
-  if (size > 0)
-    {
-      buf = malloc (size);
-      if (buf == NULL)
+      pthread_mutex_lock (&lazy_copyup_queue_lock);
+      while (lazy_copyup_queue == NULL)
+        pthread_cond_wait (&lazy_copyup_queue_cond, &lazy_copyup_queue_lock);
+      lc = lazy_copyup_queue;
+      lazy_copyup_queue = lc->next_queued;
+      pthread_mutex_unlock (&lazy_copyup_queue_lock);
+
+      pthread_mutex_lock (&lc->lock);
+      while (! lc->done)
         {
-          fuse_reply_err (req, errno);
-          return;
-        }
-    }
+          struct stat st;
 
-  if (! node->hidden)
-    ret = node->layer->ds->getxattr (node->layer, node->path, name, buf, size);
-  else
-    {
-      char path[PATH_MAX];
-      strconcat3 (path, PATH_MAX, lo->workdir, "/", node->path);
-      ret = getxattr (path, name, buf, size);
-    }
+          while (i < lc->n_chunks && lazy_copyup_chunk_copied (lc, i))
+            i++;
 
-  if (ret < 0)
-    {
-      fuse_reply_err (req, errno);
-      return;
-    }
+          /* Copy one chunk at a time, so that readers and writers wait at
+             most for one chunk.  */
+          if (lazy_copyup_chunks (lc, i, i) < 0)
+            {
+              fprintf (stderr, "lazy copy-up of inode %llu failed: %s\n",
+                       (unsigned long long) lc->ino, strerror (errno));
+              break;
+            }
+
+          if (lc->done || lc->n_unsaved < LAZY_COPYUP_SAVE_INTERVAL)
+            continue;
+
+          /* Stop if the file was deleted.  */
+          if (fstat (lc->dfd, &st) == 0 && st.st_nlink == 0)
+            {
+              char marker[32];
+
+              lazy_copyup_marker_name (marker, sizeof (marker), lc->ino);
+              unlinkat (lc->markers_fd, marker, 0);
+              break;
+            }
+
+          lazy_copyup_save (lc);
 
-  len = ret;
+          pthread_mutex_unlock (&lc->lock);
+          sched_yield ();
+          pthread_mutex_lock (&lc->lock);
+        }
+      pthread_mutex_unlock (&lc->lock);
 
-  if (size == 0)
-    fuse_reply_xattr (req, len);
-  else
-    fuse_reply_buf (req, buf, len);
+      lazy_copyup_unref (lc);
+    }
+
+  return NULL;
 }
 
+/* Complete the copy of LC in the background.  */
 static void
-ovl_access (fuse_req_t req, fuse_ino_t ino, int mask)
+lazy_copyup_schedule (struct ovl_lazy_copyup *lc)
 {
-  cleanup_lock int l = enter_big_lock ();
-  struct ovl_data *lo = ovl_data (req);
-  struct ovl_node *n = do_lookup_file (req, lo, ino, NULL);
+  struct ovl_lazy_copyup **it;
 
-  if (UNLIKELY (ovl_debug (req)))
-    fprintf (stderr, "ovl_access(ino=%" PRIu64 ", mask=%d)\n",
-	     ino, mask);
+  pthread_mutex_lock (&lazy_copyup_queue_lock);
+  if (! lazy_copyup_thread_running)
+    {
+      pthread_t thread;
+      pthread_attr_t attr;
 
-  if (0 == checkSandbox(req->ctx.pid)) {
-      fuse_reply_err (req, 1);
-      return;
-  }
-  if ((mask & n->ino->mode) == mask)
-    fuse_reply_err (req, 0);
-  else
-    fuse_reply_err (req, EPERM);
+      pthread_attr_init (&attr);
+      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+      if (pthread_create (&thread, &attr, lazy_copyup_thread, NULL) == 0)
+        lazy_copyup_thread_running = true;
+      pthread_attr_destroy (&attr);
+    }
+  if (lazy_copyup_thread_running)
+    {
+      for (it = &lazy_copyup_queue; *it; it = &(*it)->next_queued)
+        ;
+      lc->next_queued = NULL;
+      *it = lazy_copyup_ref (lc);
+      pthread_cond_signal (&lazy_copyup_queue_cond);
+    }
+  pthread_mutex_unlock (&lazy_copyup_queue_lock);
 }
 
-static int
-copy_xattr (int sfd, int dfd, char *buf, size_t buf_size)
+/* Prepare the lazy copy-up of SFD to DFD, the temporary file in the
+   workdir that is going to be renamed to the upper file.  */
+static struct ovl_lazy_copyup *
+lazy_copyup_start (struct ovl_data *lo, int sfd, int dfd, const struct stat *st)
 {
-  ssize_t xattr_len;
+  struct lazy_copyup_header h = { .version = 1, .lower_size = st->st_size, .size = st->st_size };
+  struct ovl_lazy_copyup *lc;
+  cleanup_close int marker_fd = -1;
+  cleanup_close int lsfd = -1;
+  cleanup_close int ldfd = -1;
+  struct stat dst;
+  char marker[32];
 
-  xattr_len = flistxattr (sfd, buf, buf_size);
-  if (xattr_len > 0)
-    {
-      char *it;
-      for (it = buf; it - buf < xattr_len; it += strlen (it) + 1)
-        {
-          cleanup_free char *v = NULL;
-          ssize_t s;
+  h.chunk_shift = LAZY_COPYUP_MIN_CHUNK_SHIFT;
+  while ((st->st_size >> h.chunk_shift) >= LAZY_COPYUP_MAX_CHUNKS)
+    h.chunk_shift++;
 
-          if (! can_access_xattr (it))
-            continue;
+  if (fstat (dfd, &dst) < 0)
+    return NULL;
 
-          s = safe_read_xattr (&v, sfd, it, 256);
-          if (s < 0)
-            return -1;
+  if (ftruncate (dfd, st->st_size) < 0)
+    return NULL;
 
-          if (fsetxattr (dfd, it, v, s, 0) < 0)
-            {
-              if (errno == EINVAL || errno == EOPNOTSUPP)
-                continue;
-              return -1;
-            }
-        }
-    }
-  return 0;
+  lsfd = dup (sfd);
+  if (lsfd < 0)
+    return NULL;
+
+  ldfd = dup (dfd);
+  if (ldfd < 0)
+    return NULL;
+
+  lc = make_lazy_copyup (lo, lsfd, ldfd, dst.st_ino, &h);
+  if (lc == NULL)
+    return NULL;
+  lsfd = ldfd = -1;
+
+  lc->n_unsaved = 1;
+  if (lazy_copyup_save (lc) < 0)
+    goto fail;
+
+  lazy_copyup_marker_name (marker, sizeof (marker), lc->ino);
+  marker_fd = openat (lo->lazy_copyup_fd, marker, O_CREAT|O_WRONLY|O_CLOEXEC, 0600);
+  if (marker_fd < 0)
+    goto fail;
+
+  return lc;
+
+ fail:
+  lazy_copyup_unref (lc);
+  return NULL;
 }
 
 static int
-empty_dirfd (int fd)
+compare_inos (const void *a, const void *b)
 {
-  cleanup_dir DIR *dp = NULL;
-  struct dirent *dent;
+  ino_t ia = *(const ino_t *) a, ib = *(const ino_t *) b;
 
-  dp = fdopendir (fd);
-  if (dp == NULL)
+  return ia < ib ? -1 : ia > ib;
+}
+
+/* Store in LO the markers left in the lazy-copyup directory by a
+   previous mount.  */
+static void
+load_lazy_copyup_leftovers (struct ovl_data *lo)
+{
+  size_t allocated = 0;
+  struct dirent *de;
+  DIR *dir;
+  int fd;
+
+  fd = dup (lo->lazy_copyup_fd);
+  if (fd < 0)
+    return;
+
+  dir = fdopendir (fd);
+  if (dir == NULL)
     {
       close (fd);
-      return -1;
+      return;
     }
 
-  for (;;)
+  while ((de = readdir (dir)))
     {
-      int ret;
+      unsigned long long ino;
+      char *end;
 
       errno = 0;
-      dent = readdir (dp);
-      if (dent == NULL)
-        {
-          if (errno)
-            return -1;
-
-          break;
-        }
-      if (strcmp (dent->d_name, ".") == 0)
-        continue;
-      if (strcmp (dent->d_name, "..") == 0)
+      ino = strtoull (de->d_name, &end, 10);
+      if (errno || end == de->d_name || *end != '\0')
         continue;
 
-      ret = unlinkat (dirfd (dp), dent->d_name, 0);
-      if (ret < 0 && errno == EISDIR)
+      if (lo->n_lazy_copyup_leftovers == allocated)
         {
-          ret = unlinkat (dirfd (dp), dent->d_name, AT_REMOVEDIR);
-          if (ret < 0 && errno == ENOTEMPTY)
-            {
-              int dfd;
-
-              dfd = safe_openat (dirfd (dp), dent->d_name, O_DIRECTORY, 0);
-              if (dfd < 0)
-                return -1;
-
-              ret = empty_dirfd (dfd);
-              if (ret < 0)
-                return -1;
-
-              ret = unlinkat (dirfd (dp), dent->d_name, AT_REMOVEDIR);
-              if (ret < 0)
-                return -1;
+          ino_t *new;
 
-              continue;
-            }
+          allocated = allocated ? allocated * 2 : 16;
+          new = realloc (lo->lazy_copyup_leftovers, allocated * sizeof (*new));
+          if (new == NULL)
+            break;
+          lo->lazy_copyup_leftovers = new;
         }
-      if (ret < 0)
-        return ret;
+      lo->lazy_copyup_leftovers[lo->n_lazy_copyup_leftovers++] = ino;
     }
+  closedir (dir);
 
-  return 0;
+  qsort (lo->lazy_copyup_leftovers, lo->n_lazy_copyup_leftovers, sizeof (ino_t), compare_inos);
+  lo->lazy_copyup_pending = lo->n_lazy_copyup_leftovers > 0;
 }
 
-static int create_node_directory (struct ovl_data *lo, struct ovl_node *src);
-
-static int
-create_directory (struct ovl_data *lo, int dirfd, const char *name, const struct timespec *times,
-                  struct ovl_node *parent, int xattr_sfd, uid_t uid, gid_t gid, mode_t mode, bool set_opaque, struct stat *st_out)
+static bool
+lazy_copyup_is_leftover (struct ovl_data *lo, ino_t ino)
 {
-  int ret;
-  int saved_errno;
-  cleanup_close int dfd = -1;
-  cleanup_free char *buf = NULL;
-  char wd_tmp_file_name[32];
-  bool need_rename;
+  bool ret;
 
-  if (lo->xattr_permissions)
-    mode |= 0755;
+  pthread_mutex_lock (&lazy_copyups_lock);
+  ret = bsearch (&ino, lo->lazy_copyup_leftovers, lo->n_lazy_copyup_leftovers, sizeof (ino_t), compare_inos) != NULL;
+  pthread_mutex_unlock (&lazy_copyups_lock);
+  return ret;
+}
 
-  need_rename = set_opaque || times || xattr_sfd >= 0 || uid != lo->uid || gid != lo->gid;
-  if (!need_rename)
+/* The marker of INO was resumed or removed.  */
+static void
+lazy_copyup_forget_leftover (struct ovl_data *lo, ino_t ino)
+{
+  ino_t *it;
+
+  pthread_mutex_lock (&lazy_copyups_lock);
+  it = bsearch (&ino, lo->lazy_copyup_leftovers, lo->n_lazy_copyup_leftovers, sizeof (ino_t), compare_inos);
+  if (it)
     {
-      /* mkdir can be used directly without a temporary directory in the working directory.  */
-      ret = mkdirat (dirfd, name, mode);
-      if (ret < 0)
+      memmove (it, it + 1, (lo->lazy_copyup_leftovers + lo->n_lazy_copyup_leftovers - (it + 1)) * sizeof (ino_t));
+      if (--lo->n_lazy_copyup_leftovers == 0)
         {
-          if (errno == EEXIST)
-            {
-              unlinkat (dirfd, name, 0);
-              ret = mkdirat (dirfd, name, mode);
-            }
-          if (ret < 0)
-            return ret;
+          free (lo->lazy_copyup_leftovers);
+          lo->lazy_copyup_leftovers = NULL;
+          __atomic_store_n (&lo->lazy_copyup_pending, false, __ATOMIC_RELAXED);
         }
-      if (st_out)
-        return fstatat (dirfd, name, st_out, AT_SYMLINK_NOFOLLOW);
-      return 0;
     }
+  pthread_mutex_unlock (&lazy_copyups_lock);
+}
 
-  sprintf (wd_tmp_file_name, "%lu", get_next_wd_counter ());
-
-  ret = mkdirat (lo->workdir_fd, wd_tmp_file_name, mode);
-  if (ret < 0)
-    goto out;
+/* FD is the upper file of NODE and ST its stat.  Resume the lazy
+   copy-up interrupted in a previous mount, if there is one.  */
+static int
+lazy_copyup_resume (struct ovl_data *lo, struct ovl_node *node, int fd,
+                    const struct stat *st, struct ovl_lazy_copyup **ret)
+{
+  cleanup_free char *origin = NULL;
+  cleanup_free char *data = NULL;
+  cleanup_close int sfd = -1;
+  cleanup_close int dfd = -1;
+  struct lazy_copyup_header *h;
+  struct ovl_lazy_copyup *lc;
+  struct ovl_layer *it;
+  char marker[32];
+  size_t i;
+  ssize_t s;
+  char node_buf[PATH_MAX];
+  const char *path;
 
-  ret = dfd = TEMP_FAILURE_RETRY (safe_openat (lo->workdir_fd, wd_tmp_file_name, O_RDONLY, 0));
-  if (ret < 0)
-    goto out;
+  *ret = NULL;
 
-  if (uid != lo->uid || gid != lo->gid || get_upper_layer (lo)->stat_override_mode != STAT_OVERRIDE_NONE)
-    {
-      ret = do_fchown (lo, dfd, uid, gid, mode);
-      if (ret < 0)
-        goto out;
-    }
+  lazy_copyup_marker_name (marker, sizeof (marker), st->st_ino);
+  if (faccessat (lo->lazy_copyup_fd, marker, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+    return 0;
 
-  if (times)
+  s = safe_read_xattr (&data, fd, LAZY_COPYUP_XATTR, sizeof (*h) + LAZY_COPYUP_MAX_CHUNKS / 8);
+  if (s < 0 && errno == ENODATA)
     {
-      ret = futimens (dfd, times);
-      if (ret < 0)
-        goto out;
+      /* The copy was completed.  */
+      unlinkat (lo->lazy_copyup_fd, marker, 0);
+      return 0;
     }
 
-  if (ret == 0 && xattr_sfd >= 0)
-    {
-      const size_t buf_size = 1 << 20;
-      buf = malloc (buf_size);
-      if (buf == NULL)
-        {
-          ret = -1;
-          goto out;
-        }
+  h = (struct lazy_copyup_header *) data;
+  if (s < (ssize_t) sizeof (*h) || h->version != 1
+      || h->chunk_shift < LAZY_COPYUP_MIN_CHUNK_SHIFT || h->chunk_shift > 40
+      || (size_t) s != sizeof (*h) + (lazy_copyup_n_chunks (h->size, h->chunk_shift) + 7) / 8)
+    goto fail;
 
-      ret = copy_xattr (xattr_sfd, dfd, buf, buf_size);
-      if (ret < 0)
-        goto out;
-    }
+  if (safe_read_xattr (&origin, fd, ORIGIN_XATTR, PATH_MAX) <= 0)
+    goto fail;
 
-  if (set_opaque)
+  for (it = get_lower_layers (lo); it; it = it->next)
     {
-      ret = set_fd_opaque (dfd);
-      if (ret < 0)
-        goto out;
-    }
+      struct stat sst;
 
-  if (st_out)
-    {
-      ret = fstat (dfd, st_out);
-      if (ret < 0)
-        goto out;
+      sfd = it->ds->openat (it, origin, O_RDONLY|O_NONBLOCK|O_NOFOLLOW, 0);
+      if (sfd < 0)
+        continue;
+      if (it->ds->fstat (it, sfd, origin, STATX_TYPE|STATX_SIZE, &sst) == 0
+          && S_ISREG (sst.st_mode) && sst.st_size == (off_t) h->lower_size)
+        break;
+      close (sfd);
+      sfd = -1;
     }
+  if (sfd < 0)
+    goto fail;
 
-  ret = renameat (lo->workdir_fd, wd_tmp_file_name, dirfd, name);
-  if (ret < 0)
-    {
-      if (errno == EEXIST)
-        {
-          int dfd = -1;
-
-          ret = direct_renameat2 (lo->workdir_fd, wd_tmp_file_name, dirfd, name, RENAME_EXCHANGE);
-          if (ret < 0)
-            goto out;
+  path = node_path (node, node_buf);
+  if (path == NULL)
+    return -1;
 
-          dfd = TEMP_FAILURE_RETRY (safe_openat (lo->workdir_fd, wd_tmp_file_name, O_DIRECTORY, 0));
-          if (dfd < 0)
-            return -1;
+  dfd = safe_openat (get_upper_layer (lo)->fd, path, O_WRONLY|O_NONBLOCK|O_NOFOLLOW, 0);
+  if (dfd < 0)
+    return -1;
 
-          ret = empty_dirfd (dfd);
-          if (ret < 0)
-            goto out;
+  lc = make_lazy_copyup (lo, sfd, dfd, st->st_ino, h);
+  if (lc == NULL)
+    return -1;
+  sfd = dfd = -1;
 
-          return unlinkat (lo->workdir_fd, wd_tmp_file_name, AT_REMOVEDIR);
-        }
-      if (errno == ENOTDIR)
-        unlinkat (dirfd, name, 0);
-      if (errno == ENOENT && parent)
-        {
-          ret = create_node_directory (lo, parent);
-          if (ret != 0)
-            goto out;
-        }
+  memcpy (lc->data, data, s);
+  for (i = 0; i < lc->n_chunks; i++)
+    if (lazy_copyup_chunk_copied (lc, i))
+      lc->n_copied++;
 
-      ret = renameat (lo->workdir_fd, wd_tmp_file_name, dirfd, name);
-    }
-out:
-  saved_errno = errno;
-  if (ret < 0)
-      unlinkat (lo->workdir_fd, wd_tmp_file_name, AT_REMOVEDIR);
-  errno = saved_errno;
+  *ret = lc;
+  return 0;
 
-  return ret;
+ fail:
+  fprintf (stderr, "cannot complete the lazy copy-up of %s\n", node_path (node, node_buf) ?: node->name);
+  errno = EIO;
+  return -1;
 }
 
+/* Store in RET a reference to the lazy copy-up state of the file NODE
+   opened as FD, or NULL if its data is complete.  Must be called with
+   the big lock held.  */
 static int
-create_node_directory (struct ovl_data *lo, struct ovl_node *src)
+lazy_copyup_get (struct ovl_data *lo, struct ovl_node *node, int fd, struct ovl_lazy_copyup **ret)
 {
-  int ret;
+  struct ovl_ino *ino = node->ino;
+  struct ovl_lazy_copyup *lc;
+  bool any;
   struct stat st;
-  cleanup_close int sfd = -1;
-  struct timespec times[2];
 
-  if (src == NULL)
-    return 0;
+  *ret = NULL;
 
-  if (src->layer == get_upper_layer (lo))
+  if (ino->lazy)
+    {
+      if (! lazy_copyup_is_done (ino->lazy))
+        {
+          *ret = lazy_copyup_ref (ino->lazy);
+          return 0;
+        }
+      lazy_copyup_unref (ino->lazy);
+      ino->lazy = NULL;
+      return 0;
+    }
+
+  if (ino->lazy_checked || ino->metacopy_layer || node->layer != get_upper_layer (lo) || ! S_ISREG (ino->mode))
     return 0;
 
-  ret = sfd = src->layer->ds->openat (src->layer, src->path, O_RDONLY|O_NONBLOCK, 0755);
-  if (ret < 0)
-    return ret;
+  pthread_mutex_lock (&lazy_copyups_lock);
+  any = lazy_copyups != NULL;
+  pthread_mutex_unlock (&lazy_copyups_lock);
 
-  ret = TEMP_FAILURE_RETRY (fstat (sfd, &st));
-  if (ret < 0)
-    return ret;
+  if (! any && ! __atomic_load_n (&lo->lazy_copyup_pending, __ATOMIC_RELAXED))
+    return 0;
 
-  times[0] = st.st_atim;
-  times[1] = st.st_mtim;
+  if (fstat (fd, &st) < 0)
+    return -1;
 
-  ret = create_directory (lo, get_upper_layer (lo)->fd, src->path, times, src->parent, sfd, st.st_uid, st.st_gid, st.st_mode, false, NULL);
-  if (ret == 0)
+  lc = lazy_copyup_find (st.st_ino);
+  if (lc == NULL && ! node->hidden && lazy_copyup_is_leftover (lo, st.st_ino))
     {
-      src->layer = get_upper_layer (lo);
-
-      if (src->parent)
-        delete_whiteout (lo, -1, src->parent, src->name);
+      if (lazy_copyup_resume (lo, node, fd, &st, &lc) < 0)
+        return -1;
+      lazy_copyup_forget_leftover (lo, st.st_ino);
+      if (lc)
+        {
+          lazy_copyup_register (lc);
+          lazy_copyup_schedule (lc);
+        }
     }
 
-  return ret;
+  ino->lazy_checked = true;
+  ino->lazy = lc;
+  *ret = lazy_copyup_ref (lc);
+  return 0;
 }
 
-static int
-copy_fd_to_fd (int sfd, int dfd, char *buf, size_t buf_size)
+static bool
+directory_has_entries (int dirfd)
 {
-  int ret;
+  struct dirent *de;
+  bool ret = false;
+  DIR *dir;
+  int fd;
 
-  for (;;)
-    {
-      int written;
-      int nread;
+  fd = dup (dirfd);
+  if (fd < 0)
+    return false;
 
-      nread = TEMP_FAILURE_RETRY (read (sfd, buf, buf_size));
-      if (nread < 0)
-        return nread;
+  dir = fdopendir (fd);
+  if (dir == NULL)
+    {
+      close (fd);
+      return false;
+    }
 
-      if (nread == 0)
+  while ((de = readdir (dir)))
+    if (strcmp (de->d_name, ".") && strcmp (de->d_name, ".."))
+      {
+        ret = true;
         break;
+      }
 
-      written = 0;
-      do
-        {
-          ret = TEMP_FAILURE_RETRY (write (dfd, buf + written, nread));
-          if (ret < 0)
-            return ret;
-          nread -= ret;
-          written += ret;
-        }
-      while (nread);
-    }
-  return 0;
+  closedir (dir);
+  return ret;
 }
 
 static int
@@ -3250,17 +6626,29 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
   cleanup_close int dfd = -1;
   cleanup_close int sfd = -1;
   struct stat st;
-  const size_t buf_size = 1 << 20;
-  cleanup_free char *buf = NULL;
+  char *buf;
   struct timespec times[2];
   char wd_tmp_file_name[32];
   static bool support_reflinks = true;
   bool data_copied = false;
+  struct ovl_lazy_copyup *lc = NULL;
+  struct ovl_layer *lower = node->layer;
+  bool metacopy = false;
   mode_t mode;
+  char node_buf[PATH_MAX];
+  char parent_buf[PATH_MAX];
+  char src_buf[PATH_MAX];
+  const char *src_path, *dst_path;
+  uint64_t start = ovl_stats_now ();
 
   sprintf (wd_tmp_file_name, "%lu", get_next_wd_counter ());
 
-  ret = node->layer->ds->statat (node->layer, node->path, &st, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS);
+  src_path = node_layer_path (node, src_buf);
+  dst_path = node_path (node, node_buf);
+  if (src_path == NULL || dst_path == NULL)
+    return -1;
+
+  ret = node->layer->ds->statat (node->layer, src_path, &st, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS);
   if (ret < 0)
     return ret;
 
@@ -3294,7 +6682,7 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
         {
           char *new;
 
-          ret = node->layer->ds->readlinkat (node->layer, node->path, p, current_size - 1);
+          ret = node->layer->ds->readlinkat (node->layer, src_path, p, current_size - 1);
           if (ret < 0)
             goto exit;
           if (ret < current_size - 1)
@@ -3307,13 +6695,13 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
           p = new;
         }
       p[ret] = '\0';
-      ret = symlinkat (p, get_upper_layer (lo)->fd, node->path);
+      ret = symlinkat (p, get_upper_layer (lo)->fd, dst_path);
       if (ret < 0)
         goto exit;
       goto success;
     }
 
-  ret = sfd = node->layer->ds->openat (node->layer, node->path, O_RDONLY|O_NONBLOCK, 0);
+  ret = sfd = node->layer->ds->openat (node->layer, src_path, O_RDONLY|O_NONBLOCK, 0);
   if (sfd < 0)
     goto exit;
 
@@ -3328,11 +6716,19 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
         goto exit;
     }
 
-  buf = malloc (buf_size);
+  buf = thread_buffer ();
   if (buf == NULL)
     goto exit;
 
-  if (support_reflinks)
+  if (lo->metacopy)
+    {
+      ret = ftruncate (dfd, st.st_size);
+      if (ret < 0)
+        goto exit;
+      data_copied = metacopy = true;
+    }
+
+  if (! data_copied && support_reflinks)
     {
       if (ioctl (dfd, FICLONE, sfd) >= 0)
         data_copied = true;
@@ -3343,32 +6739,20 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
         }
     }
 
-#ifdef HAVE_SYS_SENDFILE_H
-  if (! data_copied)
+  if (! data_copied && lo->lazy_copyup && lo->lazy_copyup_fd >= 0 && st.st_size >= LAZY_COPYUP_MIN_SIZE)
     {
-      off_t copied = 0;
-
-      while (copied < st.st_size)
-        {
-          off_t tocopy = st.st_size - copied;
-          ssize_t n = TEMP_FAILURE_RETRY (sendfile (dfd, sfd, NULL, tocopy > SIZE_MAX ? SIZE_MAX : (size_t) tocopy));
-          if (n < 0)
-            {
-              /* On failure, fallback to the read/write loop.  */
-              ret = copy_fd_to_fd (sfd, dfd, buf, buf_size);
-              if (ret < 0)
-                goto exit;
-              break;
-            }
-          copied += n;
-	}
-      data_copied = true;
+      lc = lazy_copyup_start (lo, sfd, dfd, &st);
+      if (lc)
+        data_copied = true;
     }
-#endif
 
   if (! data_copied)
     {
-      ret = copy_fd_to_fd (sfd, dfd, buf, buf_size);
+      ret = ftruncate (dfd, st.st_size);
+      if (ret < 0)
+        goto exit;
+
+      ret = copy_file_data (lo->copyup_pool, sfd, dfd, 0, st.st_size);
       if (ret < 0)
         goto exit;
     }
@@ -3378,25 +6762,50 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
   ret = futimens (dfd, times);
   if (ret < 0)
     goto exit;
+  if (lc)
+    {
+      lc->times[0] = times[0];
+      lc->times[1] = times[1];
+    }
 
-  ret = copy_xattr (sfd, dfd, buf, buf_size);
+  ret = copy_xattr (sfd, dfd, buf, THREAD_BUFFER_SIZE);
   if (ret < 0)
     goto exit;
 
-  ret = set_fd_origin (dfd, node->path);
+  ret = set_fd_origin (dfd, src_path);
   if (ret < 0)
     goto exit;
 
+  if (metacopy && fsetxattr (dfd, METACOPY_XATTR, "", 0, 0) < 0)
+    {
+      /* Without xattrs the data cannot be found later, copy it now.  */
+      ret = -1;
+      if (errno != ENOTSUP)
+        goto exit;
+      ret = copy_file_data (lo->copyup_pool, sfd, dfd, 0, st.st_size);
+      if (ret < 0)
+        goto exit;
+      ret = futimens (dfd, times);
+      if (ret < 0)
+        goto exit;
+      metacopy = false;
+    }
+
   /* Finally, move the file to its destination.  */
-  ret = renameat (lo->workdir_fd, wd_tmp_file_name, get_upper_layer (lo)->fd, node->path);
+  ret = renameat (lo->workdir_fd, wd_tmp_file_name, get_upper_layer (lo)->fd, dst_path);
   if (ret < 0)
     goto exit;
 
   if (node->parent)
     {
       char whpath[PATH_MAX];
+      const char *ppath = node_path (node->parent, parent_buf);
+
+      ret = -1;
+      if (ppath == NULL)
+        goto exit;
 
-      strconcat3 (whpath, PATH_MAX, node->parent->path, "/.wh.", node->name);
+      strconcat3 (whpath, PATH_MAX, ppath, "/.wh.", node->name);
 
       if (unlinkat (get_upper_layer (lo)->fd, whpath, 0) < 0 && errno != ENOENT)
         goto exit;
@@ -3407,10 +6816,44 @@ copyup (struct ovl_data *lo, struct ovl_node *node)
 
   node->layer = get_upper_layer (lo);
 
+  ovl_stats_add (OVL_STAT_copyup, 1);
+  ovl_stats_add (OVL_STAT_copyup_ns, ovl_stats_now () - start);
+  if ((st.st_mode & S_IFMT) == S_IFREG && ! metacopy && lc == NULL)
+    ovl_stats_add (OVL_STAT_copyup_bytes, st.st_size);
+
+  if (metacopy && node->ino && node->ino != &dummy_ino)
+    {
+      node->ino->metacopy_path = strdup (src_path);
+      if (node->ino->metacopy_path)
+        {
+          node->ino->metacopy_layer = lower;
+          node->ino->metacopy_checked = true;
+        }
+    }
+
+  if (lc)
+    {
+      lazy_copyup_register (lc);
+      lazy_copyup_schedule (lc);
+      if (node->ino && node->ino != &dummy_ino)
+        node->ino->lazy = lc;
+      else
+        lazy_copyup_unref (lc);
+      lc = NULL;
+    }
+
  exit:
   saved_errno = errno;
   if (ret < 0)
     unlinkat (lo->workdir_fd, wd_tmp_file_name, 0);
+  if (lc)
+    {
+      char marker[32];
+
+      lazy_copyup_marker_name (marker, sizeof (marker), lc->ino);
+      unlinkat (lo->lazy_copyup_fd, marker, 0);
+      lazy_copyup_unref (lc);
+    }
   errno = saved_errno;
 
   return ret;
@@ -3439,16 +6882,180 @@ get_node_up (struct ovl_data *lo, struct ovl_node *node)
   return node;
 }
 
+/* Metadata only copy-up.  With metacopy=on, copyup creates the upper
+   file of a regular file as a sparse file with the metadata of the
+   lower file and the METACOPY_XATTR xattr, and the data keeps being
+   read from the lower file pointed to by the origin xattr.  The data is
+   copied by metacopy_complete before the file is written.  The option
+   only controls the creation of new copies: the existing ones are
+   always honored, their upper file has no data.  */
+
+/* Find the lower file with the data of NODE, if it is a metadata only
+   copy.  Must be called with the big lock held.  */
+static int
+metacopy_lookup (struct ovl_data *lo, struct ovl_node *node)
+{
+  struct ovl_layer *upper = get_upper_layer (lo);
+  struct ovl_ino *ino = node->ino;
+  char origin[PATH_MAX];
+  struct ovl_layer *it;
+  ssize_t s;
+  char node_buf[PATH_MAX];
+  const char *path;
+
+  if (ino->metacopy_checked || node->layer != upper || node->hidden)
+    return 0;
+
+  path = node_path (node, node_buf);
+  if (path == NULL)
+    return -1;
+
+  if (upper->ds->getxattr (upper, path, METACOPY_XATTR, NULL, 0) < 0)
+    {
+      if (errno != ENODATA && errno != ENOTSUP)
+        return -1;
+      ino->metacopy_checked = true;
+      return 0;
+    }
+
+  s = upper->ds->getxattr (upper, path, ORIGIN_XATTR, origin, sizeof (origin) - 1);
+  if (s <= 0)
+    goto fail;
+  origin[s] = '\0';
+
+  for (it = get_lower_layers (lo); it; it = it->next)
+    {
+      struct stat st;
+
+      if (it->ds->statat (it, origin, &st, AT_SYMLINK_NOFOLLOW, STATX_TYPE) == 0 && S_ISREG (st.st_mode))
+        break;
+    }
+  if (it == NULL)
+    goto fail;
+
+  ino->metacopy_path = strdup (origin);
+  if (ino->metacopy_path == NULL)
+    return -1;
+  ino->metacopy_layer = it;
+  ino->metacopy_checked = true;
+  return 0;
+
+ fail:
+  fprintf (stderr, "cannot find the lower file of the metacopy %s\n", path);
+  errno = EIO;
+  return -1;
+}
+
+/* Open the file with the data of NODE, for reading.  */
+static int
+node_data_openat (struct ovl_data *lo, struct ovl_node *node, int flags, mode_t mode)
+{
+  struct ovl_layer *l = node->layer;
+  char node_buf[PATH_MAX];
+  const char *path;
+
+  if (metacopy_lookup (lo, node) < 0)
+    return -1;
+
+  if (node->ino->metacopy_layer)
+    {
+      l = node->ino->metacopy_layer;
+      return l->ds->openat (l, node->ino->metacopy_path, flags, mode);
+    }
+
+  path = node_layer_path (node, node_buf);
+  if (path == NULL)
+    return -1;
+
+  return l->ds->openat (l, path, flags, mode);
+}
+
+/* Copy the data of NODE if it is a metadata only copy.  If DISCARD, the
+   file is going to be truncated and its data is not needed.  */
+static int
+metacopy_complete (struct ovl_data *lo, struct ovl_node *node, bool discard)
+{
+  struct ovl_ino *ino = node->ino;
+  cleanup_close int sfd = -1;
+  cleanup_close int dfd = -1;
+  char node_buf[PATH_MAX];
+  const char *path;
+
+  if (metacopy_lookup (lo, node) < 0)
+    return -1;
+
+  if (ino->metacopy_layer == NULL)
+    return 0;
+
+  path = node_path (node, node_buf);
+  if (path == NULL)
+    return -1;
+
+  dfd = TEMP_FAILURE_RETRY (safe_openat (get_upper_layer (lo)->fd, path, O_WRONLY|O_NONBLOCK|O_NOFOLLOW, 0));
+  if (dfd < 0)
+    return -1;
+
+  if (! discard)
+    {
+      struct ovl_layer *l = ino->metacopy_layer;
+      struct timespec times[2];
+      struct stat st;
+
+      sfd = l->ds->openat (l, ino->metacopy_path, O_RDONLY|O_NONBLOCK|O_NOFOLLOW, 0);
+      if (sfd < 0)
+        return -1;
+
+      if (fstat (dfd, &st) < 0)
+        return -1;
+
+      if (copy_file_data (lo->copyup_pool, sfd, dfd, 0, st.st_size) < 0)
+        return -1;
+
+      times[0] = st.st_atim;
+      times[1] = st.st_mtim;
+      if (futimens (dfd, times) < 0)
+        return -1;
+
+      /* The xattr must not go away before the data is stored.  */
+      if (lo->fsync && fdatasync (dfd) < 0)
+        return -1;
+    }
+
+  if (fremovexattr (dfd, METACOPY_XATTR) < 0 && errno != ENODATA)
+    return -1;
+
+  free (ino->metacopy_path);
+  ino->metacopy_path = NULL;
+  ino->metacopy_layer = NULL;
+  return 0;
+}
+
+/* Like get_node_up, and copy the data of NODE if it is not in the upper
+   file yet.  */
+static struct ovl_node *
+get_node_data_up (struct ovl_data *lo, struct ovl_node *node, bool discard)
+{
+  node = get_node_up (lo, node);
+  if (node == NULL)
+    return NULL;
+
+  if (metacopy_complete (lo, node, discard) < 0)
+    return NULL;
+
+  return node;
+}
+
 static size_t
 count_dir_entries (struct ovl_node *node, size_t *whiteouts)
 {
   size_t c = 0;
   struct ovl_node *it;
+  size_t pos;
 
   if (whiteouts)
     *whiteouts = 0;
 
-  for (it = hash_get_first (node->children); it; it = hash_get_next (node->children, it))
+  for (pos = 0; (it = otable_next (node->children, &pos));)
     {
       if (it->whiteout)
         {
@@ -3465,36 +7072,6 @@ count_dir_entries (struct ovl_node *node, size_t *whiteouts)
   return c;
 }
 
-static int
-update_paths (struct ovl_node *node)
-{
-  struct ovl_node *it;
-
-  if (node == NULL)
-    return 0;
-
-  if (node->parent)
-    {
-      free (node->path);
-      if (asprintf (&node->path, "%s/%s", node->parent->path, node->name) < 0)
-        {
-          node->path = NULL;
-          return -1;
-        }
-    }
-
-  if (node->children)
-    {
-      for (it = hash_get_first (node->children); it; it = hash_get_next (node->children, it))
-        {
-          if (update_paths (it) < 0)
-            return -1;
-        }
-    }
-
-  return 0;
-}
-
 static int
 empty_dir (struct ovl_layer *l, const char *path)
 {
@@ -3554,21 +7131,12 @@ do_rm (fuse_req_t req, fuse_ino_t parent, const char *name, bool dirp)
 
   if (node->layer == get_upper_layer (lo))
     {
+      /* A directory with whiteouts is moved to the workdir as it
+         is, and deleted by the reaper when the node is freed.  */
       if (! dirp)
         node->do_unlink = 1;
       else
-        {
-          if (whiteouts > 0)
-            {
-              if (empty_dir (get_upper_layer (lo), node->path) < 0)
-                {
-                  fuse_reply_err (req, errno);
-                  return;
-                }
-            }
-
-          node->do_rmdir = 1;
-        }
+        node->do_rmdir = 1;
     }
 
   pnode = do_lookup_file (req, lo, parent, NULL);
@@ -3597,7 +7165,7 @@ do_rm (fuse_req_t req, fuse_ino_t parent, const char *name, bool dirp)
 
   node_set_name (&key, (char *) name);
 
-  rm = hash_delete (pnode->children, &key);
+  rm = otable_delete (pnode->children, &key);
   if (rm)
     {
       ret = hide_node (lo, rm, true);
@@ -3669,6 +7237,7 @@ ovl_setxattr (fuse_req_t req, fuse_ino_t ino, const char *name,
   struct ovl_data *lo = ovl_data (req);
   struct ovl_node *node;
   int ret;
+  char node_buf[PATH_MAX];
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_setxattr(ino=%" PRIu64 ", name=%s, value=%s, size=%zu, flags=%d)\n", ino, name,
@@ -3705,8 +7274,16 @@ ovl_setxattr (fuse_req_t req, fuse_ino_t ino, const char *name,
       return;
     }
 
+  lower_cache_forget (node);
+
   if (! node->hidden)
-    ret = direct_setxattr (node->layer, node->path, name, value, size, flags);
+    {
+      const char *npath = node_path (node, node_buf);
+
+      ret = -1;
+      if (npath != NULL)
+        ret = direct_setxattr (node->layer, npath, name, value, size, flags);
+    }
   else
     {
       char path[PATH_MAX];
@@ -3747,6 +7324,7 @@ ovl_removexattr (fuse_req_t req, fuse_ino_t ino, const char *name)
   struct ovl_node *node;
   struct ovl_data *lo = ovl_data (req);
   int ret;
+  char node_buf[PATH_MAX];
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_removexattr(ino=%" PRIu64 ", name=%s)\n", ino, name);
@@ -3770,8 +7348,16 @@ ovl_removexattr (fuse_req_t req, fuse_ino_t ino, const char *name)
       return;
     }
 
+  lower_cache_forget (node);
+
   if (! node->hidden)
-    ret = direct_removexattr (node->layer, node->path, name);
+    {
+      const char *npath = node_path (node, node_buf);
+
+      ret = -1;
+      if (npath != NULL)
+        ret = direct_removexattr (node->layer, npath, name);
+    }
   else
     {
       char path[PATH_MAX];
@@ -3843,6 +7429,9 @@ ovl_do_open (fuse_req_t req, fuse_ino_t parent, const char *name, int flags, mod
   gid_t gid;
   bool need_delete_whiteout = true;
   bool is_whiteout = false;
+  char n_buf[PATH_MAX];
+  char p_buf[PATH_MAX];
+  const char *ppath;
 
   flags |= O_NOFOLLOW;
 
@@ -3914,7 +7503,10 @@ ovl_do_open (fuse_req_t req, fuse_ino_t parent, const char *name, int flags, mod
 
       sprintf (wd_tmp_file_name, "%lu", get_next_wd_counter ());
 
-      ret = asprintf (&path, "%s/%s", p->path, name);
+      ret = -1;
+      ppath = node_path (p, p_buf);
+      if (ppath != NULL)
+        ret = asprintf (&path, "%s/%s", ppath, name);
       if (ret < 0)
         return ret;
 
@@ -3956,41 +7548,171 @@ ovl_do_open (fuse_req_t req, fuse_ino_t parent, const char *name, int flags, mod
       return ret;
     }
 
-  /* readonly, we can use both lowerdir and upperdir.  */
-  if (readonly)
+  /* readonly, we can use both lowerdir and upperdir.  */
+  if (readonly)
+    {
+      if (retnode)
+        *retnode = n;
+      return node_data_openat (lo, n, flags, mode);
+    }
+  else
+    {
+      struct ovl_layer *l;
+
+      n = get_node_data_up (lo, n, (flags & O_TRUNC) != 0);
+      if (n == NULL)
+        return -1;
+
+      if (retnode)
+        *retnode = n;
+
+      l = n->layer;
+      ppath = node_layer_path (n, n_buf);
+      if (ppath == NULL)
+        return -1;
+
+      /* The data still to be copied in by a lazy copy-up must be dropped
+         before the file is truncated.  */
+      if ((flags & O_TRUNC) && lo->lazy_copyup_fd >= 0)
+        {
+          cleanup_lazy_copyup struct ovl_lazy_copyup *lc = NULL;
+
+          fd = l->ds->openat (l, ppath, O_RDONLY|O_NONBLOCK|O_NOFOLLOW, 0);
+          if (fd < 0)
+            return -1;
+          if (lazy_copyup_get (lo, n, fd, &lc) < 0)
+            return -1;
+          if (lazy_copyup_truncate (lc, 0) < 0)
+            return -1;
+        }
+
+      return l->ds->openat (l, ppath, flags, mode);
+    }
+}
+
+/* State of an open file, stored in fi->fh.  ovl_read and ovl_write_buf
+   only use what is stored here, so that the data path never needs the
+   big lock.  */
+struct ovl_file
+{
+  int fd;
+  /* The inode stays alive while the kernel has the file open.  Its
+     mode is read atomically to restore the setuid/setgid bits after a
+     writepage without looking it up.  */
+  struct ovl_ino *ino;
+  /* Whether the file holds a reference to ino->backing_id.  */
+  bool passthrough;
+  /* Set while the data of the file is being copied up lazily.  */
+  struct ovl_lazy_copyup *lazy;
+};
+
+static struct ovl_file *
+ovl_file (struct fuse_file_info *fi)
+{
+  return (struct ovl_file *) (uintptr_t) fi->fh;
+}
+
+static struct ovl_file *
+make_ovl_file (int fd, struct ovl_ino *ino)
+{
+  struct ovl_file *f;
+
+  f = malloc (sizeof (*f));
+  if (f == NULL)
+    return NULL;
+
+  f->fd = fd;
+  f->ino = ino;
+  f->passthrough = false;
+  f->lazy = NULL;
+  return f;
+}
+
+/* Let the kernel do the I/O for the open file F directly on its file
+   descriptor.  The kernel accepts a single backing file per inode and
+   refuses to mix passthrough and cached opens of the same inode, so the
+   backing file is shared by the open files of the inode and an open
+   that cannot use it, e.g. a read-only open of the lower file while the
+   upper file is open, falls back to direct I/O.  If the backing file
+   cannot be registered, the I/O keeps going through ovl_read and
+   ovl_write_buf.  Must be called with the big lock held.  */
+static void
+set_passthrough (fuse_req_t req, struct ovl_node *node, struct ovl_file *f, struct fuse_file_info *fi)
+{
+#if HAVE_FUSE_PASSTHROUGH
+  struct ovl_data *lo = ovl_data (req);
+  struct ovl_ino *ino = f->ino;
+  char node_buf[PATH_MAX];
+
+  /* The kernel would read the holes not copied in yet, or take the
+     lower file of a metadata only copy for the upper file.  */
+  if (! lo->passthrough || f->lazy || ino->metacopy_layer)
+    return;
+
+  if (ino->backing_refs > 0)
     {
-      struct ovl_layer *l = n->layer;
-      if (retnode)
-        *retnode = n;
-      return l->ds->openat (l, n->path, flags, mode);
+      if (ino->backing_layer != node->layer)
+        {
+          fi->direct_io = 1;
+          return;
+        }
     }
   else
     {
-      struct ovl_layer *l;
+      int backing_id = fuse_passthrough_open (req, f->fd);
+      if (backing_id <= 0)
+        {
+          if (UNLIKELY (ovl_debug (req)))
+            fprintf (stderr, "cannot register the passthrough backing file for %s\n", node_path (node, node_buf) ?: node->name);
+          return;
+        }
+      ino->backing_id = backing_id;
+      ino->backing_layer = node->layer;
+    }
 
-      n = get_node_up (lo, n);
-      if (n == NULL)
-        return -1;
+  ino->backing_refs++;
+  fi->backing_id = ino->backing_id;
+  fi->keep_cache = 0;
+  f->passthrough = true;
+#endif
+}
 
-      if (retnode)
-        *retnode = n;
+static void
+release_passthrough (fuse_req_t req, struct ovl_file *f)
+{
+#if HAVE_FUSE_PASSTHROUGH
+  cleanup_lock int l = 0;
+  struct ovl_ino *ino = f->ino;
 
-      l = n->layer;
+  if (! f->passthrough)
+    return;
 
-      return l->ds->openat (l, n->path, flags, mode);
+  l = enter_big_lock ();
+  if (--ino->backing_refs == 0)
+    {
+      fuse_passthrough_close (req, ino->backing_id);
+      ino->backing_id = 0;
+      ino->backing_layer = NULL;
     }
+#endif
 }
 
 static void
 ovl_read (fuse_req_t req, fuse_ino_t ino, size_t size,
 	 off_t offset, struct fuse_file_info *fi)
 {
+  struct ovl_file *f = ovl_file (fi);
   struct fuse_bufvec buf = FUSE_BUFVEC_INIT (size);
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_read(ino=%" PRIu64 ", size=%zd, "
 	     "off=%lu)\n", ino, size, (unsigned long) offset);
+  if (lazy_copyup_range (f->lazy, offset, size) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
   buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
-  buf.buf[0].fd = fi->fh;
+  buf.buf[0].fd = f->fd;
   buf.buf[0].pos = offset;
   fuse_reply_data (req, &buf, 0);
 }
@@ -4001,29 +7723,38 @@ ovl_write_buf (fuse_req_t req, fuse_ino_t ino,
 	      struct fuse_file_info *fi)
 {
   struct ovl_data *lo = ovl_data (req);
+  struct ovl_file *f = ovl_file (fi);
   ssize_t res;
-  struct ovl_ino *inode;
   int saved_errno;
   struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT (fuse_buf_size (in_buf));
 
   out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
-  out_buf.buf[0].fd = fi->fh;
+  out_buf.buf[0].fd = f->fd;
   out_buf.buf[0].pos = off;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_write_buf(ino=%" PRIu64 ", size=%zd, off=%lu, fd=%d)\n",
-	     ino, out_buf.buf[0].size, (unsigned long) off, (int) fi->fh);
+	     ino, out_buf.buf[0].size, (unsigned long) off, f->fd);
 
-  inode = lookup_inode (lo, ino);
+  if (lazy_copyup_range (f->lazy, off, out_buf.buf[0].size) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
 
   errno = 0;
   res = fuse_buf_copy (&out_buf, in_buf, 0);
   saved_errno = errno;
 
+  if (res > 0)
+    lazy_copyup_update_times (f->lazy);
+
   /* if it is a writepage request, make sure to restore the setuid bit.  */
-  if (fi->writepage && (inode->mode & (S_ISUID|S_ISGID)))
+  if (fi->writepage)
     {
-      if (do_fchmod (lo, fi->fh, inode->mode) < 0)
+      mode_t mode = __atomic_load_n (&f->ino->mode, __ATOMIC_RELAXED);
+
+      if ((mode & (S_ISUID|S_ISGID)) && do_fchmod (lo, f->fd, mode) < 0)
         {
           fuse_reply_err (req, errno);
           return;
@@ -4039,13 +7770,18 @@ ovl_write_buf (fuse_req_t req, fuse_ino_t ino,
 static void
 ovl_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+  struct ovl_file *f = ovl_file (fi);
   int ret;
   (void) ino;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_release(ino=%" PRIu64 ")\n", ino);
 
-  ret = close (fi->fh);
+  release_passthrough (req, f);
+  lazy_copyup_unref (f->lazy);
+
+  ret = close (f->fd);
+  free (f);
   fuse_reply_err (req, ret == 0 ? 0 : errno);
 }
 
@@ -4114,6 +7850,7 @@ ovl_create (fuse_req_t req, fuse_ino_t parent, const char *name,
   struct fuse_entry_param e;
   struct ovl_node *p, *node = NULL;
   struct ovl_data *lo = ovl_data (req);
+  struct ovl_file *f;
   struct stat st;
 
   if (UNLIKELY (ovl_debug (req)))
@@ -4152,9 +7889,18 @@ ovl_create (fuse_req_t req, fuse_ino_t parent, const char *name,
       return;
     }
 
-  fi->fh = fd;
+  f = make_ovl_file (fd, node->ino);
+  if (f == NULL)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  fi->fh = (uintptr_t) f;
   fd = -1;  /* Do not clean it up.  */
 
+  set_passthrough (req, node, f, fi);
+
   node->ino->lookups++;
   fuse_reply_create (req, &e, fi);
 }
@@ -4165,6 +7911,8 @@ ovl_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
   struct ovl_data *lo = ovl_data (req);
   cleanup_lock int l = enter_big_lock ();
   cleanup_close int fd = -1;
+  struct ovl_node *node = NULL;
+  struct ovl_file *f;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_open(ino=%" PRIu64 ")\n", ino);
@@ -4172,15 +7920,28 @@ ovl_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
       fuse_reply_err (req, 1);
       return;
   }
-  fd = ovl_do_open (req, ino, NULL, fi->flags, 0700, NULL, NULL);
+  fd = ovl_do_open (req, ino, NULL, fi->flags, 0700, &node, NULL);
   if (fd < 0)
     {
       fuse_reply_err (req, errno);
       return;
     }
-  fi->fh = fd;
+  f = make_ovl_file (fd, node->ino);
+  if (f == NULL)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+  if (lazy_copyup_get (lo, node, fd, &f->lazy) < 0)
+    {
+      fuse_reply_err (req, errno);
+      free (f);
+      return;
+    }
+  fi->fh = (uintptr_t) f;
   if (get_timeout (lo) > 0)
     fi->keep_cache = 1;
+  set_passthrough (req, node, f, fi);
   fd = -1;  /* Do not clean it up.  */
   fuse_reply_open (req, fi);
 }
@@ -4188,7 +7949,7 @@ ovl_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 static void
 ovl_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  cleanup_lock int l = enter_big_lock ();
+  cleanup_lock int l = enter_big_lock_shared ();
   struct ovl_data *lo = ovl_data (req);
   struct ovl_node *node;
   struct fuse_entry_param e;
@@ -4230,6 +7991,8 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
   int ret;
   int fd = -1;
   char path[PATH_MAX];
+  cleanup_lazy_copyup struct ovl_lazy_copyup *lc = NULL;
+  char node_buf[PATH_MAX];
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_setattr(ino=%" PRIu64 ", to_set=%d)\n", ino, to_set);
@@ -4245,7 +8008,10 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
       return;
     }
 
-  node = get_node_up (lo, node);
+  if (to_set & FUSE_SET_ATTR_SIZE)
+    node = get_node_data_up (lo, node, attr->st_size == 0);
+  else
+    node = get_node_up (lo, node);
   if (node == NULL)
     {
       fuse_reply_err (req, errno);
@@ -4265,17 +8031,24 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
     gid = get_gid (lo, attr->st_gid);
 
   if (fi != NULL)
-    fd = fi->fh;  // use existing fd if fuse_file_info is available
+    fd = ovl_file (fi)->fd;  // use existing fd if fuse_file_info is available
   else
     {
       mode_t mode = node->ino->mode;
       int dirfd = node_dirfd (node);
+      const char *npath = node_path (node, node_buf);
+
+      if (npath == NULL)
+        {
+          fuse_reply_err (req, errno);
+          return;
+        }
 
       if (mode == 0)
         {
           struct stat st;
 
-          ret = fstatat (dirfd, node->path, &st, AT_SYMLINK_NOFOLLOW);
+          ret = fstatat (dirfd, npath, &st, AT_SYMLINK_NOFOLLOW);
           if (ret < 0)
             {
               fuse_reply_err (req, errno);
@@ -4287,7 +8060,7 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
       switch (mode & S_IFMT)
         {
         case S_IFREG:
-          cleaned_up_fd = fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, node->path, O_NOFOLLOW|O_NONBLOCK|(to_set & FUSE_SET_ATTR_SIZE ? O_WRONLY : 0), 0));
+          cleaned_up_fd = fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, npath, O_NOFOLLOW|O_NONBLOCK|(to_set & FUSE_SET_ATTR_SIZE ? O_WRONLY : 0), 0));
           if (fd < 0)
             {
               fuse_reply_err (req, errno);
@@ -4296,7 +8069,7 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
           break;
 
         case S_IFDIR:
-          cleaned_up_fd = fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, node->path, O_NOFOLLOW|O_NONBLOCK, 0));
+          cleaned_up_fd = fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, npath, O_NOFOLLOW|O_NONBLOCK, 0));
           if (fd < 0)
             {
               if (errno != ELOOP)
@@ -4308,7 +8081,7 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
           break;
 
         case S_IFLNK:
-          cleaned_up_fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, node->path, O_PATH|O_NOFOLLOW|O_NONBLOCK, 0));
+          cleaned_up_fd = TEMP_FAILURE_RETRY (safe_openat (dirfd, npath, O_PATH|O_NOFOLLOW|O_NONBLOCK, 0));
           if (cleaned_up_fd < 0)
             {
               fuse_reply_err (req, errno);
@@ -4318,11 +8091,17 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
           break;
 
         default:
-          strconcat3 (path, PATH_MAX, get_upper_layer (lo)->path, "/", node->path);
+          strconcat3 (path, PATH_MAX, get_upper_layer (lo)->path, "/", npath);
           break;
         }
     }
 
+  if (fd >= 0 && lazy_copyup_get (lo, node, fd, &lc) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
   l = release_big_lock ();
 
   memset (times, 0, sizeof (times));
@@ -4366,11 +8145,16 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
           fuse_reply_err (req, errno);
           return;
         }
-      node->ino->mode = attr->st_mode;
+      __atomic_store_n (&node->ino->mode, attr->st_mode, __ATOMIC_RELAXED);
     }
 
   if (to_set & FUSE_SET_ATTR_SIZE)
     {
+      if (lazy_copyup_truncate (lc, attr->st_size) < 0)
+        {
+          fuse_reply_err (req, errno);
+          return;
+        }
       if (fd >= 0)
         ret = ftruncate (fd, attr->st_size);
       else
@@ -4395,6 +8179,8 @@ ovl_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, stru
         }
     }
 
+  lazy_copyup_update_times (lc);
+
   if (do_getattr (req, &e, node, fd, path) < 0)
     {
       fuse_reply_err (req, errno);
@@ -4420,6 +8206,9 @@ ovl_link (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newn
   int ret;
   struct fuse_entry_param e;
   char wd_tmp_file_name[32];
+  char newparentnode_buf[PATH_MAX];
+  char node_buf[PATH_MAX];
+  const char *ppath, *npath;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_link(ino=%" PRIu64 ", newparent=%" PRIu64 ", newname=%s)\n", ino, newparent, newname);
@@ -4478,14 +8267,20 @@ ovl_link (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newn
 
   sprintf (wd_tmp_file_name, "%lu", get_next_wd_counter ());
 
-  ret = asprintf (&path, "%s/%s", newparentnode->path, newname);
+  ret = -1;
+  ppath = node_path (newparentnode, newparentnode_buf);
+  if (ppath != NULL)
+    ret = asprintf (&path, "%s/%s", ppath, newname);
   if (ret < 0)
     {
       fuse_reply_err (req, errno);
       return;
     }
 
-  ret = direct_linkat (get_upper_layer (lo), node->path, path, 0);
+  ret = -1;
+  npath = node_path (node, node_buf);
+  if (npath != NULL)
+    ret = direct_linkat (get_upper_layer (lo), npath, path, 0);
   if (ret < 0)
     {
       fuse_reply_err (req, errno);
@@ -4569,7 +8364,9 @@ ovl_symlink (fuse_req_t req, const char *link, fuse_ino_t parent, const char *na
   const struct fuse_ctx *ctx = fuse_req_ctx (req);
   char wd_tmp_file_name[32];
   bool need_delete_whiteout = true;
+  const char *ppath;
   cleanup_free char *path = NULL;
+  char pnode_buf[PATH_MAX];
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_symlink(link=%s, ino=%" PRIu64 ", name=%s)\n", link, parent, name);
@@ -4609,10 +8406,13 @@ ovl_symlink (fuse_req_t req, const char *link, fuse_ino_t parent, const char *na
   if (pnode->loaded && node == NULL)
     need_delete_whiteout = false;
 
-  ret = asprintf (&path, "%s/%s", pnode->path, name);
+  ret = -1;
+  ppath = node_path (pnode, pnode_buf);
+  if (ppath != NULL)
+    ret = asprintf (&path, "%s/%s", ppath, name);
   if (ret < 0)
     {
-      fuse_reply_err (req, ENOMEM);
+      fuse_reply_err (req, errno);
       return;
     }
 
@@ -4672,6 +8472,9 @@ ovl_rename_exchange (fuse_req_t req, fuse_ino_t parent, const char *name,
   cleanup_close int destfd = -1;
   struct ovl_node *rm1, *rm2;
   char *tmp;
+  char pnode_buf[PATH_MAX];
+  char destpnode_buf[PATH_MAX];
+  const char *path;
 
   node = do_lookup_file (req, lo, parent, name);
   if (node == NULL || node->whiteout)
@@ -4704,7 +8507,11 @@ ovl_rename_exchange (fuse_req_t req, fuse_ino_t parent, const char *name,
   if (pnode == NULL)
     goto error;
 
-  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (pnode), pnode->path, O_DIRECTORY, 0));
+  path = node_path (pnode, pnode_buf);
+  if (path == NULL)
+    goto error;
+
+  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (pnode), path, O_DIRECTORY, 0));
   if (ret < 0)
     goto error;
   srcfd = ret;
@@ -4713,7 +8520,11 @@ ovl_rename_exchange (fuse_req_t req, fuse_ino_t parent, const char *name,
   if (destpnode == NULL)
     goto error;
 
-  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (destpnode), destpnode->path, O_DIRECTORY, 0));
+  path = node_path (destpnode, destpnode_buf);
+  if (path == NULL)
+    goto error;
+
+  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (destpnode), path, O_DIRECTORY, 0));
   if (ret < 0)
     goto error;
   destfd = ret;
@@ -4743,12 +8554,8 @@ ovl_rename_exchange (fuse_req_t req, fuse_ino_t parent, const char *name,
   if (ret < 0)
     goto error;
 
-  rm1 = hash_delete (destpnode->children, destnode);
-  rm2 = hash_delete (pnode->children, node);
-
-  tmp = node->path;
-  node->path = destnode->path;
-  destnode->path = tmp;
+  rm1 = otable_delete (destpnode->children, destnode);
+  rm2 = otable_delete (pnode->children, node);
 
   tmp = node->name;
   node_set_name (node, destnode->name);
@@ -4768,8 +8575,6 @@ ovl_rename_exchange (fuse_req_t req, fuse_ino_t parent, const char *name,
       node_free (rm2);
       goto error;
     }
-  if ((update_paths (node) < 0) || (update_paths (destnode) < 0))
-    goto error;
 
   if (delete_whiteout (lo, destfd, NULL, newname) < 0)
     goto error;
@@ -4796,6 +8601,12 @@ ovl_rename_direct (fuse_req_t req, fuse_ino_t parent, const char *name,
   cleanup_close int destfd = -1;
   struct ovl_node key;
   bool destnode_is_whiteout = false;
+  char pnode_buf[PATH_MAX];
+  char destpnode_buf[PATH_MAX];
+  char destnode_buf[PATH_MAX];
+  char lower_buf[PATH_MAX];
+  const char *path;
+  cleanup_free char *redirect = NULL;
 
   node = do_lookup_file (req, lo, parent, name);
   if (node == NULL || node->whiteout)
@@ -4813,10 +8624,23 @@ ovl_rename_direct (fuse_req_t req, fuse_ino_t parent, const char *name,
           return;
         }
 
+      /* A directory with lower layers is moved with a redirect to its
+         lower path, only its upper directory is renamed.  */
       if (node->layer != get_upper_layer (lo) || node->last_layer != get_upper_layer (lo))
         {
-          fuse_reply_err (req, EXDEV);
-          return;
+          if (! lo->redirect_create)
+            {
+              fuse_reply_err (req, EXDEV);
+              return;
+            }
+          path = node_lower_path (node, lower_buf);
+          if (path != NULL)
+            redirect = strdup (path);
+          if (redirect == NULL)
+            {
+              fuse_reply_err (req, errno);
+              return;
+            }
         }
     }
   pnode = node->parent;
@@ -4828,7 +8652,11 @@ ovl_rename_direct (fuse_req_t req, fuse_ino_t parent, const char *name,
   if (pnode == NULL)
     goto error;
 
-  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (pnode), pnode->path, O_DIRECTORY, 0));
+  path = node_path (pnode, pnode_buf);
+  if (path == NULL)
+    goto error;
+
+  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (pnode), path, O_DIRECTORY, 0));
   if (ret < 0)
     goto error;
   srcfd = ret;
@@ -4837,18 +8665,27 @@ ovl_rename_direct (fuse_req_t req, fuse_ino_t parent, const char *name,
   if (destpnode == NULL)
     goto error;
 
-  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (destpnode), destpnode->path, O_DIRECTORY, 0));
+  path = node_path (destpnode, destpnode_buf);
+  if (path == NULL)
+    goto error;
+
+  ret = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (destpnode), path, O_DIRECTORY, 0));
   if (ret < 0)
     goto error;
   destfd = ret;
 
   node_set_name (&key, (char *) newname);
-  destnode = hash_lookup (destpnode->children, &key);
+  destnode = otable_lookup (destpnode->children, &key);
 
   node = get_node_up (lo, node);
   if (node == NULL)
     goto error;
 
+  /* Written before the rename: left at the old place, the redirect
+     points to where the directory is anyway.  */
+  if (redirect && write_redirect (srcfd, name, redirect) < 0)
+    goto error;
+
   if (flags & RENAME_NOREPLACE && destnode && !destnode->whiteout)
     {
       errno = EEXIST;
@@ -4875,11 +8712,16 @@ ovl_rename_direct (fuse_req_t req, fuse_ino_t parent, const char *name,
               errno = ENOTEMPTY;
               goto error;
             }
-          if (destnode_whiteouts && empty_dir (get_upper_layer (lo), destnode->path) < 0)
-            goto error;
         }
 
-      if (node_dirp (node) && create_missing_whiteouts (lo, node, destnode->path) < 0)
+      path = node_path (destnode, destnode_buf);
+      if (path == NULL)
+        goto error;
+
+      if (destnode_whiteouts && empty_dir (get_upper_layer (lo), path) < 0)
+        goto error;
+
+      if (node_dirp (node) && redirect == NULL && create_missing_whiteouts (lo, node, path) < 0)
         goto error;
 
       if (destnode->ino->lookups > 0)
@@ -4962,18 +8804,22 @@ ovl_rename_direct (fuse_req_t req, fuse_ino_t parent, const char *name,
     goto error;
 
  done:
-  hash_delete (pnode->children, node);
+  otable_delete (pnode->children, node);
+
+  if (redirect)
+    {
+      node_set_redirect (node, redirect);
+      redirect = NULL;
+    }
 
-  free (node->name);
-  node_set_name (node, strdup (newname));
+  slab_strfree (node->name);
+  node_set_name (node, slab_strdup (newname));
   if (node->name == NULL)
     goto error;
 
   node = insert_node (destpnode, node, true);
   if (node == NULL)
     goto error;
-  if (update_paths (node) < 0)
-    goto error;
 
   node->loaded = 0;
 
@@ -5047,12 +8893,14 @@ ovl_statfs (fuse_req_t req, fuse_ino_t ino)
 static void
 ovl_readlink (fuse_req_t req, fuse_ino_t ino)
 {
-  cleanup_lock int l = enter_big_lock ();
+  cleanup_lock int l = enter_big_lock_shared ();
   struct ovl_data *lo = ovl_data (req);
   cleanup_free char *buf = NULL;
   struct ovl_node *node;
   size_t current_size;
   int ret = 0;
+  char node_buf[PATH_MAX];
+  const char *path;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_readlink(ino=%" PRIu64 ")\n", ino);
@@ -5069,6 +8917,13 @@ ovl_readlink (fuse_req_t req, fuse_ino_t ino)
       return;
     }
 
+  path = node_layer_path (node, node_buf);
+  if (path == NULL)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
   current_size = PATH_MAX + 1;
   buf = malloc (current_size);
   if (buf == NULL)
@@ -5081,7 +8936,7 @@ ovl_readlink (fuse_req_t req, fuse_ino_t ino)
     {
       char *tmp;
 
-      ret = node->layer->ds->readlinkat (node->layer, node->path, buf, current_size - 1);
+      ret = node->layer->ds->readlinkat (node->layer, path, buf, current_size - 1);
       if (ret == -1)
         {
           fuse_reply_err (req, errno);
@@ -5108,18 +8963,20 @@ static int
 hide_all (struct ovl_data *lo, struct ovl_node *node)
 {
   struct ovl_node **nodes;
-  size_t i, nodes_size;
+  size_t i, pos, nodes_size;
 
   node = reload_dir (lo, node);
   if (node == NULL)
     return -1;
 
-  nodes_size = hash_get_n_entries (node->children) + 2;
+  nodes_size = otable_n_entries (node->children) + 2;
   nodes = malloc (sizeof (struct ovl_node *) * nodes_size);
   if (nodes == NULL)
     return -1;
 
-  nodes_size = hash_get_entries (node->children, (void **) nodes, nodes_size);
+  for (i = 0, pos = 0; i < nodes_size && (nodes[i] = otable_next (node->children, &pos)); i++)
+    ;
+  nodes_size = i;
   for (i = 0; i < nodes_size; i++)
     {
       struct ovl_node *it;
@@ -5150,8 +9007,10 @@ ovl_mknod (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev
   int ret = 0;
   cleanup_free char *path = NULL;
   struct fuse_entry_param e;
+  const char *ppath;
   const struct fuse_ctx *ctx = fuse_req_ctx (req);
   char wd_tmp_file_name[32];
+  char pnode_buf[PATH_MAX];
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_mknod(ino=%" PRIu64 ", name=%s, mode=%d, rdev=%lu)\n",
@@ -5208,7 +9067,10 @@ ovl_mknod (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev
       return;
     }
 
-  ret = asprintf (&path, "%s/%s", pnode->path, name);
+  ret = -1;
+  ppath = node_path (pnode, pnode_buf);
+  if (ppath != NULL)
+    ret = asprintf (&path, "%s/%s", ppath, name);
   if (ret < 0)
     {
       fuse_reply_err (req, errno);
@@ -5277,9 +9139,11 @@ ovl_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
   ino_t ino = 0;
   dev_t dev = 0;
   int ret = 0;
+  const char *ppath;
   cleanup_free char *path = NULL;
   bool need_delete_whiteout = true;
   cleanup_lock int l = enter_big_lock ();
+  char pnode_buf[PATH_MAX];
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_mkdir(ino=%" PRIu64 ", name=%s, mode=%d)\n",
@@ -5324,7 +9188,10 @@ ovl_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 
   parent_upperdir_only = pnode->last_layer == get_upper_layer (lo);
 
-  ret = asprintf (&path, "%s/%s", pnode->path, name);
+  ret = -1;
+  ppath = node_path (pnode, pnode_buf);
+  if (ppath != NULL)
+    ret = asprintf (&path, "%s/%s", ppath, name);
   if (ret < 0)
     {
       fuse_reply_err (req, errno);
@@ -5415,6 +9282,105 @@ direct_fsync (struct ovl_layer *l, int fd, const char *path, int datasync)
   return datasync ? fdatasync (fd) : fsync (fd);
 }
 
+/* Group commit.  With group_commit=USEC, the first fsync waits up to
+   USEC microseconds for others to arrive, then flushes them all at
+   once: with one flush per file issued back to back, preceded by a
+   syncfs on the upper layer when there are at least GROUP_COMMIT_SYNCFS
+   of them so that the flushes find the data already written.  syncfs
+   does not report the writeback errors of each file, the result of
+   every caller is the one of the flush of its own file.  A batch is closed early when GROUP_COMMIT_MAX callers
+   are waiting.  Every caller gets its reply once its data is durable,
+   and the fsyncs arriving during a flush form the next batch.  */
+
+#define GROUP_COMMIT_SYNCFS 8
+#define GROUP_COMMIT_MAX 64
+
+struct group_commit_waiter
+{
+  struct group_commit_waiter *next;
+  int fd;
+  int datasync;
+  int ret;
+  int err;
+  bool done;
+};
+
+static pthread_mutex_t group_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_commit_cond = PTHREAD_COND_INITIALIZER;
+static struct group_commit_waiter *group_commit_pending;
+static size_t group_commit_n_pending;
+static bool group_commit_leader;
+
+static void
+group_commit_flush (struct ovl_data *lo, struct group_commit_waiter *batch, size_t n)
+{
+  struct group_commit_waiter *it;
+
+  ovl_stats_add (OVL_STAT_fsync_batches, 1);
+  ovl_stats_add (OVL_STAT_fsync_batched, n);
+
+  if (n >= GROUP_COMMIT_SYNCFS)
+    syncfs (get_upper_layer (lo)->fd);
+
+  for (it = batch; it; it = it->next)
+    {
+      it->ret = it->datasync ? fdatasync (it->fd) : fsync (it->fd);
+      it->err = errno;
+    }
+}
+
+static int
+group_commit_sync (struct ovl_data *lo, int fd, int datasync)
+{
+  struct group_commit_waiter w = { .fd = fd, .datasync = datasync };
+  struct group_commit_waiter *batch, *it;
+  struct timespec deadline;
+  size_t n;
+
+  pthread_mutex_lock (&group_commit_lock);
+  w.next = group_commit_pending;
+  group_commit_pending = &w;
+  group_commit_n_pending++;
+
+  if (group_commit_leader)
+    {
+      if (group_commit_n_pending >= GROUP_COMMIT_MAX)
+        pthread_cond_broadcast (&group_commit_cond);
+      while (! w.done)
+        pthread_cond_wait (&group_commit_cond, &group_commit_lock);
+      pthread_mutex_unlock (&group_commit_lock);
+      errno = w.err;
+      return w.ret;
+    }
+
+  group_commit_leader = true;
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += (long) lo->group_commit * 1000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+  while (group_commit_n_pending < GROUP_COMMIT_MAX
+         && pthread_cond_timedwait (&group_commit_cond, &group_commit_lock, &deadline) != ETIMEDOUT)
+    ;
+
+  batch = group_commit_pending;
+  n = group_commit_n_pending;
+  group_commit_pending = NULL;
+  group_commit_n_pending = 0;
+  group_commit_leader = false;
+  pthread_mutex_unlock (&group_commit_lock);
+
+  group_commit_flush (lo, batch, n);
+
+  pthread_mutex_lock (&group_commit_lock);
+  for (it = batch; it; it = it->next)
+    it->done = true;
+  pthread_cond_broadcast (&group_commit_cond);
+  pthread_mutex_unlock (&group_commit_lock);
+
+  errno = w.err;
+  return w.ret;
+}
+
 static void
 do_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, int fd)
 {
@@ -5423,6 +9389,8 @@ do_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, int fd)
   struct ovl_node *node;
   struct ovl_data *lo = ovl_data (req);
   cleanup_lock int l = 0;
+  char node_buf[PATH_MAX];
+  const char *path;
 
   if (!lo->fsync)
     {
@@ -5454,8 +9422,39 @@ do_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, int fd)
       return;
     }
 
+  path = node_path (node, node_buf);
+  if (path == NULL)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  /* The batch is flushed without the lock, so that the other callers
+     can join it.  */
+  if (lo->group_commit > 0 && lo->threaded)
+    {
+      cleanup_close int cfd = -1;
+
+      if (fd < 0)
+        {
+          cfd = safe_openat (node->layer->fd, path, O_NOFOLLOW|O_DIRECTORY, 0);
+          if (cfd < 0)
+            {
+              fuse_reply_err (req, errno);
+              return;
+            }
+          fd = cfd;
+        }
+      release_big_lock ();
+      l = 0;
+
+      ret = group_commit_sync (lo, fd, datasync);
+      fuse_reply_err (req, ret == 0 ? 0 : errno);
+      return;
+    }
+
   if (do_fsync)
-    ret = direct_fsync (node->layer, fd, node->path, datasync);
+    ret = direct_fsync (node->layer, fd, path, datasync);
 
   fuse_reply_err (req, ret == 0 ? 0 : errno);
 }
@@ -5472,7 +9471,13 @@ ovl_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *
     fprintf (stderr, "ovl_fsync(ino=%" PRIu64 ", datasync=%d, fi=%p)\n",
              ino, datasync, fi);
 
-  return do_fsync (req, ino, datasync, fi->fh);
+  if (lazy_copyup_sync (ovl_file (fi)->lazy) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
+  return do_fsync (req, ino, datasync, ovl_file (fi)->fd);
 }
 
 static void
@@ -5507,6 +9512,7 @@ ovl_ioctl (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
   struct ovl_node *node;
   int fd = -1;
   unsigned long r;
+  char node_buf[PATH_MAX];
 
   if (flags & FUSE_IOCTL_COMPAT)
     {
@@ -5535,7 +9541,7 @@ ovl_ioctl (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
     case FS_IOC_GETVERSION:
     case FS_IOC_GETFLAGS:
       if (! node_dirp (node))
-        fd = fi->fh;
+        fd = ovl_file (fi)->fd;
       break;
 
     case FS_IOC_SETVERSION:
@@ -5557,7 +9563,10 @@ ovl_ioctl (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
 
   if (fd < 0)
     {
-      fd = cleaned_fd = node->layer->ds->openat (node->layer, node->path, O_RDONLY|O_NONBLOCK, 0755);
+      const char *path = node_layer_path (node, node_buf);
+
+      if (path != NULL)
+        fd = cleaned_fd = node->layer->ds->openat (node->layer, path, O_RDONLY|O_NONBLOCK, 0755);
       if (fd < 0)
         {
           fuse_reply_err (req, errno);
@@ -5586,8 +9595,11 @@ ovl_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t len
   struct ovl_data *lo = ovl_data (req);
   cleanup_close int fd = -1;
   struct ovl_node *node;
+  cleanup_lazy_copyup struct ovl_lazy_copyup *lc = NULL;
   int dirfd;
   int ret;
+  char node_buf[PATH_MAX];
+  const char *path;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_fallocate(ino=%" PRIu64 ", mode=%d, offset=%lo, length=%lu, fi=%p)\n",
@@ -5605,7 +9617,7 @@ ovl_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t len
       return;
     }
 
-  node = get_node_up (lo, node);
+  node = get_node_data_up (lo, node, false);
   if (node == NULL)
     {
       fuse_reply_err (req, errno);
@@ -5613,15 +9625,30 @@ ovl_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t len
     }
 
   dirfd = node_dirfd (node);
-  fd = safe_openat (dirfd, node->path, O_NONBLOCK|O_NOFOLLOW|O_WRONLY, 0);
+  path = node_path (node, node_buf);
+  if (path != NULL)
+    fd = safe_openat (dirfd, path, O_NONBLOCK|O_NOFOLLOW|O_WRONLY, 0);
   if (fd < 0)
     {
       fuse_reply_err (req, errno);
       return;
     }
 
+  if (lazy_copyup_get (lo, node, fd, &lc) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
   l = release_big_lock ();
 
+  /* Only a plain allocation leaves the data untouched.  */
+  if (mode != 0 && lazy_copyup_finish (lc) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
   ret = direct_fallocate (node->layer, fd, mode, offset, length);
   fuse_reply_err (req, ret < 0 ? errno : 0);
 }
@@ -5644,7 +9671,11 @@ ovl_copy_file_range (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fus
   struct ovl_node *node, *dnode;
   cleanup_close int fd_dest = -1;
   cleanup_close int fd = -1;
+  cleanup_lazy_copyup struct ovl_lazy_copyup *lc_in = NULL;
+  cleanup_lazy_copyup struct ovl_lazy_copyup *lc_out = NULL;
   ssize_t ret;
+  char dnode_buf[PATH_MAX];
+  const char *path;
 
   if (UNLIKELY (ovl_debug (req)))
     fprintf (stderr, "ovl_copy_file_range(ino_in=%" PRIu64 ", off_in=%lo, fi_in=%p, ino_out=%" PRIu64 ", off_out=%lo, fi_out=%p, size=%zu, flags=%d)\n",
@@ -5664,30 +9695,48 @@ ovl_copy_file_range (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fus
       return;
     }
 
-  dnode = get_node_up (lo, dnode);
+  dnode = get_node_data_up (lo, dnode, false);
   if (dnode == NULL)
     {
       fuse_reply_err (req, errno);
       return;
     }
 
-  fd = node->layer->ds->openat (node->layer, node->path, O_NONBLOCK|O_NOFOLLOW|O_RDONLY, 0755);
+  fd = node_data_openat (lo, node, O_NONBLOCK|O_NOFOLLOW|O_RDONLY, 0755);
   if (fd < 0)
     {
       fuse_reply_err (req, errno);
       return;
     }
 
-  fd_dest = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (dnode), dnode->path, O_NONBLOCK|O_NOFOLLOW|O_WRONLY, 0));
+  path = node_path (dnode, dnode_buf);
+  if (path != NULL)
+    fd_dest = TEMP_FAILURE_RETRY (safe_openat (node_dirfd (dnode), path, O_NONBLOCK|O_NOFOLLOW|O_WRONLY, 0));
   if (fd_dest < 0)
     {
       fuse_reply_err (req, errno);
       return;
     }
 
+  if (lazy_copyup_get (lo, node, fd, &lc_in) < 0
+      || lazy_copyup_get (lo, dnode, fd_dest, &lc_out) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
   l = release_big_lock ();
 
+  if (lazy_copyup_range (lc_in, off_in, len) < 0
+      || lazy_copyup_range (lc_out, off_out, len) < 0)
+    {
+      fuse_reply_err (req, errno);
+      return;
+    }
+
   ret = direct_copy_file_range (node->layer, fd, &off_in, fd_dest, &off_out, len, flags);
+  if (ret > 0)
+    lazy_copyup_update_times (lc_out);
   if (ret < 0)
     fuse_reply_err (req, errno);
   else
@@ -5695,43 +9744,109 @@ ovl_copy_file_range (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fus
 }
 #endif
 
+/* Every operation is timed by a wrapper that calls the handler and
+   accounts the elapsed time to its histogram.  */
+#define STATS_WRAP(op, proto, args)                     \
+  static void                                           \
+  stats_##op proto                                      \
+  {                                                     \
+    uint64_t start = ovl_stats_now ();                  \
+    ovl_##op args;                                      \
+    ovl_stats_op (OVL_OP_##op, start);                  \
+  }
+
+STATS_WRAP (statfs, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+STATS_WRAP (access, (fuse_req_t req, fuse_ino_t ino, int mask), (req, ino, mask))
+STATS_WRAP (getxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size),
+            (req, ino, name, size))
+STATS_WRAP (removexattr, (fuse_req_t req, fuse_ino_t ino, const char *name), (req, ino, name))
+STATS_WRAP (setxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags),
+            (req, ino, name, value, size, flags))
+STATS_WRAP (listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size))
+STATS_WRAP (lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+STATS_WRAP (forget, (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup), (req, ino, nlookup))
+STATS_WRAP (forget_multi, (fuse_req_t req, size_t count, struct fuse_forget_data *forgets),
+            (req, count, forgets))
+STATS_WRAP (getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_WRAP (readlink, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+STATS_WRAP (opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_WRAP (readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+            (req, ino, size, offset, fi))
+STATS_WRAP (readdirplus, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+            (req, ino, size, offset, fi))
+STATS_WRAP (releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_WRAP (create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi),
+            (req, parent, name, mode, fi))
+STATS_WRAP (open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_WRAP (release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_WRAP (read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+            (req, ino, size, offset, fi))
+STATS_WRAP (write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf, off_t off, struct fuse_file_info *fi),
+            (req, ino, in_buf, off, fi))
+STATS_WRAP (unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+STATS_WRAP (rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+STATS_WRAP (setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi),
+            (req, ino, attr, to_set, fi))
+STATS_WRAP (symlink, (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name),
+            (req, link, parent, name))
+STATS_WRAP (rename, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags),
+            (req, parent, name, newparent, newname, flags))
+STATS_WRAP (mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+            (req, parent, name, mode))
+STATS_WRAP (mknod, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev),
+            (req, parent, name, mode, rdev))
+STATS_WRAP (link, (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname),
+            (req, ino, newparent, newname))
+STATS_WRAP (fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+            (req, ino, datasync, fi))
+STATS_WRAP (fsyncdir, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+            (req, ino, datasync, fi))
+STATS_WRAP (ioctl, (fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz),
+            (req, ino, cmd, arg, fi, flags, in_buf, in_bufsz, out_bufsz))
+STATS_WRAP (fallocate, (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi),
+            (req, ino, mode, offset, length, fi))
+#if HAVE_COPY_FILE_RANGE && HAVE_FUSE_COPY_FILE_RANGE
+STATS_WRAP (copy_file_range, (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags),
+            (req, ino_in, off_in, fi_in, ino_out, off_out, fi_out, len, flags))
+#endif
+
 static struct fuse_lowlevel_ops ovl_oper =
   {
-   .statfs = ovl_statfs,
-   .access = ovl_access,
-   .getxattr = ovl_getxattr,
-   .removexattr = ovl_removexattr,
-   .setxattr = ovl_setxattr,
-   .listxattr = ovl_listxattr,
+   .statfs = stats_statfs,
+   .access = stats_access,
+   .getxattr = stats_getxattr,
+   .removexattr = stats_removexattr,
+   .setxattr = stats_setxattr,
+   .listxattr = stats_listxattr,
    .init = ovl_init,
-   .lookup = ovl_lookup,
-   .forget = ovl_forget,
-   .forget_multi = ovl_forget_multi,
-   .getattr = ovl_getattr,
-   .readlink = ovl_readlink,
-   .opendir = ovl_opendir,
-   .readdir = ovl_readdir,
-   .readdirplus = ovl_readdirplus,
-   .releasedir = ovl_releasedir,
-   .create = ovl_create,
-   .open = ovl_open,
-   .release = ovl_release,
-   .read = ovl_read,
-   .write_buf = ovl_write_buf,
-   .unlink = ovl_unlink,
-   .rmdir = ovl_rmdir,
-   .setattr = ovl_setattr,
-   .symlink = ovl_symlink,
-   .rename = ovl_rename,
-   .mkdir = ovl_mkdir,
-   .mknod = ovl_mknod,
-   .link = ovl_link,
-   .fsync = ovl_fsync,
-   .fsyncdir = ovl_fsyncdir,
-   .ioctl = ovl_ioctl,
-   .fallocate = ovl_fallocate,
+   .lookup = stats_lookup,
+   .forget = stats_forget,
+   .forget_multi = stats_forget_multi,
+   .getattr = stats_getattr,
+   .readlink = stats_readlink,
+   .opendir = stats_opendir,
+   .readdir = stats_readdir,
+   .readdirplus = stats_readdirplus,
+   .releasedir = stats_releasedir,
+   .create = stats_create,
+   .open = stats_open,
+   .release = stats_release,
+   .read = stats_read,
+   .write_buf = stats_write_buf,
+   .unlink = stats_unlink,
+   .rmdir = stats_rmdir,
+   .setattr = stats_setattr,
+   .symlink = stats_symlink,
+   .rename = stats_rename,
+   .mkdir = stats_mkdir,
+   .mknod = stats_mknod,
+   .link = stats_link,
+   .fsync = stats_fsync,
+   .fsyncdir = stats_fsyncdir,
+   .ioctl = stats_ioctl,
+   .fallocate = stats_fallocate,
 #if HAVE_COPY_FILE_RANGE && HAVE_FUSE_COPY_FILE_RANGE
-   .copy_file_range = ovl_copy_file_range,
+   .copy_file_range = stats_copy_file_range,
 #endif
   };
 
@@ -5832,6 +9947,17 @@ get_new_args (int *argc, char **argv)
   return newargv;
 }
 
+/* Account the startup phase NAME that started at START, return the
+   start of the next one.  */
+static uint64_t
+startup_phase (const char *name, uint64_t start)
+{
+  uint64_t now = ovl_stats_now ();
+
+  ovl_stats_startup (name, now - start);
+  return now;
+}
+
 static void
 set_limits ()
 {
@@ -5847,6 +9973,51 @@ set_limits ()
     error (EXIT_FAILURE, errno, "cannot set nofile rlimit");
 }
 
+/* Restrict the process to the CPUs of cpus= and numa_node=, before any
+   other thread is created so that the FUSE workers and the helper
+   threads inherit the mask.  */
+static void
+set_cpu_affinity (struct ovl_data *lo)
+{
+  cpu_set_t set, node_set;
+
+  if (lo->cpus == NULL && lo->numa_node < 0)
+    return;
+
+  if (lo->cpus && parse_cpu_list (lo->cpus, &set) < 0)
+    error (EXIT_FAILURE, 0, "invalid value for cpus: %s", lo->cpus);
+
+  if (lo->numa_node >= 0)
+    {
+      char path[64], list[4096];
+      cleanup_close int fd = -1;
+      ssize_t r;
+
+      sprintf (path, "/sys/devices/system/node/node%d/cpulist", lo->numa_node);
+      fd = open (path, O_RDONLY|O_CLOEXEC);
+      if (fd < 0)
+        error (EXIT_FAILURE, errno, "cannot read the CPUs of the NUMA node %d", lo->numa_node);
+      r = TEMP_FAILURE_RETRY (read (fd, list, sizeof (list) - 1));
+      if (r < 0)
+        error (EXIT_FAILURE, errno, "cannot read the CPUs of the NUMA node %d", lo->numa_node);
+      list[r] = '\0';
+      if (r > 0 && list[r - 1] == '\n')
+        list[r - 1] = '\0';
+      if (parse_cpu_list (list, &node_set) < 0)
+        error (EXIT_FAILURE, 0, "the NUMA node %d has no CPUs", lo->numa_node);
+
+      if (lo->cpus)
+        CPU_AND (&set, &set, &node_set);
+      else
+        set = node_set;
+      if (CPU_COUNT (&set) == 0)
+        error (EXIT_FAILURE, 0, "no CPU of cpus=%s is in the NUMA node %d", lo->cpus, lo->numa_node);
+    }
+
+  if (sched_setaffinity (0, sizeof (set), &set) < 0)
+    error (EXIT_FAILURE, errno, "cannot set the CPU affinity");
+}
+
 static char *
 load_default_plugins ()
 {
@@ -5889,8 +10060,6 @@ main (int argc, char *argv[])
   struct fuse_cmdline_opts opts;
   char **newargv = get_new_args (&argc, argv);
   struct ovl_data lo = {.debug = 0,
-                        .uid_mappings = NULL,
-                        .gid_mappings = NULL,
                         .uid_str = NULL,
                         .gid_str = NULL,
                         .root = NULL,
@@ -5906,15 +10075,19 @@ main (int argc, char *argv[])
                         .timeout = 1000000000.0,
                         .timeout_str = NULL,
                         .writeback = 1,
+                        .lazy_copyup_fd = -1,
+                        .dirfd_cache = 64,
+                        .max_idle_threads = 10,
+                        .numa_node = -1,
   };
   struct fuse_loop_config fuse_conf = {
                                        .clone_fd = 1,
-                                       .max_idle_threads = 10,
   };
   int ret = -1;
   cleanup_layer struct ovl_layer *layers = NULL;
   struct ovl_layer *tmp_layer = NULL;
   struct fuse_args args = FUSE_ARGS_INIT (argc, newargv);
+  uint64_t startup_start = ovl_stats_now (), phase = startup_start;
 
   memset (&opts, 0, sizeof (opts));
   if (fuse_opt_parse (&args, &lo, ovl_opts, fuse_opt_proc) == -1)
@@ -5927,7 +10100,7 @@ main (int argc, char *argv[])
 
   read_overflowids ();
 
-  pthread_mutex_init (&lock, PTHREAD_MUTEX_DEFAULT);
+  init_big_lock ();
 
   if (opts.show_help)
     {
@@ -5947,12 +10120,24 @@ main (int argc, char *argv[])
   lo.uid = geteuid ();
   lo.gid = getegid ();
 
-  if (lo.redirect_dir && strcmp (lo.redirect_dir, "off"))
-    error (EXIT_FAILURE, 0, "fuse-overlayfs only supports redirect_dir=off");
+  if (lo.redirect_dir)
+    {
+      if (strcmp (lo.redirect_dir, "on") == 0)
+        lo.redirect_create = lo.redirect_follow = true;
+      else if (strcmp (lo.redirect_dir, "follow") == 0)
+        lo.redirect_follow = true;
+      else if (strcmp (lo.redirect_dir, "off") && strcmp (lo.redirect_dir, "nofollow"))
+        error (EXIT_FAILURE, 0, "invalid value for redirect_dir: %s", lo.redirect_dir);
+    }
+
+  set_cpu_affinity (&lo);
 
   if (lo.mountpoint == NULL)
     error (EXIT_FAILURE, 0, "no mountpoint specified");
 
+  if (compile_path_policy (&lo) < 0)
+    error (EXIT_FAILURE, errno, "cannot compile the denied paths");
+
   if (lo.upperdir != NULL)
     {
       cleanup_free char *full_path = NULL;
@@ -5981,8 +10166,28 @@ main (int argc, char *argv[])
       fprintf (stderr, "fsync=%s\n", lo.fsync ? "enabled" : "disabled");
     }
 
-  lo.uid_mappings = lo.uid_str ? read_mappings (lo.uid_str) : NULL;
-  lo.gid_mappings = lo.gid_str ? read_mappings (lo.gid_str) : NULL;
+  {
+    struct ovl_mapping *uid_mappings = lo.uid_str ? read_mappings (lo.uid_str) : NULL;
+    struct ovl_mapping *gid_mappings = lo.gid_str ? read_mappings (lo.gid_str) : NULL;
+
+    if (lo.squash_to_uid != -1)
+      compile_id_squash (&lo.uid_map, lo.squash_to_uid);
+    else if (lo.squash_to_root)
+      compile_id_squash (&lo.uid_map, 0);
+    else
+      compile_id_map (&lo.uid_map, uid_mappings, true, overflow_uid);
+    if (lo.squash_to_gid != -1)
+      compile_id_squash (&lo.gid_map, lo.squash_to_gid);
+    else if (lo.squash_to_root)
+      compile_id_squash (&lo.gid_map, 0);
+    else
+      compile_id_map (&lo.gid_map, gid_mappings, true, overflow_gid);
+    compile_id_map (&lo.uid_map_back, uid_mappings, false, overflow_uid);
+    compile_id_map (&lo.gid_map_back, gid_mappings, false, overflow_gid);
+
+    free_mapping (uid_mappings);
+    free_mapping (gid_mappings);
+  }
 
   errno = 0;
   if (lo.timeout_str)
@@ -5992,10 +10197,13 @@ main (int argc, char *argv[])
         error (EXIT_FAILURE, errno, "cannot convert %s", lo.timeout_str);
     }
 
+  phase = startup_phase ("options", phase);
+
   if (lo.plugins == NULL)
     lo.plugins = load_default_plugins ();
 
   lo.plugins_ctx = load_plugins (lo.plugins);
+  phase = startup_phase ("plugins", phase);
 
   layers = read_dirs (&lo, lo.lowerdir, true, NULL);
   if (layers == NULL)
@@ -6012,6 +10220,10 @@ main (int argc, char *argv[])
     }
 
   lo.layers = layers;
+  phase = startup_phase ("layers", phase);
+
+  if (lo.lower_view && lower_view_attach (get_lower_layers (&lo), lo.lower_view) < 0)
+    error (0, errno, "cannot use the lower view in %s, accessing the lower layers directly", lo.lower_view);
 
   if (lo.upperdir)
     {
@@ -6055,19 +10267,32 @@ main (int argc, char *argv[])
         }
     }
 
-  lo.inodes = hash_initialize (2048, NULL, node_inode_hasher, node_inode_compare, inode_free);
+  lo.inodes = otable_new (2048, node_inode_hasher, node_inode_compare, inode_free);
 
-  lo.root = load_dir (&lo, NULL, lo.layers, ".", "");
+  /* With fast_startup the root is loaded by the first readdir, the
+     lookups before it go to the layers.  */
+  if (lo.fast_startup)
+    {
+      lo.root = make_ovl_node (&lo, ".", lo.layers, "", 0, 0, true, NULL, lo.fast_ino_check);
+      for (tmp_layer = lo.layers; lo.root && tmp_layer != lo.root->last_layer; tmp_layer = tmp_layer->next)
+        if (is_directory_opaque (tmp_layer, ".") > 0)
+          {
+            lo.root->last_layer = tmp_layer;
+            break;
+          }
+    }
+  else
+    lo.root = load_dir (&lo, NULL, lo.layers, ".", "");
   if (lo.root == NULL)
     error (EXIT_FAILURE, errno, "cannot read upper dir");
   lo.root->ino->lookups = 2;
+  phase = startup_phase ("root", phase);
 
   if (lo.workdir == NULL && lo.upperdir != NULL)
     error (EXIT_FAILURE, 0, "workdir not specified");
 
   if (lo.workdir)
     {
-      int dfd;
       cleanup_free char *path = NULL;
 
       path = realpath (lo.workdir, NULL);
@@ -6088,14 +10313,25 @@ main (int argc, char *argv[])
       if (lo.workdir_fd < 0)
         error (EXIT_FAILURE, errno, "cannot open workdir");
 
-      dfd = dup (lo.workdir_fd);
-      if (dfd < 0)
-        error (EXIT_FAILURE, errno, "dup workdir file descriptor");
-      empty_dirfd (dfd);
+      init_reaper (lo.workdir_fd, lo.fast_startup);
+
+      /* Look for lazy copy-ups to resume even when lazy_copyup is not
+         set, so that their files are not left incomplete.  */
+      if (lo.lazy_copyup && mkdirat (lo.workdir_fd, "../" LAZY_COPYUP_DIR, 0700) < 0 && errno != EEXIST)
+        error (EXIT_FAILURE, errno, "cannot create the lazy-copyup directory");
+      lo.lazy_copyup_fd = openat (lo.workdir_fd, "../" LAZY_COPYUP_DIR, O_DIRECTORY|O_RDONLY|O_CLOEXEC);
+      if (lo.lazy_copyup_fd < 0 && lo.lazy_copyup)
+        error (EXIT_FAILURE, errno, "cannot open the lazy-copyup directory");
+      if (lo.lazy_copyup_fd >= 0)
+        load_lazy_copyup_leftovers (&lo);
     }
 
+  phase = startup_phase ("workdir", phase);
+
   umask (0);
   disable_locking = !lo.threaded;
+  init_pidns_cache ();
+  init_lower_cache ();
 
   se = fuse_session_new (&args, &ovl_oper, sizeof (ovl_oper), &lo);
   lo.se = se;
@@ -6118,14 +10354,49 @@ main (int argc, char *argv[])
       error (0, errno, "cannot mount");
       goto err_out3;
     }
+  phase = startup_phase ("session", phase);
   fuse_daemonize (opts.foreground);
 
+  /* Threads do not survive the fork in fuse_daemonize.  */
+  if (lo.threaded)
+    {
+      lo.copyup_pool = thread_pool_new (COPYUP_THREADS);
+      if (lo.copyup_pool == NULL)
+        error (EXIT_FAILURE, errno, "cannot create the copy-up threads");
+      if (get_timeout (&lo) > 0)
+        lo.attr_pool = thread_pool_new (ATTR_PREFETCH_THREADS);
+      if (lo.parallel_lookup > 0)
+        {
+          lo.lookup_pool = thread_pool_new (lo.parallel_lookup);
+          if (lo.lookup_pool == NULL)
+            error (EXIT_FAILURE, errno, "cannot create the lookup threads");
+        }
+    }
+
+  if (lo.whiteout_filters)
+    start_filters_thread (&lo);
+
+  start_reaper_thread ();
+  if (lo.threaded)
+    start_forget_thread (&lo);
+
+  phase = startup_phase ("threads", phase);
+  ovl_stats_startup ("total", phase - startup_start);
+
+  if (lo.stats_socket && ovl_stats_start_server (lo.stats_socket) < 0)
+    error (0, errno, "cannot serve the statistics on %s", lo.stats_socket);
+
+  fuse_conf.max_idle_threads = lo.max_idle_threads;
   if (lo.threaded)
     ret = fuse_session_loop_mt (se, &fuse_conf);
   else
     ret = fuse_session_loop (se);
 
   fuse_session_unmount (se);
+  stop_filters_thread ();
+  stop_reaper_thread ();
+  stop_forget_thread ();
+  ovl_stats_stop_server ();
 err_out3:
   fuse_remove_signal_handlers (se);
 err_out2:
@@ -6135,16 +10406,34 @@ err_out1:
   for (tmp_layer = lo.layers; tmp_layer; tmp_layer = tmp_layer->next)
     tmp_layer->ds->cleanup (tmp_layer);
 
+  free_all_snapshots (lo.inodes);
   node_mark_all_free (lo.root);
 
-  hash_free (lo.inodes);
+  otable_free (lo.inodes);
+
+  slab_release (&node_slab);
+  slab_release (&ino_slab);
+  slab_strings_release ();
 
   plugin_free_all (lo.plugins_ctx);
 
-  free_mapping (lo.uid_mappings);
-  free_mapping (lo.gid_mappings);
+  free (lo.uid_map.ranges);
+  free (lo.gid_map.ranges);
+  free (lo.uid_map_back.ranges);
+  free (lo.gid_map_back.ranges);
+
+  free_path_policy (&lo);
+
+  thread_pool_free (lo.copyup_pool);
+  thread_pool_free (lo.attr_pool);
+  thread_pool_free (lo.lookup_pool);
 
   close (lo.workdir_fd);
+  if (lo.lazy_copyup_fd >= 0)
+    close (lo.lazy_copyup_fd);
+  free (lo.lazy_copyup_leftovers);
+  if (reaper_trash_fd >= 0)
+    close (reaper_trash_fd);
 
   fuse_opt_free_args (&args);
 
@@ -0,0 +1,250 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "open-table.h"
+
+#define OTABLE_MIN_BITS 3
+
+struct otable_slot
+{
+  size_t hash;
+  void *entry;
+};
+
+struct otable
+{
+  struct otable_slot *slots;
+  unsigned int bits;
+  size_t n_entries;
+  size_t (*hasher) (const void *entry);
+  bool (*compare) (const void *e1, const void *e2);
+  void (*free_entry) (void *entry);
+};
+
+/* Fibonacci hashing, so that the hashers do not need to mix their
+   bits.  */
+static inline size_t
+slot_of (const struct otable *t, size_t hash)
+{
+  return (size_t) (((uint64_t) hash * 0x9e3779b97f4a7c15ULL) >> (64 - t->bits));
+}
+
+static inline size_t
+mask_of (const struct otable *t)
+{
+  return ((size_t) 1 << t->bits) - 1;
+}
+
+/* Grow the table when it is 3/4 full.  */
+static inline bool
+too_full (unsigned int bits, size_t n_entries)
+{
+  return n_entries + 1 > (((size_t) 3) << bits) / 4;
+}
+
+struct otable *
+otable_new (size_t n_entries, size_t (*hasher) (const void *entry),
+            bool (*compare) (const void *e1, const void *e2),
+            void (*free_entry) (void *entry))
+{
+  unsigned int bits = OTABLE_MIN_BITS;
+  struct otable *t;
+
+  while (too_full (bits, n_entries))
+    bits++;
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL)
+    return NULL;
+
+  t->slots = calloc ((size_t) 1 << bits, sizeof (*t->slots));
+  if (t->slots == NULL)
+    {
+      free (t);
+      return NULL;
+    }
+  t->bits = bits;
+  t->hasher = hasher;
+  t->compare = compare;
+  t->free_entry = free_entry;
+  return t;
+}
+
+void
+otable_free (struct otable *t)
+{
+  void (*free_entry) (void *entry);
+  struct otable_slot *slots;
+  size_t i, n;
+
+  if (t == NULL)
+    return;
+
+  /* The table is released before the entries, so FREE_ENTRY must not
+     use it.  */
+  slots = t->slots;
+  n = mask_of (t) + 1;
+  free_entry = t->free_entry;
+  free (t);
+
+  if (free_entry)
+    {
+      for (i = 0; i < n; i++)
+        if (slots[i].entry)
+          free_entry (slots[i].entry);
+    }
+  free (slots);
+}
+
+size_t
+otable_n_entries (const struct otable *t)
+{
+  return t->n_entries;
+}
+
+static struct otable_slot *
+find_slot (const struct otable *t, size_t hash, const void *key)
+{
+  size_t mask = mask_of (t);
+  size_t i;
+
+  for (i = slot_of (t, hash); t->slots[i].entry; i = (i + 1) & mask)
+    {
+      struct otable_slot *s = &t->slots[i];
+
+      if (s->hash == hash && (s->entry == key || t->compare (s->entry, key)))
+        return s;
+    }
+  return NULL;
+}
+
+void *
+otable_lookup (const struct otable *t, const void *key)
+{
+  struct otable_slot *s = find_slot (t, t->hasher (key), key);
+
+  return s ? s->entry : NULL;
+}
+
+static void
+put_slot (struct otable_slot *slots, const struct otable *t, size_t hash, void *entry)
+{
+  size_t mask = mask_of (t);
+  size_t i;
+
+  for (i = slot_of (t, hash); slots[i].entry; i = (i + 1) & mask)
+    ;
+  slots[i].hash = hash;
+  slots[i].entry = entry;
+}
+
+static int
+grow (struct otable *t)
+{
+  struct otable_slot *old = t->slots;
+  size_t i, n = mask_of (t) + 1;
+  struct otable_slot *slots;
+
+  slots = calloc (n * 2, sizeof (*slots));
+  if (slots == NULL)
+    return -1;
+
+  t->slots = slots;
+  t->bits++;
+  for (i = 0; i < n; i++)
+    if (old[i].entry)
+      put_slot (slots, t, old[i].hash, old[i].entry);
+  free (old);
+  return 0;
+}
+
+int
+otable_insert_if_absent (struct otable *t, void *entry, void **matched)
+{
+  size_t hash = t->hasher (entry);
+  struct otable_slot *s;
+
+  s = find_slot (t, hash, entry);
+  if (s)
+    {
+      if (matched)
+        *matched = s->entry;
+      return 0;
+    }
+
+  if (too_full (t->bits, t->n_entries) && grow (t) < 0)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  put_slot (t->slots, t, hash, entry);
+  t->n_entries++;
+  return 1;
+}
+
+void *
+otable_delete (struct otable *t, const void *key)
+{
+  size_t mask = mask_of (t);
+  struct otable_slot *s;
+  size_t i, j;
+  void *entry;
+
+  s = find_slot (t, t->hasher (key), key);
+  if (s == NULL)
+    return NULL;
+
+  entry = s->entry;
+  t->n_entries--;
+
+  /* Shift back the following entries of the cluster, so that no
+     tombstone is needed.  */
+  i = s - t->slots;
+  for (j = (i + 1) & mask; t->slots[j].entry; j = (j + 1) & mask)
+    {
+      size_t home = slot_of (t, t->slots[j].hash);
+
+      /* Move the entry at J to I unless its home slot is in (I, J].  */
+      if (((j - home) & mask) >= ((j - i) & mask))
+        {
+          t->slots[i] = t->slots[j];
+          i = j;
+        }
+    }
+  t->slots[i].entry = NULL;
+  t->slots[i].hash = 0;
+  return entry;
+}
+
+void *
+otable_next (const struct otable *t, size_t *pos)
+{
+  size_t n = mask_of (t) + 1;
+
+  for (; *pos < n; (*pos)++)
+    if (t->slots[*pos].entry)
+      return t->slots[(*pos)++].entry;
+  return NULL;
+}
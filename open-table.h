@@ -0,0 +1,50 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OPEN_TABLE_H
+# define OPEN_TABLE_H
+
+# include <stdbool.h>
+# include <stddef.h>
+
+/* Hash table with open addressing and linear probing.  The hash of
+   each entry is stored in the slot next to the entry pointer, so that
+   a probe compares entries only when the full hash matches.  HASHER
+   returns the hash of an entry and COMPARE tells whether two entries
+   have the same key.  */
+struct otable;
+
+struct otable *otable_new (size_t n_entries, size_t (*hasher) (const void *entry),
+                           bool (*compare) (const void *e1, const void *e2),
+                           void (*free_entry) (void *entry));
+/* Free the table, and all its entries with FREE_ENTRY.  */
+void otable_free (struct otable *t);
+
+size_t otable_n_entries (const struct otable *t);
+void *otable_lookup (const struct otable *t, const void *key);
+/* Return 1 if ENTRY was inserted, 0 if an entry with the same key is
+   already present and store it in MATCHED, -1 on errors.  */
+int otable_insert_if_absent (struct otable *t, void *entry, void **matched);
+/* Remove and return the entry with the same key as KEY.  */
+void *otable_delete (struct otable *t, const void *key);
+
+/* Iterate the entries, *POS must be 0 at the first call.  The table must
+   not be modified while iterating.  Return NULL at the end.  */
+void *otable_next (const struct otable *t, size_t *pos);
+
+#endif
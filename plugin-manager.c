@@ -20,11 +20,37 @@
 
 #include <config.h>
 #include <plugin.h>
+#include <layer-index.h>
+#include <uring.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <fuse_overlayfs_error.h>
 #include <errno.h>
 #include <string.h>
 
+/* Register a data source built into fuse-overlayfs, unless a plugin
+   with the same name was loaded.  */
+static void
+plugin_register_builtin (struct ovl_plugin_context *context, plugin_name name,
+                         plugin_load_data_source load, plugin_release release)
+{
+  struct ovl_plugin *p;
+
+  if (plugin_find (context, name ()))
+    return;
+
+  p = calloc (1, sizeof (*p));
+  if (p == NULL)
+    error (EXIT_FAILURE, errno, "cannot register plugin %s", name ());
+
+  p->name = name ();
+  p->version = PLUGIN_VERSION;
+  p->load = load;
+  p->release = release;
+  p->next = context->plugins;
+  context->plugins = p;
+}
+
 struct ovl_plugin_context *
 load_plugins (const char *plugins)
 {
@@ -43,6 +69,9 @@ load_plugins (const char *plugins)
   for (it = strtok_r (buf, ":", &saveptr); it; it = strtok_r (NULL, ":", &saveptr))
     plugin_load_one (ctx, it);
 
+  plugin_register_builtin (ctx, layer_index_plugin_name, layer_index_plugin_load, layer_index_plugin_release);
+  plugin_register_builtin (ctx, uring_plugin_name, uring_plugin_load, uring_plugin_release);
+
   return ctx;
 }
 
@@ -65,7 +94,8 @@ plugin_load_one (struct ovl_plugin_context *context, const char *path)
   if (version == NULL)
     error (EXIT_FAILURE, 0, "cannot find symbol `plugin_version` in plugin %s", path);
 
-  if (version () != 1)
+  p->version = version ();
+  if (p->version < 1 || p->version > PLUGIN_VERSION)
     error (EXIT_FAILURE, 0, "invalid plugin version for %s", path);
 
   p->handle = handle;
@@ -102,6 +132,32 @@ plugin_find (struct ovl_plugin_context *context, const char *name)
   return NULL;
 }
 
+struct data_source *
+plugin_get_data_source (struct ovl_plugin *p, const char *opaque, const char *path)
+{
+  struct ovl_plugin_compat *c;
+  struct data_source *ds;
+
+  ds = p->load (opaque, path);
+  if (ds == NULL || p->version >= 2)
+    return ds;
+
+  for (c = p->compat; c; c = c->next)
+    if (c->orig == ds)
+      return &c->ds;
+
+  c = calloc (1, sizeof (*c));
+  if (c == NULL)
+    return NULL;
+
+  /* A version 1 data source ends with readlinkat.  */
+  memcpy (&c->ds, ds, offsetof (struct data_source, statat_batch));
+  c->orig = ds;
+  c->next = p->compat;
+  p->compat = c;
+  return &c->ds;
+}
+
 int
 plugin_free_all (struct ovl_plugin_context *context)
 {
@@ -110,10 +166,18 @@ plugin_free_all (struct ovl_plugin_context *context)
   it = context->plugins;
   while (it)
     {
+      struct ovl_plugin_compat *c, *c_next;
+
       next = it->next;
 
       it->release ();
 
+      for (c = it->compat; c; c = c_next)
+        {
+          c_next = c->next;
+          free (c);
+        }
+
       /* Skip dlclose (it->handle) as it causes plugins written in Go to crash.  */
 
       free (it);
@@ -31,6 +31,7 @@ void plugin_load_one (struct ovl_plugin_context *context, const char *path);
 int plugin_free_all (struct ovl_plugin_context *context);
 struct ovl_plugin *plugin_find (struct ovl_plugin_context *context, const char *name);
 struct ovl_plugin_context *load_plugins (const char *plugins);
+struct data_source *plugin_get_data_source (struct ovl_plugin *p, const char *opaque, const char *path);
 
 #endif
 
@@ -28,11 +28,25 @@ typedef int (*plugin_release)();
 typedef const char *(*plugin_name)();
 typedef int (*plugin_version)();
 
+/* Version 2 added the statat_batch field to struct data_source.  */
+# define PLUGIN_VERSION 2
+
+/* Copy of a data source of a version 1 plugin, with the fields it does
+   not know cleared.  */
+struct ovl_plugin_compat
+{
+  struct ovl_plugin_compat *next;
+  struct data_source *orig;
+  struct data_source ds;
+};
+
 struct ovl_plugin
 {
   struct ovl_plugin *next;
   const char *name;
   void *handle;
+  int version;
+  struct ovl_plugin_compat *compat;
 
   plugin_load_data_source load;
   plugin_release release;
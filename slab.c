@@ -0,0 +1,282 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_ALIGN 16
+
+/* Header at the start of every chunk.  Chunks are aligned to their size,
+   so the chunk of an object is found by masking its address.  */
+struct slab_chunk
+{
+  struct slab_chunk *prev;
+  struct slab_chunk *next;
+  void *free_list;
+  /* Objects never allocated, after the free list is empty.  */
+  char *unused;
+  size_t n_unused;
+  size_t in_use;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof (struct slab_chunk) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1))
+
+static size_t
+slab_object_size (struct slab *s)
+{
+  size_t size = s->object_size < sizeof (void *) ? sizeof (void *) : s->object_size;
+
+  return (size + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1);
+}
+
+static size_t
+slab_chunk_objects (struct slab *s)
+{
+  return (SLAB_CHUNK_SIZE - SLAB_HEADER_SIZE) / slab_object_size (s);
+}
+
+static void
+chunk_unlink (struct slab_chunk **list, struct slab_chunk *c)
+{
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    *list = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  c->prev = c->next = NULL;
+}
+
+static void
+chunk_push (struct slab_chunk **list, struct slab_chunk *c)
+{
+  c->prev = NULL;
+  c->next = *list;
+  if (*list)
+    (*list)->prev = c;
+  *list = c;
+}
+
+static struct slab_chunk *
+chunk_new (struct slab *s)
+{
+  struct slab_chunk *c;
+  void *p;
+
+  if (slab_chunk_objects (s) == 0 || posix_memalign (&p, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE) != 0)
+    return NULL;
+
+  c = p;
+  memset (c, 0, sizeof (*c));
+  c->unused = (char *) c + SLAB_HEADER_SIZE;
+  c->n_unused = slab_chunk_objects (s);
+  s->capacity += c->n_unused;
+  return c;
+}
+
+void *
+slab_alloc (struct slab *s)
+{
+  size_t size = slab_object_size (s);
+  struct slab_chunk *c;
+  void *p;
+
+  pthread_mutex_lock (&s->lock);
+  c = s->partial;
+  if (c == NULL)
+    {
+      c = chunk_new (s);
+      if (c == NULL)
+        {
+          pthread_mutex_unlock (&s->lock);
+          return NULL;
+        }
+      chunk_push (&s->partial, c);
+    }
+
+  if (c->free_list)
+    {
+      p = c->free_list;
+      c->free_list = *(void **) p;
+    }
+  else
+    {
+      p = c->unused;
+      c->unused += size;
+      c->n_unused--;
+    }
+  c->in_use++;
+  if (c->free_list == NULL && c->n_unused == 0)
+    {
+      chunk_unlink (&s->partial, c);
+      chunk_push (&s->full, c);
+    }
+  s->in_use++;
+  s->allocs++;
+  pthread_mutex_unlock (&s->lock);
+
+  memset (p, 0, size);
+  return p;
+}
+
+void
+slab_free (struct slab *s, void *p)
+{
+  struct slab_chunk *c;
+
+  if (p == NULL)
+    return;
+
+  c = (struct slab_chunk *) ((uintptr_t) p & ~((uintptr_t) SLAB_CHUNK_SIZE - 1));
+
+  pthread_mutex_lock (&s->lock);
+  if (c->free_list == NULL && c->n_unused == 0)
+    {
+      chunk_unlink (&s->full, c);
+      chunk_push (&s->partial, c);
+    }
+  *(void **) p = c->free_list;
+  c->free_list = p;
+  c->in_use--;
+  s->in_use--;
+
+  /* Keep one chunk with free objects, so that a single object
+     allocated and freed in a loop does not get a new chunk each time.  */
+  if (c->in_use == 0 && (c->prev || c->next))
+    {
+      chunk_unlink (&s->partial, c);
+      s->capacity -= slab_chunk_objects (s);
+      free (c);
+    }
+  pthread_mutex_unlock (&s->lock);
+}
+
+static void
+free_chunks (struct slab_chunk *c)
+{
+  struct slab_chunk *next;
+
+  for (; c; c = next)
+    {
+      next = c->next;
+      free (c);
+    }
+}
+
+void
+slab_release (struct slab *s)
+{
+  pthread_mutex_lock (&s->lock);
+  free_chunks (s->partial);
+  free_chunks (s->full);
+  s->partial = NULL;
+  s->full = NULL;
+  s->in_use = 0;
+  s->capacity = 0;
+  pthread_mutex_unlock (&s->lock);
+}
+
+static struct slab string_slabs[] =
+  {
+    SLAB_INITIALIZER (16),
+    SLAB_INITIALIZER (32),
+    SLAB_INITIALIZER (64),
+    SLAB_INITIALIZER (128),
+  };
+
+#define N_STRING_SLABS (sizeof (string_slabs) / sizeof (string_slabs[0]))
+
+static size_t big_strings_size;
+
+static struct slab *
+string_slab (size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < N_STRING_SLABS; i++)
+    if (len <= string_slabs[i].object_size)
+      return &string_slabs[i];
+  return NULL;
+}
+
+char *
+slab_strdup (const char *s)
+{
+  size_t len = strlen (s) + 1;
+  struct slab *slab = string_slab (len);
+  char *r;
+
+  if (slab)
+    r = slab_alloc (slab);
+  else
+    {
+      r = malloc (len);
+      if (r)
+        __atomic_add_fetch (&big_strings_size, len, __ATOMIC_RELAXED);
+    }
+  if (r == NULL)
+    return NULL;
+
+  memcpy (r, s, len);
+  return r;
+}
+
+void
+slab_strfree (char *s)
+{
+  size_t len;
+  struct slab *slab;
+
+  if (s == NULL)
+    return;
+
+  len = strlen (s) + 1;
+  slab = string_slab (len);
+  if (slab)
+    slab_free (slab, s);
+  else
+    {
+      __atomic_sub_fetch (&big_strings_size, len, __ATOMIC_RELAXED);
+      free (s);
+    }
+}
+
+size_t
+slab_strings_size (void)
+{
+  size_t i, size = __atomic_load_n (&big_strings_size, __ATOMIC_RELAXED);
+
+  for (i = 0; i < N_STRING_SLABS; i++)
+    size += string_slabs[i].capacity * string_slabs[i].object_size;
+  return size;
+}
+
+void
+slab_strings_release (void)
+{
+  size_t i;
+
+  for (i = 0; i < N_STRING_SLABS; i++)
+    slab_release (&string_slabs[i]);
+}
@@ -0,0 +1,61 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SLAB_H
+# define SLAB_H
+
+# include <pthread.h>
+# include <stddef.h>
+
+struct slab_chunk;
+
+/* Pool of objects of the same size, carved out of aligned chunks and
+   recycled through a free list in each chunk.  A chunk whose objects
+   are all free is given back, unless it is the only one with free
+   objects, so the memory held is bounded by the objects in use plus one
+   chunk and the fragmentation of the others.  slab_release gives back
+   all of them.  The objects must fit in a chunk.  */
+struct slab
+{
+  pthread_mutex_t lock;
+  size_t object_size;
+  /* Chunks with free objects, and chunks without.  */
+  struct slab_chunk *partial;
+  struct slab_chunk *full;
+
+  size_t in_use;
+  size_t capacity;
+  size_t allocs;
+};
+
+# define SLAB_INITIALIZER(size) { PTHREAD_MUTEX_INITIALIZER, (size), NULL, NULL, 0, 0, 0 }
+
+/* Return a zeroed object.  */
+void *slab_alloc (struct slab *s);
+void slab_free (struct slab *s, void *p);
+void slab_release (struct slab *s);
+
+/* Copies of short strings are allocated from slabs of a few size
+   classes, longer ones with malloc.  */
+char *slab_strdup (const char *s);
+void slab_strfree (char *s);
+/* Bytes held by the strings allocated with slab_strdup.  */
+size_t slab_strings_size (void);
+void slab_strings_release (void);
+
+#endif
@@ -0,0 +1,370 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+struct thread_stats
+{
+  struct thread_stats *next;
+  struct thread_stats *prev;
+
+  uint64_t ops[OVL_OP_MAX];
+  uint64_t op_ns[OVL_OP_MAX];
+  uint64_t hist[OVL_OP_MAX][OVL_STATS_BUCKETS];
+  uint64_t counters[OVL_STAT_MAX];
+};
+
+#define OVL_STATS_NAME(name) #name,
+
+static const char *op_names[] = { OVL_STATS_OPS (OVL_STATS_NAME) };
+static const char *counter_names[] = { OVL_STATS_COUNTERS (OVL_STATS_NAME) };
+
+/* The stats of the running threads, and the sum of the exited ones.  */
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *threads;
+static struct thread_stats retired;
+
+static __thread struct thread_stats *self;
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+static void
+add_stats (struct thread_stats *to, const struct thread_stats *from)
+{
+  size_t i, j;
+
+  for (i = 0; i < OVL_OP_MAX; i++)
+    {
+      to->ops[i] += __atomic_load_n (&from->ops[i], __ATOMIC_RELAXED);
+      to->op_ns[i] += __atomic_load_n (&from->op_ns[i], __ATOMIC_RELAXED);
+      for (j = 0; j < OVL_STATS_BUCKETS; j++)
+        to->hist[i][j] += __atomic_load_n (&from->hist[i][j], __ATOMIC_RELAXED);
+    }
+  for (i = 0; i < OVL_STAT_MAX; i++)
+    to->counters[i] += __atomic_load_n (&from->counters[i], __ATOMIC_RELAXED);
+}
+
+static void
+retire_thread (void *p)
+{
+  struct thread_stats *s = p;
+
+  pthread_mutex_lock (&threads_lock);
+  add_stats (&retired, s);
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    threads = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  pthread_mutex_unlock (&threads_lock);
+
+  free (s);
+}
+
+static void
+make_self_key (void)
+{
+  pthread_key_create (&self_key, retire_thread);
+}
+
+static struct thread_stats *
+get_self ()
+{
+  struct thread_stats *s = self;
+
+  if (s)
+    return s;
+
+  s = calloc (1, sizeof (*s));
+  if (s == NULL)
+    return NULL;
+
+  pthread_once (&self_once, make_self_key);
+
+  pthread_mutex_lock (&threads_lock);
+  s->next = threads;
+  if (threads)
+    threads->prev = s;
+  threads = s;
+  pthread_mutex_unlock (&threads_lock);
+
+  pthread_setspecific (self_key, s);
+  self = s;
+  return s;
+}
+
+/* Only the owner thread writes, so a plain add is enough; the relaxed
+   accesses keep the concurrent reads of the report well defined.  */
+static inline void
+bump (uint64_t *p, uint64_t v)
+{
+  __atomic_store_n (p, __atomic_load_n (p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+uint64_t
+ovl_stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+ovl_stats_op (enum ovl_stats_op op, uint64_t start)
+{
+  struct thread_stats *s = get_self ();
+  uint64_t ns = ovl_stats_now () - start;
+  uint64_t us = ns / 1000;
+  unsigned int bucket = us ? 64 - __builtin_clzll (us) : 0;
+
+  if (s == NULL)
+    return;
+
+  if (bucket >= OVL_STATS_BUCKETS)
+    bucket = OVL_STATS_BUCKETS - 1;
+
+  bump (&s->ops[op], 1);
+  bump (&s->op_ns[op], ns);
+  bump (&s->hist[op][bucket], 1);
+}
+
+void
+ovl_stats_add (enum ovl_stats_counter c, uint64_t v)
+{
+  struct thread_stats *s = get_self ();
+
+  if (s)
+    bump (&s->counters[c], v);
+}
+
+#define STARTUP_PHASES 16
+
+static struct
+{
+  const char *name;
+  uint64_t ns;
+} startup[STARTUP_PHASES];
+static size_t n_startup;
+
+void
+ovl_stats_startup (const char *name, uint64_t ns)
+{
+  if (n_startup == STARTUP_PHASES)
+    return;
+  startup[n_startup].name = name;
+  startup[n_startup].ns = ns;
+  n_startup++;
+}
+
+int
+ovl_stats_write (FILE *f)
+{
+  struct thread_stats *sum, *it;
+  size_t i, j;
+
+  sum = calloc (1, sizeof (*sum));
+  if (sum == NULL)
+    return -1;
+
+  pthread_mutex_lock (&threads_lock);
+  add_stats (sum, &retired);
+  for (it = threads; it; it = it->next)
+    add_stats (sum, it);
+  pthread_mutex_unlock (&threads_lock);
+
+  fprintf (f, "{\n  \"bucket_bounds_us\": [");
+  for (j = 0; j < OVL_STATS_BUCKETS - 1; j++)
+    fprintf (f, "%s%llu", j ? ", " : "", 1ULL << j);
+  fprintf (f, ", null],\n  \"ops\": {\n");
+
+  for (i = 0; i < OVL_OP_MAX; i++)
+    {
+      fprintf (f, "    \"%s\": {\"count\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", \"buckets\": [",
+               op_names[i], sum->ops[i], sum->op_ns[i]);
+      for (j = 0; j < OVL_STATS_BUCKETS; j++)
+        fprintf (f, "%s%" PRIu64, j ? ", " : "", sum->hist[i][j]);
+      fprintf (f, "]}%s\n", i + 1 < OVL_OP_MAX ? "," : "");
+    }
+
+  fprintf (f, "  },\n  \"counters\": {\n");
+  for (i = 0; i < OVL_STAT_MAX; i++)
+    fprintf (f, "    \"%s\": %" PRIu64 "%s\n", counter_names[i], sum->counters[i], i + 1 < OVL_STAT_MAX ? "," : "");
+
+  fprintf (f, "  },\n  \"startup_ns\": {\n");
+  for (i = 0; i < n_startup; i++)
+    fprintf (f, "    \"%s\": %" PRIu64 "%s\n", startup[i].name, startup[i].ns, i + 1 < n_startup ? "," : "");
+  fprintf (f, "  }\n}\n");
+
+  free (sum);
+  return ferror (f) ? -1 : 0;
+}
+
+/* The report server.  */
+
+static int server_fd = -1;
+static int server_stop[2] = { -1, -1 };
+static pthread_t server_thread;
+static bool server_running;
+/* Whether the socket at SERVER_PATH was created by us.  */
+static bool server_bound;
+static char *server_path;
+
+static void *
+server_run (void *arg)
+{
+  for (;;)
+    {
+      struct pollfd fds[2] = {
+        { .fd = server_fd, .events = POLLIN },
+        { .fd = server_stop[0], .events = POLLIN },
+      };
+      FILE *f;
+      int fd;
+
+      if (poll (fds, 2, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      if (fds[1].revents)
+        break;
+
+      fd = accept4 (server_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        continue;
+
+      f = fdopen (fd, "w");
+      if (f == NULL)
+        {
+          close (fd);
+          continue;
+        }
+      ovl_stats_write (f);
+      fclose (f);
+    }
+
+  return NULL;
+}
+
+int
+ovl_stats_start_server (const char *path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t mask;
+  int ret;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  server_path = strdup (path);
+  if (server_path == NULL)
+    return -1;
+
+  server_fd = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (server_fd < 0)
+    goto fail;
+
+  /* A socket left by a previous instance.  Anything else at PATH is
+     not ours, and bind fails on it.  */
+  if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (path);
+
+  /* The socket is created with mode 0600, there is no window where
+     other users could connect to it.  */
+  mask = umask (0177);
+  ret = bind (server_fd, (struct sockaddr *) &addr, sizeof (addr));
+  umask (mask);
+  if (ret < 0)
+    goto fail;
+  server_bound = true;
+
+  if (listen (server_fd, 16) < 0
+      || pipe2 (server_stop, O_CLOEXEC) < 0)
+    goto fail;
+
+  ret = pthread_create (&server_thread, NULL, server_run, NULL);
+  if (ret != 0)
+    {
+      errno = ret;
+      goto fail;
+    }
+  server_running = true;
+  return 0;
+
+ fail:
+  ret = errno;
+  ovl_stats_stop_server ();
+  errno = ret;
+  return -1;
+}
+
+void
+ovl_stats_stop_server (void)
+{
+  if (server_running && write (server_stop[1], "", 1) == 1)
+    pthread_join (server_thread, NULL);
+  server_running = false;
+
+  if (server_fd >= 0)
+    {
+      close (server_fd);
+      server_fd = -1;
+    }
+  if (server_bound)
+    {
+      unlink (server_path);
+      server_bound = false;
+    }
+  if (server_stop[0] >= 0)
+    {
+      close (server_stop[0]);
+      close (server_stop[1]);
+      server_stop[0] = server_stop[1] = -1;
+    }
+  free (server_path);
+  server_path = NULL;
+}
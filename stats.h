@@ -0,0 +1,87 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_H
+# define STATS_H
+
+# include <stdint.h>
+# include <stdio.h>
+
+/* Always-on counters and latency histograms.  Every thread updates its
+   own copy without atomics, the report sums them.  */
+
+# define OVL_STATS_OPS(X) \
+  X (statfs) X (access) X (getxattr) X (removexattr) X (setxattr) X (listxattr) \
+  X (lookup) X (forget) X (forget_multi) X (getattr) X (readlink) X (opendir) \
+  X (readdir) X (readdirplus) X (releasedir) X (create) X (open) X (release) \
+  X (read) X (write_buf) X (unlink) X (rmdir) X (setattr) X (symlink) X (rename) \
+  X (mkdir) X (mknod) X (link) X (fsync) X (fsyncdir) X (ioctl) X (fallocate) \
+  X (copy_file_range)
+
+# define OVL_STATS_COUNTERS(X) \
+  X (copyup) X (copyup_bytes) X (copyup_ns) \
+  X (lookup_slow) X (lookup_probes) \
+  X (lock_waits) X (lock_wait_ns) \
+  X (negative_hits) X (negative_misses) \
+  X (attr_hits) X (attr_misses) \
+  X (xattr_hits) X (xattr_misses) \
+  X (snapshot_reuses) X (snapshot_builds) \
+  X (fsync_batches) X (fsync_batched) \
+  X (dirfd_hits) X (dirfd_misses) \
+  X (forget_batches) X (forget_freed)
+
+# define OVL_STATS_ENUM_OP(name) OVL_OP_##name,
+# define OVL_STATS_ENUM_COUNTER(name) OVL_STAT_##name,
+
+enum ovl_stats_op
+  {
+   OVL_STATS_OPS (OVL_STATS_ENUM_OP)
+   OVL_OP_MAX
+  };
+
+enum ovl_stats_counter
+  {
+   OVL_STATS_COUNTERS (OVL_STATS_ENUM_COUNTER)
+   OVL_STAT_MAX
+  };
+
+/* Bucket I counts the operations that took less than 2^I microseconds,
+   the last one all the slower ones.  */
+# define OVL_STATS_BUCKETS 24
+
+/* Monotonic time in nanoseconds.  */
+uint64_t ovl_stats_now (void);
+
+/* Account an operation OP that started at START.  */
+void ovl_stats_op (enum ovl_stats_op op, uint64_t start);
+
+void ovl_stats_add (enum ovl_stats_counter c, uint64_t v);
+
+/* Record that the startup phase NAME took NS nanoseconds.  It is only
+   called by the main thread before the server starts.  */
+void ovl_stats_startup (const char *name, uint64_t ns);
+
+/* Write the report as a JSON object to F.  */
+int ovl_stats_write (FILE *f);
+
+/* Serve the report to every client connecting to the unix socket PATH,
+   from a background thread.  */
+int ovl_stats_start_server (const char *path);
+void ovl_stats_stop_server (void);
+
+#endif
@@ -0,0 +1,449 @@
+/* Workloads for the file system benchmark, see bench.sh.
+
+   Usage: bench-fs [OPTIONS] populate ROOT
+          bench-fs [OPTIONS] WORKLOAD MERGED
+
+   populate creates the lower layers ROOT/l0 (the top one) to
+   ROOT/lN-1.  Each layer has the same tree of directories under
+   tree/ with files of its own in every directory, so that a lookup
+   goes through the layers down to the one holding the file.  The
+   bottom layer also has huge/, a directory with many entries, and
+   copyup/, with small and large files to copy up.
+
+   The workloads run on the merged directory of a mount of those
+   layers.  Each prints one tab separated line: the label, the number
+   of operations, the elapsed seconds, the nanoseconds per operation
+   and, for the data workloads, the throughput in MiB/s.  */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int layers = 4;
+static int depth = 2;
+static int width = 8;
+static int files = 16;
+static int huge = 50000;
+static int small = 1000;
+static int large = 4;
+static long large_mb = 64;
+static int threads = 4;
+static long ops = 10000;
+static const char *label;
+
+static double
+now ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report (double start, long n, double bytes)
+{
+  double elapsed = now () - start;
+
+  printf ("%s\t%ld\t%.6f\t%.1f\t", label, n, elapsed, n ? elapsed * 1e9 / n : 0);
+  if (bytes > 0)
+    printf ("%.1f\n", bytes / (1 << 20) / elapsed);
+  else
+    printf ("-\n");
+  fflush (stdout);
+}
+
+static void
+fail (const char *what, const char *path)
+{
+  fprintf (stderr, "bench-fs: %s %s: %s\n", what, path, strerror (errno));
+  exit (EXIT_FAILURE);
+}
+
+static void
+make_dir (const char *path)
+{
+  if (mkdir (path, 0755) < 0 && errno != EEXIST)
+    fail ("mkdir", path);
+}
+
+static void
+write_file (const char *path, size_t size)
+{
+  static char buf[1 << 16];
+  int fd;
+
+  fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0)
+    fail ("open", path);
+  memset (buf, 'x', sizeof (buf));
+  while (size > 0)
+    {
+      size_t n = size < sizeof (buf) ? size : sizeof (buf);
+      ssize_t ret = write (fd, buf, n);
+
+      if (ret < 0)
+        fail ("write", path);
+      size -= ret;
+    }
+  close (fd);
+}
+
+/* Call FN on every directory of the tree under BASE, depth first.  */
+static void
+walk_tree (char *base, int level, void (*fn) (const char *dir, void *arg), void *arg)
+{
+  size_t len = strlen (base);
+  int i;
+
+  fn (base, arg);
+  if (level == depth)
+    return;
+
+  for (i = 0; i < width; i++)
+    {
+      sprintf (base + len, "/d%d", i);
+      walk_tree (base, level + 1, fn, arg);
+    }
+  base[len] = '\0';
+}
+
+static void
+populate_dir (const char *dir, void *arg)
+{
+  int layer = *(int *) arg;
+  char path[PATH_MAX];
+  int i;
+
+  make_dir (dir);
+  for (i = 0; i < files; i++)
+    {
+      sprintf (path, "%s/f%d-%d", dir, layer, i);
+      write_file (path, 0);
+    }
+}
+
+static int
+populate (const char *root)
+{
+  char path[PATH_MAX];
+  int l, i;
+
+  make_dir (root);
+  for (l = 0; l < layers; l++)
+    {
+      sprintf (path, "%s/l%d", root, l);
+      make_dir (path);
+      strcat (path, "/tree");
+      walk_tree (path, 0, populate_dir, &l);
+    }
+
+  l = layers - 1;
+  sprintf (path, "%s/l%d/huge", root, l);
+  make_dir (path);
+  for (i = 0; i < huge; i++)
+    {
+      sprintf (path, "%s/l%d/huge/e%d", root, l, i);
+      write_file (path, 0);
+    }
+
+  sprintf (path, "%s/l%d/copyup", root, l);
+  make_dir (path);
+  for (i = 0; i < small; i++)
+    {
+      sprintf (path, "%s/l%d/copyup/s%d", root, l, i);
+      write_file (path, 4096);
+    }
+  for (i = 0; i < large; i++)
+    {
+      sprintf (path, "%s/l%d/copyup/b%d", root, l, i);
+      write_file (path, large_mb << 20);
+    }
+  return 0;
+}
+
+struct lookup_arg
+{
+  long n;
+  bool miss;
+};
+
+static void
+lookup_dir (const char *dir, void *arg)
+{
+  struct lookup_arg *a = arg;
+  char path[PATH_MAX];
+  struct stat st;
+  int l, i;
+
+  for (l = 0; l < layers; l++)
+    for (i = 0; i < files; i++)
+      {
+        if (a->miss)
+          sprintf (path, "%s/missing%d-%d", dir, l, i);
+        else
+          sprintf (path, "%s/f%d-%d", dir, l, i);
+        if (lstat (path, &st) < 0 && (! a->miss || errno != ENOENT))
+          fail ("stat", path);
+        a->n++;
+      }
+}
+
+static int
+lookup (const char *merged, bool miss)
+{
+  struct lookup_arg a = { .n = 0, .miss = miss };
+  char path[PATH_MAX];
+  double start = now ();
+
+  sprintf (path, "%s/tree", merged);
+  walk_tree (path, 0, lookup_dir, &a);
+  report (start, a.n, 0);
+  return 0;
+}
+
+static int
+do_readdir (const char *merged, bool plus)
+{
+  char path[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  double start = now ();
+  long n = 0;
+  DIR *d;
+
+  sprintf (path, "%s/huge", merged);
+  d = opendir (path);
+  if (d == NULL)
+    fail ("opendir", path);
+  while ((de = readdir (d)))
+    {
+      if (plus && fstatat (dirfd (d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        fail ("stat", de->d_name);
+      n++;
+    }
+  closedir (d);
+  report (start, n, 0);
+  return 0;
+}
+
+static int
+copyup (const char *merged, bool big)
+{
+  char path[PATH_MAX];
+  double start = now ();
+  double bytes = 0;
+  int i, n = big ? large : small;
+
+  for (i = 0; i < n; i++)
+    {
+      struct stat st;
+      int fd;
+
+      sprintf (path, "%s/copyup/%c%d", merged, big ? 'b' : 's', i);
+      fd = open (path, O_WRONLY);
+      if (fd < 0)
+        fail ("open", path);
+      if (fstat (fd, &st) == 0)
+        bytes += st.st_size;
+      close (fd);
+    }
+  report (start, n, bytes);
+  return 0;
+}
+
+static void *
+meta_thread (void *arg)
+{
+  const char *dir = arg;
+  char path[PATH_MAX], path2[PATH_MAX];
+  struct stat st;
+  long i;
+
+  for (i = 0; i < ops; i++)
+    {
+      int fd;
+
+      sprintf (path, "%s/a%ld", dir, i);
+      sprintf (path2, "%s/b%ld", dir, i);
+      fd = open (path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+      if (fd < 0)
+        fail ("create", path);
+      close (fd);
+      if (stat (path, &st) < 0)
+        fail ("stat", path);
+      if (rename (path, path2) < 0)
+        fail ("rename", path);
+      if (unlink (path2) < 0)
+        fail ("unlink", path2);
+    }
+  return NULL;
+}
+
+/* Every thread creates, stats, renames and deletes files in its own
+   directory.  */
+static int
+meta (const char *merged)
+{
+  pthread_t *tids = calloc (threads, sizeof (*tids));
+  char (*dirs)[PATH_MAX] = calloc (threads, PATH_MAX);
+  double start;
+  int i, ret;
+
+  if (tids == NULL || dirs == NULL)
+    fail ("alloc", merged);
+
+  for (i = 0; i < threads; i++)
+    {
+      sprintf (dirs[i], "%s/meta%d", merged, i);
+      make_dir (dirs[i]);
+    }
+
+  start = now ();
+  for (i = 0; i < threads; i++)
+    {
+      ret = pthread_create (&tids[i], NULL, meta_thread, dirs[i]);
+      if (ret)
+        {
+          errno = ret;
+          fail ("pthread_create", merged);
+        }
+    }
+  for (i = 0; i < threads; i++)
+    pthread_join (tids[i], NULL);
+  report (start, threads * ops * 4, 0);
+
+  free (tids);
+  free (dirs);
+  return 0;
+}
+
+/* Sequential I/O uses 128 KiB blocks, random I/O 4 KiB blocks at
+   offsets from a fixed seed so that runs are comparable.  */
+static int
+rw (const char *merged, bool writing, bool random)
+{
+  size_t block = random ? 4096 : 128 << 10;
+  off_t size = large_mb << 20;
+  long n = random ? ops : size / block;
+  char path[PATH_MAX];
+  unsigned int seed = 1;
+  double start;
+  char *buf;
+  long i;
+  int fd;
+
+  buf = malloc (block);
+  if (buf == NULL)
+    fail ("alloc", merged);
+  memset (buf, 'y', block);
+
+  sprintf (path, "%s/data", merged);
+  fd = open (path, writing ? O_RDWR|O_CREAT : O_RDONLY, 0644);
+  if (fd < 0)
+    fail ("open", path);
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    {
+      off_t off = random ? (off_t) (rand_r (&seed) % (size / block)) * block : i * block;
+      ssize_t ret;
+
+      if (writing)
+        ret = pwrite (fd, buf, block, off);
+      else
+        ret = pread (fd, buf, block, off);
+      if (ret < 0)
+        fail (writing ? "write" : "read", path);
+    }
+  if (writing && fsync (fd) < 0)
+    fail ("fsync", path);
+  report (start, n, (double) n * block);
+
+  close (fd);
+  free (buf);
+  return 0;
+}
+
+static void
+usage ()
+{
+  fprintf (stderr, "usage: bench-fs [-L layers] [-D depth] [-W width] [-F files] [-H huge]\n"
+           "                [-c small] [-b large] [-S large_mb] [-t threads] [-n ops] [-l label]\n"
+           "                populate|lookup|miss|readdir|readdirplus|copyup-small|copyup-large|\n"
+           "                meta|seqwrite|seqread|randwrite|randread DIR\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *workload, *dir;
+  int c;
+
+  while ((c = getopt (argc, argv, "L:D:W:F:H:c:b:S:t:n:l:")) != -1)
+    switch (c)
+      {
+      case 'L': layers = atoi (optarg); break;
+      case 'D': depth = atoi (optarg); break;
+      case 'W': width = atoi (optarg); break;
+      case 'F': files = atoi (optarg); break;
+      case 'H': huge = atoi (optarg); break;
+      case 'c': small = atoi (optarg); break;
+      case 'b': large = atoi (optarg); break;
+      case 'S': large_mb = atol (optarg); break;
+      case 't': threads = atoi (optarg); break;
+      case 'n': ops = atol (optarg); break;
+      case 'l': label = optarg; break;
+      default: usage ();
+      }
+
+  if (argc - optind != 2 || layers < 1 || threads < 1 || large_mb < 1)
+    usage ();
+
+  workload = argv[optind];
+  dir = argv[optind + 1];
+  if (label == NULL)
+    label = workload;
+
+  if (strcmp (workload, "populate") == 0)
+    return populate (dir);
+  if (strcmp (workload, "lookup") == 0)
+    return lookup (dir, false);
+  if (strcmp (workload, "miss") == 0)
+    return lookup (dir, true);
+  if (strcmp (workload, "readdir") == 0)
+    return do_readdir (dir, false);
+  if (strcmp (workload, "readdirplus") == 0)
+    return do_readdir (dir, true);
+  if (strcmp (workload, "copyup-small") == 0)
+    return copyup (dir, false);
+  if (strcmp (workload, "copyup-large") == 0)
+    return copyup (dir, true);
+  if (strcmp (workload, "meta") == 0)
+    return meta (dir);
+  if (strcmp (workload, "seqwrite") == 0)
+    return rw (dir, true, false);
+  if (strcmp (workload, "seqread") == 0)
+    return rw (dir, false, false);
+  if (strcmp (workload, "randwrite") == 0)
+    return rw (dir, true, true);
+  if (strcmp (workload, "randread") == 0)
+    return rw (dir, false, true);
+  usage ();
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,157 @@
+/* Compare the gnulib hash table with the open addressing table used
+   for the directory children.
+
+   Usage: bench-hash [N_ENTRIES [ROUNDS]]  */
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <hash.h>
+#include <open-table.h>
+
+struct entry
+{
+  char *name;
+  size_t name_hash;
+};
+
+static size_t
+gnulib_hasher (const void *p, size_t s)
+{
+  return ((const struct entry *) p)->name_hash % s;
+}
+
+static size_t
+entry_hasher (const void *p)
+{
+  return ((const struct entry *) p)->name_hash;
+}
+
+static bool
+entry_compare (const void *p1, const void *p2)
+{
+  const struct entry *e1 = p1, *e2 = p2;
+
+  return e1->name_hash == e2->name_hash && strcmp (e1->name, e2->name) == 0;
+}
+
+static double
+now ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report (const char *what, double start, size_t ops)
+{
+  printf ("%-28s %8.1f ns/op\n", what, (now () - start) / ops);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t n = argc > 1 ? strtoul (argv[1], NULL, 10) : 100000;
+  size_t rounds = argc > 2 ? strtoul (argv[2], NULL, 10) : 10;
+  struct entry *entries, *misses;
+  struct otable *ot;
+  Hash_table *ht;
+  size_t i, r, pos, found = 0;
+  double start;
+  void *it;
+
+  entries = calloc (n, sizeof (*entries));
+  misses = calloc (n, sizeof (*misses));
+  if (entries == NULL || misses == NULL)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < n; i++)
+    {
+      if (asprintf (&entries[i].name, "file-%zu.dat", i * 7919) < 0
+          || asprintf (&misses[i].name, "missing-%zu", i) < 0)
+        return EXIT_FAILURE;
+      entries[i].name_hash = hash_string (entries[i].name, SIZE_MAX);
+      misses[i].name_hash = hash_string (misses[i].name, SIZE_MAX);
+    }
+
+  printf ("%zu entries, %zu rounds\n", n, rounds);
+
+  ht = hash_initialize (4, NULL, gnulib_hasher, entry_compare, NULL);
+  ot = otable_new (4, entry_hasher, entry_compare, NULL);
+  if (ht == NULL || ot == NULL)
+    return EXIT_FAILURE;
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    if (hash_insert (ht, &entries[i]) == NULL)
+      return EXIT_FAILURE;
+  report ("gnulib insert", start, n);
+
+  start = now ();
+  for (i = 0; i < n; i++)
+    if (otable_insert_if_absent (ot, &entries[i], NULL) < 0)
+      return EXIT_FAILURE;
+  report ("open table insert", start, n);
+
+  start = now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      found += hash_lookup (ht, &entries[(i * 31) % n]) != NULL;
+  report ("gnulib lookup", start, n * rounds);
+
+  start = now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      found += otable_lookup (ot, &entries[(i * 31) % n]) != NULL;
+  report ("open table lookup", start, n * rounds);
+
+  start = now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      found += hash_lookup (ht, &misses[i]) != NULL;
+  report ("gnulib lookup miss", start, n * rounds);
+
+  start = now ();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < n; i++)
+      found += otable_lookup (ot, &misses[i]) != NULL;
+  report ("open table lookup miss", start, n * rounds);
+
+  start = now ();
+  for (r = 0; r < rounds; r++)
+    for (it = hash_get_first (ht); it; it = hash_get_next (ht, it))
+      found++;
+  report ("gnulib iterate", start, n * rounds);
+
+  start = now ();
+  for (r = 0; r < rounds; r++)
+    for (pos = 0; (it = otable_next (ot, &pos));)
+      found++;
+  report ("open table iterate", start, n * rounds);
+
+  if (found != 2 * n * rounds + 2 * n * rounds)
+    {
+      fprintf (stderr, "unexpected number of entries found: %zu\n", found);
+      return EXIT_FAILURE;
+    }
+
+  hash_free (ht);
+  otable_free (ot);
+  for (i = 0; i < n; i++)
+    {
+      free (entries[i].name);
+      free (misses[i].name);
+    }
+  free (entries);
+  free (misses);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#!/bin/sh
+
+# Run the benchmark matrix on a synthetic layer stack, see bench-fs.c.
+#
+# Usage: bench.sh [DIR]
+#
+# The results are printed as tab separated lines: workload, operations,
+# seconds, ns/op and MiB/s, after a header of lines starting with #
+# that describes the run.  The environment configures it:
+#
+#   OVERLAY         fuse (default) or kernel, to mount the kernel overlay
+#   FUSE_OVERLAYFS  the fuse-overlayfs binary
+#   BENCH_FS        the bench-fs binary
+#   MOUNT_OPTIONS   extra mount options
+#   LAYERS DEPTH WIDTH FILES HUGE SMALL LARGE LARGE_MB THREADS OPS
+#                   the layer stack and the workloads, see bench-fs -h
+
+set -e
+
+OVERLAY=${OVERLAY:-fuse}
+FUSE_OVERLAYFS=${FUSE_OVERLAYFS:-fuse-overlayfs}
+BENCH_FS=${BENCH_FS:-bench-fs}
+LAYERS=${LAYERS:-4}
+DEPTH=${DEPTH:-2}
+WIDTH=${WIDTH:-8}
+FILES=${FILES:-16}
+HUGE=${HUGE:-50000}
+SMALL=${SMALL:-1000}
+LARGE=${LARGE:-4}
+LARGE_MB=${LARGE_MB:-64}
+THREADS=${THREADS:-4}
+OPS=${OPS:-10000}
+
+dir=${1:-bench-test}
+layout="-L $LAYERS -D $DEPTH -W $WIDTH -F $FILES -H $HUGE -c $SMALL -b $LARGE -S $LARGE_MB"
+
+rm -rf $dir
+mkdir -p $dir/upper $dir/workdir $dir/merged
+$BENCH_FS $layout populate $dir/layers
+
+lowerdirs=
+i=0
+while [ $i -lt $LAYERS ]; do
+    lowerdirs=$lowerdirs${lowerdirs:+:}$dir/layers/l$i
+    i=$((i + 1))
+done
+options=lowerdir=$lowerdirs,upperdir=$dir/upper,workdir=$dir/workdir${MOUNT_OPTIONS:+,$MOUNT_OPTIONS}
+
+mounted=0
+
+do_mount() {
+    if [ $OVERLAY = kernel ]; then
+        mount -t overlay overlay -o $options $dir/merged
+    else
+        $FUSE_OVERLAYFS -o $options $dir/merged
+    fi
+    mounted=1
+}
+
+do_umount() {
+    if [ $OVERLAY = kernel ]; then
+        umount $dir/merged
+    else
+        fusermount -u $dir/merged 2>/dev/null || umount $dir/merged
+    fi
+    mounted=0
+}
+
+# Each workload that is measured cold gets a fresh mount.  The upper
+# layer is kept, so the order of the workloads matters.
+remount() {
+    do_umount
+    do_mount
+}
+
+trap 'if [ $mounted -eq 1 ]; then do_umount; fi' EXIT
+
+run() {
+    $BENCH_FS $layout -t $THREADS -n $OPS "$@" $dir/merged
+}
+
+if [ $OVERLAY = kernel ]; then
+    version="kernel overlay"
+else
+    version=$($FUSE_OVERLAYFS --version 2>/dev/null | head -n 1)
+fi
+echo "# $version"
+echo "# kernel $(uname -r), mount options $options"
+echo "# layers $LAYERS depth $DEPTH width $WIDTH files $FILES huge $HUGE small $SMALL large $LARGE x $LARGE_MB MiB threads $THREADS ops $OPS"
+printf '# workload\tops\tseconds\tns/op\tMiB/s\n'
+
+do_mount
+run -l lookup-cold lookup
+run -l lookup-warm lookup
+run -l miss-cold miss
+run -l miss-warm miss
+remount
+run readdir
+remount
+run readdirplus
+remount
+run copyup-small
+run copyup-large
+run meta
+run seqwrite
+remount
+run seqread
+run randwrite
+remount
+run randread
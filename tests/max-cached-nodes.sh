@@ -0,0 +1,43 @@
+#!/bin/sh
+
+set -ex
+
+rm -rf max-cached-nodes-test
+mkdir max-cached-nodes-test
+
+cd max-cached-nodes-test
+
+mkdir lower upper workdir merged
+
+for d in $(seq 20); do
+    mkdir lower/d$d
+    for f in $(seq 50); do
+        echo $d-$f > lower/d$d/f$f
+    done
+done
+
+# Few enough cached nodes that the directories are unloaded all along,
+# while the files are looked up, opened, changed and removed.
+fuse-overlayfs -o lowerdir=lower,upperdir=upper,workdir=workdir,max_cached_nodes=64 merged
+
+for i in 1 2 3; do
+    for d in $(seq 20); do
+        for f in $(seq 50); do
+            stat merged/d$d/f$f > /dev/null
+        done
+        grep -q $d-1 merged/d$d/f1
+        chmod 600 merged/d$d/f2
+        touch merged/d$d/new$i
+        stat merged/d$d/new$i > /dev/null
+        rm merged/d$d/new$i
+    done
+done
+
+for d in $(seq 20); do
+    rm merged/d$d/f3
+    test \! -e merged/d$d/f3
+    test $(stat --printf=%a merged/d$d/f2) -eq 600
+    grep $d-50 merged/d$d/f50
+done
+
+umount merged || [ $? -eq "${EXPECT_UMOUNT_STATUS:-0}" ]
@@ -0,0 +1,69 @@
+#!/bin/sh
+
+set -ex
+
+# mv falls back to a copy on EXDEV, use a plain rename(2).
+rename () {
+    python3 -c 'import os, sys; os.rename(sys.argv[1], sys.argv[2])' "$1" "$2"
+}
+
+rm -rf redirect-dir-test
+mkdir redirect-dir-test
+
+cd redirect-dir-test
+
+mkdir lower upper workdir merged
+
+mkdir -p lower/dir/sub lower/other
+echo hello > lower/dir/file
+echo world > lower/dir/sub/file
+
+# By default a directory with lower layers cannot be renamed.
+fuse-overlayfs -o lowerdir=lower,upperdir=upper,workdir=workdir merged
+
+if rename merged/dir merged/moved; then exit 1; fi
+test -d merged/dir
+
+umount merged || [ $? -eq "${EXPECT_UMOUNT_STATUS:-0}" ]
+
+fuse-overlayfs -o lowerdir=lower,upperdir=upper,workdir=workdir,redirect_dir=on merged
+
+rename merged/dir merged/moved
+echo new > merged/moved/new
+
+test \! -e merged/dir
+grep hello merged/moved/file
+grep world merged/moved/sub/file
+grep new merged/moved/new
+
+test -d upper/moved
+test -e lower/dir/file
+if [ ${FUSE_OVERLAYFS_DISABLE_OVL_WHITEOUT:-0} -eq 1 ]; then
+    test -e upper/.wh.dir
+else
+    test -c upper/dir
+fi
+
+umount merged || [ $? -eq "${EXPECT_UMOUNT_STATUS:-0}" ]
+
+# The redirect is followed after a remount, but no new one is created.
+fuse-overlayfs -o lowerdir=lower,upperdir=upper,workdir=workdir,redirect_dir=follow merged
+
+test \! -e merged/dir
+grep hello merged/moved/file
+grep world merged/moved/sub/file
+grep new merged/moved/new
+
+if rename merged/other merged/other2; then exit 1; fi
+test -d merged/other
+
+umount merged || [ $? -eq "${EXPECT_UMOUNT_STATUS:-0}" ]
+
+# With redirects ignored only the upper directory is left.
+fuse-overlayfs -o lowerdir=lower,upperdir=upper,workdir=workdir,redirect_dir=off merged
+
+test \! -e merged/dir
+test \! -e merged/moved/file
+grep new merged/moved/new
+
+umount merged || [ $? -eq "${EXPECT_UMOUNT_STATUS:-0}" ]
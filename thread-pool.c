@@ -0,0 +1,189 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "thread-pool.h"
+
+struct thread_pool_job
+{
+  struct thread_pool_job *next;
+  int (*fn) (void *arg, size_t i);
+  void *arg;
+  size_t n;
+  /* Next index to run.  */
+  size_t next_index;
+  size_t n_done;
+  int ret;
+  pthread_cond_t done;
+};
+
+struct thread_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* Jobs that still have indexes to run.  */
+  struct thread_pool_job *jobs;
+  bool stop;
+  size_t n_threads;
+  pthread_t *threads;
+};
+
+/* Run one index of JOB, must be called with pool->lock held.  */
+static void
+run_one (struct thread_pool *pool, struct thread_pool_job *job)
+{
+  size_t i = job->next_index++;
+  int ret;
+
+  /* Every index is taken, no other thread must pick the job.  */
+  if (job->next_index == job->n)
+    {
+      struct thread_pool_job **it;
+
+      for (it = &pool->jobs; *it != job; it = &(*it)->next)
+        ;
+      *it = job->next;
+    }
+
+  pthread_mutex_unlock (&pool->lock);
+  ret = job->fn (job->arg, i);
+  pthread_mutex_lock (&pool->lock);
+
+  if (ret && job->ret == 0)
+    job->ret = ret;
+  if (++job->n_done == job->n)
+    pthread_cond_broadcast (&job->done);
+}
+
+static void *
+worker (void *arg)
+{
+  struct thread_pool *pool = arg;
+
+  pthread_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      while (pool->jobs == NULL && ! pool->stop)
+        pthread_cond_wait (&pool->cond, &pool->lock);
+      if (pool->jobs == NULL)
+        break;
+      run_one (pool, pool->jobs);
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+struct thread_pool *
+thread_pool_new (size_t n_threads)
+{
+  struct thread_pool *pool;
+
+  pool = calloc (1, sizeof (*pool));
+  if (pool == NULL)
+    return NULL;
+
+  pool->threads = calloc (n_threads, sizeof (pthread_t));
+  if (pool->threads == NULL && n_threads > 0)
+    {
+      free (pool);
+      return NULL;
+    }
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+
+  for (pool->n_threads = 0; pool->n_threads < n_threads; pool->n_threads++)
+    {
+      int ret = pthread_create (&pool->threads[pool->n_threads], NULL, worker, pool);
+      if (ret != 0)
+        {
+          thread_pool_free (pool);
+          errno = ret;
+          return NULL;
+        }
+    }
+
+  return pool;
+}
+
+void
+thread_pool_free (struct thread_pool *pool)
+{
+  size_t i;
+
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+
+  for (i = 0; i < pool->n_threads; i++)
+    pthread_join (pool->threads[i], NULL);
+
+  pthread_cond_destroy (&pool->cond);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool->threads);
+  free (pool);
+}
+
+int
+thread_pool_run (struct thread_pool *pool, int (*fn) (void *arg, size_t i), void *arg, size_t n)
+{
+  struct thread_pool_job job = { .fn = fn, .arg = arg, .n = n };
+  struct thread_pool_job **it;
+  size_t i;
+
+  if (pool == NULL || pool->n_threads == 0 || n <= 1)
+    {
+      for (i = 0; i < n; i++)
+        {
+          int ret = fn (arg, i);
+          if (ret)
+            return ret;
+        }
+      return 0;
+    }
+
+  pthread_cond_init (&job.done, NULL);
+
+  pthread_mutex_lock (&pool->lock);
+  for (it = &pool->jobs; *it; it = &(*it)->next)
+    ;
+  *it = &job;
+  pthread_cond_broadcast (&pool->cond);
+
+  while (job.next_index < job.n)
+    run_one (pool, &job);
+
+  while (job.n_done < job.n)
+    pthread_cond_wait (&job.done, &pool->lock);
+  pthread_mutex_unlock (&pool->lock);
+
+  pthread_cond_destroy (&job.done);
+
+  return job.ret;
+}
@@ -0,0 +1,36 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREAD_POOL_H
+# define THREAD_POOL_H
+
+# include <stddef.h>
+
+struct thread_pool;
+
+/* Create a pool of N_THREADS workers.  */
+struct thread_pool *thread_pool_new (size_t n_threads);
+void thread_pool_free (struct thread_pool *pool);
+
+/* Run FN (ARG, I) for each I in [0, N) and wait for all of them to
+   complete.  The calling thread runs the jobs too, so it works with a
+   busy or NULL POOL.  Return the first value different from 0 returned
+   by FN, or 0.  */
+int thread_pool_run (struct thread_pool *pool, int (*fn) (void *arg, size_t i), void *arg, size_t n);
+
+#endif
@@ -0,0 +1,403 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <config.h>
+
+#include "fuse-overlayfs.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+#if defined HAVE_LINUX_IO_URING_H && defined HAVE_STATX && defined __NR_io_uring_setup
+# define USE_IO_URING 1
+# include <linux/io_uring.h>
+#endif
+
+#define URING_DEFAULT_DEPTH 64
+#define URING_MAX_DEPTH 256
+
+struct uring_layer
+{
+  unsigned int depth;
+};
+
+#ifdef USE_IO_URING
+
+/* Every thread has its own ring, so that the batches of the FUSE
+   workers do not need any locking.  */
+struct uring
+{
+  int fd;
+  unsigned int entries;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Written by the kernel, it is owned by the ring so that the statx
+     still in flight when the ring breaks cannot write to the stack of
+     the caller.  */
+  struct statx stx[URING_MAX_DEPTH];
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+/* io_uring_setup failed once, or a ring broke, do not try again.  */
+static bool uring_unavailable;
+
+static void
+uring_close (struct uring *r)
+{
+  if (r->sqes)
+    munmap (r->sqes, r->sqes_size);
+  if (r->cq_ring && r->cq_ring != r->sq_ring)
+    munmap (r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring)
+    munmap (r->sq_ring, r->sq_ring_size);
+  if (r->fd >= 0)
+    close (r->fd);
+}
+
+static void
+uring_free (void *p)
+{
+  struct uring *r = p;
+
+  if (r == NULL)
+    return;
+
+  uring_close (r);
+  free (r);
+}
+
+/* The completions of R cannot be waited for any more.  Tear down the
+   ring of the thread, the statx still in flight are cancelled by the
+   kernel.  R itself is not freed since they may still write to
+   R->STX.  */
+static void
+uring_break (struct uring *r)
+{
+  __atomic_store_n (&uring_unavailable, true, __ATOMIC_RELAXED);
+  pthread_setspecific (uring_key, NULL);
+  uring_close (r);
+}
+
+static void
+make_uring_key (void)
+{
+  pthread_key_create (&uring_key, uring_free);
+}
+
+static struct uring *
+uring_new ()
+{
+  struct io_uring_params p;
+  struct uring *r;
+  char *sq, *cq;
+
+  r = calloc (1, sizeof (*r));
+  if (r == NULL)
+    return NULL;
+
+  memset (&p, 0, sizeof (p));
+  r->fd = syscall (__NR_io_uring_setup, URING_MAX_DEPTH, &p);
+  if (r->fd < 0)
+    goto fail;
+  r->entries = p.sq_entries;
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (r->cq_ring_size > r->sq_ring_size)
+        r->sq_ring_size = r->cq_ring_size;
+      r->cq_ring_size = r->sq_ring_size;
+    }
+
+  r->sq_ring = mmap (NULL, r->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    {
+      r->sq_ring = NULL;
+      goto fail;
+    }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else
+    {
+      r->cq_ring = mmap (NULL, r->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if (r->cq_ring == MAP_FAILED)
+        {
+          r->cq_ring = NULL;
+          goto fail;
+        }
+    }
+
+  r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  r->sqes = mmap (NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    {
+      r->sqes = NULL;
+      goto fail;
+    }
+
+  sq = r->sq_ring;
+  cq = r->cq_ring;
+  r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  return r;
+
+ fail:
+  __atomic_store_n (&uring_unavailable, true, __ATOMIC_RELAXED);
+  uring_free (r);
+  return NULL;
+}
+
+static struct uring *
+get_uring ()
+{
+  struct uring *r;
+
+  if (__atomic_load_n (&uring_unavailable, __ATOMIC_RELAXED))
+    return NULL;
+
+  pthread_once (&uring_once, make_uring_key);
+
+  r = pthread_getspecific (uring_key);
+  if (r)
+    return r;
+
+  r = uring_new ();
+  if (r == NULL)
+    return NULL;
+
+  if (pthread_setspecific (uring_key, r) != 0)
+    {
+      uring_free (r);
+      return NULL;
+    }
+  return r;
+}
+
+/* Submit the statx of the N <= R->ENTRIES PATHS to R->STX and wait for
+   all of them.  Return the number of entries that were submitted, or -1
+   if the ring broke and was torn down.  */
+static int
+uring_statx (struct uring *r, int dirfd, size_t n, const char **paths, int *errs, int flags, unsigned int mask)
+{
+  unsigned int tail = *r->sq_tail;
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+  size_t i, done = 0;
+  int submitted;
+
+  for (i = 0; i < n; i++)
+    {
+      unsigned int idx = (tail + i) & *r->sq_mask;
+      struct io_uring_sqe *sqe = &r->sqes[idx];
+
+      memset (sqe, 0, sizeof (*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = dirfd;
+      sqe->addr = (uintptr_t) paths[i];
+      sqe->len = mask;
+      sqe->off = (uintptr_t) &r->stx[i];
+      sqe->statx_flags = AT_STATX_DONT_SYNC | flags;
+      sqe->user_data = i;
+      r->sq_array[idx] = idx;
+    }
+  __atomic_store_n (r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+  submitted = syscall (__NR_io_uring_enter, r->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0);
+  if (submitted < 0)
+    submitted = 0;
+  /* Take back the entries that the kernel did not consume.  */
+  if ((size_t) submitted < n)
+    __atomic_store_n (r->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+
+  head = *r->cq_head;
+  while (done < (size_t) submitted)
+    {
+      if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+          __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+          if (syscall (__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+              && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+              uring_break (r);
+              return -1;
+            }
+          continue;
+        }
+
+      cqe = &r->cqes[head & *r->cq_mask];
+      errs[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+      head++;
+      done++;
+    }
+  __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+
+  return done;
+}
+
+#endif
+
+static int
+uring_statat_batch (struct ovl_layer *l, size_t n, const char **paths, struct stat *st, int *errs, int flags, unsigned int mask)
+{
+  struct uring_layer *ul = l->data_source_private_data;
+  size_t i = 0;
+
+#ifdef USE_IO_URING
+  struct uring *r = get_uring ();
+
+  if (r)
+    {
+      size_t chunk = ul->depth < r->entries ? ul->depth : r->entries;
+
+      while (i < n)
+        {
+          size_t j, len = n - i < chunk ? n - i : chunk;
+          int done;
+
+          done = uring_statx (r, l->fd, len, paths + i, errs + i, flags, mask);
+          if (done <= 0)
+            break;
+
+          for (j = 0; j < (size_t) done; j++)
+            {
+              /* STATX is not supported by old kernels.  */
+              if (errs[i + j] == EINVAL)
+                errs[i + j] = direct_access_ds.statat (l, paths[i + j], &st[i + j], flags, mask) < 0 ? errno : 0;
+              else if (errs[i + j] == 0)
+                {
+                  statx_to_stat (&r->stx[j], &st[i + j]);
+                  if (override_mode (l, -1, NULL, paths[i + j], &st[i + j]) < 0)
+                    errs[i + j] = errno;
+                }
+            }
+          i += done;
+        }
+    }
+#endif
+
+  for (; i < n; i++)
+    errs[i] = direct_access_ds.statat (l, paths[i], &st[i], flags, mask) < 0 ? errno : 0;
+
+  return 0;
+}
+
+static int
+uring_load_data_source (struct ovl_layer *l, const char *opaque, const char *path, int n_layer)
+{
+  struct uring_layer *ul;
+  unsigned long depth;
+  char *end;
+
+  depth = strtoul (opaque, &end, 10);
+  if (*end != '\0')
+    {
+      fprintf (stderr, "invalid uring depth %s\n", opaque);
+      errno = EINVAL;
+      return -1;
+    }
+  if (depth == 0)
+    depth = URING_DEFAULT_DEPTH;
+  if (depth > URING_MAX_DEPTH)
+    depth = URING_MAX_DEPTH;
+
+  ul = calloc (1, sizeof (*ul));
+  if (ul == NULL)
+    return -1;
+  ul->depth = depth;
+
+  if (direct_access_ds.load_data_source (l, opaque, path, n_layer) < 0)
+    {
+      free (ul);
+      return -1;
+    }
+
+  l->data_source_private_data = ul;
+  return 0;
+}
+
+static int
+uring_cleanup (struct ovl_layer *l)
+{
+  free (l->data_source_private_data);
+  l->data_source_private_data = NULL;
+  return direct_access_ds.cleanup (l);
+}
+
+static struct data_source uring_ds;
+
+struct data_source *
+uring_plugin_load (const char *opaque, const char *path)
+{
+  if (uring_ds.statat == NULL)
+    {
+      uring_ds = direct_access_ds;
+      uring_ds.load_data_source = uring_load_data_source;
+      uring_ds.cleanup = uring_cleanup;
+      uring_ds.statat_batch = uring_statat_batch;
+    }
+  return &uring_ds;
+}
+
+int
+uring_plugin_release ()
+{
+  return 0;
+}
+
+const char *
+uring_plugin_name ()
+{
+  return "uring";
+}
@@ -0,0 +1,32 @@
+/* fuse-overlayfs: Overlay Filesystem in Userspace
+
+   Copyright (C) 2019 Red Hat Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef URING_H
+# define URING_H
+
+# include <plugin.h>
+
+/* Built-in "uring" data source: a lower directory specified as
+   //uring/DEPTH/PATH is accessed like a plain directory, but the
+   batches of stats are submitted through io_uring, at most DEPTH at a
+   time.  When io_uring is not usable the batch falls back to statx.  */
+struct data_source *uring_plugin_load (const char *opaque, const char *path);
+int uring_plugin_release ();
+const char *uring_plugin_name ();
+
+#endif
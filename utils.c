@@ -322,3 +322,48 @@ override_mode (struct ovl_layer *l, int fd, const char *abs_path, const char *pa
 
   return 0;
 }
+
+/* Parse a list of CPUs like "0-3,8,10-11", as used in sysfs, into SET.
+   The ranges can also be separated by ':', as ',' already separates
+   the mount options.  */
+int
+parse_cpu_list (const char *list, cpu_set_t *set)
+{
+  const char *it = list;
+
+  CPU_ZERO (set);
+  while (*it)
+    {
+      unsigned long first, last;
+      char *end;
+
+      errno = 0;
+      first = last = strtoul (it, &end, 10);
+      if (end == it || errno)
+        goto fail;
+      if (*end == '-')
+        {
+          it = end + 1;
+          last = strtoul (it, &end, 10);
+          if (end == it || errno || last < first)
+            goto fail;
+        }
+      if (last >= CPU_SETSIZE)
+        goto fail;
+
+      for (; first <= last; first++)
+        CPU_SET (first, set);
+
+      if ((*end == ',' || *end == ':') && end[1] != '\0')
+        end++;
+      else if (*end != '\0')
+        goto fail;
+      it = end;
+    }
+
+  if (CPU_COUNT (set) > 0)
+    return 0;
+ fail:
+  errno = EINVAL;
+  return -1;
+}
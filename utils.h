@@ -31,6 +31,7 @@
 # include <stdlib.h>
 # include <sys/types.h>
 # include <fcntl.h>
+# include <sched.h>
 # include "fuse-overlayfs.h"
 
 # define XATTR_OVERRIDE_STAT "user.fuseoverlayfs.override_stat"
@@ -63,4 +64,6 @@ int safe_openat (int dirfd, const char *pathname, int flags, mode_t mode);
 
 int override_mode (struct ovl_layer *l, int fd, const char *abs_path, const char *path, struct stat *st);
 
+int parse_cpu_list (const char *list, cpu_set_t *set);
+
 #endif